@@ -6,7 +6,7 @@
 # note this should be run inside the docker container
 
 # If a container is already successfully running after `make startcontainer outputdir=<ABSOLUTE_PATH1> testdir=<ABSOLUTE_PATH2>`
-# This endpoint takes a `test_id` argument, from 01 up to 43,
+# This endpoint takes a `test_id` argument, from 01 up to 49,
 #     runs the corresponding generated test DSLs
 #    and checks the output against corresponding EXP file.
 
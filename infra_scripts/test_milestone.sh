@@ -7,7 +7,7 @@
 #### Contact: Wilson Qin                    ####
 
 
-UPTOMILE="${1:-5}"
+UPTOMILE="${1:-6}"
 
 # the number of seconds you need to wait for your server to go from shutdown 
 # to ready to receive queries from client.
@@ -19,7 +19,7 @@ UPTOMILE="${1:-5}"
 WAIT_SECONDS_TO_RECOVER_DATA="${2:-5}"
 
 MAX_AVAILABLE_MS=5
-MAX_TEST=43
+MAX_TEST=49
 TEST_IDS=`seq -w 1 ${MAX_TEST}`
 
 if [ "$UPTOMILE" -eq "1" ] ;
@@ -37,6 +37,9 @@ then
 elif [ "$UPTOMILE" -eq "5" ] ;
 then
     MAX_TEST=43
+elif [ "$UPTOMILE" -eq "6" ] ;
+then
+    MAX_TEST=49
 fi
 
 function killserver () {
@@ -61,9 +64,10 @@ do
             # start the server before the first case we test.
             ./server > last_server.out &
             FIRST_SERVER_START=1
-        elif [ ${TEST_ID} -eq 2 ] || [ ${TEST_ID} -eq 5 ] || [ ${TEST_ID} -eq 11 ] || [ ${TEST_ID} -eq 19 ] || [ ${TEST_ID} -eq 20 ] || [ ${TEST_ID} -eq 29 ] || [ ${TEST_ID} -eq 32 ] || [ ${TEST_ID} -eq 41 ]
+        elif [ ${TEST_ID} -eq 2 ] || [ ${TEST_ID} -eq 5 ] || [ ${TEST_ID} -eq 11 ] || [ ${TEST_ID} -eq 19 ] || [ ${TEST_ID} -eq 20 ] || [ ${TEST_ID} -eq 29 ] || [ ${TEST_ID} -eq 32 ] || [ ${TEST_ID} -eq 41 ] || [ ${TEST_ID} -eq 46 ] || [ ${TEST_ID} -eq 48 ]
         then
             # We restart the server after test 1,4,10,18,19,28,31 (before 2,3,11,12,17,18,29,32), as expected.
+            # Test 45 ends without a shutdown, so the restart before 46 recovers from a crash.
         
             killserver
 
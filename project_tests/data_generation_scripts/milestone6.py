@@ -0,0 +1,275 @@
+#!/usr/bin/python
+import sys, string
+from random import choice
+import random
+from string import ascii_lowercase
+from scipy.stats import beta, uniform
+import numpy as np
+import struct
+import pandas as pd
+import math
+
+import data_gen_utils
+
+# note this is the base path to the data files we generate
+TEST_BASE_DIR = "/cs165/generated_data"
+
+# note this is the base path that _POINTS_ to the data files we generate
+DOCKER_TEST_BASE_DIR = "/cs165/staff_test"
+
+#
+# Example usage:
+#   python milestone6.py 10000 42 ~/repo/cs165-docker-test-runner/test_data /cs165/staff_test
+#
+
+############################################################################
+# Notes: These tests cover durability and the extensions beyond milestone 5:
+# typed columns (int, long, float), recovery from a crash through the
+# write-ahead log with an index in place, compaction of deleted rows and
+# batched selects over tables that went through both.
+#
+# The test runner restarts the server with `kill -9` before tests 46 and 48,
+# so test 45 ends with a crash and test 47 with a clean shutdown.
+############################################################################
+
+# longs beyond the int range, floats in quarters so that they print exactly
+LONG_BASE = 2 ** 32
+
+def outputFloats(series):
+    return '\n'.join('{:.2f}'.format(v) for v in series)
+
+def writeExpected(exp_output_file, outputs):
+    exp_output_file.write('\n\n'.join(outputs))
+    exp_output_file.write('\n')
+
+def generateDataMilestone6(dataSize):
+    outputFile = TEST_BASE_DIR + '/data6.csv'
+    header_line = data_gen_utils.generateHeaderLine('db1', 'tbl6', 3)
+    outputTable = pd.DataFrame()
+    outputTable['col1'] = np.random.randint(0, 1000, size = (dataSize))
+    outputTable['col2'] = np.random.randint(0, 1000, size = (dataSize)).astype(np.int64) * LONG_BASE + np.random.randint(0, 1000, size = (dataSize))
+    outputTable['col3'] = np.random.randint(-4000, 4000, size = (dataSize)) / 4.0
+    outputTable.to_csv(outputFile, sep=',', index=False, header=header_line)
+    return outputTable
+
+def generateDataMilestone6Compaction(dataSize):
+    outputFile = TEST_BASE_DIR + '/data7.csv'
+    header_line = data_gen_utils.generateHeaderLine('db1', 'tbl7', 2)
+    outputTable = pd.DataFrame()
+    outputTable['col1'] = np.random.randint(0, 1000, size = (dataSize))
+    outputTable['col2'] = np.random.randint(0, 10000, size = (dataSize))
+    outputTable.to_csv(outputFile, sep=',', index=False, header=header_line)
+    return outputTable
+
+def writeTypedQueries(dataTable, output_file):
+    # the same queries before and after the crash
+    output_file.write('-- SELECT col2 FROM tbl6 WHERE col1 >= 100 AND col1 < 120;\n')
+    output_file.write('-- SELECT col3 FROM tbl6 WHERE col1 >= 100 AND col1 < 120;\n')
+    output_file.write('-- SELECT col1 FROM tbl6 WHERE col2 >= {} AND col2 < {};\n'.format(500 * LONG_BASE, 510 * LONG_BASE))
+    output_file.write('-- SELECT col1 FROM tbl6 WHERE col3 >= -10.5 AND col3 < 12.25;\n')
+    output_file.write('-- SELECT SUM(col2), MAX(col3) FROM tbl6;\n')
+    output_file.write('s1=select(db1.tbl6.col1,100,120)\n')
+    output_file.write('f1=fetch(db1.tbl6.col2,s1)\n')
+    output_file.write('f2=fetch(db1.tbl6.col3,s1)\n')
+    output_file.write('print(f1)\n')
+    output_file.write('print(f2)\n')
+    output_file.write('s2=select(db1.tbl6.col2,{},{})\n'.format(500 * LONG_BASE, 510 * LONG_BASE))
+    output_file.write('f3=fetch(db1.tbl6.col1,s2)\n')
+    output_file.write('print(f3)\n')
+    output_file.write('s3=select(db1.tbl6.col3,-10.5,12.25)\n')
+    output_file.write('f4=fetch(db1.tbl6.col1,s3)\n')
+    output_file.write('print(f4)\n')
+    output_file.write('a1=sum(db1.tbl6.col2)\n')
+    output_file.write('a2=max(db1.tbl6.col3)\n')
+    output_file.write('print(a1)\n')
+    output_file.write('print(a2)\n')
+    mask1 = (dataTable['col1'] >= 100) & (dataTable['col1'] < 120)
+    mask2 = (dataTable['col2'] >= 500 * LONG_BASE) & (dataTable['col2'] < 510 * LONG_BASE)
+    mask3 = (dataTable['col3'] >= -10.5) & (dataTable['col3'] < 12.25)
+    return [data_gen_utils.outputPrint(dataTable[mask1]['col2']),
+            outputFloats(dataTable[mask1]['col3']),
+            data_gen_utils.outputPrint(dataTable[mask2]['col1']),
+            data_gen_utils.outputPrint(dataTable[mask3]['col1']),
+            str(dataTable['col2'].sum()),
+            '{:.2f}'.format(dataTable['col3'].max())]
+
+def createTest44(dataTable):
+    output_file, exp_output_file = data_gen_utils.openFileHandles(44, TEST_DIR=TEST_BASE_DIR)
+    output_file.write('-- Load a table with int, long and float columns\n')
+    output_file.write('--\n')
+    output_file.write('-- col2 holds values beyond the int range, col3 fractions.\n')
+    output_file.write('-- col1 has an unclustered btree index, built by the load.\n')
+    output_file.write('--\n')
+    output_file.write('create(tbl,"tbl6",db1,3)\n')
+    output_file.write('create(col,"col1",db1.tbl6,int)\n')
+    output_file.write('create(col,"col2",db1.tbl6,long)\n')
+    output_file.write('create(col,"col3",db1.tbl6,float)\n')
+    output_file.write('create(idx,db1.tbl6.col1,btree,unclustered)\n')
+    output_file.write('load(\"'+DOCKER_TEST_BASE_DIR+'/data6.csv\")\n')
+    output_file.write('--\n')
+    writeExpected(exp_output_file, writeTypedQueries(dataTable, output_file))
+    data_gen_utils.closeFileHandles(output_file, exp_output_file)
+
+def createTest45(dataTable):
+    output_file, exp_output_file = data_gen_utils.openFileHandles(45, TEST_DIR=TEST_BASE_DIR)
+    output_file.write('-- Inserts, updates and deletes on tbl6 that are only in the log\n')
+    output_file.write('--\n')
+    output_file.write('-- The test ends without a shutdown: the server is killed before the\n')
+    output_file.write('-- next test, which has to find all of these changes.\n')
+    output_file.write('--\n')
+    rows = []
+    for i in range(50):
+        col1Val = np.random.randint(100, 120)
+        col2Val = np.random.randint(500, 510) * LONG_BASE + i
+        col3Val = np.random.randint(-40, 48) / 4.0
+        output_file.write('relational_insert(db1.tbl6,{},{},{:.2f})\n'.format(col1Val, col2Val, col3Val))
+        rows.append({"col1": col1Val, "col2": col2Val, "col3": col3Val})
+    dataTable = pd.concat([dataTable, pd.DataFrame(rows)], ignore_index = True)
+    output_file.write('--\n')
+    output_file.write('-- UPDATE tbl6 SET col1 = 115 WHERE col1 >= 200 AND col1 < 203;\n')
+    output_file.write('-- UPDATE tbl6 SET col3 = 1.75 WHERE col1 >= 110 AND col1 < 112;\n')
+    output_file.write('-- DELETE FROM tbl6 WHERE col1 >= 104 AND col1 < 108;\n')
+    output_file.write('--\n')
+    output_file.write('u1=select(db1.tbl6.col1,200,203)\n')
+    output_file.write('relational_update(db1.tbl6.col1,u1,115)\n')
+    dataTable.loc[(dataTable['col1'] >= 200) & (dataTable['col1'] < 203), 'col1'] = 115
+    output_file.write('u2=select(db1.tbl6.col1,110,112)\n')
+    output_file.write('relational_update(db1.tbl6.col3,u2,1.75)\n')
+    dataTable.loc[(dataTable['col1'] >= 110) & (dataTable['col1'] < 112), 'col3'] = 1.75
+    output_file.write('d1=select(db1.tbl6.col1,104,108)\n')
+    output_file.write('relational_delete(db1.tbl6,d1)\n')
+    dataTable = dataTable[(dataTable['col1'] < 104) | (dataTable['col1'] >= 108)]
+    output_file.write('--\n')
+    writeExpected(exp_output_file, writeTypedQueries(dataTable, output_file))
+    data_gen_utils.closeFileHandles(output_file, exp_output_file)
+    return dataTable
+
+def createTest46(dataTable):
+    output_file, exp_output_file = data_gen_utils.openFileHandles(46, TEST_DIR=TEST_BASE_DIR)
+    output_file.write('-- Recovery after a crash\n')
+    output_file.write('--\n')
+    output_file.write('-- The server was killed after test 45. Its changes are replayed from\n')
+    output_file.write('-- the log, on top of the checkpointed load and its index.\n')
+    output_file.write('--\n')
+    writeExpected(exp_output_file, writeTypedQueries(dataTable, output_file))
+    data_gen_utils.closeFileHandles(output_file, exp_output_file)
+
+def writeCompactedQueries(dataTable, output_file):
+    output_file.write('-- SELECT col2 FROM tbl7 WHERE col1 >= 390 AND col1 < 420;\n')
+    output_file.write('-- SELECT col1 FROM tbl7 WHERE col2 >= 5000 AND col2 < 5100;\n')
+    output_file.write('s1=select(db1.tbl7.col1,390,420)\n')
+    output_file.write('f1=fetch(db1.tbl7.col2,s1)\n')
+    output_file.write('print(f1)\n')
+    output_file.write('s2=select(db1.tbl7.col2,5000,5100)\n')
+    output_file.write('f2=fetch(db1.tbl7.col1,s2)\n')
+    output_file.write('print(f2)\n')
+    mask1 = (dataTable['col1'] >= 390) & (dataTable['col1'] < 420)
+    mask2 = (dataTable['col2'] >= 5000) & (dataTable['col2'] < 5100)
+    return [data_gen_utils.outputPrint(dataTable[mask1]['col2']),
+            data_gen_utils.outputPrint(dataTable[mask2]['col1'])]
+
+def createTest47(dataTable):
+    output_file, exp_output_file = data_gen_utils.openFileHandles(47, TEST_DIR=TEST_BASE_DIR)
+    output_file.write('-- Delete enough rows of a table for the shutdown to compact it\n')
+    output_file.write('--\n')
+    output_file.write('-- DELETE FROM tbl7 WHERE col1 < 400;\n')
+    output_file.write('--\n')
+    output_file.write('create(tbl,"tbl7",db1,2)\n')
+    output_file.write('create(col,"col1",db1.tbl7)\n')
+    output_file.write('create(col,"col2",db1.tbl7)\n')
+    output_file.write('load(\"'+DOCKER_TEST_BASE_DIR+'/data7.csv\")\n')
+    output_file.write('d1=select(db1.tbl7.col1,0,400)\n')
+    output_file.write('relational_delete(db1.tbl7,d1)\n')
+    dataTable = dataTable[dataTable['col1'] >= 400]
+    output_file.write('--\n')
+    writeExpected(exp_output_file, writeCompactedQueries(dataTable, output_file))
+    output_file.write('shutdown\n')
+    data_gen_utils.closeFileHandles(output_file, exp_output_file)
+    return dataTable
+
+def createTest48(dataTable):
+    output_file, exp_output_file = data_gen_utils.openFileHandles(48, TEST_DIR=TEST_BASE_DIR)
+    output_file.write('-- Queries and changes on a compacted table after a restart\n')
+    output_file.write('--\n')
+    output_file.write('-- Compaction renumbered the rows of tbl7; new rows, deletes and\n')
+    output_file.write('-- selects have to agree with the new positions.\n')
+    output_file.write('--\n')
+    output_file.write('relational_insert(db1.tbl7,395,5050)\n')
+    output_file.write('relational_insert(db1.tbl7,410,5099)\n')
+    dataTable = pd.concat([dataTable, pd.DataFrame([{"col1": 395, "col2": 5050},
+                                                    {"col1": 410, "col2": 5099}])],
+                          ignore_index = True)
+    output_file.write('-- DELETE FROM tbl7 WHERE col1 >= 412 AND col1 < 415;\n')
+    output_file.write('d1=select(db1.tbl7.col1,412,415)\n')
+    output_file.write('relational_delete(db1.tbl7,d1)\n')
+    dataTable = dataTable[(dataTable['col1'] < 412) | (dataTable['col1'] >= 415)]
+    output_file.write('--\n')
+    writeExpected(exp_output_file, writeCompactedQueries(dataTable, output_file))
+    data_gen_utils.closeFileHandles(output_file, exp_output_file)
+    return dataTable
+
+def createTest49(typedTable, compactedTable):
+    output_file, exp_output_file = data_gen_utils.openFileHandles(49, TEST_DIR=TEST_BASE_DIR)
+    output_file.write('-- Batched selects over the recovered and the compacted table\n')
+    output_file.write('--\n')
+    output_file.write('-- SELECT col2 FROM tbl7 WHERE col1 >= 450 AND col1 < 460;\n')
+    output_file.write('-- SELECT col2 FROM tbl7 WHERE col1 >= 455 AND col1 < 470;\n')
+    output_file.write('-- SELECT col2 FROM tbl7 WHERE col1 >= 100 AND col1 < 500;\n')
+    output_file.write('-- SELECT col2 FROM tbl6 WHERE col1 >= 100 AND col1 < 105;\n')
+    output_file.write('--\n')
+    output_file.write('batch_queries()\n')
+    output_file.write('s1=select(db1.tbl7.col1,450,460)\n')
+    output_file.write('s2=select(db1.tbl7.col1,455,470)\n')
+    output_file.write('s3=select(db1.tbl7.col1,100,500)\n')
+    output_file.write('s4=select(db1.tbl6.col1,100,105)\n')
+    output_file.write('batch_execute()\n')
+    output_file.write('f1=fetch(db1.tbl7.col2,s1)\n')
+    output_file.write('f2=fetch(db1.tbl7.col2,s2)\n')
+    output_file.write('f3=fetch(db1.tbl7.col2,s3)\n')
+    output_file.write('f4=fetch(db1.tbl6.col2,s4)\n')
+    output_file.write('a3=sum(f3)\n')
+    output_file.write('print(f1)\n')
+    output_file.write('print(f2)\n')
+    output_file.write('print(a3)\n')
+    output_file.write('print(f4)\n')
+    outputs = []
+    for low, high in [(450, 460), (455, 470)]:
+        mask = (compactedTable['col1'] >= low) & (compactedTable['col1'] < high)
+        outputs.append(data_gen_utils.outputPrint(compactedTable[mask]['col2']))
+    mask = (compactedTable['col1'] >= 100) & (compactedTable['col1'] < 500)
+    outputs.append(str(compactedTable[mask]['col2'].sum()))
+    mask = (typedTable['col1'] >= 100) & (typedTable['col1'] < 105)
+    outputs.append(data_gen_utils.outputPrint(typedTable[mask]['col2']))
+    writeExpected(exp_output_file, outputs)
+    data_gen_utils.closeFileHandles(output_file, exp_output_file)
+
+def generateMilestoneSixFiles(dataSize, randomSeed=48):
+    np.random.seed(randomSeed)
+    typedTable = generateDataMilestone6(dataSize)
+    compactedTable = generateDataMilestone6Compaction(dataSize)
+    createTest44(typedTable)
+    typedTable = createTest45(typedTable)
+    createTest46(typedTable)
+    compactedTable = createTest47(compactedTable)
+    compactedTable = createTest48(compactedTable)
+    createTest49(typedTable, compactedTable)
+
+def main(argv):
+    global TEST_BASE_DIR
+    global DOCKER_TEST_BASE_DIR
+    dataSize = int(argv[0])
+    if len(argv) > 1:
+        randomSeed = int(argv[1])
+    else:
+        randomSeed = 48
+
+    if len(argv) > 2:
+        TEST_BASE_DIR = argv[2]
+        if len(argv) > 3:
+            DOCKER_TEST_BASE_DIR = argv[3]
+
+    generateMilestoneSixFiles(dataSize, randomSeed=randomSeed)
+
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
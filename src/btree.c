@@ -0,0 +1,642 @@
+/*
+ * -- btree.c
+ *
+ *  B+trees mapping column values to row positions (see btree.h)
+ */
+
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include "btree.h"
+#include "kernels.h"
+
+/*
+ * Leaves are binary searched until the keys left to look at fit in
+ * LEAF_WINDOW keys (two cache lines), which count_below then compares.
+ */
+#define LEAF_WINDOW 16
+
+typedef struct RangeScan {
+    int64_t low;
+    int64_t high;
+    position_t *out;
+    size_t count;
+    size_t capacity;
+} RangeScan;
+
+static void pad_keys(int64_t *keys, size_t from, size_t to)
+{
+    for (size_t i = from; i < to; i++) {
+        keys[i] = INT64_MAX;
+    }
+}
+
+/*
+ * Adds n groups of node_size byte nodes to an arena holding *groups groups,
+ * reallocating it on the heap (aligned to node_size, at least doubling its
+ * capacity) if it is full. The old arena is freed unless it is *mapped.
+ * Returns the number of the first new group, -1 if out of memory.
+ */
+static long new_groups(void **arena, bool *mapped, size_t *groups, size_t *capacity, size_t n,
+                       size_t node_size)
+{
+    size_t group_bytes = node_size * BTREE_GROUP;
+
+    if (*groups + n > *capacity) {
+        size_t grown_capacity = *capacity * 2 > *groups + n ? *capacity * 2 : *groups + n;
+        void *grown;
+        if (posix_memalign(&grown, node_size, group_bytes * grown_capacity) != 0) {
+            return -1;
+        }
+        if (*groups > 0) {
+            memcpy(grown, *arena, group_bytes * *groups);
+        }
+        if (!*mapped) {
+            free(*arena);
+        }
+        *mapped = false;
+        *arena = grown;
+        *capacity = grown_capacity;
+    }
+    *groups += n;
+    return *groups - n;
+}
+
+static long new_inner_groups(BTree *tree, size_t n)
+{
+    void *arena = tree->inner;
+    long group = new_groups(&arena, &tree->inner_mapped, &tree->inner_groups,
+                            &tree->inner_capacity, n, sizeof(BTreeInner));
+    tree->inner = arena;
+    return group;
+}
+
+static long new_leaf_groups(BTree *tree, size_t n)
+{
+    void *arena = tree->leaves;
+    long group = new_groups(&arena, &tree->leaves_mapped, &tree->leaf_groups,
+                            &tree->leaf_capacity, n, sizeof(BTreeLeaf));
+    tree->leaves = arena;
+    return group;
+}
+
+/*
+ * Returns the child of an inner node whose subtree holds (key, pos), which
+ * is the number of separators ordering at or before it.
+ */
+static size_t inner_child(const BTreeInner *node, int64_t key, position_t pos)
+{
+    size_t at = count_below(node->keys, BTREE_INNER_KEYS, key);
+    while (at < node->count && node->keys[at] == key && node->positions[at] <= pos) {
+        at++;
+    }
+    return at;
+}
+
+/*
+ * Returns how many keys of a leaf are below key.
+ */
+static size_t leaf_below(const BTreeLeaf *leaf, int64_t key)
+{
+    size_t lo = 0, hi = leaf->count;
+    while (hi - lo > LEAF_WINDOW) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (leaf->keys[mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    // the keys before lo are below key and those from hi on (the padding
+    // included) are not, so the window can be widened to blocks of 4
+    lo &= ~(size_t) 3;
+    hi = (hi + 3) & ~(size_t) 3;
+    return lo + count_below(leaf->keys + lo, hi - lo, key);
+}
+
+/*
+ * Returns how many entries of a leaf order before (key, pos).
+ */
+static size_t leaf_lower(const BTreeLeaf *leaf, int64_t key, position_t pos)
+{
+    size_t at = leaf_below(leaf, key);
+    while (at < leaf->count && leaf->keys[at] == key && leaf->positions[at] < pos) {
+        at++;
+    }
+    return at;
+}
+
+static int node_full(const BTree *tree, size_t node, size_t height)
+{
+    return height == 0 ? tree->leaves[node].count == BTREE_LEAF_ENTRIES
+                       : tree->inner[node].count == BTREE_INNER_KEYS;
+}
+
+
+/*
+ * Builds the levels of a tree bottom up over n sorted entries, using
+ * min_keys and min_positions as scratch for one entry per leaf: the least
+ * entry of every node of the level last built. Returns -1 if out of
+ * memory.
+ */
+static int build_levels(BTree *tree, const int64_t *keys, const position_t *positions, size_t n,
+                        int64_t *min_keys, position_t *min_positions)
+{
+    size_t num_nodes = n > 0 ? (n + BTREE_LEAF_ENTRIES - 1) / BTREE_LEAF_ENTRIES : 1;
+    size_t first = 0;
+
+    if (new_leaf_groups(tree, (num_nodes + BTREE_GROUP - 1) / BTREE_GROUP) == -1) {
+        return -1;
+    }
+    for (size_t l = 0; l < num_nodes; l++) {
+        BTreeLeaf *leaf = &tree->leaves[l];
+        size_t begin = l * BTREE_LEAF_ENTRIES;
+        leaf->count = n - begin < BTREE_LEAF_ENTRIES ? n - begin : BTREE_LEAF_ENTRIES;
+        memcpy(leaf->keys, keys + begin, sizeof(int64_t) * leaf->count);
+        memcpy(leaf->positions, positions + begin, sizeof(position_t) * leaf->count);
+        pad_keys(leaf->keys, leaf->count, BTREE_LEAF_ENTRIES);
+        if (leaf->count > 0) {
+            min_keys[l] = keys[begin];
+            min_positions[l] = positions[begin];
+        }
+    }
+    tree->root = 0;
+    tree->height = 0;
+
+    // the nodes of a level fill groups first, first + 1, ... in order, so
+    // parent p takes group first + p as its children; it replaces the least
+    // entry of node p, which it never reads again
+    while (num_nodes > 1) {
+        size_t num_parents = (num_nodes + BTREE_GROUP - 1) / BTREE_GROUP;
+        long parents = new_inner_groups(tree, (num_parents + BTREE_GROUP - 1) / BTREE_GROUP);
+        if (parents == -1) {
+            return -1;
+        }
+        for (size_t p = 0; p < num_parents; p++) {
+            BTreeInner *node = &tree->inner[parents * BTREE_GROUP + p];
+            size_t kids = num_nodes - p * BTREE_GROUP < BTREE_GROUP ? num_nodes - p * BTREE_GROUP
+                                                                    : BTREE_GROUP;
+            node->count = kids - 1;
+            node->height = tree->height + 1;
+            node->children = first + p;
+            for (size_t c = 1; c < kids; c++) {
+                node->keys[c - 1] = min_keys[p * BTREE_GROUP + c];
+                node->positions[c - 1] = min_positions[p * BTREE_GROUP + c];
+            }
+            pad_keys(node->keys, node->count, BTREE_INNER_KEYS);
+            min_keys[p] = min_keys[p * BTREE_GROUP];
+            min_positions[p] = min_positions[p * BTREE_GROUP];
+        }
+        first = parents;
+        num_nodes = num_parents;
+        tree->root = parents * BTREE_GROUP;
+        tree->height++;
+    }
+    return 0;
+}
+
+
+/******************************************************************************
+ * -- btree_build --
+ *
+ * Bulk loads a tree bottom up: full leaves are cut from the entries in
+ * order, then every level is built from the one below it, each inner node
+ * taking a whole group of BTREE_GROUP nodes as children, until a single
+ * root is left.
+ *
+ * Params:
+ *    keys [in]         The keys of the entries
+ *    positions [in]    The positions of the entries
+ *    n [in]            The number of entries, sorted by (key, position)
+ *
+ * Returns the tree, NULL if out of memory
+ *
+ ******************************************************************************
+ */
+
+BTree *btree_build(const int64_t *keys,          // IN
+                   const position_t *positions,  // IN
+                   size_t n)                     // IN
+{
+    size_t num_leaves = n > 0 ? (n + BTREE_LEAF_ENTRIES - 1) / BTREE_LEAF_ENTRIES : 1;
+    BTree *tree = calloc(1, sizeof(BTree));
+    int64_t *min_keys = malloc(sizeof(int64_t) * num_leaves);
+    position_t *min_positions = malloc(sizeof(position_t) * num_leaves);
+
+    if (tree == NULL || min_keys == NULL || min_positions == NULL ||
+        build_levels(tree, keys, positions, n, min_keys, min_positions) == -1) {
+        btree_free(tree);
+        free(min_keys);
+        free(min_positions);
+        return NULL;
+    }
+    free(min_keys);
+    free(min_positions);
+    tree->num_entries = n;
+    return tree;
+}
+
+
+/*
+ * Splits child c of inner node parent_id, which is full while the parent
+ * is not. The siblings after the child move up one slot in their group
+ * and the upper half of the child becomes child c + 1. For a leaf the
+ * least entry of the new leaf becomes separator c of the parent; an inner
+ * child hands its middle separator up instead, and the children after it
+ * to a new group. Returns -1 if out of memory, with the tree unchanged.
+ */
+static int split_child(BTree *tree, size_t parent_id, size_t c)
+{
+    size_t child_height = tree->inner[parent_id].height - 1;
+    long group = 0;
+    BTreeInner *parent;
+    size_t base, movers;
+    int64_t up_key;
+    position_t up_pos;
+
+    // allocate before taking pointers, the arenas may move
+    if (child_height == 1) {
+        group = new_leaf_groups(tree, 1);
+    } else if (child_height > 1) {
+        group = new_inner_groups(tree, 1);
+    }
+    if (group == -1) {
+        return -1;
+    }
+    parent = &tree->inner[parent_id];
+    base = (size_t) parent->children * BTREE_GROUP;
+    movers = parent->count - c;
+
+    if (child_height == 0) {
+        BTreeLeaf *left = &tree->leaves[base + c], *right = left + 1;
+        size_t half = BTREE_LEAF_ENTRIES / 2;
+        memmove(right + 1, right, sizeof(BTreeLeaf) * movers);
+        right->count = left->count - half;
+        memcpy(right->keys, left->keys + half, sizeof(int64_t) * right->count);
+        memcpy(right->positions, left->positions + half, sizeof(position_t) * right->count);
+        pad_keys(right->keys, right->count, BTREE_LEAF_ENTRIES);
+        left->count = half;
+        pad_keys(left->keys, half, BTREE_LEAF_ENTRIES);
+        up_key = right->keys[0];
+        up_pos = right->positions[0];
+    } else {
+        BTreeInner *left = &tree->inner[base + c], *right = left + 1;
+        size_t half = BTREE_INNER_KEYS / 2;
+        size_t from = (size_t) left->children * BTREE_GROUP + half + 1;
+        size_t to = (size_t) group * BTREE_GROUP;
+        memmove(right + 1, right, sizeof(BTreeInner) * movers);
+        up_key = left->keys[half];
+        up_pos = left->positions[half];
+        right->count = left->count - half - 1;
+        right->height = left->height;
+        right->children = group;
+        memcpy(right->keys, left->keys + half + 1, sizeof(int64_t) * right->count);
+        memcpy(right->positions, left->positions + half + 1, sizeof(position_t) * right->count);
+        pad_keys(right->keys, right->count, BTREE_INNER_KEYS);
+        left->count = half;
+        pad_keys(left->keys, half, BTREE_INNER_KEYS);
+        if (child_height == 1) {
+            memcpy(&tree->leaves[to], &tree->leaves[from], sizeof(BTreeLeaf) * (right->count + 1));
+        } else {
+            memcpy(&tree->inner[to], &tree->inner[from], sizeof(BTreeInner) * (right->count + 1));
+        }
+    }
+
+    memmove(&parent->keys[c + 1], &parent->keys[c], sizeof(int64_t) * (parent->count - c));
+    memmove(&parent->positions[c + 1], &parent->positions[c],
+            sizeof(position_t) * (parent->count - c));
+    parent->keys[c] = up_key;
+    parent->positions[c] = up_pos;
+    parent->count++;
+    return 0;
+}
+
+/*
+ * Puts a new root, in a group of its own, above the full root and splits
+ * the old root, which becomes its first child. Returns -1 if out of
+ * memory.
+ */
+static int grow_root(BTree *tree)
+{
+    long group = new_inner_groups(tree, 1);
+    BTreeInner *root;
+
+    if (group == -1) {
+        return -1;
+    }
+    root = &tree->inner[group * BTREE_GROUP];
+    root->count = 0;
+    root->height = tree->height + 1;
+    root->children = tree->root / BTREE_GROUP;
+    pad_keys(root->keys, 0, BTREE_INNER_KEYS);
+    tree->root = group * BTREE_GROUP;
+    tree->height++;
+    // should the split fail, a root with a single child is still a tree
+    return split_child(tree, tree->root, 0);
+}
+
+
+/******************************************************************************
+ * -- btree_insert --
+ *
+ * Adds entry (key, pos) to a tree. Full nodes on the way down are split
+ * before descending into them, so the leaf reached has room.
+ *
+ * Returns -1 if out of memory, the tree then lacks the entry
+ *          0 on success
+ *
+ ******************************************************************************
+ */
+
+int btree_insert(BTree *tree,       // IN/OUT
+                 int64_t key,       // IN
+                 position_t pos)    // IN
+{
+    size_t node;
+    BTreeLeaf *leaf;
+    size_t at;
+
+    if (node_full(tree, tree->root, tree->height) && grow_root(tree) == -1) {
+        return -1;
+    }
+    node = tree->root;
+    for (size_t height = tree->height; height > 0; height--) {
+        size_t c = inner_child(&tree->inner[node], key, pos);
+        if (node_full(tree, tree->inner[node].children * BTREE_GROUP + c, height - 1)) {
+            if (split_child(tree, node, c) == -1) {
+                return -1;
+            }
+            c = inner_child(&tree->inner[node], key, pos);
+        }
+        node = tree->inner[node].children * BTREE_GROUP + c;
+    }
+
+    leaf = &tree->leaves[node];
+    at = leaf_lower(leaf, key, pos);
+    if (at < leaf->count && leaf->keys[at] == key && leaf->positions[at] == pos) {
+        return 0;
+    }
+    memmove(&leaf->keys[at + 1], &leaf->keys[at], sizeof(int64_t) * (leaf->count - at));
+    memmove(&leaf->positions[at + 1], &leaf->positions[at],
+            sizeof(position_t) * (leaf->count - at));
+    leaf->keys[at] = key;
+    leaf->positions[at] = pos;
+    leaf->count++;
+    tree->num_entries++;
+    return 0;
+}
+
+
+/******************************************************************************
+ * -- btree_remove --
+ *
+ * Removes entry (key, pos) from its leaf. Nodes are never merged.
+ *
+ * Returns -1 if the tree has no such entry
+ *          0 on success
+ *
+ ******************************************************************************
+ */
+
+int btree_remove(BTree *tree,       // IN/OUT
+                 int64_t key,       // IN
+                 position_t pos)    // IN
+{
+    size_t node = tree->root;
+    BTreeLeaf *leaf;
+    size_t at;
+
+    for (size_t height = tree->height; height > 0; height--) {
+        const BTreeInner *inner = &tree->inner[node];
+        node = inner->children * BTREE_GROUP + inner_child(inner, key, pos);
+    }
+    leaf = &tree->leaves[node];
+    at = leaf_lower(leaf, key, pos);
+    if (at == leaf->count || leaf->keys[at] != key || leaf->positions[at] != pos) {
+        return -1;
+    }
+    memmove(&leaf->keys[at], &leaf->keys[at + 1], sizeof(int64_t) * (leaf->count - at - 1));
+    memmove(&leaf->positions[at], &leaf->positions[at + 1],
+            sizeof(position_t) * (leaf->count - at - 1));
+    leaf->count--;
+    leaf->keys[leaf->count] = INT64_MAX;
+    tree->num_entries--;
+    return 0;
+}
+
+
+static int append_positions(RangeScan *scan, const position_t *positions, size_t n)
+{
+    if (scan->count + n > scan->capacity) {
+        size_t capacity = scan->capacity;
+        position_t *grown;
+        while (scan->count + n > capacity) {
+            capacity *= 2;
+        }
+        grown = realloc(scan->out, sizeof(position_t) * capacity);
+        if (grown == NULL) {
+            return -1;
+        }
+        scan->out = grown;
+        scan->capacity = capacity;
+    }
+    memcpy(scan->out + scan->count, positions, sizeof(position_t) * n);
+    scan->count += n;
+    return 0;
+}
+
+/*
+ * Appends the positions of the entries of the subtree under node (a leaf
+ * if height is 0) with keys in [low, high], in key order, visiting the
+ * children from the first one that may hold low on. Returns 1 once a key
+ * above high was seen, -1 if out of memory, else 0.
+ */
+static int scan_range(const BTree *tree, size_t node, size_t height, RangeScan *scan)
+{
+    const BTreeInner *inner;
+
+    if (height == 0) {
+        const BTreeLeaf *leaf = &tree->leaves[node];
+        size_t begin = leaf_below(leaf, scan->low);
+        size_t end = scan->high == INT64_MAX ? leaf->count : leaf_below(leaf, scan->high + 1);
+        if (end < begin) {
+            end = begin;
+        }
+        if (append_positions(scan, leaf->positions + begin, end - begin) == -1) {
+            return -1;
+        }
+        return end < leaf->count;
+    }
+    inner = &tree->inner[node];
+    for (size_t c = count_below(inner->keys, BTREE_INNER_KEYS, scan->low); c <= inner->count; c++) {
+        int done;
+        if (c > 0 && inner->keys[c - 1] > scan->high) {
+            return 1;
+        }
+        done = scan_range(tree, inner->children * BTREE_GROUP + c, height - 1, scan);
+        if (done != 0) {
+            return done;
+        }
+    }
+    return 0;
+}
+
+
+/******************************************************************************
+ * -- btree_range --
+ *
+ * Collects the positions of the entries whose key lies within
+ * [low, high]. The tree has no leaf links, the scan descends to the leaf
+ * of the least such entry and moves on through the following subtrees.
+ *
+ * Params:
+ *    tree [in]     The tree
+ *    low [in]      Inclusive lower bound
+ *    high [in]     Inclusive upper bound
+ *    count [out]   The number of positions returned
+ *
+ * Returns the positions in key order, to be freed by the caller, NULL if
+ * out of memory
+ *
+ ******************************************************************************
+ */
+
+position_t *btree_range(const BTree *tree,  // IN
+                        int64_t low,        // IN
+                        int64_t high,       // IN
+                        size_t *count)      // OUT
+{
+    RangeScan scan;
+
+    scan.low = low;
+    scan.high = high;
+    scan.count = 0;
+    scan.capacity = BTREE_LEAF_ENTRIES;
+    scan.out = malloc(sizeof(position_t) * scan.capacity);
+    if (scan.out == NULL || scan_range(tree, tree->root, tree->height, &scan) == -1) {
+        free(scan.out);
+        return NULL;
+    }
+    *count = scan.count;
+    return scan.out;
+}
+
+
+/******************************************************************************
+ * -- btree_save --
+ *
+ * Writes an image of a tree to file, at its current offset, which must be
+ * a multiple of the page size so the leaves can be mapped in place: the
+ * leaf groups, then the inner groups.
+ *
+ * Params:
+ *    tree [in]     The tree
+ *    file [in]     The file to write to
+ *    image [out]   The rest of the image, for btree_map
+ *
+ * Returns -1 on failure
+ *          0 on success
+ *
+ ******************************************************************************
+ */
+
+int btree_save(const BTree *tree,     // IN
+               FILE *file,            // IN
+               BTreeImage *image)     // OUT
+{
+    image->num_entries = tree->num_entries;
+    image->leaf_groups = tree->leaf_groups;
+    image->inner_groups = tree->inner_groups;
+    image->root = tree->root;
+    image->height = tree->height;
+    if (fwrite(tree->leaves, sizeof(BTreeLeaf) * BTREE_GROUP, tree->leaf_groups, file) !=
+        tree->leaf_groups) {
+        return -1;
+    }
+    if (tree->inner_groups > 0 &&
+        fwrite(tree->inner, sizeof(BTreeInner) * BTREE_GROUP, tree->inner_groups, file) !=
+        tree->inner_groups) {
+        return -1;
+    }
+    return 0;
+}
+
+
+/******************************************************************************
+ * -- btree_map --
+ *
+ * Makes a tree of an image written by btree_save that is mapped into
+ * memory, private and writable, using its nodes where they are. The
+ * caller unmaps the image once the tree is freed.
+ *
+ * Params:
+ *    image [in]    What btree_save returned with the image
+ *    data [in]     The mapped arenas, page aligned
+ *    bytes [in]    The bytes mapped from data on
+ *
+ * Returns the tree, NULL if the arenas do not fit in the mapping or out
+ * of memory
+ *
+ ******************************************************************************
+ */
+
+BTree *btree_map(const BTreeImage *image,   // IN
+                 void *data,                // IN
+                 size_t bytes)              // IN
+{
+    size_t leaf_group_bytes = sizeof(BTreeLeaf) * BTREE_GROUP;
+    size_t inner_group_bytes = sizeof(BTreeInner) * BTREE_GROUP;
+    size_t leaf_bytes;
+    BTree *tree;
+
+    if (image->leaf_groups == 0 || image->leaf_groups > bytes / leaf_group_bytes) {
+        return NULL;
+    }
+    leaf_bytes = leaf_group_bytes * image->leaf_groups;
+    if (image->inner_groups > (bytes - leaf_bytes) / inner_group_bytes ||
+        image->root >= (image->height == 0 ? image->leaf_groups : image->inner_groups) *
+                       BTREE_GROUP) {
+        return NULL;
+    }
+    tree = calloc(1, sizeof(BTree));
+    if (tree == NULL) {
+        return NULL;
+    }
+    tree->leaves = data;
+    tree->leaf_groups = image->leaf_groups;
+    tree->leaf_capacity = image->leaf_groups;
+    tree->leaves_mapped = true;
+    if (image->inner_groups > 0) {
+        tree->inner = (BTreeInner *) ((char *) data + leaf_bytes);
+        tree->inner_groups = image->inner_groups;
+        tree->inner_capacity = image->inner_groups;
+        tree->inner_mapped = true;
+    }
+    tree->root = image->root;
+    tree->height = image->height;
+    tree->num_entries = image->num_entries;
+    return tree;
+}
+
+
+/******************************************************************************
+ * -- btree_free --
+ *
+ * Releases a tree and the node arenas it owns.
+ *
+ ******************************************************************************
+ */
+
+void btree_free(BTree *tree) // IN/OUT
+{
+    if (tree == NULL) {
+        return;
+    }
+    if (!tree->inner_mapped) {
+        free(tree->inner);
+    }
+    if (!tree->leaves_mapped) {
+        free(tree->leaves);
+    }
+    free(tree);
+}
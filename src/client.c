@@ -1,7 +1,7 @@
 /* This line at the top is necessary for compilation on the lab machine and many other Unix machines.
 Please look up _XOPEN_SOURCE for more details. As well, if your code does not compile on the lab
 machine please look into this as a a source of error. */
-#define _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
 
 /**
  * client.c
@@ -84,27 +84,26 @@ int main(void)
         prefix = "db_client > ";
     }
 
-    char *output_str = NULL;
+    ssize_t read_length = 0;
     int len = 0;
 
     // Continuously loop and wait for input. At each iteration:
     // 1. output interactive marker
     // 2. read from stdin until eof.
-    char read_buffer[DEFAULT_STDIN_BUFFER_SIZE];
-    send_message.payload = read_buffer;
+    // Lines are read with getline so batched statements (e.g. a
+    // relational_insert_batch carrying many rows) are not cut off.
+    size_t read_buffer_size = DEFAULT_STDIN_BUFFER_SIZE;
+    char *read_buffer = malloc(read_buffer_size);
     send_message.status = 0;
 
-    while (printf("%s", prefix), output_str = fgets(read_buffer,
-           DEFAULT_STDIN_BUFFER_SIZE, stdin), !feof(stdin)) {
-        if (output_str == NULL) {
-            log_err("fgets failed.\n");
-            break;
-        }
+    while (printf("%s", prefix),
+           (read_length = getline(&read_buffer, &read_buffer_size, stdin)) != -1) {
+        send_message.payload = read_buffer;
 
         // Only process input that is greater than 1 character.
         // Convert to message and send the message and the
         // payload directly to the server.
-        send_message.length = strlen(read_buffer);
+        send_message.length = read_length;
         if (send_message.length > 1) {
             // Send the message_header, which tells server payload size
             if (send(client_socket, &(send_message), sizeof(message), 0) == -1) {
@@ -120,16 +119,22 @@ int main(void)
 
             // Always wait for server response (even if it is just an OK message)
             if ((len = recv(client_socket, &(recv_message), sizeof(message), 0)) > 0) {
-                if ((recv_message.status == OK_WAIT_FOR_RESPONSE || recv_message.status == OK_DONE) &&
-                    (int) recv_message.length > 0) {
+                if ((int) recv_message.length > 0) {
                     // Calculate number of bytes in response package
                     int num_bytes = (int) recv_message.length;
-                    char payload[num_bytes + 1];
-
-                    // Receive the payload and print it out
-                    if ((len = recv(client_socket, payload, num_bytes, 0)) > 0) {
-                        payload[num_bytes] = '\0';
+                    char* payload = malloc(num_bytes + 1);
+
+                    // Receive the payload: printed results go to stdout,
+                    // errors to stderr
+                    if ((len = recv(client_socket, payload, num_bytes, MSG_WAITALL)) > 0) {
+                        payload[len] = '\0';
+                        if (recv_message.status == OK_WAIT_FOR_RESPONSE) {
+                            printf("%s\n", payload);
+                        } else {
+                            log_err("%s\n", payload);
+                        }
                     }
+                    free(payload);
                 }
             }
             else {
@@ -143,6 +148,7 @@ int main(void)
             }
         }
     }
+    free(read_buffer);
     close(client_socket);
     return 0;
 }
@@ -1,7 +1,9 @@
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 #include "client_context.h"
 #include "hashtable.h"
+#include "query.h"
 #include "utils.h"
 
 hashtable *table_ht;
@@ -15,13 +17,18 @@ hashtable *table_ht;
  */
 Table *lookup_table(char *name) {
     int val;
-	get(table_ht, name, &val);
+	if (current_db == NULL || table_ht == NULL || get(table_ht, name, &val) != 0) {
+		return NULL;
+	}
 	return &current_db->tables[val];
 }
 
 Column *lookup_column(char *tbl_name, char *col_name) {
 	assert(col_name != NULL && tbl_name != NULL);
 	const Table *tbl = lookup_table(tbl_name);
+	if (tbl == NULL) {
+		return NULL;
+	}
 	int tbl_name_length = strlen(tbl_name);
 	int col_length = strlen(col_name);
     char full_col_name[tbl_name_length + col_length + 2];
@@ -54,3 +61,235 @@ Column *lookup_column(char *tbl_name, char *col_name) {
 * 		What other entities are context related (and contextual with respect to what scope in your design)?
 * 		What else will you define in this file?
 **/
+
+/*
+ * Every connected client's context, so that a change can run the deferred
+ * statements of all clients first (see materialize_deferred_handles).
+ */
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+static ClientContext *clients = NULL;
+
+/*
+ * Handles live in a flat array per client. Clients keep only a handful of
+ * intermediates alive, so a linear scan beats hashing here.
+ */
+ClientContext *create_client_context(void) {
+	ClientContext *context = malloc(sizeof(ClientContext));
+	if (context == NULL) {
+		return NULL;
+	}
+	context->chandle_table = malloc(sizeof(GeneralizedColumnHandle) * C_HANDLE_LIMIT);
+	context->chandles_in_use = 0;
+	context->chandle_slots = C_HANDLE_LIMIT;
+	context->batching = false;
+	context->batch = NULL;
+	context->batch_count = 0;
+	context->batch_slots = 0;
+
+	pthread_mutex_lock(&clients_lock);
+	context->next_client = clients;
+	clients = context;
+	pthread_mutex_unlock(&clients_lock);
+	return context;
+}
+
+/*
+ * Releases what a handle is bound to, a result or a deferred pipeline.
+ */
+static void release_handle(GeneralizedColumn *handle) {
+	if (handle->column_type == DEFERRED) {
+		free(handle->column_pointer.pipeline);
+	} else {
+		free_result(handle->column_pointer.result);
+	}
+}
+
+void free_client_context(ClientContext *context) {
+	if (context == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&clients_lock);
+	for (ClientContext **link = &clients; *link != NULL; link = &(*link)->next_client) {
+		if (*link == context) {
+			*link = context->next_client;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&clients_lock);
+
+	for (int i = 0; i < context->chandles_in_use; i++) {
+		release_handle(&context->chandle_table[i].generalized_column);
+	}
+	free(context->chandle_table);
+	free(context->batch);
+	free(context);
+}
+
+/*
+ * Runs the pipeline of a deferred handle and binds the handle to its
+ * result instead. Returns 0 if the pipeline failed, the handle then stays
+ * deferred.
+ */
+static int materialize(GeneralizedColumn *handle) {
+	Result *result = NULL;
+	Status status = pipeline_result(handle->column_pointer.pipeline, &result);
+	if (status.code != OK) {
+		log_err("%s:%d: Cannot materialize handle: %s\n", __FUNCTION__, __LINE__,
+		        status.error_message);
+		return 0;
+	}
+	free(handle->column_pointer.pipeline);
+	handle->column_type = RESULT;
+	handle->column_pointer.result = result;
+	return 1;
+}
+
+static GeneralizedColumnHandle *find_handle(ClientContext *context, const char *name) {
+	for (int i = 0; i < context->chandles_in_use; i++) {
+		if (strcmp(context->chandle_table[i].name, name) == 0) {
+			return &context->chandle_table[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * lookup_handle returns the result bound to a handle, running its
+ * pipeline first if it was deferred. Returns NULL if there is no such
+ * handle or its pipeline failed.
+ */
+GeneralizedColumn *lookup_handle(ClientContext *context, const char *name) {
+	GeneralizedColumnHandle *handle = find_handle(context, name);
+	if (handle == NULL) {
+		return NULL;
+	}
+	if (handle->generalized_column.column_type == DEFERRED &&
+	    !materialize(&handle->generalized_column)) {
+		return NULL;
+	}
+	return &handle->generalized_column;
+}
+
+/*
+ * lookup_pipeline returns the pipeline of a deferred handle without
+ * running it, NULL if the handle does not exist or holds a result.
+ */
+const Pipeline *lookup_pipeline(ClientContext *context, const char *name) {
+	GeneralizedColumnHandle *handle = find_handle(context, name);
+	if (handle == NULL || handle->generalized_column.column_type != DEFERRED) {
+		return NULL;
+	}
+	return handle->generalized_column.column_pointer.pipeline;
+}
+
+/*
+ * Binds a handle, releasing whatever a reused handle name was bound to.
+ */
+static Status bind_handle(ClientContext *context, const char *name, GeneralizedColumn bound) {
+	Status ret_status = { OK, SUCCESS_STR };
+	GeneralizedColumnHandle *existing = find_handle(context, name);
+	if (existing != NULL) {
+		release_handle(&existing->generalized_column);
+		existing->generalized_column = bound;
+		return ret_status;
+	}
+	if (context->chandles_in_use == context->chandle_slots) {
+		int slots = context->chandle_slots * 2;
+		GeneralizedColumnHandle *table = realloc(context->chandle_table,
+		                                         sizeof(GeneralizedColumnHandle) * slots);
+		if (table == NULL) {
+			log_err("%s:%d: Cannot grow handle table\n", __FUNCTION__, __LINE__);
+			ret_status.code = ERROR;
+			ret_status.error_message = OUT_OF_MEMORY_STR;
+			return ret_status;
+		}
+		context->chandle_table = table;
+		context->chandle_slots = slots;
+	}
+	GeneralizedColumnHandle *handle = &context->chandle_table[context->chandles_in_use++];
+	strncpy(handle->name, name, HANDLE_MAX_SIZE - 1);
+	handle->name[HANDLE_MAX_SIZE - 1] = '\0';
+	handle->generalized_column = bound;
+	return ret_status;
+}
+
+/*
+ * store_result binds a result to a handle, taking ownership of it.
+ */
+Status store_result(ClientContext *context, const char *name, Result *result) {
+	GeneralizedColumn bound;
+	bound.column_type = RESULT;
+	bound.column_pointer.result = result;
+	return bind_handle(context, name, bound);
+}
+
+/*
+ * store_pipeline binds a copy of a pipeline to a handle; the pipeline
+ * runs once the handle's result is needed.
+ */
+Status store_pipeline(ClientContext *context, const char *name, const Pipeline *pipeline) {
+	Status ret_status = { ERROR, OUT_OF_MEMORY_STR };
+	GeneralizedColumn bound;
+	bound.column_type = DEFERRED;
+	bound.column_pointer.pipeline = malloc(sizeof(Pipeline));
+	if (bound.column_pointer.pipeline == NULL) {
+		return ret_status;
+	}
+	*bound.column_pointer.pipeline = *pipeline;
+	ret_status = bind_handle(context, name, bound);
+	if (ret_status.code != OK) {
+		free(bound.column_pointer.pipeline);
+	}
+	return ret_status;
+}
+
+/*
+ * materialize_deferred_handles runs the deferred pipelines of every
+ * client. Pipelines refer to columns and read them only when they run, so
+ * this must happen before anything changes the catalog or the data, with
+ * the database locked exclusively; otherwise a handle would see changes
+ * made after the statement that bound it. Returns an error if a pipeline
+ * failed; its handle stays deferred, so the change must not be made.
+ */
+Status materialize_deferred_handles(void) {
+	Status ret_status = { OK, SUCCESS_STR };
+	pthread_mutex_lock(&clients_lock);
+	for (ClientContext *context = clients; context != NULL; context = context->next_client) {
+		for (int i = 0; i < context->chandles_in_use; i++) {
+			GeneralizedColumn *handle = &context->chandle_table[i].generalized_column;
+			if (handle->column_type == DEFERRED && !materialize(handle)) {
+				ret_status.code = ERROR;
+				ret_status.error_message = OUT_OF_MEMORY_STR;
+			}
+		}
+	}
+	pthread_mutex_unlock(&clients_lock);
+	return ret_status;
+}
+
+/*
+ * batch_select queues a select of the batch being collected, to be run
+ * by batch_execute() together with the others.
+ */
+Status batch_select(ClientContext *context, const char *handle, const SelectOperator *select) {
+	Status ret_status = { OK, SUCCESS_STR };
+	if (context->batch_count == context->batch_slots) {
+		int slots = context->batch_slots > 0 ? context->batch_slots * 2 : C_HANDLE_LIMIT;
+		BatchedSelect *batch = realloc(context->batch, sizeof(BatchedSelect) * slots);
+		if (batch == NULL) {
+			log_err("%s:%d: Cannot grow batch\n", __FUNCTION__, __LINE__);
+			ret_status.code = ERROR;
+			ret_status.error_message = OUT_OF_MEMORY_STR;
+			return ret_status;
+		}
+		context->batch = batch;
+		context->batch_slots = slots;
+	}
+	BatchedSelect *queued = &context->batch[context->batch_count++];
+	strncpy(queued->handle, handle, HANDLE_MAX_SIZE - 1);
+	queued->handle[HANDLE_MAX_SIZE - 1] = '\0';
+	queued->col = select->col;
+	queued->lower = select->lower;
+	queued->upper = select->upper;
+	return ret_status;
+}
@@ -0,0 +1,692 @@
+/*
+ * -- compression.c
+ *
+ *  per segment encodings of int columns and the scans that run on them
+ *  (see compression.h for the formats)
+ *
+ *  Encodings are chosen per segment by size: frame of reference, dictionary
+ *  or run length, whichever is smallest, as long as it saves at least a
+ *  quarter of the raw segment. They are built when a load finishes and
+ *  when the server checkpoints, and are persisted next to the column file
+ *  in DATA_DIR/<column>.enc so restarts do not need to re-encode.
+ */
+
+#define _DEFAULT_SOURCE
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "column.h"
+#include "compression.h"
+#include "kernels.h"
+#include "persistence.h"
+#include "utils.h"
+
+// identifies encoding files ("ENC1")
+#define ENCODING_MAGIC 0x31434e45u
+
+// dictionaries larger than this do not pay off against frame of reference
+#define DICTIONARY_MAX_ENTRIES 4096
+#define DICTIONARY_HASH_SLOTS (2 * DICTIONARY_MAX_ENTRIES)
+
+// padding after packed codes, see get_code
+#define PACKED_PADDING 8
+
+
+/*
+ * Bit packing. Code i of width w starts at bit i * w; with w <= 32 it lies
+ * within the 8 bytes starting at byte (i * w) / 8.
+ */
+
+static inline unsigned bit_width(uint32_t max_code)
+{
+    return max_code == 0 ? 0 : 32 - __builtin_clz(max_code);
+}
+
+static inline size_t packed_bytes(size_t n, unsigned width)
+{
+    return (n * width + 7) / 8 + PACKED_PADDING;
+}
+
+static inline void put_code(unsigned char *codes, size_t i, unsigned width, uint32_t code)
+{
+    size_t bit = i * width;
+    uint64_t word;
+    memcpy(&word, codes + (bit >> 3), sizeof(word));
+    word |= (uint64_t) code << (bit & 7);
+    memcpy(codes + (bit >> 3), &word, sizeof(word));
+}
+
+static inline uint32_t get_code(const unsigned char *codes, size_t i, unsigned width)
+{
+    size_t bit = i * width;
+    uint64_t word;
+    memcpy(&word, codes + (bit >> 3), sizeof(word));
+    return (word >> (bit & 7)) & (((uint64_t) 1 << width) - 1);
+}
+
+static inline const int32_t *dictionary(const SegmentEncoding *enc)
+{
+    return (const int32_t *) enc->data;
+}
+
+static inline const unsigned char *packed_codes(const SegmentEncoding *enc)
+{
+    return enc->header.encoding == ENCODING_DICTIONARY
+        ? enc->data + enc->header.num_entries * sizeof(int32_t)
+        : enc->data;
+}
+
+static inline const uint32_t *run_ends(const SegmentEncoding *enc)
+{
+    return (const uint32_t *) (enc->data + enc->header.num_entries * sizeof(int32_t));
+}
+
+
+/******************************************************************************
+ * -- count_distinct --
+ *
+ * Collects the distinct values of a segment into distinct, giving up once
+ * there are more than DICTIONARY_MAX_ENTRIES of them.
+ *
+ * Returns the number of distinct values, 0 if there are too many
+ *
+ ******************************************************************************
+ */
+
+static size_t count_distinct(const int *values, size_t n, int32_t *distinct)
+{
+    int32_t slots[DICTIONARY_HASH_SLOTS];
+    unsigned char used[DICTIONARY_HASH_SLOTS] = { 0 };
+    size_t count = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        uint32_t h = ((uint32_t) values[i] * 2654435761u) % DICTIONARY_HASH_SLOTS;
+        while (used[h] && slots[h] != values[i]) {
+            h = (h + 1) % DICTIONARY_HASH_SLOTS;
+        }
+        if (!used[h]) {
+            if (count == DICTIONARY_MAX_ENTRIES) {
+                return 0;
+            }
+            used[h] = 1;
+            slots[h] = values[i];
+            distinct[count++] = values[i];
+        }
+    }
+    return count;
+}
+
+static int compare_int32(const void *a, const void *b)
+{
+    int32_t x = *(const int32_t *) a;
+    int32_t y = *(const int32_t *) b;
+    return (x > y) - (x < y);
+}
+
+// index of the first dictionary entry >= value
+static uint32_t dictionary_lower_bound(const int32_t *dict, uint32_t size, long value)
+{
+    uint32_t lo = 0, hi = size;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (dict[mid] < value) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+
+/******************************************************************************
+ * -- encode_segment --
+ *
+ * Picks the smallest encoding for a segment and builds it.
+ *
+ * Returns NULL if no encoding saves enough to be worth it (or on failure,
+ * in which case the segment simply stays raw)
+ *
+ ******************************************************************************
+ */
+
+static SegmentEncoding *encode_segment(const int *values, size_t n, uint32_t segment)
+{
+    int32_t distinct[DICTIONARY_MAX_ENTRIES];
+    int min = values[0], max = values[0];
+    size_t runs = 1;
+    size_t num_distinct;
+    size_t for_bytes, dictionary_bytes, rle_bytes, best;
+    unsigned for_width, dictionary_width = 0;
+    SegmentEncoding *enc;
+
+    for (size_t i = 1; i < n; i++) {
+        min = values[i] < min ? values[i] : min;
+        max = values[i] > max ? values[i] : max;
+        runs += values[i] != values[i - 1];
+    }
+    for_width = bit_width((uint32_t) ((long) max - min));
+    for_bytes = packed_bytes(n, for_width);
+    rle_bytes = runs * (sizeof(int32_t) + sizeof(uint32_t));
+    num_distinct = count_distinct(values, n, distinct);
+    dictionary_bytes = (size_t) -1;
+    if (num_distinct > 0) {
+        dictionary_width = bit_width(num_distinct - 1);
+        dictionary_bytes = num_distinct * sizeof(int32_t) + packed_bytes(n, dictionary_width);
+    }
+
+    best = for_bytes < rle_bytes ? for_bytes : rle_bytes;
+    best = dictionary_bytes < best ? dictionary_bytes : best;
+    if (best * 4 > n * sizeof(int) * 3) {
+        return NULL;
+    }
+
+    enc = malloc(sizeof(SegmentEncoding));
+    if (enc == NULL) {
+        return NULL;
+    }
+    enc->header.segment = segment;
+    enc->header.min = min;
+    enc->header.max = max;
+    enc->header.num_entries = 0;
+    enc->header.bit_width = 0;
+    enc->header.data_bytes = best;
+    enc->data = calloc(1, best);
+    if (enc->data == NULL) {
+        free(enc);
+        return NULL;
+    }
+
+    if (best == rle_bytes) {
+        int32_t *run_values = (int32_t *) enc->data;
+        uint32_t *ends = (uint32_t *) (enc->data + runs * sizeof(int32_t));
+        size_t run = 0;
+        enc->header.encoding = ENCODING_RLE;
+        enc->header.num_entries = runs;
+        run_values[0] = values[0];
+        for (size_t i = 1; i < n; i++) {
+            if (values[i] != values[i - 1]) {
+                ends[run++] = i;
+                run_values[run] = values[i];
+            }
+        }
+        ends[run] = n;
+    } else if (best == for_bytes) {
+        enc->header.encoding = ENCODING_FOR;
+        enc->header.bit_width = for_width;
+        for (size_t i = 0; i < n; i++) {
+            put_code(enc->data, i, for_width, (uint32_t) ((long) values[i] - min));
+        }
+    } else {
+        int32_t *dict = (int32_t *) enc->data;
+        unsigned char *codes = enc->data + num_distinct * sizeof(int32_t);
+        enc->header.encoding = ENCODING_DICTIONARY;
+        enc->header.bit_width = dictionary_width;
+        enc->header.num_entries = num_distinct;
+        memcpy(dict, distinct, num_distinct * sizeof(int32_t));
+        qsort(dict, num_distinct, sizeof(int32_t), compare_int32);
+        for (size_t i = 0; i < n; i++) {
+            put_code(codes, i, dictionary_width,
+                     dictionary_lower_bound(dict, num_distinct, values[i]));
+        }
+    }
+    return enc;
+}
+
+
+/******************************************************************************
+ * -- select_codes --
+ *
+ * The packed code equivalent of the select kernels: writes base + i for
+ * every code i of [begin, begin + n) within [low, high] to out.
+ *
+ * Returns the number of positions written
+ *
+ ******************************************************************************
+ */
+
+static size_t select_codes(const unsigned char *codes, unsigned width, size_t begin, size_t n,
+                           uint32_t low, uint32_t high, position_t base, position_t *out)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t code = get_code(codes, begin + i, width);
+        out[count] = base + (position_t) i;
+        count += (code >= low) & (code <= high);
+    }
+    return count;
+}
+
+
+/*****************************************************************************
+ * -- encoded_select --
+ *
+ * Evaluates low <= value <= high on values [begin, begin + n) of an
+ * encoded segment without decoding them. The bounds are translated into
+ * code bounds once; segments entirely inside or outside the range are
+ * answered from their min and max.
+ *
+ * params:
+ *    enc [in]      The encoded segment
+ *    begin [in]    Offset of the first value to look at
+ *    n [in]        Number of values to look at
+ *    low [in]      Inclusive lower bound
+ *    high [in]     Inclusive upper bound
+ *    base [in]     Position of the value at offset begin
+ *    out [out]     Qualifying positions, room for n is needed
+ *
+ * Returns the number of positions written
+ *
+ *****************************************************************************
+ */
+
+size_t encoded_select(const SegmentEncoding *enc,   // IN
+                      size_t begin,                 // IN
+                      size_t n,                     // IN
+                      int low,                      // IN
+                      int high,                     // IN
+                      position_t base,              // IN
+                      position_t *out)              // OUT
+{
+    const EncodingHeader *h = &enc->header;
+    uint32_t code_low, code_high;
+    size_t count = 0;
+
+    if (low > high || high < h->min || low > h->max) {
+        return 0;
+    }
+    if (low <= h->min && high >= h->max) {
+        return select_all(n, base, out);
+    }
+
+    switch (h->encoding) {
+    case ENCODING_RLE: {
+        const int32_t *run_values = (const int32_t *) enc->data;
+        const uint32_t *ends = run_ends(enc);
+        size_t end = begin + n;
+        uint32_t run_begin = 0;
+        for (uint32_t r = 0; r < h->num_entries && run_begin < end; r++) {
+            if (ends[r] > begin && run_values[r] >= low && run_values[r] <= high) {
+                size_t from = run_begin > begin ? run_begin : begin;
+                size_t to = ends[r] < end ? ends[r] : end;
+                count += select_all(to - from, base + (position_t) (from - begin), out + count);
+            }
+            run_begin = ends[r];
+        }
+        return count;
+    }
+    case ENCODING_DICTIONARY:
+        code_low = dictionary_lower_bound(dictionary(enc), h->num_entries, low);
+        // one past the last entry <= high
+        code_high = dictionary_lower_bound(dictionary(enc), h->num_entries, (long) high + 1);
+        if (code_low >= code_high) {
+            return 0;
+        }
+        return select_codes(packed_codes(enc), h->bit_width, begin, n,
+                            code_low, code_high - 1, base, out);
+    case ENCODING_FOR:
+    default:
+        code_low = low <= h->min ? 0 : (uint32_t) ((long) low - h->min);
+        code_high = (uint32_t) ((long) (high < h->max ? high : h->max) - h->min);
+        return select_codes(packed_codes(enc), h->bit_width, begin, n,
+                            code_low, code_high, base, out);
+    }
+}
+
+
+/******************************************************************************
+ * -- encoded_value --
+ *
+ * Decodes the value at offset within an encoded segment.
+ *
+ ******************************************************************************
+ */
+
+int encoded_value(const SegmentEncoding *enc, size_t offset)
+{
+    const EncodingHeader *h = &enc->header;
+
+    switch (h->encoding) {
+    case ENCODING_RLE: {
+        const uint32_t *ends = run_ends(enc);
+        uint32_t lo = 0, hi = h->num_entries - 1;
+        // first run ending after offset
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (ends[mid] <= offset) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return ((const int32_t *) enc->data)[lo];
+    }
+    case ENCODING_DICTIONARY:
+        return dictionary(enc)[get_code(packed_codes(enc), offset, h->bit_width)];
+    case ENCODING_FOR:
+    default:
+        return (int) ((long) h->min + get_code(enc->data, offset, h->bit_width));
+    }
+}
+
+
+/******************************************************************************
+ * -- encoded_decode --
+ *
+ * Decodes values [begin, begin + n) of an encoded segment into out, for
+ * scans that evaluate many predicates on the same values and are better
+ * off paying for decoding once.
+ *
+ ******************************************************************************
+ */
+
+void encoded_decode(const SegmentEncoding *enc, size_t begin, size_t n, int *out)
+{
+    const EncodingHeader *h = &enc->header;
+
+    switch (h->encoding) {
+    case ENCODING_RLE: {
+        const int32_t *run_values = (const int32_t *) enc->data;
+        const uint32_t *ends = run_ends(enc);
+        size_t i = 0;
+        for (uint32_t r = 0; r < h->num_entries && i < n; r++) {
+            while (i < n && begin + i < ends[r]) {
+                out[i++] = run_values[r];
+            }
+        }
+        return;
+    }
+    case ENCODING_DICTIONARY: {
+        const unsigned char *codes = packed_codes(enc);
+        for (size_t i = 0; i < n; i++) {
+            out[i] = dictionary(enc)[get_code(codes, begin + i, h->bit_width)];
+        }
+        return;
+    }
+    case ENCODING_FOR:
+    default:
+        for (size_t i = 0; i < n; i++) {
+            out[i] = (int) ((long) h->min + get_code(enc->data, begin + i, h->bit_width));
+        }
+        return;
+    }
+}
+
+
+/******************************************************************************
+ * -- encoded_sum --
+ *
+ * Sums an encoded segment of n values on its codes: frame of reference
+ * sums the codes and adds n * min, dictionaries count codes, runs multiply
+ * out.
+ *
+ ******************************************************************************
+ */
+
+long encoded_sum(const SegmentEncoding *enc, size_t n)
+{
+    const EncodingHeader *h = &enc->header;
+    long sum = 0;
+
+    switch (h->encoding) {
+    case ENCODING_RLE: {
+        const int32_t *run_values = (const int32_t *) enc->data;
+        const uint32_t *ends = run_ends(enc);
+        uint32_t begin = 0;
+        for (uint32_t r = 0; r < h->num_entries; r++) {
+            sum += (long) run_values[r] * (ends[r] - begin);
+            begin = ends[r];
+        }
+        return sum;
+    }
+    case ENCODING_DICTIONARY: {
+        uint32_t counts[DICTIONARY_MAX_ENTRIES] = { 0 };
+        const unsigned char *codes = packed_codes(enc);
+        for (size_t i = 0; i < n; i++) {
+            counts[get_code(codes, i, h->bit_width)]++;
+        }
+        for (uint32_t k = 0; k < h->num_entries; k++) {
+            sum += (long) dictionary(enc)[k] * counts[k];
+        }
+        return sum;
+    }
+    case ENCODING_FOR:
+    default:
+        for (size_t i = 0; i < n; i++) {
+            sum += get_code(enc->data, i, h->bit_width);
+        }
+        return sum + (long) h->min * (long) n;
+    }
+}
+
+
+/*****************************************************************************
+ * -- column_encode --
+ *
+ * Encodes the full segments of an int column that have not been looked at
+ * yet. The raw pages of encoded segments are dropped from memory; they
+ * stay in the column file and are only faulted back in if written.
+ *
+ * Params:
+ *    col [in/out]  The column to encode
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status column_encode(Column *col) // IN/OUT
+{
+    Status ret_status;
+    size_t full_segments = column_length(col) >> SEGMENT_SHIFT;
+
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+
+    if (col->type != INT || full_segments <= col->num_encodings) {
+        return ret_status;
+    }
+
+    SegmentEncoding **encodings = realloc(col->encodings, sizeof(SegmentEncoding *) * full_segments);
+    if (encodings == NULL) {
+        ret_status.code = ERROR;
+        ret_status.error_message = OUT_OF_MEMORY_STR;
+        return ret_status;
+    }
+    col->encodings = encodings;
+
+    for (size_t s = col->num_encodings; s < full_segments; s++) {
+        encodings[s] = encode_segment(col->segments[s], SEGMENT_SIZE, s);
+        if (encodings[s] != NULL) {
+            madvise(col->segments[s], column_segment_bytes(col), MADV_DONTNEED);
+        }
+    }
+    col->num_encodings = full_segments;
+    return ret_status;
+}
+
+
+/*****************************************************************************
+ * -- column_encode_segment --
+ *
+ * Encodes segment seg of an int column again after values of it were
+ * overwritten in place (see column_delta_fold). Segments column_encode has
+ * not looked at yet are left to it.
+ *
+ * Params:
+ *    col [in/out]  The column
+ *    seg [in]      The rewritten segment
+ *
+ *****************************************************************************
+ */
+
+void column_encode_segment(Column *col, // IN/OUT
+                           size_t seg)  // IN
+{
+    SegmentEncoding *enc = column_encoding(col, seg);
+
+    if (seg >= col->num_encodings) {
+        return;
+    }
+    if (enc != NULL) {
+        free(enc->data);
+        free(enc);
+    }
+    col->encodings[seg] = encode_segment(col->segments[seg], SEGMENT_SIZE, seg);
+    if (col->encodings[seg] != NULL) {
+        madvise(col->segments[seg], column_segment_bytes(col), MADV_DONTNEED);
+    }
+}
+
+
+/******************************************************************************
+ * -- column_drop_encodings --
+ *
+ * Forgets all encodings of a column, e.g. after its segments were
+ * rewritten. The next column_encode encodes the column from scratch.
+ *
+ ******************************************************************************
+ */
+
+void column_drop_encodings(Column *col) // IN/OUT
+{
+    for (size_t s = 0; s < col->num_encodings; s++) {
+        if (col->encodings[s] != NULL) {
+            free(col->encodings[s]->data);
+            free(col->encodings[s]);
+        }
+    }
+    free(col->encodings);
+    col->encodings = NULL;
+    col->num_encodings = 0;
+}
+
+
+/*****************************************************************************
+ * -- column_save_encodings --
+ *
+ * Writes the encodings of a column to DATA_DIR/<column>.enc, through a
+ * temporary file so a crash never leaves a torn file behind.
+ *
+ * Format: magic, number of segments examined (both uint32_t), then per
+ * encoded segment its EncodingHeader followed by data_bytes of data.
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status column_save_encodings(Column *col) // IN
+{
+    Status ret_status;
+    char path[sizeof(DATA_DIR) + MAX_SIZE_NAME + 8];
+    char tmp_path[sizeof(DATA_DIR) + MAX_SIZE_NAME + 12];
+    uint32_t file_header[2] = { ENCODING_MAGIC, col->num_encodings };
+    FILE *file;
+    int failed;
+
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+
+    sprintf(path, "%s/%s.enc", DATA_DIR, col->name);
+    if (col->num_encodings == 0) {
+        unlink(path);
+        return ret_status;
+    }
+    sprintf(tmp_path, "%s.tmp", path);
+
+    file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        log_err("%s:%d: Unable to open %s\n", __FUNCTION__, __LINE__, tmp_path);
+        ret_status.code = ERROR;
+        ret_status.error_message = QUERY_INVALID_STR;
+        return ret_status;
+    }
+    failed = fwrite(file_header, sizeof(file_header), 1, file) != 1;
+    for (size_t s = 0; s < col->num_encodings && !failed; s++) {
+        const SegmentEncoding *enc = col->encodings[s];
+        if (enc != NULL) {
+            failed = fwrite(&enc->header, sizeof(EncodingHeader), 1, file) != 1 ||
+                     fwrite(enc->data, enc->header.data_bytes, 1, file) != 1;
+        }
+    }
+    failed = failed || fflush(file) != 0 || fsync(fileno(file)) == -1;
+    fclose(file);
+
+    if (failed || rename(tmp_path, path) == -1) {
+        log_err("%s:%d: Unable to write %s\n", __FUNCTION__, __LINE__, path);
+        unlink(tmp_path);
+        ret_status.code = ERROR;
+        ret_status.error_message = QUERY_INVALID_STR;
+    }
+    return ret_status;
+}
+
+
+/*****************************************************************************
+ * -- column_load_encodings --
+ *
+ * Reads the encodings written by column_save_encodings back in. The
+ * column length must already be known. A missing file means the column
+ * has no encodings; a damaged one is ignored, the column then is scanned
+ * raw until it is encoded again.
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status column_load_encodings(Column *col) // IN/OUT
+{
+    Status ret_status;
+    char path[sizeof(DATA_DIR) + MAX_SIZE_NAME + 8];
+    uint32_t file_header[2];
+    size_t full_segments = column_length(col) >> SEGMENT_SHIFT;
+    FILE *file;
+
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+
+    sprintf(path, "%s/%s.enc", DATA_DIR, col->name);
+    file = fopen(path, "r");
+    if (file == NULL) {
+        return ret_status;
+    }
+    if (fread(file_header, sizeof(file_header), 1, file) != 1 ||
+        file_header[0] != ENCODING_MAGIC || file_header[1] > full_segments ||
+        col->type != INT) {
+        log_err("%s:%d: Ignoring damaged %s\n", __FUNCTION__, __LINE__, path);
+        fclose(file);
+        return ret_status;
+    }
+
+    col->encodings = calloc(file_header[1] > 0 ? file_header[1] : 1, sizeof(SegmentEncoding *));
+    col->num_encodings = file_header[1];
+    for (;;) {
+        SegmentEncoding *enc = malloc(sizeof(SegmentEncoding));
+        if (fread(&enc->header, sizeof(EncodingHeader), 1, file) != 1) {
+            free(enc);
+            break;
+        }
+        enc->data = malloc(enc->header.data_bytes);
+        if (enc->data == NULL || enc->header.segment >= col->num_encodings ||
+            col->encodings[enc->header.segment] != NULL ||
+            fread(enc->data, enc->header.data_bytes, 1, file) != 1) {
+            log_err("%s:%d: Ignoring damaged %s\n", __FUNCTION__, __LINE__, path);
+            free(enc->data);
+            free(enc);
+            column_drop_encodings(col);
+            break;
+        }
+        col->encodings[enc->header.segment] = enc;
+    }
+    fclose(file);
+    return ret_status;
+}
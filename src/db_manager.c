@@ -1,28 +1,29 @@
+#include "bitvector.h"
 #include "client_context.h"
+#include "column.h"
 #include "cs165_api.h"
+#include "delta.h"
 #include "hashtable.h"
+#include "index.h"
+#include "persistence.h"
 #include "utils.h"
+#include "zonemap.h"
 #include <string.h>
 
-/*
- * bitvector macros from
- * http://www.mathcs.emory.edu/~cheung/Courses/255/Syllabus/1-C-intro/bit-array.html
- */
-#define SetBit(A,k)     ( A[(k/32)] |= (1 << (k%32)) )
-#define ClearBit(A,k)   ( A[(k/32)] &= ~(1 << (k%32)) )
-#define TestBit(A,k)    ( A[(k/32)] & (1 << (k%32)) )
 // only one active database at a time
 Db *current_db;
 
 /*****************************************************************************
- * -- relational_insert -- 
+ * -- table_reserve -- 
  *
- * This API call adds a new row of values to an existing Table 
+ * Makes sure every column of a Table can hold at least num_rows values.
+ * Columns are file backed (see persistence.c) and all grow together;
+ * capacity at least doubles so repeated single row growth stays amortized.
+ * Growing only adds segments, existing values are never moved or copied.
  * 
  * params:
- *    db [in/out]       The database to add a table to
- *    name [in]         The name of the table
- *    num_columns [in]  The number of columns in the table
+ *    table [in/out]    The table to grow
+ *    num_rows [in]     The number of rows the table must be able to hold
  *
  * Returns:
  *    Status OK on success
@@ -31,48 +32,344 @@ Db *current_db;
  *****************************************************************************
  */
 
-Status relational_insert(Table *table, int *values) {
+Status table_reserve(Table *table,      // IN/OUT
+                     size_t num_rows)   // IN
+{
+    Status ret_status;
+    size_t new_capacity;
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+
+    if (num_rows <= table->row_capacity) {
+        return ret_status;
+    }
+
+    new_capacity = table->row_capacity == 0 ? COLUMN_LENGTH : table->row_capacity * 2;
+    if (new_capacity < num_rows) {
+        new_capacity = num_rows;
+    }
+
+    for (size_t i = 0; i < table->col_count; i++) {
+        ret_status = column_reserve(&table->columns[i], new_capacity);
+        if (ret_status.code != OK) {
+            return ret_status;
+        }
+    }
+    // segments are allocated whole, so the columns may hold more than asked for
+    new_capacity = table->col_count > 0 ? table->columns[0].capacity : new_capacity;
+
+    // tombstones, once there are any, cover every row the table can hold
+    if (table->deleted != NULL) {
+        size_t old_words = bitvector_words(table->row_capacity);
+        size_t new_words = bitvector_words(new_capacity);
+        uint64_t *deleted = realloc(table->deleted, sizeof(uint64_t) * new_words);
+        if (deleted == NULL) {
+            ret_status.code = ERROR;
+            ret_status.error_message = OUT_OF_MEMORY_STR;
+            return ret_status;
+        }
+        memset(deleted + old_words, 0, sizeof(uint64_t) * (new_words - old_words));
+        table->deleted = deleted;
+    }
+    table->row_capacity = new_capacity;
+    return ret_status;
+}
+
+/*
+ * Appends nrows values to col starting at position first_row, one run per
+ * segment. SOURCE is evaluated for every row k of the batch and converted
+ * to the column type T, so each instantiation is a monomorphic copy loop.
+ */
+#define APPEND_RUNS(T, col, first_row, nrows, SOURCE)                       \
+    do {                                                                    \
+        size_t k = 0;                                                       \
+        while (k < (nrows)) {                                               \
+            size_t row = (first_row) + k;                                   \
+            T *dst = &COLUMN_VALUE(col, T, row);                            \
+            size_t run = SEGMENT_SIZE - (row & SEGMENT_MASK);               \
+            if (run > (nrows) - k) {                                        \
+                run = (nrows) - k;                                          \
+            }                                                               \
+            for (size_t j = 0; j < run; j++, k++) {                         \
+                dst[j] = (T) (SOURCE);                                      \
+            }                                                               \
+        }                                                                   \
+    } while (0)
+
+/*
+ * Validates an append of nrows rows and reserves room for them.
+ * On success *first_row is the position of the first new row.
+ */
+static Status prepare_append(Table *table,          // IN/OUT
+                             const void *values,    // IN
+                             size_t nrows,          // IN
+                             size_t *first_row)     // OUT
+{
     Status ret_status;
-    size_t i;
-    size_t index_next = table->table_length;
     ret_status.code = ERROR;
     ret_status.error_message = QUERY_INVALID_STR;
 
     if (table == NULL ||
         values == NULL) {
-        log_err("%s:%d: Unable to insert row due to invalid inputs\n",
+        log_err("%s:%d: Unable to insert rows due to invalid inputs\n",
                 __FUNCTION__, __LINE__);
         return ret_status;
     }
 
-    for (i = 0; i < table->col_count; i++) {
-        if (table->columns[i].data == NULL) {
-            table->columns[i].data = malloc(sizeof(int) * COLUMN_LENGTH);
-            table->columns[i].data[index_next] = values[i];
-            // only need to set the row_capacity once
-            if (i == 0) {
-                table->row_capacity = COLUMN_LENGTH;
-            }
+    *first_row = table->table_length;
+    return table_reserve(table, *first_row + nrows);
+}
 
-        } else if (index_next >= table->row_capacity) {
-            // only need to increase row_capacity once
-            if (i == 0) {
-                table->row_capacity *= 2;
+/*
+ * Publishes nrows rows written at first_row: extends the zone maps over
+ * them, makes them part of the table and then brings the column indexes
+ * up to date (see column_index_append).
+ */
+static Status finish_append(Table *table,       // IN/OUT
+                            size_t first_row,   // IN
+                            size_t nrows)       // IN
+{
+    Status ret_status;
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+
+    for (size_t i = 0; i < table->col_count; i++) {
+        ret_status = column_zones_extend(&table->columns[i], first_row, first_row + nrows);
+        if (ret_status.code != OK) {
+            return ret_status;
+        }
+    }
+    table->table_length += nrows;
+    for (size_t i = 0; i < table->col_count; i++) {
+        column_index_append(&table->columns[i], first_row, first_row + nrows);
+    }
+    return ret_status;
+}
+
+/*****************************************************************************
+ * -- relational_insert_batch -- 
+ *
+ * This API call appends nrows rows of int values to an existing Table,
+ * widening them for LONG and FLOAT columns. Capacity is reserved once for
+ * the whole batch and every column is then written in one pass, one
+ * segment run at a time.
+ * 
+ * params:
+ *    table [in/out]            The table to append to
+ *    row_major_values [in]     nrows * col_count values, row after row
+ *    nrows [in]                The number of rows to append
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure 
+ *
+ *****************************************************************************
+ */
+
+Status relational_insert_batch(Table *table,                    // IN/OUT
+                               const int *row_major_values,     // IN
+                               size_t nrows)                    // IN
+{
+    size_t first_row;
+    Status ret_status = prepare_append(table, row_major_values, nrows, &first_row);
+    if (ret_status.code != OK) {
+        return ret_status;
+    }
+
+    for (size_t i = 0; i < table->col_count; i++) {
+        Column *col = &table->columns[i];
+        const int *src = row_major_values + i;
+        size_t stride = table->col_count;
+
+        switch (col->type) {
+        case LONG:
+            APPEND_RUNS(long, col, first_row, nrows, src[k * stride]);
+            break;
+        case FLOAT:
+            APPEND_RUNS(float, col, first_row, nrows, src[k * stride]);
+            break;
+        default:
+            APPEND_RUNS(int, col, first_row, nrows, src[k * stride]);
+            break;
+        }
+    }
+    return finish_append(table, first_row, nrows);
+}
+
+/*****************************************************************************
+ * -- relational_insert_values -- 
+ *
+ * Like relational_insert_batch, but every value is already in the type
+ * of its column (this is what the parser produces).
+ * 
+ * params:
+ *    table [in/out]            The table to append to
+ *    row_major_values [in]     nrows * col_count values, row after row
+ *    nrows [in]                The number of rows to append
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure 
+ *
+ *****************************************************************************
+ */
+
+Status relational_insert_values(Table *table,                   // IN/OUT
+                                const Value *row_major_values,  // IN
+                                size_t nrows)                   // IN
+{
+    size_t first_row;
+    Status ret_status = prepare_append(table, row_major_values, nrows, &first_row);
+    if (ret_status.code != OK) {
+        return ret_status;
+    }
+
+    for (size_t i = 0; i < table->col_count; i++) {
+        Column *col = &table->columns[i];
+        const Value *src = row_major_values + i;
+        size_t stride = table->col_count;
+
+        switch (col->type) {
+        case LONG:
+            APPEND_RUNS(long, col, first_row, nrows, src[k * stride].l);
+            break;
+        case FLOAT:
+            APPEND_RUNS(float, col, first_row, nrows, src[k * stride].f);
+            break;
+        default:
+            APPEND_RUNS(int, col, first_row, nrows, src[k * stride].i);
+            break;
+        }
+    }
+    return finish_append(table, first_row, nrows);
+}
+
+/*****************************************************************************
+ * -- relational_insert -- 
+ *
+ * This API call adds a new row of values to an existing Table 
+ * 
+ * params:
+ *    table [in/out]    The table to add a row to
+ *    values [in]       One value per column of the table
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure 
+ *
+ *****************************************************************************
+ */
+
+Status relational_insert(Table *table, int *values) {
+    return relational_insert_batch(table, values, 1);
+}
+
+/*****************************************************************************
+ * -- relational_delete -- 
+ *
+ * This API call deletes rows of a Table by setting their tombstone bits.
+ * Column data is left in place, scans mask deleted rows out until the
+ * table is compacted (see table_compact). Positions that are already
+ * deleted are ignored, so deleting is idempotent.
+ * 
+ * params:
+ *    table [in/out]        The table to delete from
+ *    positions [in]        Positions of the rows to delete
+ *    num_positions [in]    The number of positions
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure 
+ *
+ *****************************************************************************
+ */
+
+Status relational_delete(Table *table,                  // IN/OUT
+                         const position_t *positions,   // IN
+                         size_t num_positions)          // IN
+{
+    Status ret_status;
+    ret_status.code = ERROR;
+    ret_status.error_message = QUERY_INVALID_STR;
+
+    for (size_t i = 0; i < num_positions; i++) {
+        if (positions[i] >= table->table_length) {
+            log_err("%s:%d: Position %u is not a row of %s\n",
+                    __FUNCTION__, __LINE__, positions[i], table->name);
+            return ret_status;
+        }
+    }
+
+    if (table->deleted == NULL && num_positions > 0) {
+        table->deleted = calloc(bitvector_words(table->row_capacity), sizeof(uint64_t));
+        if (table->deleted == NULL) {
+            ret_status.error_message = OUT_OF_MEMORY_STR;
+            return ret_status;
+        }
+    }
+    for (size_t i = 0; i < num_positions; i++) {
+        if (!TestBit(table->deleted, positions[i])) {
+            for (size_t j = 0; j < table->col_count; j++) {
+                column_index_delete(&table->columns[j], positions[i]);
             }
-            table->columns[i].data = realloc(table->columns[i].data, table->row_capacity);
+            SetBit(table->deleted, positions[i]);
+            table->num_deleted++;
         }
-        
-        table->columns[i].data[index_next] = values[i];
     }
-    table->table_length += 1;
 
     ret_status.code = OK;
     ret_status.error_message = SUCCESS_STR;
-
     return ret_status;
 }
 
 
+/*****************************************************************************
+ * -- relational_update -- 
+ *
+ * This API call sets a column to value at a list of positions. The new
+ * values go to the column's delta store (see delta.h), which is folded
+ * into the column once it holds DELTA_FOLD_ENTRIES entries.
+ * 
+ * params:
+ *    col [in/out]          The column to update
+ *    positions [in]        Positions of the rows to update
+ *    num_positions [in]    The number of positions
+ *    value [in]            The new value, in the column's type
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure 
+ *
+ *****************************************************************************
+ */
+
+Status relational_update(Column *col,                   // IN/OUT
+                         const position_t *positions,   // IN
+                         size_t num_positions,          // IN
+                         Value value)                   // IN
+{
+    Status ret_status;
+    ret_status.code = ERROR;
+    ret_status.error_message = QUERY_INVALID_STR;
+
+    for (size_t i = 0; i < num_positions; i++) {
+        if (positions[i] >= column_length(col)) {
+            log_err("%s:%d: Position %u is not a row of %s\n",
+                    __FUNCTION__, __LINE__, positions[i], col->table->name);
+            return ret_status;
+        }
+    }
+
+    ret_status = column_update(col, positions, num_positions, value);
+    if (ret_status.code != OK) {
+        return ret_status;
+    }
+    if (col->delta->count >= DELTA_FOLD_ENTRIES) {
+        ret_status = column_delta_fold(col);
+    }
+    return ret_status;
+}
+
 
 /*****************************************************************************
  * -- create_column -- 
@@ -82,6 +379,7 @@ Status relational_insert(Table *table, int *values) {
  * params:
  *    Table [in/out]    The table to add a column to 
  *    name [in]         The name of the column
+ *    type [in]         The type of the values stored in the column
  *
  * Returns:
  *    Status OK on success
@@ -91,7 +389,8 @@ Status relational_insert(Table *table, int *values) {
  */
 
 Status create_column(Table *table,  // IN/OUT
-                     char *name)    // IN
+                     char *name,    // IN
+                     DataType type) // IN
 {
     Status ret_status;
     int name_length;
@@ -118,7 +417,23 @@ Status create_column(Table *table,  // IN/OUT
         return ret_status;
     }
 
-    table->columns[table->col_count].data = NULL;
+    table->columns[table->col_count].type = type;
+    table->columns[table->col_count].table = table;
+    table->columns[table->col_count].segments = NULL;
+    table->columns[table->col_count].num_segments = 0;
+    table->columns[table->col_count].segments_capacity = 0;
+    table->columns[table->col_count].capacity = 0;
+    table->columns[table->col_count].fd = -1;
+    table->columns[table->col_count].encodings = NULL;
+    table->columns[table->col_count].num_encodings = 0;
+    table->columns[table->col_count].zone_min = NULL;
+    table->columns[table->col_count].zone_max = NULL;
+    table->columns[table->col_count].num_zones = 0;
+    table->columns[table->col_count].zones_capacity = 0;
+    table->columns[table->col_count].delta = NULL;
+    table->columns[table->col_count].index_type = NO_INDEX;
+    table->columns[table->col_count].clustered = false;
+    table->columns[table->col_count].index = NULL;
     table->col_count += 1; 
 
     ret_status.code = OK;
@@ -177,7 +492,13 @@ Status create_table(Db* db,                 // IN
 
     if (current_db->tables_size == current_db->tables_capacity) {
         current_db->tables_capacity *= 2;
-        current_db->tables = realloc(current_db->tables, current_db->tables_capacity);
+        current_db->tables = realloc(current_db->tables, sizeof(Table) * current_db->tables_capacity);
+        // the tables moved, point their columns at the new location
+        for (size_t i = 0; i < current_db->tables_size; i++) {
+            for (size_t j = 0; j < current_db->tables[i].col_count; j++) {
+                current_db->tables[i].columns[j].table = &current_db->tables[i];
+            }
+        }
     }
 
     if (sprintf(tb->name, "%s.%s", db->name, name) <= 0) {
@@ -188,6 +509,8 @@ Status create_table(Db* db,                 // IN
     tb->col_count = 0;
     tb->table_length = 0;
     tb->row_capacity = 0;
+    tb->deleted = NULL;
+    tb->num_deleted = 0;
     tb->columns = malloc(sizeof(Column) * num_columns);
 
     db->tables[db->tables_size] = *tb;
@@ -221,7 +544,7 @@ Status create_db(const char* db_name) {
     // void pattern for 'using' a variable to prevent compiler unused variable warning
     struct Status ret_status;
     int db_name_length = strlen(db_name);
-    int chars_to_copy = db_name_length < MAX_SIZE_NAME ? db_name_length : MAX_SIZE_NAME;
+    int chars_to_copy = db_name_length < MAX_SIZE_NAME ? db_name_length : MAX_SIZE_NAME - 1;
 
     current_db = malloc(sizeof(Db));
 
@@ -231,6 +554,7 @@ Status create_db(const char* db_name) {
         return ret_status;
     }
     strncpy(current_db->name, db_name, chars_to_copy);
+    current_db->name[chars_to_copy] = '\0';
     current_db->tables = NULL;
     current_db->tables_size = 0;
     current_db->tables_capacity = MAX_TABLES;
@@ -0,0 +1,722 @@
+/*
+ * -- delta.c
+ *
+ *  delta stores of updated values and the merges of operators reading
+ *  through them (see delta.h)
+ */
+
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "bitvector.h"
+#include "column.h"
+#include "compression.h"
+#include "delta.h"
+#include "index.h"
+#include "persistence.h"
+#include "utils.h"
+#include "zonemap.h"
+
+// identifies delta files ("DLT1")
+#define DELTA_MAGIC 0x31544c44u
+
+typedef struct DeltaFileHeader {
+    uint32_t magic;
+    uint32_t type;
+    // entries in the file: positions, then values
+    uint64_t count;
+} DeltaFileHeader;
+
+static int compare_positions(const void *a, const void *b)
+{
+    position_t x = *(const position_t *) a;
+    position_t y = *(const position_t *) b;
+    return (x > y) - (x < y);
+}
+
+/******************************************************************************
+ * -- reserve_delta --
+ *
+ * Makes sure the delta of a column exists and can hold count entries.
+ *
+ * Returns -1 on failure
+ *          0 on success
+ *
+ ******************************************************************************
+ */
+
+static int reserve_delta(Column *col, size_t count)
+{
+    ColumnDelta *delta = col->delta;
+    size_t slots;
+
+    if (delta == NULL) {
+        delta = calloc(1, sizeof(ColumnDelta));
+        if (delta == NULL) {
+            return -1;
+        }
+        col->delta = delta;
+    }
+    if (count <= delta->capacity) {
+        return 0;
+    }
+    slots = delta->capacity == 0 ? 64 : delta->capacity;
+    while (slots < count) {
+        slots *= 2;
+    }
+    position_t *positions = realloc(delta->positions, slots * sizeof(position_t));
+    if (positions == NULL) {
+        return -1;
+    }
+    delta->positions = positions;
+    void *values = realloc(delta->values, slots * data_type_size(col->type));
+    if (values == NULL) {
+        return -1;
+    }
+    delta->values = values;
+    delta->capacity = slots;
+    return 0;
+}
+
+
+/*****************************************************************************
+ * -- column_update --
+ *
+ * Records value as the new value of a column at a list of positions. The
+ * positions need not be sorted or distinct and must lie inside the
+ * column. Entries for positions already in the delta are overwritten, the
+ * others are merged in from the back so only the tail of the delta moves.
+ * The column's index is brought up to date first (see column_index_update).
+ *
+ * Params:
+ *    col [in/out]      The column to update
+ *    positions [in]    The rows to update
+ *    n [in]            The number of positions
+ *    value [in]        The new value, in the column's type
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status column_update(Column *col,                   // IN/OUT
+                     const position_t *positions,   // IN
+                     size_t n,                      // IN
+                     Value value)                   // IN
+{
+    Status ret_status;
+    size_t width = data_type_size(col->type);
+    position_t *fresh;
+    size_t num_fresh = 0;
+    ColumnDelta *delta;
+    char *values;
+
+    ret_status.code = ERROR;
+    ret_status.error_message = OUT_OF_MEMORY_STR;
+
+    fresh = malloc(sizeof(position_t) * (n > 0 ? n : 1));
+    if (fresh == NULL) {
+        return ret_status;
+    }
+    memcpy(fresh, positions, sizeof(position_t) * n);
+    for (size_t i = 1; i < n; i++) {
+        if (fresh[i] <= fresh[i - 1]) {
+            qsort(fresh, n, sizeof(position_t), compare_positions);
+            break;
+        }
+    }
+    if (reserve_delta(col, (col->delta != NULL ? col->delta->count : 0) + n) == -1) {
+        free(fresh);
+        return ret_status;
+    }
+    column_index_update(col, fresh, n, value);
+    delta = col->delta;
+    values = delta->values;
+
+    // overwrite the positions already present, keep the others in fresh
+    for (size_t i = 0; i < n; i++) {
+        size_t d;
+        if (i > 0 && fresh[i] == fresh[i - 1]) {
+            continue;
+        }
+        d = column_delta_find(col, fresh[i]);
+        if (d < delta->count && delta->positions[d] == fresh[i]) {
+            memcpy(values + d * width, &value, width);
+        } else {
+            fresh[num_fresh++] = fresh[i];
+        }
+    }
+
+    // merge the new positions in, largest first
+    for (size_t d = delta->count, k = delta->count + num_fresh; num_fresh > 0;) {
+        k--;
+        if (d > 0 && delta->positions[d - 1] > fresh[num_fresh - 1]) {
+            d--;
+            delta->positions[k] = delta->positions[d];
+            memcpy(values + k * width, values + d * width, width);
+        } else {
+            num_fresh--;
+            delta->positions[k] = fresh[num_fresh];
+            memcpy(values + k * width, &value, width);
+            delta->count++;
+        }
+    }
+    free(fresh);
+
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+    return ret_status;
+}
+
+
+/*
+ * Overwrites values[pos - begin] with the delta value of every delta
+ * entry pos in [begin, begin + n).
+ */
+#define PATCH_RANGE(T)                                                          \
+    for (size_t d = column_delta_find(col, begin);                              \
+         d < delta->count && delta->positions[d] < begin + n; d++) {            \
+        ((T *) values)[delta->positions[d] - begin] = ((const T *) delta->values)[d]; \
+    }
+
+/******************************************************************************
+ * -- column_delta_patch --
+ *
+ * Applies the delta of a column to a copy of its rows [begin, begin + n).
+ *
+ * Params:
+ *    col [in]          The column
+ *    begin [in]        First row of the copy
+ *    n [in]            Number of rows in the copy
+ *    values [in/out]   The copy, in the column's type
+ *
+ ******************************************************************************
+ */
+
+void column_delta_patch(const Column *col, // IN
+                        size_t begin,      // IN
+                        size_t n,          // IN
+                        void *values)      // IN/OUT
+{
+    const ColumnDelta *delta = col->delta;
+
+    if (delta == NULL) {
+        return;
+    }
+    switch (col->type) {
+    case LONG:
+        PATCH_RANGE(long);
+        break;
+    case FLOAT:
+        PATCH_RANGE(float);
+        break;
+    default:
+        PATCH_RANGE(int);
+        break;
+    }
+}
+
+
+/*
+ * Replaces out[i] by the delta value of positions[i], if there is one.
+ * Positions usually come sorted (they are select output), so the delta is
+ * walked alongside them and only searched when a position goes backwards.
+ */
+#define PATCH_GATHER(T)                                                         \
+    for (size_t i = 0, d = 0; i < n && delta->count > 0; i++) {                 \
+        position_t pos = positions[i];                                          \
+        if (i > 0 && pos < positions[i - 1]) {                                  \
+            d = column_delta_find(col, pos);                                    \
+        }                                                                       \
+        while (d < delta->count && delta->positions[d] < pos) {                 \
+            d++;                                                                \
+        }                                                                       \
+        if (d < delta->count && delta->positions[d] == pos) {                   \
+            ((T *) out)[i] = ((const T *) delta->values)[d];                    \
+        }                                                                       \
+    }
+
+/******************************************************************************
+ * -- column_delta_fetch --
+ *
+ * Applies the delta of a column to values gathered from its segments.
+ *
+ * Params:
+ *    col [in]          The column
+ *    positions [in]    The positions the values were gathered from
+ *    n [in]            The number of positions
+ *    out [in/out]      The gathered values, in the column's type
+ *
+ ******************************************************************************
+ */
+
+void column_delta_fetch(const Column *col,              // IN
+                        const position_t *positions,    // IN
+                        size_t n,                       // IN
+                        void *out)                      // IN/OUT
+{
+    const ColumnDelta *delta = col->delta;
+
+    if (delta == NULL) {
+        return;
+    }
+    switch (col->type) {
+    case LONG:
+        PATCH_GATHER(long);
+        break;
+    case FLOAT:
+        PATCH_GATHER(float);
+        break;
+    default:
+        PATCH_GATHER(int);
+        break;
+    }
+}
+
+
+/*
+ * Merges the ascending base positions with delta entries [first, last):
+ * base positions that have a delta entry are dropped, delta positions
+ * whose value is in [low, high] and whose row is live are added.
+ */
+#define MERGE_SELECT(T, FIELD)                                                  \
+    do {                                                                        \
+        const T *values = delta->values;                                        \
+        for (size_t d = first; d < last; d++) {                                 \
+            position_t pos = delta->positions[d];                               \
+            while (b < num_base && base[b] < pos) {                             \
+                out[count++] = base[b++];                                       \
+            }                                                                   \
+            if (b < num_base && base[b] == pos) {                               \
+                b++;                                                            \
+            }                                                                   \
+            if (values[d] >= low.FIELD && values[d] <= high.FIELD &&            \
+                (deleted == NULL || !TestBit(deleted, pos))) {                  \
+                out[count++] = pos;                                             \
+            }                                                                   \
+        }                                                                       \
+    } while (0)
+
+/*****************************************************************************
+ * -- column_delta_select --
+ *
+ * Corrects the result of a select over the base values of a range of rows
+ * for the delta entries first to last of the column, which must be the
+ * entries of exactly that range.
+ *
+ * Params:
+ *    col [in]          The column
+ *    first [in]        First delta entry of the range
+ *    last [in]         One past the last delta entry of the range
+ *    low [in]          Inclusive lower bound, in the column's type
+ *    high [in]         Inclusive upper bound, in the column's type
+ *    deleted [in]      The table's tombstones, NULL if there are none
+ *    base [in]         Ascending live positions of the range whose base
+ *                      value qualifies
+ *    num_base [in]     The number of base positions
+ *    out [out]         The qualifying positions, ascending; must not
+ *                      overlap base
+ *
+ * Returns:
+ *    the number of positions written to out
+ *
+ *****************************************************************************
+ */
+
+size_t column_delta_select(const Column *col,           // IN
+                           size_t first,                // IN
+                           size_t last,                 // IN
+                           Value low,                   // IN
+                           Value high,                  // IN
+                           const uint64_t *deleted,     // IN
+                           const position_t *base,      // IN
+                           size_t num_base,             // IN
+                           position_t *out)             // OUT
+{
+    const ColumnDelta *delta = col->delta;
+    size_t count = 0;
+    size_t b = 0;
+
+    switch (col->type) {
+    case LONG:
+        MERGE_SELECT(long, l);
+        break;
+    case FLOAT:
+        MERGE_SELECT(float, f);
+        break;
+    default:
+        MERGE_SELECT(int, i);
+        break;
+    }
+    while (b < num_base) {
+        out[count++] = base[b++];
+    }
+    return count;
+}
+
+
+/*
+ * Sets or clears the bit of every delta entry in [first, last) depending
+ * on whether its value is in [low, high] and its row live.
+ */
+#define MERGE_BITMAP(T, FIELD)                                                  \
+    do {                                                                        \
+        const T *values = delta->values;                                        \
+        for (size_t d = first; d < last; d++) {                                 \
+            position_t pos = delta->positions[d];                               \
+            if (values[d] >= low.FIELD && values[d] <= high.FIELD &&            \
+                (deleted == NULL || !TestBit(deleted, pos))) {                  \
+                SetBit(bits, pos);                                              \
+            } else {                                                            \
+                ClearBit(bits, pos);                                            \
+            }                                                                   \
+        }                                                                       \
+    } while (0)
+
+/*****************************************************************************
+ * -- column_delta_select_bits --
+ *
+ * Bitmap counterpart of column_delta_select: corrects the bits of a range
+ * of rows, computed from their base values, for the delta entries first to
+ * last of the column.
+ *
+ * Params:
+ *    col [in]          The column
+ *    first [in]        First delta entry of the range
+ *    last [in]         One past the last delta entry of the range
+ *    low [in]          Inclusive lower bound, in the column's type
+ *    high [in]         Inclusive upper bound, in the column's type
+ *    deleted [in]      The table's tombstones, NULL if there are none
+ *    bits [in/out]     Bitmap over the rows of the table
+ *
+ *****************************************************************************
+ */
+
+void column_delta_select_bits(const Column *col,       // IN
+                              size_t first,            // IN
+                              size_t last,             // IN
+                              Value low,               // IN
+                              Value high,              // IN
+                              const uint64_t *deleted, // IN
+                              uint64_t *bits)          // IN/OUT
+{
+    const ColumnDelta *delta = col->delta;
+
+    switch (col->type) {
+    case LONG:
+        MERGE_BITMAP(long, l);
+        break;
+    case FLOAT:
+        MERGE_BITMAP(float, f);
+        break;
+    default:
+        MERGE_BITMAP(int, i);
+        break;
+    }
+}
+
+
+/******************************************************************************
+ * -- column_delta_fetch_bits --
+ *
+ * Bitmap counterpart of column_delta_fetch: applies the delta of a column
+ * to the values gathered for the rows set in bits, in row order. The
+ * output slot of a row is the number of set bits before it.
+ *
+ * Params:
+ *    col [in]          The column
+ *    bits [in]         The rows the values were gathered from
+ *    num_rows [in]     The number of rows bits covers
+ *    out [in/out]      The gathered values, in the column's type
+ *
+ ******************************************************************************
+ */
+
+void column_delta_fetch_bits(const Column *col,       // IN
+                             const uint64_t *bits,    // IN
+                             size_t num_rows,         // IN
+                             void *out)               // IN/OUT
+{
+    const ColumnDelta *delta = col->delta;
+    size_t width = data_type_size(col->type);
+    // set bits in the words before word w
+    size_t rank = 0, w = 0;
+
+    if (delta == NULL) {
+        return;
+    }
+    for (size_t d = 0; d < delta->count && delta->positions[d] < num_rows; d++) {
+        position_t pos = delta->positions[d];
+        uint64_t below;
+        while (w < pos >> BITVECTOR_WORD_SHIFT) {
+            rank += __builtin_popcountll(bits[w++]);
+        }
+        if (!TestBit(bits, pos)) {
+            continue;
+        }
+        below = bits[w] & (((uint64_t) 1 << (pos & 63)) - 1);
+        memcpy((char *) out + (rank + __builtin_popcountll(below)) * width,
+               (const char *) delta->values + d * width, width);
+    }
+}
+
+
+/*****************************************************************************
+ * -- column_delta_fold --
+ *
+ * Writes the values of the delta of a column into its segments and empties
+ * the delta. The touched segments are synced before the delta is
+ * forgotten, so a checkpoint writing the now empty delta never loses an
+ * update. Touched encoded segments are encoded again, touched zones
+ * recomputed and the column's index told (see column_index_fold). The
+ * caller must hold the database write lock.
+ *
+ * Params:
+ *    col [in/out]  The column
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status column_delta_fold(Column *col) // IN/OUT
+{
+    Status ret_status;
+    ColumnDelta *delta = col->delta;
+    size_t width = data_type_size(col->type);
+    size_t length = column_length(col);
+    int reencoded = 0;
+
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+
+    if (delta == NULL || delta->count == 0) {
+        return ret_status;
+    }
+
+    for (size_t d = 0; d < delta->count; d++) {
+        position_t pos = delta->positions[d];
+        memcpy((char *) col->segments[pos >> SEGMENT_SHIFT] + (pos & SEGMENT_MASK) * width,
+               (const char *) delta->values + d * width, width);
+    }
+    column_index_fold(col);
+
+    for (size_t d = 0; d < delta->count;) {
+        size_t seg = delta->positions[d] >> SEGMENT_SHIFT;
+        if (msync(col->segments[seg], column_segment_bytes(col), MS_SYNC) == -1) {
+            log_err("%s:%d: Unable to flush column %s\n", __FUNCTION__, __LINE__, col->name);
+            ret_status.code = ERROR;
+            ret_status.error_message = QUERY_INVALID_STR;
+            return ret_status;
+        }
+        if (seg < col->num_encodings) {
+            column_encode_segment(col, seg);
+            reencoded = 1;
+        }
+        while (d < delta->count && delta->positions[d] >> SEGMENT_SHIFT == seg) {
+            d++;
+        }
+    }
+
+    for (size_t d = 0; d < delta->count;) {
+        size_t begin = (delta->positions[d] >> ZONE_SHIFT) << ZONE_SHIFT;
+        size_t end = begin + ZONE_SIZE < length ? begin + ZONE_SIZE : length;
+        ret_status = column_zones_extend(col, begin, end);
+        if (ret_status.code != OK) {
+            return ret_status;
+        }
+        while (d < delta->count && delta->positions[d] < end) {
+            d++;
+        }
+    }
+
+    if (reencoded) {
+        ret_status = column_save_encodings(col);
+        if (ret_status.code != OK) {
+            return ret_status;
+        }
+    }
+    delta->count = 0;
+    return ret_status;
+}
+
+
+/******************************************************************************
+ * -- column_drop_delta --
+ *
+ * Releases the delta of a column.
+ *
+ ******************************************************************************
+ */
+
+void column_drop_delta(Column *col) // IN/OUT
+{
+    if (col->delta != NULL) {
+        free(col->delta->positions);
+        free(col->delta->values);
+        free(col->delta);
+        col->delta = NULL;
+    }
+}
+
+
+/******************************************************************************
+ * -- column_copy_delta --
+ *
+ * Returns a private copy of the delta of a column, or NULL if the column
+ * has no delta entries or memory ran out (check col->delta to tell).
+ *
+ ******************************************************************************
+ */
+
+ColumnDelta *column_copy_delta(const Column *col) // IN
+{
+    const ColumnDelta *delta = col->delta;
+    size_t width = data_type_size(col->type);
+    ColumnDelta *copy;
+
+    if (delta == NULL || delta->count == 0) {
+        return NULL;
+    }
+    copy = calloc(1, sizeof(ColumnDelta));
+    if (copy == NULL) {
+        return NULL;
+    }
+    copy->positions = malloc(sizeof(position_t) * delta->count);
+    copy->values = malloc(width * delta->count);
+    if (copy->positions == NULL || copy->values == NULL) {
+        free(copy->positions);
+        free(copy->values);
+        free(copy);
+        return NULL;
+    }
+    memcpy(copy->positions, delta->positions, sizeof(position_t) * delta->count);
+    memcpy(copy->values, delta->values, width * delta->count);
+    copy->count = copy->capacity = delta->count;
+    return copy;
+}
+
+
+/*****************************************************************************
+ * -- column_save_delta --
+ *
+ * Writes the delta of a column to DATA_DIR/<column>.dlt through a
+ * temporary file, or removes the file if the delta is empty.
+ *
+ * Format: a DeltaFileHeader, then the positions, then the values.
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status column_save_delta(const Column *col) // IN
+{
+    Status ret_status;
+    char path[sizeof(DATA_DIR) + MAX_SIZE_NAME + 8];
+    char tmp_path[sizeof(DATA_DIR) + MAX_SIZE_NAME + 12];
+    const ColumnDelta *delta = col->delta;
+    size_t count = delta != NULL ? delta->count : 0;
+    DeltaFileHeader header = { DELTA_MAGIC, col->type, count };
+    FILE *file;
+    int failed;
+
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+
+    sprintf(path, "%s/%s.dlt", DATA_DIR, col->name);
+    if (count == 0) {
+        if (unlink(path) == -1 && errno != ENOENT) {
+            log_err("%s:%d: Unable to remove %s\n", __FUNCTION__, __LINE__, path);
+            ret_status.code = ERROR;
+            ret_status.error_message = QUERY_INVALID_STR;
+        }
+        return ret_status;
+    }
+    sprintf(tmp_path, "%s.tmp", path);
+
+    file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        log_err("%s:%d: Unable to open %s\n", __FUNCTION__, __LINE__, tmp_path);
+        ret_status.code = ERROR;
+        ret_status.error_message = QUERY_INVALID_STR;
+        return ret_status;
+    }
+    failed = fwrite(&header, sizeof(header), 1, file) != 1 ||
+             fwrite(delta->positions, sizeof(position_t), count, file) != count ||
+             fwrite(delta->values, data_type_size(col->type), count, file) != count ||
+             fflush(file) != 0 || fsync(fileno(file)) == -1;
+    fclose(file);
+
+    if (failed || rename(tmp_path, path) == -1) {
+        log_err("%s:%d: Unable to write %s\n", __FUNCTION__, __LINE__, path);
+        unlink(tmp_path);
+        ret_status.code = ERROR;
+        ret_status.error_message = QUERY_INVALID_STR;
+    }
+    return ret_status;
+}
+
+
+/*****************************************************************************
+ * -- column_load_delta --
+ *
+ * Reads the delta written by column_save_delta back in. The column length
+ * must already be known. The delta holds the only copy of the values it
+ * has, so a damaged file is an error.
+ *
+ * Returns:
+ *    Status OK on success (also when there is no file)
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status column_load_delta(Column *col) // IN/OUT
+{
+    Status ret_status;
+    char path[sizeof(DATA_DIR) + MAX_SIZE_NAME + 8];
+    DeltaFileHeader header;
+    size_t width = data_type_size(col->type);
+    FILE *file;
+    int loaded;
+
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+
+    sprintf(path, "%s/%s.dlt", DATA_DIR, col->name);
+    file = fopen(path, "r");
+    if (file == NULL) {
+        return ret_status;
+    }
+    loaded = fread(&header, sizeof(header), 1, file) == 1 &&
+             header.magic == DELTA_MAGIC && header.type == (uint32_t) col->type &&
+             reserve_delta(col, header.count) == 0 &&
+             fread(col->delta->positions, sizeof(position_t), header.count, file) == header.count &&
+             fread(col->delta->values, width, header.count, file) == header.count;
+    fclose(file);
+
+    if (loaded) {
+        col->delta->count = header.count;
+        for (size_t d = 0; d < header.count && loaded; d++) {
+            loaded = col->delta->positions[d] < column_length(col) &&
+                     (d == 0 || col->delta->positions[d] > col->delta->positions[d - 1]);
+        }
+    }
+    if (!loaded) {
+        log_err("%s:%d: Damaged %s\n", __FUNCTION__, __LINE__, path);
+        column_drop_delta(col);
+        ret_status.code = ERROR;
+        ret_status.error_message = QUERY_INVALID_STR;
+    }
+    return ret_status;
+}
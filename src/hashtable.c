@@ -168,6 +168,7 @@ int get(hashtable *map,  // IN
             *val = tmp->val;
             return 0; 
         }
+        tmp = tmp->next;
     }
     *val = -1;
     return -1;
@@ -0,0 +1,45 @@
+#ifndef BITVECTOR_H
+#define BITVECTOR_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Bitvectors are arrays of 64 bit words, bit k lives in word k / 64.
+ * Table tombstones (Table.deleted) use them: a set bit marks a deleted row.
+ * Scans consume them a word at a time, so 64 live rows cost a single test.
+ *
+ * bitvector macros from
+ * http://www.mathcs.emory.edu/~cheung/Courses/255/Syllabus/1-C-intro/bit-array.html
+ * widened to 64 bit words
+ */
+#define BITVECTOR_WORD_SHIFT 6
+#define BITVECTOR_WORD_BITS ((size_t) 1 << BITVECTOR_WORD_SHIFT)
+
+#define SetBit(A,k)     ( (A)[(k) >> BITVECTOR_WORD_SHIFT] |= (uint64_t) 1 << ((k) & 63) )
+#define ClearBit(A,k)   ( (A)[(k) >> BITVECTOR_WORD_SHIFT] &= ~((uint64_t) 1 << ((k) & 63)) )
+#define TestBit(A,k)    ( ((A)[(k) >> BITVECTOR_WORD_SHIFT] >> ((k) & 63)) & 1 )
+
+/*
+ * Returns the number of words needed to hold num_bits bits.
+ */
+static inline size_t bitvector_words(size_t num_bits)
+{
+    return (num_bits + BITVECTOR_WORD_BITS - 1) >> BITVECTOR_WORD_SHIFT;
+}
+
+/*
+ * Returns whether any of bits [begin, begin + n) is set. begin must be a
+ * multiple of the word size.
+ */
+static inline int bitvector_any(const uint64_t *bits, size_t begin, size_t n)
+{
+    const uint64_t *words = bits + (begin >> BITVECTOR_WORD_SHIFT);
+    uint64_t any = 0;
+    for (size_t w = 0; w < bitvector_words(n); w++) {
+        any |= words[w];
+    }
+    return any != 0;
+}
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef BTREE_H
+#define BTREE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "cs165_api.h"
+
+/*
+ * B+trees over (key, position) entries.
+ *
+ * Keys are the values of a column mapped to int64_t so that their order is
+ * the order of the values (see index_key in index.c); the position of an
+ * entry breaks ties, so every entry is unique and the entries of a key are
+ * in row order. Inner nodes hold up to BTREE_INNER_KEYS separators, the
+ * least entry of each child but the first. Leaves hold up to
+ * BTREE_LEAF_ENTRIES entries.
+ *
+ * The layout is that of a full CSB+-tree. All children of an inner node
+ * are stored next to each other in a node group with room for
+ * BTREE_GROUP nodes, so a node needs the number of its group only, and
+ * child c is node c of that group. Inner nodes fill four cache lines, the
+ * keys the first two of them, and are searched by comparing the key
+ * against all keys at once (count_below, SIMD on x86); the positions are
+ * only read to break ties. Leaves fill a 4 KiB page, keys first, and are
+ * binary searched down to a few cache lines that are then compared the
+ * same way. Unused keys hold INT64_MAX so whole nodes can be compared.
+ *
+ * Nodes live in two arenas, one for inner nodes and one for leaves, and
+ * refer to each other by group number, never by pointer. A split moves
+ * the siblings after the node up by one slot within their group, and an
+ * inner node that splits hands the second half of its group to a new one.
+ * Groups are never freed before the tree; removing entries never merges
+ * nodes, leaves may become empty and are skipped by range scans. Trees
+ * are bulk loaded bottom up from sorted entries, with every node full,
+ * and rebuilt rather than shrunk (see index.h).
+ *
+ * Since no node holds a pointer, the arenas saved as they are
+ * (btree_save) make an image of the tree that is valid wherever it is
+ * mapped again: btree_map uses the nodes of a mapped image in place. The
+ * mapping is private, so modifying the tree copies the pages it touches,
+ * and an arena that has to grow moves to the heap.
+ */
+#define BTREE_INNER_KEYS 16
+#define BTREE_GROUP (BTREE_INNER_KEYS + 1)
+#define BTREE_LEAF_ENTRIES 340
+
+typedef struct BTreeInner {
+    int64_t keys[BTREE_INNER_KEYS];
+    position_t positions[BTREE_INNER_KEYS];
+    uint32_t count;
+    // 1 if the children are leaves, else the height of the children + 1
+    uint32_t height;
+    // the group holding the count + 1 children, in the leaf arena if
+    // height is 1
+    uint32_t children;
+} __attribute__((aligned(64))) BTreeInner;
+
+typedef struct BTreeLeaf {
+    int64_t keys[BTREE_LEAF_ENTRIES];
+    position_t positions[BTREE_LEAF_ENTRIES];
+    uint32_t count;
+} __attribute__((aligned(4096))) BTreeLeaf;
+
+typedef struct BTree {
+    // groups of BTREE_GROUP nodes each
+    BTreeInner *inner;
+    size_t inner_groups;
+    size_t inner_capacity;
+    BTreeLeaf *leaves;
+    size_t leaf_groups;
+    size_t leaf_capacity;
+    // the root, a leaf if height is 0; it is node 0 of a group of its own
+    uint32_t root;
+    uint32_t height;
+    size_t num_entries;
+    // the arena lies in a mapped image, which the tree does not own
+    bool inner_mapped;
+    bool leaves_mapped;
+} BTree;
+
+/*
+ * What btree_map needs to know about an image besides its arenas.
+ */
+typedef struct BTreeImage {
+    uint64_t num_entries;
+    uint64_t leaf_groups;
+    uint64_t inner_groups;
+    uint32_t root;
+    uint32_t height;
+} BTreeImage;
+
+BTree *btree_build(const int64_t *keys, const position_t *positions, size_t n);
+
+int btree_insert(BTree *tree, int64_t key, position_t pos);
+
+int btree_remove(BTree *tree, int64_t key, position_t pos);
+
+position_t *btree_range(const BTree *tree, int64_t low, int64_t high, size_t *count);
+
+int btree_save(const BTree *tree, FILE *file, BTreeImage *image);
+
+BTree *btree_map(const BTreeImage *image, void *data, size_t bytes);
+
+void btree_free(BTree *tree);
+
+#endif
@@ -9,5 +9,14 @@
 Table* lookup_table(char *name);
 Column *lookup_column(char *tbl_name, char *col_name);
 
+ClientContext *create_client_context(void);
+void free_client_context(ClientContext *context);
+GeneralizedColumn *lookup_handle(ClientContext *context, const char *name);
+const Pipeline *lookup_pipeline(ClientContext *context, const char *name);
+Status store_result(ClientContext *context, const char *name, Result *result);
+Status store_pipeline(ClientContext *context, const char *name, const Pipeline *pipeline);
+Status materialize_deferred_handles(void);
+Status batch_select(ClientContext *context, const char *handle, const SelectOperator *select);
+
 extern hashtable *table_ht; 
 #endif
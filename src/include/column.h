@@ -0,0 +1,155 @@
+#ifndef COLUMN_H
+#define COLUMN_H
+
+#include <string.h>
+#include "cs165_api.h"
+
+/*
+ * Columns are stored as a directory of fixed size segments (see
+ * persistence.c). Segment i holds the values at positions
+ * [i * SEGMENT_SIZE, (i + 1) * SEGMENT_SIZE). Segments never move once
+ * they exist, growing a column only adds segments to the directory.
+ */
+#define SEGMENT_SHIFT 16
+#define SEGMENT_SIZE ((size_t) 1 << SEGMENT_SHIFT)
+#define SEGMENT_MASK (SEGMENT_SIZE - 1)
+
+/*
+ * Accesses the value at position pos of a column holding values of type T.
+ * Usable as an lvalue.
+ */
+#define COLUMN_VALUE(col, T, pos) \
+    (((T *) (col)->segments[(pos) >> SEGMENT_SHIFT])[(pos) & SEGMENT_MASK])
+
+/*
+ * Returns the width in bytes of a single value of the given type.
+ */
+static inline size_t data_type_size(DataType type)
+{
+    switch (type) {
+    case LONG:
+        return sizeof(long);
+    case FLOAT:
+        return sizeof(float);
+    case DOUBLE:
+        return sizeof(double);
+    case POSITION:
+        return sizeof(position_t);
+    case INT:
+    default:
+        return sizeof(int);
+    }
+}
+
+/*
+ * Returns the width in bytes of a row of the given table, one value of
+ * every column.
+ */
+static inline size_t table_row_width(const Table *table)
+{
+    size_t width = 0;
+    for (size_t i = 0; i < table->col_count; i++) {
+        width += data_type_size(table->columns[i].type);
+    }
+    return width;
+}
+
+/*
+ * Names of the column types as used by the DSL and the catalog.
+ */
+static inline const char *data_type_name(DataType type)
+{
+    switch (type) {
+    case LONG:
+        return "long";
+    case FLOAT:
+        return "float";
+    case INT:
+    default:
+        return "int";
+    }
+}
+
+/*
+ * Parses a column type name. Returns -1 if name is not a column type.
+ */
+static inline int data_type_from_name(const char *name, DataType *type)
+{
+    if (strcmp(name, "int") == 0) {
+        *type = INT;
+    } else if (strcmp(name, "long") == 0) {
+        *type = LONG;
+    } else if (strcmp(name, "float") == 0) {
+        *type = FLOAT;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Returns the size in bytes of one segment of a column.
+ */
+static inline size_t column_segment_bytes(const Column *col)
+{
+    return SEGMENT_SIZE * data_type_size(col->type);
+}
+
+/*
+ * Returns the number of rows currently stored in a column.
+ */
+static inline size_t column_length(const Column *col)
+{
+    return col->table->table_length;
+}
+
+/*
+ * Returns the number of segments needed to hold num_rows values.
+ */
+static inline size_t column_segment_count(size_t num_rows)
+{
+    return (num_rows + SEGMENT_SIZE - 1) >> SEGMENT_SHIFT;
+}
+
+/*
+ * Returns how many of the first num_rows values fall into segment seg.
+ * Scans use this to walk a column segment by segment:
+ *
+ *    for (size_t s = 0; s < column_segment_count(n); s++) {
+ *        const int *vals = col->segments[s];
+ *        for (size_t i = 0; i < column_segment_length(s, n); i++) ...
+ *    }
+ */
+static inline size_t column_segment_length(size_t seg, size_t num_rows)
+{
+    size_t begin = seg << SEGMENT_SHIFT;
+    return num_rows - begin < SEGMENT_SIZE ? num_rows - begin : SEGMENT_SIZE;
+}
+
+/*
+ * Copies values [first_row, first_row + n) of a column to or from a
+ * contiguous buffer, one segment run at a time.
+ */
+static inline void column_copy(Column *col, size_t first_row, size_t n, unsigned char *buffer,
+                               int to_column)
+{
+    size_t width = data_type_size(col->type);
+    size_t k = 0;
+    while (k < n) {
+        size_t row = first_row + k;
+        unsigned char *slot = (unsigned char *) col->segments[row >> SEGMENT_SHIFT] +
+                              (row & SEGMENT_MASK) * width;
+        size_t run = SEGMENT_SIZE - (row & SEGMENT_MASK);
+        if (run > n - k) {
+            run = n - k;
+        }
+        if (to_column) {
+            memcpy(slot, buffer + k * width, run * width);
+        } else {
+            memcpy(buffer + k * width, slot, run * width);
+        }
+        k += run;
+    }
+}
+
+#endif
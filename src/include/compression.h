@@ -0,0 +1,90 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <stdint.h>
+#include "cs165_api.h"
+
+/*
+ * Lightweight compression of int columns.
+ *
+ * Every full segment of an int column may carry a compressed copy next to
+ * its raw values. The raw segment stays the authoritative data (it is what
+ * the column file holds); the encoded copy is what select, fetch and the
+ * aggregates read, so the raw pages of encoded segments stay cold.
+ * Only full segments are encoded: appends never touch them again, so an
+ * encoding stays valid until a delta fold (see delta.h) rewrites values of
+ * its segment, which encodes the segment again.
+ *
+ * Encodings:
+ *    ENCODING_FOR         frame of reference: value - min, bit packed
+ *    ENCODING_DICTIONARY  index into a sorted dictionary of the distinct
+ *                         values, bit packed
+ *    ENCODING_RLE         runs of equal values
+ *
+ * Both packed encodings preserve order (code(a) <= code(b) iff a <= b), so
+ * a range predicate on values becomes a range predicate on codes and is
+ * evaluated on the packed codes directly.
+ */
+typedef enum Encoding {
+    ENCODING_FOR,
+    ENCODING_DICTIONARY,
+    ENCODING_RLE,
+} Encoding;
+
+/*
+ * Fixed part of an encoded segment; also its on-disk header.
+ */
+typedef struct EncodingHeader {
+    uint32_t segment;
+    uint32_t encoding;
+    int32_t min;
+    int32_t max;
+    // code width in bits of the packed encodings
+    uint32_t bit_width;
+    // dictionary entries or runs
+    uint32_t num_entries;
+    uint64_t data_bytes;
+} EncodingHeader;
+
+/*
+ * data holds, depending on the encoding:
+ *    FOR:         packed codes
+ *    DICTIONARY:  num_entries int32_t dictionary values, then packed codes
+ *    RLE:         num_entries int32_t run values, then num_entries
+ *                 uint32_t exclusive run ends
+ * Packed codes are followed by 8 bytes of padding so every code can be
+ * read with one unaligned 64 bit load.
+ */
+typedef struct SegmentEncoding {
+    EncodingHeader header;
+    unsigned char *data;
+} SegmentEncoding;
+
+/*
+ * Returns the encoding of segment seg of a column, NULL if it is raw.
+ */
+static inline SegmentEncoding *column_encoding(const Column *col, size_t seg)
+{
+    return seg < col->num_encodings ? col->encodings[seg] : NULL;
+}
+
+Status column_encode(Column *col);
+
+void column_encode_segment(Column *col, size_t seg);
+
+void column_drop_encodings(Column *col);
+
+Status column_save_encodings(Column *col);
+
+Status column_load_encodings(Column *col);
+
+size_t encoded_select(const SegmentEncoding *enc, size_t begin, size_t n,
+                      int low, int high, position_t base, position_t *out);
+
+int encoded_value(const SegmentEncoding *enc, size_t offset);
+
+void encoded_decode(const SegmentEncoding *enc, size_t begin, size_t n, int *out);
+
+long encoded_sum(const SegmentEncoding *enc, size_t n);
+
+#endif
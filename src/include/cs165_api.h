@@ -27,6 +27,7 @@ SOFTWARE.
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 // Limits the size of a name in our database to 64 characters
@@ -38,35 +39,96 @@ SOFTWARE.
 #define QUERY_INVALID_STR "Query Invalid"
 #define OUT_OF_MEMORY_STR "Out of Memory"
 #define SUCCESS_STR "Success"
+#define FILE_NOT_FOUND_STR "File Not Found"
+#define INCORRECT_FILE_FORMAT_STR "Incorrect File Format"
 
 
 /**
  * EXTRA
  * DataType
  * Flag to mark what type of data is held in the struct.
- * You can support additional types by including this enum and using void*
- * in place of int* in db_operator simliar to the way IndexType supports
- * additional types.
+ * Columns can be declared as INT, LONG or FLOAT. DOUBLE only appears in
+ * results (averages, sums of floats) and POSITION marks a result holding
+ * row positions (position_t) produced by a select.
  **/
 
 typedef enum DataType {
      INT,
      LONG,
-     FLOAT
+     FLOAT,
+     DOUBLE,
+     POSITION,
+     // the rows of a table as a bitvector (see bitvector.h): bit i is set
+     // if row i qualifies; num_tuples counts the rows covered, not the set
+     // bits. Produced by selects that match much of a column.
+     BITMAP
 } DataType;
 
+/*
+ * A row position within a table. Tables are limited to 2^32 rows, which
+ * keeps position lists half the size of size_t based ones.
+ */
+typedef uint32_t position_t;
+#define MAX_TABLE_ROWS ((size_t) UINT32_MAX + 1)
+
+/*
+ * A single value of any DataType, used wherever the type is only known at
+ * runtime (parsed literals, scalar aggregates).
+ */
+typedef union Value {
+    int i;
+    long l;
+    float f;
+    double d;
+    position_t p;
+} Value;
+
+/*
+ * Indexes a column can be declared with (create(idx,...), see index.h).
+ */
+typedef enum IndexType {
+    NO_INDEX,
+    BTREE_INDEX,
+    SORTED_INDEX,
+} IndexType;
+
 struct Comparator;
-//struct ColumnIndex;
+struct Table;
+struct SegmentEncoding;
+struct ColumnIndex;
 
 typedef struct Column {
     char name[MAX_SIZE_NAME]; 
-    int* data;
+    DataType type;
+    // the table this column belongs to
+    struct Table* table;
+    // segment directory, see column.h for the layout
+    void** segments;
+    size_t num_segments;
+    size_t segments_capacity;
     int data_length;
-    int capacity;
-    // You will implement column indexes later. 
-    void* index;
-    //struct ColumnIndex *index;
-    //bool clustered;
+    // number of values the mapped segments can currently hold
+    size_t capacity;
+    // descriptor of the backing column file, -1 until the column is mapped
+    int fd;
+    // compressed copies of full segments, NULL entries are raw segments
+    // (see compression.h)
+    struct SegmentEncoding** encodings;
+    size_t num_encodings;
+    // per block min/max in the column's type (see zonemap.h)
+    void* zone_min;
+    void* zone_max;
+    size_t num_zones;
+    size_t zones_capacity;
+    // updated values not yet folded into the segments, NULL until the
+    // first update (see delta.h)
+    struct ColumnDelta* delta;
+    // the index declared on the column and its in-memory structure, NULL
+    // until built; undeclared columns may get a cracker column (see index.h)
+    IndexType index_type;
+    // whether loads order the table by this column
+    bool clustered;
+    struct ColumnIndex *index;
 } Column;
 
 
@@ -90,6 +152,10 @@ typedef struct Table {
     size_t col_count;
     size_t row_capacity;
     size_t table_length;
+    // tombstones, bit i is set once row i was deleted (see bitvector.h).
+    // NULL until the first delete, then sized for row_capacity rows.
+    uint64_t *deleted;
+    size_t num_deleted;
 } Table;
 
 /**
@@ -145,19 +211,47 @@ typedef struct Result {
     void *payload;
 } Result;
 
+/*
+ * A chain of dependent statements run as one pass over a table (see
+ * query.c): the rows of col within [low, high], narrowed down by every
+ * filter, a range on the values of another column of the table at the
+ * rows left, and then, if fetch is set, the values of fetch at the rows
+ * that remain. Ranges are inclusive and in the type of their column.
+ */
+#define PIPELINE_MAX_FILTERS 8
+
+typedef struct PipelineFilter {
+    Column *col;
+    Value low;
+    Value high;
+} PipelineFilter;
+
+typedef struct Pipeline {
+    Column *col;
+    Value low;
+    Value high;
+    PipelineFilter filters[PIPELINE_MAX_FILTERS];
+    size_t num_filters;
+    Column *fetch;
+} Pipeline;
+
 /*
  * an enum which allows us to differentiate between columns and results
+ * DEFERRED marks a handle whose result was not computed yet, only the
+ * pipeline producing it is kept (see client_context.c)
  */
 typedef enum GeneralizedColumnType {
     RESULT,
-    COLUMN
+    COLUMN,
+    DEFERRED
 } GeneralizedColumnType;
 /*
- * a union type holding either a column or a result struct
+ * a union type holding either a column, a result struct or a pipeline
  */
 typedef union GeneralizedColumnPointer {
     Result* result;
     Column* column;
+    Pipeline* pipeline;
 } GeneralizedColumnPointer;
 
 /*
@@ -176,13 +270,31 @@ typedef struct GeneralizedColumnHandle {
     char name[HANDLE_MAX_SIZE];
     GeneralizedColumn generalized_column;
 } GeneralizedColumnHandle;
+/*
+ * a select queued between batch_queries() and batch_execute(), its result
+ * is stored under handle once the batch runs
+ */
+typedef struct BatchedSelect {
+    char handle[HANDLE_MAX_SIZE];
+    Column *col;
+    Value lower;
+    Value upper;
+} BatchedSelect;
+
 /*
  * holds the information necessary to refer to generalized columns (results or columns)
+ * and the selects of the batch being collected, if any
  */
 typedef struct ClientContext {
-    Result* chandle_table;
+    GeneralizedColumnHandle* chandle_table;
+    // the next connected client, see materialize_deferred_handles
+    struct ClientContext* next_client;
     int chandles_in_use;
     int chandle_slots;
+    bool batching;
+    BatchedSelect* batch;
+    int batch_count;
+    int batch_slots;
 } ClientContext;
 
 /**
@@ -206,6 +318,15 @@ typedef enum OperatorType {
     INSERT,
     LOAD,
     SELECT,
+    FETCH,
+    AGGREGATE,
+    ARITHMETIC,
+    DEFER,
+    PRINT,
+    DELETE,
+    UPDATE,
+    BATCH,
+    SHUTDOWN,
 } OperatorType;
 
 
@@ -213,6 +334,7 @@ typedef enum CreateType {
     _DB,
     _TABLE,
     _COLUMN,
+    _INDEX,
 } CreateType;
 
 /*
@@ -221,6 +343,8 @@ typedef enum CreateType {
  * For example, if create_type == _DB, the operator should create a db named <<name>> 
  * if create_type = _TABLE, the operator should create a table named <<name>> with <<col_count>> columns within db <<db>>
  * if create_type = = _COLUMN, the operator should create a column named <<name>> within table <<table>>
+ * if create_type == _INDEX, the operator should declare an index of type <<index_type>> on <<column>>,
+ * clustering its table by <<column>> if <<clustered>>
  */
 typedef struct CreateOperator {
     CreateType create_type; 
@@ -228,6 +352,10 @@ typedef struct CreateOperator {
     Db* db;
     Table* table;
     int col_count;
+    DataType data_type;
+    Column* column;
+    IndexType index_type;
+    bool clustered;
 } CreateOperator;
 
 /*
@@ -235,8 +363,28 @@ typedef struct CreateOperator {
  */
 typedef struct InsertOperator {
     Table* table;
-    int* values;
+    // num_rows rows of table->col_count values each, row after row,
+    // every value already in the type of its column
+    Value* values;
+    size_t num_rows;
 } InsertOperator;
+/*
+ * necessary fields for deletion, positions is the result of a select
+ * on the table
+ */
+typedef struct DeleteOperator {
+    Table* table;
+    Result* positions;
+} DeleteOperator;
+/*
+ * necessary fields for updates: col is set to value at positions, the
+ * result of a select on its table
+ */
+typedef struct UpdateOperator {
+    Column* col;
+    Result* positions;
+    Value value;
+} UpdateOperator;
 /*
  * necessary fields for insertion
  */
@@ -246,13 +394,85 @@ typedef struct LoadOperator {
 
 /*
  * necessary fields for select
+ * Either col is the column to scan, or col is NULL and the select filters
+ * earlier results instead: values, fetched at positions, keep the
+ * positions of the values in range.
+ * lower and upper are inclusive and in the type of col (of values); the
+ * parser turns the DSL's [low, high) range (with null for unbounded) into
+ * this form. An empty range has lower > upper.
  */
  typedef struct SelectOperator {
      Column *col;
-     int lower;
-     int upper;
+     Result *positions;
+     Result *values;
+     Value lower;
+     Value upper;
  } SelectOperator;
 
+/*
+ * necessary fields for fetch
+ */
+typedef struct FetchOperator {
+    Column *col;
+    Result *positions;
+} FetchOperator;
+
+typedef enum AggregateType {
+    SUM,
+    AVG,
+    MIN,
+    MAX,
+} AggregateType;
+
+/*
+ * necessary fields for an aggregate over a column or a result
+ * If pipeline.col is set, input is unused and the values the pipeline
+ * fetches are aggregated instead, without materializing them.
+ */
+typedef struct AggregateOperator {
+    AggregateType type;
+    GeneralizedColumn input;
+    Pipeline pipeline;
+} AggregateOperator;
+
+typedef enum ArithmeticType {
+    ADD,
+    SUB,
+} ArithmeticType;
+
+/*
+ * necessary fields for add and sub of two results of the same length
+ */
+typedef struct ArithmeticOperator {
+    ArithmeticType type;
+    Result *left;
+    Result *right;
+} ArithmeticOperator;
+
+/*
+ * necessary fields for binding a handle to a pipeline that is only run
+ * once its result is needed
+ */
+typedef struct DeferOperator {
+    Pipeline pipeline;
+} DeferOperator;
+
+/*
+ * necessary fields for print, the results are printed side by side
+ */
+typedef struct PrintOperator {
+    Result **results;
+    size_t num_results;
+} PrintOperator;
+
+/*
+ * necessary fields for batch_execute(), the selects collected since
+ * batch_queries()
+ */
+typedef struct BatchOperator {
+    BatchedSelect *selects;
+    size_t num_selects;
+} BatchOperator;
 
 /*
  * union type holding the fields of any operator
@@ -260,8 +480,16 @@ typedef struct LoadOperator {
 typedef union OperatorFields {
     CreateOperator create_operator;
     InsertOperator insert_operator;
+    DeleteOperator delete_operator;
+    UpdateOperator update_operator;
     LoadOperator load_operator;
     SelectOperator select_operator;
+    FetchOperator fetch_operator;
+    AggregateOperator aggregate_operator;
+    ArithmeticOperator arithmetic_operator;
+    DeferOperator defer_operator;
+    PrintOperator print_operator;
+    BatchOperator batch_operator;
 } OperatorFields;
 /*
  * DbOperator holds the following fields:
@@ -269,12 +497,14 @@ typedef union OperatorFields {
  * operator fields: the fields of the operator in question
  * client_fd: the file descriptor of the client that this operator will return to
  * context: the context of the operator in question. This context holds the local results of the client in question.
+ * handle: name the result of the operator is stored under in the context (empty if none)
  */
 typedef struct DbOperator {
     OperatorType type;
     OperatorFields operator_fields;
     int client_fd;
     ClientContext* context;
+    char handle[HANDLE_MAX_SIZE];
 } DbOperator;
 
 extern Db *current_db;
@@ -289,11 +519,24 @@ Status create_db(const char* db_name);
 
 Status create_table(Db* db, const char* name, size_t num_columns);
 
-Status create_column(Table *table, char *name);
+Status create_column(Table *table, char *name, DataType type);
+
+Status table_reserve(Table *table, size_t num_rows);
 
 Status relational_insert(Table *table, int *values);
 
-Status shutdown_server();
+Status relational_insert_batch(Table *table, const int *row_major_values, size_t nrows);
+
+Status relational_insert_values(Table *table, const Value *row_major_values, size_t nrows);
+
+Status relational_delete(Table *table, const position_t *positions, size_t num_positions);
+
+Status relational_update(Column *col, const position_t *positions, size_t num_positions,
+                         Value value);
+
+Status load_file(const char *file_name);
+
+Status shutdown_server(bool compact);
 
 char** execute_db_operator(DbOperator* query);
 
@@ -0,0 +1,97 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "cs165_api.h"
+
+/*
+ * Delta stores.
+ *
+ * relational_update does not write into the segments of a column. The new
+ * values go to the column's delta (Column.delta, allocated on the first
+ * update): pairs of position and value, sorted by position, at most one
+ * pair per position. Operators read the base segments exactly as before
+ * and merge the delta in, a value in the delta replaces the one at its
+ * position. Encodings and zone maps keep describing the base data, so
+ * updates leave them alone; the only price is that a zone with delta
+ * entries is always scanned (its min/max may be wrong for the new values).
+ *
+ * Once a delta holds DELTA_FOLD_ENTRIES entries it is folded: the values
+ * are written into the segments in one pass, the touched segments are
+ * synced and re-encoded, the touched zones recomputed, and the delta is
+ * emptied. Foreground checkpoints fold every delta.
+ *
+ * Deltas are part of checkpoints (DATA_DIR/<column>.dlt) and updates are
+ * logged, so after a restart a zone map saved before a fold may still be
+ * off for folded rows; those rows are in the restored delta, which keeps
+ * their zones from being skipped until the next fold fixes the zones.
+ */
+#ifndef DELTA_FOLD_ENTRIES
+#define DELTA_FOLD_ENTRIES 16384
+#endif
+
+typedef struct ColumnDelta {
+    // ascending
+    position_t *positions;
+    // values[i], in the column's type, replaces the value at positions[i]
+    void *values;
+    size_t count;
+    size_t capacity;
+} ColumnDelta;
+
+/*
+ * Returns the index of the first delta entry at or after position pos.
+ */
+static inline size_t column_delta_find(const Column *col, size_t pos)
+{
+    const ColumnDelta *delta = col->delta;
+    size_t lo = 0, hi = delta != NULL ? delta->count : 0;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (delta->positions[mid] < pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * Returns whether the delta of a column has entries for rows
+ * [begin, begin + n).
+ */
+static inline int column_delta_any(const Column *col, size_t begin, size_t n)
+{
+    if (col->delta == NULL || col->delta->count == 0) {
+        return 0;
+    }
+    size_t first = column_delta_find(col, begin);
+    return first < col->delta->count && col->delta->positions[first] < begin + n;
+}
+
+Status column_update(Column *col, const position_t *positions, size_t n, Value value);
+
+void column_delta_patch(const Column *col, size_t begin, size_t n, void *values);
+
+void column_delta_fetch(const Column *col, const position_t *positions, size_t n, void *out);
+
+size_t column_delta_select(const Column *col, size_t first, size_t last, Value low, Value high,
+                           const uint64_t *deleted, const position_t *base, size_t num_base,
+                           position_t *out);
+
+void column_delta_select_bits(const Column *col, size_t first, size_t last, Value low,
+                              Value high, const uint64_t *deleted, uint64_t *bits);
+
+void column_delta_fetch_bits(const Column *col, const uint64_t *bits, size_t num_rows, void *out);
+
+Status column_delta_fold(Column *col);
+
+void column_drop_delta(Column *col);
+
+ColumnDelta *column_copy_delta(const Column *col);
+
+Status column_save_delta(const Column *col);
+
+Status column_load_delta(Column *col);
+
+#endif
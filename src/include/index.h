@@ -0,0 +1,160 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <pthread.h>
+#include "cs165_api.h"
+#include "wal.h"
+
+struct BTree;
+struct IndexLoad;
+
+/*
+ * Column indexes (Column.index).
+ *
+ * INDEX_BTREE: the structure of a column declared with
+ * create(idx,<col>,btree,<clustered|unclustered>), a B+tree (see btree.h)
+ * of the column's values and positions. It is bulk loaded from the sorted
+ * (value, position) pairs of the column when the index is declared and
+ * when a load appends more rows than the tree holds, and otherwise
+ * maintained entry by entry by inserts, updates and deletes. Range
+ * selects that are not expected to match much of the column descend the
+ * tree instead of scanning. The declaration is persistent (catalog and
+ * log), the tree is saved by checkpoints (see below); it is built again by
+ * the first select after a compaction, or after maintenance ran out of
+ * memory and dropped it.
+ *
+ * INDEX_SORTED: create(idx,<col>,sorted,unclustered), a copy of the keys
+ * of the live rows in value order with their positions, searched with two
+ * binary searches. Appends and updates drop it, the next select sorts the
+ * column again; deletes are left to the tombstones.
+ *
+ * Loads leave every declared index of the table built (table_index_append),
+ * so the table is fully indexed when the load returns. The columns are
+ * indexed concurrently, and entries are sorted on the thread pool: runs
+ * are radix sorted in parallel, then merged pairwise in rounds, each
+ * round cut into blocks of output that merge independently. A load into an
+ * empty, unclustered table sorts the entries of every chunk of the csv on
+ * the thread that parsed it, right after parsing (index_load_begin), so
+ * only the merges and bulk loads are left once the last chunk is in.
+ *
+ * Declared indexes are saved by the checkpoints that hold the database
+ * write lock (db_checkpoint: after loads, at shutdown, after recovery) to
+ * DATA_DIR/<column>.idx: a header page, then the arenas of the B+tree (see
+ * btree.h) or the keys and positions of the sorted copy, which hold no
+ * pointers. Startup maps the file back (private, so maintenance copies the
+ * pages it changes) before the log is replayed, and replayed changes
+ * maintain the index as they would at runtime. The file is only used by
+ * the checkpoint it was saved with: background checkpoints do not save
+ * indexes, so after a crash an index older than the catalog is rebuilt by
+ * the first select. An index unchanged since it was saved or mapped only
+ * has its header moved on to the new checkpoint.
+ *
+ * Clustered indexes: a table has at most one clustered column, declared
+ * while the table is still empty. Every load then sorts the rows it
+ * appends by that column (table_cluster), moving the values of all
+ * columns with one shared permutation, so after a load into an empty table
+ * equal and neighbouring keys are in neighbouring rows and selects on the
+ * key return runs of consecutive positions. A clustered btree is an
+ * INDEX_BTREE over the ordered table. A clustered sorted index needs no
+ * copy at all, INDEX_CLUSTERED only records how many leading rows of the
+ * column are in order; selects binary search those, take updated rows
+ * from the delta and scan the rows behind the sorted prefix, which is
+ * where inserts land. Folding updates into the column may break the
+ * order, so a fold drops the index and the next select measures the
+ * prefix again.
+ *
+ * INDEX_CRACKER: database cracking. A column without a declared index gets
+ * a cracker column the first time a range select runs over it, if it has
+ * at least CRACK_MIN_ROWS rows: a copy of its values (with their updates
+ * applied) and of their positions. Every range select then partitions the
+ * pieces of the copy holding its bounds around them, quicksort style, and
+ * records the new boundaries as cracks, so the rows it wants end up
+ * contiguous. Each query only reorganizes the pieces it touches, and as
+ * cracks accumulate pieces get small and selects approach the cost of a
+ * binary search and a copy.
+ *
+ * The cracker describes the rows the column had when it was built. Appends
+ * and updates drop it (the next select builds it again), deletes are left
+ * to the tombstones, which selects through the cracker still apply. It
+ * lives in memory only. Cracking rewrites the copy, so selects, which run
+ * concurrently, take the index's lock while they crack.
+ */
+#ifndef CRACKING
+#define CRACKING 1
+#endif
+
+#ifndef CRACK_MIN_ROWS
+#define CRACK_MIN_ROWS ((size_t) 1 << 16)
+#endif
+
+typedef enum IndexKind {
+    INDEX_CRACKER,
+    INDEX_BTREE,
+    INDEX_SORTED,
+    INDEX_CLUSTERED,
+} IndexKind;
+
+/*
+ * A boundary in the cracker column: the values before offset are < value,
+ * or <= value if inclusive, and those from offset on are not.
+ */
+typedef struct Crack {
+    Value value;
+    int inclusive;
+    size_t offset;
+} Crack;
+
+typedef struct ColumnIndex {
+    IndexKind kind;
+    pthread_mutex_t lock;
+    // rows of the column covered
+    size_t num_rows;
+    // the cracker column: values in the column's type and their positions
+    void *values;
+    position_t *positions;
+    // ascending by (value, inclusive)
+    Crack *cracks;
+    size_t num_cracks;
+    size_t cracks_capacity;
+    struct BTree *btree;
+    // the sorted copy: ascending keys of the positions above
+    int64_t *keys;
+    size_t num_keys;
+    // clustered columns: rows [0, sorted_rows) are in order
+    size_t sorted_rows;
+    // the index file the index is mapped from, NULL if built in memory
+    void *map;
+    size_t map_bytes;
+    // the index file holds the index as it is
+    bool saved;
+} ColumnIndex;
+
+Status column_create_index(Column *col, IndexType type, bool clustered);
+
+Status table_cluster(Table *table, size_t begin, size_t end);
+
+position_t *index_select(Column *col, Value low, Value high, size_t *count);
+
+void column_index_append(Column *col, size_t begin, size_t end);
+
+struct IndexLoad *index_load_begin(Table *table, size_t begin, size_t end, size_t num_runs);
+
+void index_load_run(struct IndexLoad *load, size_t run, size_t begin, size_t end);
+
+void table_index_append(Table *table, size_t begin, size_t end, struct IndexLoad *load);
+
+void index_load_free(struct IndexLoad *load);
+
+void column_index_update(Column *col, const position_t *positions, size_t n, Value value);
+
+void column_index_delete(Column *col, position_t pos);
+
+void column_index_fold(Column *col);
+
+void column_drop_index(Column *col);
+
+Status column_save_index(Column *col, lsn_t lsn);
+
+Status column_load_index(Column *col, lsn_t lsn);
+
+#endif
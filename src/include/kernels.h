@@ -0,0 +1,87 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include "cs165_api.h"
+
+/*
+ * Type specialized inner loops of the query operators.
+ *
+ * Every kernel is written once as a macro (see kernels.c) and instantiated
+ * for each value type, so the loops the compiler sees are monomorphic and
+ * free of any per value type dispatch. Operators pick the instantiation
+ * once per column or segment based on DataType.
+ *
+ * X(T, NAME, SUM_T): the C type, the suffix of the kernel names and the
+ * type sums are accumulated in (64 bit for integers).
+ */
+#define FOR_EACH_VALUE_TYPE(X)      \
+    X(int, int, long)               \
+    X(long, long, long)             \
+    X(float, float, double)         \
+    X(double, double, double)
+
+/*
+ * select_T:  writes base + i for every values[i] in [low, high] to out and
+ *            returns how many positions were written; out must have room
+ *            for n positions, whatever the count (SIMD versions on x86,
+ *            see kernels.c). Branch free, best when many values match
+ * select_sparse_T: the same, branching on matches, best when few do
+ * bitmap_T:  sets bit i of bits for every values[i] in [low, high] and
+ *            clears the others, writing whole words; bits[0] holds the
+ *            bit of values[0]
+ * fetch_T:   gathers the values at positions out of a segment directory,
+ *            copying runs of consecutive rows and prefetching rows a few
+ *            blocks ahead of sparse ones
+ * sum_T:     sum of values, accumulated in SUM_T (AVX2 versions widen
+ *            every value to SUM_T first, so int sums never overflow)
+ * min_T/max_T: minimum/maximum of init and values
+ * add_T/sub_T: out[i] = a[i] + b[i] (a[i] - b[i]), computed in SUM_T
+ * live_T:    copies the values whose tombstone bit is clear to out (which
+ *            may alias values) and returns how many were copied; deleted
+ *            points at the word holding the bit of values[0]
+ */
+#define DECLARE_KERNELS(T, NAME, SUM_T)                                         \
+    size_t select_##NAME(const T *values, size_t n, T low, T high,             \
+                         position_t base, position_t *out);                     \
+    size_t select_sparse_##NAME(const T *values, size_t n, T low, T high,      \
+                                position_t base, position_t *out);              \
+    void bitmap_##NAME(const T *values, size_t n, T low, T high,               \
+                       uint64_t *bits);                                         \
+    void fetch_##NAME(void *const *segments, const position_t *positions,      \
+                      size_t n, T *out);                                        \
+    SUM_T sum_##NAME(const T *values, size_t n);                                \
+    T min_##NAME(const T *values, size_t n, T init);                            \
+    T max_##NAME(const T *values, size_t n, T init);                            \
+    void add_##NAME(const T *a, const T *b, size_t n, SUM_T *out);             \
+    void sub_##NAME(const T *a, const T *b, size_t n, SUM_T *out);             \
+    size_t live_##NAME(const T *values, const uint64_t *deleted, size_t n,     \
+                       T *out);
+
+FOR_EACH_VALUE_TYPE(DECLARE_KERNELS)
+
+/*
+ * Writes base, ..., base + n - 1 to out and returns n. Used where every
+ * value of a range is known to qualify.
+ */
+size_t select_all(size_t n, position_t base, position_t *out);
+
+/*
+ * Like select_all, but skips the rows whose tombstone bit is set. deleted
+ * points at the word holding the bit of base.
+ */
+size_t select_live(const uint64_t *deleted, size_t n, position_t base, position_t *out);
+
+/*
+ * Removes the positions of deleted rows from positions (in place, keeping
+ * the order) and returns how many are left. deleted is the tombstone
+ * bitvector of the whole table.
+ */
+size_t drop_deleted(const uint64_t *deleted, position_t *positions, size_t n);
+
+/*
+ * Returns how many of keys[0, n) are below key, n a multiple of 4. Used
+ * for the in-node searches of B+trees (see btree.c).
+ */
+size_t count_below(const int64_t *keys, size_t n, int64_t key);
+
+#endif
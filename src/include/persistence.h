@@ -0,0 +1,63 @@
+#ifndef PERSISTENCE_H
+#define PERSISTENCE_H
+
+#include "cs165_api.h"
+
+/*
+ * Everything the server persists lives under DATA_DIR (relative to the
+ * directory the server is started from): one catalog describing the
+ * Db/Table/Column metadata, plus one raw file per column holding its values.
+ * Columns may also have derived files next to their raw file (.enc, see
+ * compression.h, .zone, see zonemap.h, and .idx, see index.h) and updated
+ * columns a delta
+ * file (.dlt, see delta.h), tables with deleted rows a tombstone file
+ * (.del). Changes made since the catalog was last written
+ * are recorded in the write-ahead log (see wal.h).
+ */
+#define DATA_DIR "db_data"
+#define CATALOG_PATH DATA_DIR "/catalog"
+#define CATALOG_TMP_PATH DATA_DIR "/catalog.tmp"
+
+/*
+ * Seconds between two background checkpoints. Recovery replays at most
+ * what was logged in that time.
+ */
+#ifndef CHECKPOINT_INTERVAL_S
+#define CHECKPOINT_INTERVAL_S 30
+#endif
+
+/*
+ * Tables with at least this percentage of deleted rows are compacted, in
+ * the background while no client is connected and at shutdown.
+ */
+#ifndef COMPACT_DELETED_PERCENT
+#define COMPACT_DELETED_PERCENT 25
+#endif
+
+typedef struct Checkpoint Checkpoint;
+
+int ensure_data_dir();
+
+Status column_reserve(Column *col, size_t capacity);
+
+Status column_sync(Column *col, size_t first_row);
+
+void column_close(Column *col);
+
+void column_remove_files(const Column *col);
+
+Status checkpoint_capture(int force, Checkpoint **checkpoint);
+
+Status checkpoint_write(Checkpoint *checkpoint);
+
+Status db_checkpoint();
+
+Status table_compact(Table *table);
+
+Status table_compaction_finish(Table *table, size_t num_rows);
+
+bool db_compaction_due();
+
+Status db_compact();
+
+#endif
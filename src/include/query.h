@@ -0,0 +1,42 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include "cs165_api.h"
+
+Result *create_result(DataType data_type, size_t num_tuples);
+
+/*
+ * Returns whether a result lists rows of a table, as positions or as a
+ * bitmap.
+ */
+static inline int is_position_result(const Result *result)
+{
+    return result->data_type == POSITION || result->data_type == BITMAP;
+}
+
+position_t *result_positions(const Result *result, size_t *num_positions);
+
+void free_result(Result *result);
+
+Status select_column(Column *col, Value low, Value high, Result **result);
+
+Status select_column_batch(Column *col, const Value *lows, const Value *highs,
+                           size_t num_queries, Result **results);
+
+Status select_result(const Result *positions, const Result *values, Value low,
+                     Value high, Result **result);
+
+Status fetch_column(Column *col, const Result *positions, Result **result);
+
+Status aggregate(AggregateType type, const GeneralizedColumn *input, Result **result);
+
+Status aggregate_pipeline(AggregateType type, const Pipeline *pipeline, Result **result);
+
+Status pipeline_result(const Pipeline *pipeline, Result **result);
+
+Status arithmetic(ArithmeticType type, const Result *left, const Result *right,
+                  Result **result);
+
+Status print_results(Result **results, size_t num_results, char **output);
+
+#endif
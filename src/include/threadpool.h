@@ -0,0 +1,38 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <stddef.h>
+#include "cs165_api.h"
+
+/*
+ * Thread pool for intra-query parallelism.
+ *
+ * Operators cut their work into morsels, one segment (SEGMENT_SIZE rows)
+ * each for column scans, and hand them to parallel_for. The worker
+ * threads are started once with the server and take morsels from every
+ * running parallel_for, one morsel at a time: a thread that is done with
+ * a morsel claims the next unclaimed one, so fast threads take over the
+ * work of slow ones and no thread idles while morsels are left. The thread
+ * calling parallel_for works on its own morsels too, so a call always
+ * progresses, even when all workers are busy with other clients' queries.
+ *
+ * Morsel functions get the index of the thread running them, below
+ * thread_pool_slots(), to reach per-thread scratch space; within one
+ * parallel_for no two threads share an index. They must not take the
+ * database lock, the caller of parallel_for holds it for them.
+ */
+#ifndef THREAD_POOL_MAX_WORKERS
+#define THREAD_POOL_MAX_WORKERS 64
+#endif
+
+typedef void (*morsel_fn)(void *arg, size_t morsel, size_t slot);
+
+Status thread_pool_start(size_t num_workers);
+
+void thread_pool_stop(void);
+
+size_t thread_pool_slots(void);
+
+void parallel_for(size_t num_morsels, morsel_fn work, void *arg);
+
+#endif
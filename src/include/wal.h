@@ -0,0 +1,81 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include "cs165_api.h"
+#include "persistence.h"
+
+/*
+ * Write-ahead log.
+ *
+ * Every change made since the last checkpoint is described by a record in
+ * the log, a sequence of files DATA_DIR/wal.<n>. Records are appended to
+ * the newest file in the order the changes are applied
+ * (callers hold the database write lock while logging), each one tagged
+ * with a log sequence number. Records are position based (an insert
+ * carries the row it starts at), so replaying a record whose effect is
+ * already on disk is harmless.
+ *
+ * Group commit: logging only copies the record into an in-memory buffer.
+ * A flusher thread writes the buffer and issues a single fdatasync for
+ * everything that accumulated, at most every WAL_COMMIT_WINDOW_US
+ * microseconds. wal_commit blocks the caller until its record is durable,
+ * so a longer window trades commit latency for fewer syncs under load.
+ *
+ * A checkpoint rotates the log to a new file when it snapshots the
+ * database and deletes the older files once the snapshot is on disk, so
+ * recovery only replays what was logged since the last checkpoint.
+ */
+#define WAL_PREFIX "wal."
+
+#ifndef WAL_COMMIT_WINDOW_US
+#define WAL_COMMIT_WINDOW_US 1000
+#endif
+
+typedef uint64_t lsn_t;
+
+typedef enum WalRecordType {
+    WAL_CREATE_DB = 1,
+    WAL_CREATE_TABLE,
+    WAL_CREATE_COLUMN,
+    WAL_INSERT,
+    WAL_DELETE,
+    WAL_COMPACT,
+    WAL_UPDATE,
+    WAL_CREATE_INDEX,
+} WalRecordType;
+
+Status wal_replay(lsn_t checkpoint_lsn);
+
+Status wal_open(void);
+
+Status wal_reserve(size_t bytes);
+
+void wal_cancel(void);
+
+lsn_t wal_log_create_db(const char *name);
+
+lsn_t wal_log_create_table(const char *name, size_t num_columns);
+
+lsn_t wal_log_create_column(const Table *table, const char *name, DataType type);
+
+lsn_t wal_log_insert(const Table *table, size_t first_row, size_t num_rows);
+
+lsn_t wal_log_delete(const Table *table, const position_t *positions, size_t num_positions);
+
+lsn_t wal_log_compact(const Table *table, size_t num_rows);
+
+lsn_t wal_log_update(const Column *col, const position_t *positions, size_t num_positions,
+                     Value value);
+
+lsn_t wal_log_create_index(const Column *col, IndexType type, bool clustered);
+
+Status wal_commit(lsn_t lsn);
+
+lsn_t wal_last_lsn(void);
+
+Status wal_rotate(void);
+
+void wal_discard_rotated(void);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef ZONEMAP_H
+#define ZONEMAP_H
+
+#include "cs165_api.h"
+
+/*
+ * Zone maps: the min and max of every block of ZONE_SIZE values of a
+ * column, kept in two arrays of the column's type (zone_min/zone_max).
+ * Blocks never straddle a segment. Select skips blocks whose [min, max]
+ * misses the predicate and takes blocks that lie entirely inside it
+ * without looking at their values.
+ *
+ * The zones always cover every row of the column: appends (inserts and
+ * loads) extend them, and they are saved next to the column file in
+ * DATA_DIR/<column>.zone at shutdown.
+ */
+#define ZONE_SHIFT 12
+#define ZONE_SIZE ((size_t) 1 << ZONE_SHIFT)
+
+/*
+ * Returns the number of zones needed to cover num_rows values.
+ */
+static inline size_t column_zone_count(size_t num_rows)
+{
+    return (num_rows + ZONE_SIZE - 1) >> ZONE_SHIFT;
+}
+
+/*
+ * Returns how many of the first num_rows values fall into zone z.
+ */
+static inline size_t column_zone_length(size_t z, size_t num_rows)
+{
+    size_t begin = z << ZONE_SHIFT;
+    return num_rows - begin < ZONE_SIZE ? num_rows - begin : ZONE_SIZE;
+}
+
+Status column_zones_extend(Column *col, size_t begin, size_t end);
+
+void column_drop_zones(Column *col);
+
+Status column_save_zones(Column *col);
+
+Status column_load_zones(Column *col);
+
+#endif
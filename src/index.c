@@ -0,0 +1,1825 @@
+/*
+ * -- index.c
+ *
+ *  column indexes: declared B+trees, sorted copies and clustered columns
+ *  and their index files, and cracker columns built and reorganized by
+ *  range selects (see index.h)
+ */
+
+#define _DEFAULT_SOURCE
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bitvector.h"
+#include "btree.h"
+#include "column.h"
+#include "delta.h"
+#include "index.h"
+#include "persistence.h"
+#include "threadpool.h"
+#include "utils.h"
+
+/*
+ * Positions and index entries are sorted RADIX_BITS bits at a time, least
+ * significant digit first, with as many passes as the table's row numbers
+ * (the spread of the keys) need.
+ */
+#define RADIX_BITS 11
+#define RADIX_SIZE ((size_t) 1 << RADIX_BITS)
+
+#define SIGN_BIT ((uint64_t) 1 << 63)
+
+/*
+ * Sorts of at least PARALLEL_SORT_MIN_ENTRIES entries run on the thread
+ * pool, whose merges hand out MERGE_BLOCK entries of output per morsel.
+ */
+#define PARALLEL_SORT_MIN_ENTRIES ((size_t) 1 << 17)
+#define MERGE_BLOCK ((size_t) 1 << 16)
+
+// identifies index files ("IDX1")
+#define INDEX_MAGIC 0x31584449u
+// the header fills the first page, so what follows can be mapped in place
+#define INDEX_HEADER_BYTES 4096
+
+typedef struct IndexFileHeader {
+    uint32_t magic;
+    // IndexKind
+    uint32_t kind;
+    // the checkpoint that saved the file
+    uint64_t lsn;
+    // rows of the column covered
+    uint64_t num_rows;
+    // entries of a sorted copy, or the sorted rows of a clustered column
+    uint64_t count;
+    BTreeImage btree;
+} IndexFileHeader;
+
+// guards attaching indexes, which concurrent selects may race to do
+static pthread_mutex_t attach_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * B+tree keys: values mapped to int64_t preserving their order. Floats
+ * are ordered by their bits once the magnitude bits of negative ones are
+ * flipped, with -0.0 equal to 0.0.
+ */
+static inline int64_t int_key(int value)
+{
+    return value;
+}
+
+static inline int64_t long_key(long value)
+{
+    return value;
+}
+
+static inline int64_t float_key(float value)
+{
+    int32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    if (bits == INT32_MIN) {
+        return 0;
+    }
+    return bits >= 0 ? bits : bits ^ INT32_MAX;
+}
+
+static int64_t index_key(DataType type, Value value)
+{
+    switch (type) {
+    case LONG:
+        return long_key(value.l);
+    case FLOAT:
+        return float_key(value.f);
+    default:
+        return int_key(value.i);
+    }
+}
+
+/*
+ * Returns the key of the value stored in row pos of a column, ignoring
+ * its delta.
+ */
+static int64_t raw_key(const Column *col, size_t pos)
+{
+    switch (col->type) {
+    case LONG:
+        return long_key(COLUMN_VALUE(col, long, pos));
+    case FLOAT:
+        return float_key(COLUMN_VALUE(col, float, pos));
+    default:
+        return int_key(COLUMN_VALUE(col, int, pos));
+    }
+}
+
+/*
+ * Returns the key of the value of delta entry d of a column.
+ */
+static int64_t delta_key(const Column *col, size_t d)
+{
+    switch (col->type) {
+    case LONG:
+        return long_key(((const long *) col->delta->values)[d]);
+    case FLOAT:
+        return float_key(((const float *) col->delta->values)[d]);
+    default:
+        return int_key(((const int *) col->delta->values)[d]);
+    }
+}
+
+/*
+ * Returns the key of the value of row pos of a column, taking it from the
+ * delta if the row was updated.
+ */
+static int64_t row_key(const Column *col, size_t pos)
+{
+    const ColumnDelta *delta = col->delta;
+    size_t d = column_delta_find(col, pos);
+
+    if (delta != NULL && d < delta->count && delta->positions[d] == pos) {
+        return delta_key(col, d);
+    }
+    return raw_key(col, pos);
+}
+
+/*
+ * Computes the keys of rows [0, n) of a column of type T, with the
+ * updates in its delta.
+ */
+#define COLUMN_KEYS(T)                                                          \
+    do {                                                                        \
+        const ColumnDelta *delta = col->delta;                                  \
+        for (size_t s = 0; s < column_segment_count(n); s++) {                  \
+            const T *values = col->segments[s];                                 \
+            int64_t *out = keys + (s << SEGMENT_SHIFT);                         \
+            for (size_t i = 0; i < column_segment_length(s, n); i++) {          \
+                out[i] = T##_key(values[i]);                                    \
+            }                                                                   \
+        }                                                                       \
+        for (size_t d = 0; delta != NULL && d < delta->count; d++) {            \
+            keys[delta->positions[d]] = T##_key(((const T *) delta->values)[d]); \
+        }                                                                       \
+    } while (0)
+
+static void column_keys(const Column *col, size_t n, int64_t *keys)
+{
+    switch (col->type) {
+    case LONG:
+        COLUMN_KEYS(long);
+        break;
+    case FLOAT:
+        COLUMN_KEYS(float);
+        break;
+    default:
+        COLUMN_KEYS(int);
+        break;
+    }
+}
+
+/*
+ * Sorts n (key, position) entries by key, stably, so entries that come in
+ * row order leave sorted by (key, position). The passes alternate between
+ * the entries and the scratch arrays; passes above the highest bit in
+ * which two keys differ are skipped. Returns 1 if the sorted entries
+ * ended up in the scratch arrays, else 0.
+ */
+static int radix_sort(int64_t *keys, position_t *positions, int64_t *key_scratch,
+                      position_t *pos_scratch, size_t n)
+{
+    size_t counts[RADIX_SIZE];
+    uint64_t spread = 0;
+    int swapped = 0;
+
+    for (size_t i = 1; i < n; i++) {
+        spread |= (uint64_t) keys[i] ^ (uint64_t) keys[0];
+    }
+    for (unsigned shift = 0; shift < 64 && spread >> shift != 0; shift += RADIX_BITS) {
+        size_t offset = 0;
+        int64_t *key_swap = keys;
+        position_t *pos_swap = positions;
+        memset(counts, 0, sizeof(counts));
+        for (size_t i = 0; i < n; i++) {
+            counts[(((uint64_t) keys[i] ^ SIGN_BIT) >> shift) & (RADIX_SIZE - 1)]++;
+        }
+        for (size_t d = 0; d < RADIX_SIZE; d++) {
+            size_t count = counts[d];
+            counts[d] = offset;
+            offset += count;
+        }
+        for (size_t i = 0; i < n; i++) {
+            size_t at = counts[(((uint64_t) keys[i] ^ SIGN_BIT) >> shift) & (RADIX_SIZE - 1)]++;
+            key_scratch[at] = keys[i];
+            pos_scratch[at] = positions[i];
+        }
+        keys = key_scratch;
+        positions = pos_scratch;
+        key_scratch = key_swap;
+        pos_scratch = pos_swap;
+        swapped = !swapped;
+    }
+    return swapped;
+}
+
+/*
+ * Sorts n entries, leaving them in the entry arrays.
+ */
+static void sort_in_place(int64_t *keys, position_t *positions, int64_t *key_scratch,
+                          position_t *pos_scratch, size_t n)
+{
+    if (radix_sort(keys, positions, key_scratch, pos_scratch, n)) {
+        memcpy(keys, key_scratch, sizeof(int64_t) * n);
+        memcpy(positions, pos_scratch, sizeof(position_t) * n);
+    }
+}
+
+/*
+ * Sorts runs of entries, entries [bounds[r], bounds[r + 1]) for run r, one
+ * morsel per run.
+ */
+typedef struct RunSort {
+    int64_t *keys;
+    position_t *positions;
+    int64_t *key_scratch;
+    position_t *pos_scratch;
+    const size_t *bounds;
+} RunSort;
+
+static void sort_run(void *arg, size_t run, size_t slot)
+{
+    const RunSort *task = arg;
+    size_t first = task->bounds[run];
+    size_t n = task->bounds[run + 1] - first;
+    (void) slot;
+
+    sort_in_place(task->keys + first, task->positions + first, task->key_scratch + first,
+                  task->pos_scratch + first, n);
+}
+
+/*
+ * One round of merge_runs: merges runs 2p and 2p + 1 of the source
+ * entries into the same place of the output arrays, for every pair p.
+ * Each pair is cut into blocks of MERGE_BLOCK output entries, one morsel
+ * each; blocks_per_pair is enough for the longest pair.
+ */
+typedef struct MergeRound {
+    const int64_t *keys;
+    const position_t *positions;
+    int64_t *out_keys;
+    position_t *out_positions;
+    const size_t *bounds;
+    size_t num_runs;
+    size_t blocks_per_pair;
+} MergeRound;
+
+/*
+ * Returns how many of the first k entries of the merge of sorted runs
+ * left and right (of nl and nr keys) come from left, where entries of left
+ * go first among equal keys.
+ */
+static size_t co_rank(const int64_t *left, size_t nl, const int64_t *right, size_t nr, size_t k)
+{
+    size_t lo = k > nr ? k - nr : 0, hi = k < nl ? k : nl;
+    while (lo < hi) {
+        size_t i = lo + (hi - lo) / 2;
+        if (left[i] <= right[k - i - 1]) {
+            lo = i + 1;
+        } else {
+            hi = i;
+        }
+    }
+    return lo;
+}
+
+static void merge_block(void *arg, size_t morsel, size_t slot)
+{
+    const MergeRound *round = arg;
+    size_t pair = morsel / round->blocks_per_pair;
+    size_t first = round->bounds[2 * pair];
+    size_t middle = round->bounds[2 * pair + 1 < round->num_runs ? 2 * pair + 1 : round->num_runs];
+    size_t last = round->bounds[2 * pair + 2 < round->num_runs ? 2 * pair + 2 : round->num_runs];
+    size_t nl = middle - first, nr = last - middle;
+    size_t begin = (morsel % round->blocks_per_pair) * MERGE_BLOCK;
+    size_t end = begin + MERGE_BLOCK < nl + nr ? begin + MERGE_BLOCK : nl + nr;
+    const int64_t *left = round->keys + first, *right = round->keys + middle;
+    size_t i, j;
+    (void) slot;
+
+    if (begin >= end) {
+        return;
+    }
+    i = co_rank(left, nl, right, nr, begin);
+    j = begin - i;
+    for (size_t k = begin; k < end; k++) {
+        size_t from = j == nr || (i < nl && left[i] <= right[j]) ? first + i++ : middle + j++;
+        round->out_keys[first + k] = round->keys[from];
+        round->out_positions[first + k] = round->positions[from];
+    }
+}
+
+/*
+ * Merges sorted runs of entries, run r being entries [bounds[r],
+ * bounds[r + 1]), into one, where every run holds rows that come after
+ * those of the runs before it, so the result is sorted by (key, position).
+ * Pairs of runs are merged in rounds, alternating between the entry and
+ * the scratch arrays, and every round is spread over the thread pool in
+ * blocks of output: a block finds where it starts in both runs by binary
+ * search and merges from there. bounds is overwritten. Returns 1 if the
+ * merged entries ended up in the scratch arrays, else 0.
+ */
+static int merge_runs(int64_t *keys, position_t *positions, int64_t *key_scratch,
+                      position_t *pos_scratch, size_t *bounds, size_t num_runs)
+{
+    MergeRound round;
+    int swapped = 0;
+
+    round.bounds = bounds;
+    while (num_runs > 1) {
+        size_t longest = 1;
+        int64_t *key_swap = keys;
+        position_t *pos_swap = positions;
+        for (size_t r = 0; r < num_runs; r += 2) {
+            size_t last = bounds[r + 2 < num_runs ? r + 2 : num_runs];
+            longest = last - bounds[r] > longest ? last - bounds[r] : longest;
+        }
+        round.keys = keys;
+        round.positions = positions;
+        round.out_keys = key_scratch;
+        round.out_positions = pos_scratch;
+        round.num_runs = num_runs;
+        round.blocks_per_pair = (longest + MERGE_BLOCK - 1) / MERGE_BLOCK;
+        parallel_for((num_runs + 1) / 2 * round.blocks_per_pair, merge_block, &round);
+
+        for (size_t r = 0; r < num_runs; r += 2) {
+            bounds[r / 2] = bounds[r];
+        }
+        bounds[(num_runs + 1) / 2] = bounds[num_runs];
+        num_runs = (num_runs + 1) / 2;
+        keys = key_scratch;
+        positions = pos_scratch;
+        key_scratch = key_swap;
+        pos_scratch = pos_swap;
+        swapped = !swapped;
+    }
+    return swapped;
+}
+
+/*
+ * Sorts n (key, position) entries that come in row order by (key,
+ * position). Large inputs are cut into one run per thread of the pool,
+ * the runs are sorted in parallel and then merged. Returns -1 if out of
+ * memory.
+ */
+static int sort_entries(int64_t **keys, position_t **positions, size_t n)
+{
+    size_t num_runs = n >= PARALLEL_SORT_MIN_ENTRIES ? thread_pool_slots() : 1;
+    int64_t *key_scratch = malloc(sizeof(int64_t) * (n + 1));
+    position_t *pos_scratch = malloc(sizeof(position_t) * (n + 1));
+    size_t *bounds = malloc(sizeof(size_t) * (num_runs + 1));
+    RunSort task = { *keys, *positions, key_scratch, pos_scratch, bounds };
+    int swapped;
+
+    if (key_scratch == NULL || pos_scratch == NULL || bounds == NULL) {
+        free(key_scratch);
+        free(pos_scratch);
+        free(bounds);
+        return -1;
+    }
+    if (num_runs == 1) {
+        swapped = radix_sort(*keys, *positions, key_scratch, pos_scratch, n);
+    } else {
+        for (size_t r = 0; r <= num_runs; r++) {
+            bounds[r] = n * r / num_runs;
+        }
+        parallel_for(num_runs, sort_run, &task);
+        swapped = merge_runs(*keys, *positions, key_scratch, pos_scratch, bounds, num_runs);
+    }
+    if (swapped) {
+        int64_t *key_swap = *keys;
+        position_t *pos_swap = *positions;
+        *keys = key_scratch;
+        *positions = pos_scratch;
+        key_scratch = key_swap;
+        pos_scratch = pos_swap;
+    }
+    free(key_scratch);
+    free(pos_scratch);
+    free(bounds);
+    return 0;
+}
+
+/*
+ * Collects the (key, position) entries of the live rows of a column,
+ * sorted, into new arrays. Returns -1 if out of memory.
+ */
+static int live_entries(const Column *col, int64_t **keys, position_t **positions,
+                        size_t *count)
+{
+    size_t n = column_length(col);
+    const Table *table = col->table;
+    size_t live = 0;
+
+    *keys = malloc(sizeof(int64_t) * (n + 1));
+    *positions = malloc(sizeof(position_t) * (n + 1));
+    if (*keys == NULL || *positions == NULL) {
+        free(*keys);
+        free(*positions);
+        return -1;
+    }
+    column_keys(col, n, *keys);
+    for (size_t i = 0; i < n; i++) {
+        if (table->num_deleted == 0 || !TestBit(table->deleted, i)) {
+            (*keys)[live] = (*keys)[i];
+            (*positions)[live++] = i;
+        }
+    }
+    if (sort_entries(keys, positions, live) == -1) {
+        free(*keys);
+        free(*positions);
+        return -1;
+    }
+    *count = live;
+    return 0;
+}
+
+/*
+ * Computes the keys of the stored values of rows [begin, begin + n) of a
+ * column of type T, ignoring its delta.
+ */
+#define RANGE_KEYS(T)                                                           \
+    do {                                                                        \
+        for (size_t i = 0; i < n; i++) {                                        \
+            keys[i] = T##_key(COLUMN_VALUE(col, T, begin + i));                 \
+        }                                                                       \
+    } while (0)
+
+static void range_keys(const Column *col, size_t begin, size_t n, int64_t *keys)
+{
+    switch (col->type) {
+    case LONG:
+        RANGE_KEYS(long);
+        break;
+    case FLOAT:
+        RANGE_KEYS(float);
+        break;
+    default:
+        RANGE_KEYS(int);
+        break;
+    }
+}
+
+/*
+ * Collects the (key, position) entries of rows [begin, begin + n) of a
+ * column, keyed by their stored values, sorted, into new arrays. Returns
+ * -1 (leaving both arrays NULL) if out of memory.
+ */
+static int range_entries(const Column *col, size_t begin, size_t n, int64_t **keys,
+                         position_t **positions)
+{
+    *keys = malloc(sizeof(int64_t) * (n + 1));
+    *positions = malloc(sizeof(position_t) * (n + 1));
+    if (*keys != NULL && *positions != NULL) {
+        range_keys(col, begin, n, *keys);
+        for (size_t i = 0; i < n; i++) {
+            (*positions)[i] = begin + i;
+        }
+        if (sort_entries(keys, positions, n) == 0) {
+            return 0;
+        }
+    }
+    free(*keys);
+    free(*positions);
+    *keys = NULL;
+    *positions = NULL;
+    return -1;
+}
+
+/*
+ * Extends a run of rows of a column that are in order, rows [0, begin),
+ * over rows [begin, n). Returns where the run ends.
+ */
+static size_t sorted_prefix(const Column *col, size_t begin, size_t n)
+{
+    for (size_t pos = begin > 0 ? begin : 1; pos < n; pos++) {
+        if (raw_key(col, pos) < raw_key(col, pos - 1)) {
+            return pos;
+        }
+    }
+    return n;
+}
+
+/******************************************************************************
+ * -- entries_index --
+ *
+ * Makes the declared index of a column from the sorted (key, position)
+ * entries of its live rows, taking the entry arrays over: a B+tree is bulk
+ * loaded from them bottom up, a sorted copy keeps them.
+ *
+ * Returns NULL if out of memory, the arrays are freed then
+ *
+ ******************************************************************************
+ */
+
+static ColumnIndex *entries_index(const Column *col, int64_t *keys, position_t *positions,
+                                  size_t n)
+{
+    ColumnIndex *index = calloc(1, sizeof(ColumnIndex));
+
+    if (index == NULL) {
+        free(keys);
+        free(positions);
+        return NULL;
+    }
+    if (col->index_type == BTREE_INDEX) {
+        index->kind = INDEX_BTREE;
+        index->btree = btree_build(keys, positions, n);
+        free(keys);
+        free(positions);
+        if (index->btree == NULL) {
+            free(index);
+            return NULL;
+        }
+    } else {
+        index->kind = INDEX_SORTED;
+        index->keys = keys;
+        index->positions = positions;
+        index->num_keys = n;
+    }
+    index->num_rows = column_length(col);
+    pthread_mutex_init(&index->lock, NULL);
+    return index;
+}
+
+/******************************************************************************
+ * -- build_declared --
+ *
+ * Builds the index declared on a column from its rows: for a clustered
+ * sorted column the length of its sorted prefix, else a B+tree or a sorted
+ * copy of the sorted entries of its live rows.
+ *
+ * Returns NULL if out of memory
+ *
+ ******************************************************************************
+ */
+
+static ColumnIndex *build_declared(const Column *col)
+{
+    ColumnIndex *index;
+    int64_t *keys;
+    position_t *positions;
+    size_t live;
+
+    if (col->index_type == SORTED_INDEX && col->clustered) {
+        index = calloc(1, sizeof(ColumnIndex));
+        if (index == NULL) {
+            return NULL;
+        }
+        index->kind = INDEX_CLUSTERED;
+        index->num_rows = column_length(col);
+        index->sorted_rows = sorted_prefix(col, 0, index->num_rows);
+        pthread_mutex_init(&index->lock, NULL);
+        return index;
+    }
+    if (live_entries(col, &keys, &positions, &live) == -1) {
+        return NULL;
+    }
+    return entries_index(col, keys, positions, live);
+}
+
+/******************************************************************************
+ * -- build_cracker --
+ *
+ * Copies the values of a column, with its delta applied, and their
+ * positions into a new, uncracked cracker column.
+ *
+ * Returns NULL if out of memory
+ *
+ ******************************************************************************
+ */
+
+static ColumnIndex *build_cracker(const Column *col)
+{
+    size_t n = column_length(col);
+    size_t width = data_type_size(col->type);
+    ColumnIndex *index = calloc(1, sizeof(ColumnIndex));
+
+    if (index == NULL) {
+        return NULL;
+    }
+    index->kind = INDEX_CRACKER;
+    index->num_rows = n;
+    index->values = malloc(width * n);
+    index->positions = malloc(sizeof(position_t) * n);
+    if (index->values == NULL || index->positions == NULL) {
+        free(index->values);
+        free(index->positions);
+        free(index);
+        return NULL;
+    }
+    // raw segments stay authoritative when a segment is also encoded
+    for (size_t s = 0; s < column_segment_count(n); s++) {
+        memcpy((char *) index->values + (s << SEGMENT_SHIFT) * width, col->segments[s],
+               column_segment_length(s, n) * width);
+    }
+    column_delta_patch(col, 0, n, index->values);
+    for (size_t i = 0; i < n; i++) {
+        index->positions[i] = i;
+    }
+    pthread_mutex_init(&index->lock, NULL);
+    return index;
+}
+
+/*
+ * Returns the index of col, building it first if the column has none: the
+ * index declared on it, else a cracker column if the column is large
+ * enough. Returns NULL if the column has no index.
+ */
+static ColumnIndex *column_index(Column *col)
+{
+    ColumnIndex *index;
+
+    pthread_mutex_lock(&attach_lock);
+    if (col->index == NULL && col->index_type != NO_INDEX) {
+        col->index = build_declared(col);
+        if (col->index == NULL) {
+            log_err("%s:%d: Unable to index column %s\n", __FUNCTION__, __LINE__, col->name);
+        }
+    } else if (CRACKING && col->index == NULL && column_length(col) >= CRACK_MIN_ROWS) {
+        col->index = build_cracker(col);
+        if (col->index == NULL) {
+            log_err("%s:%d: Unable to crack column %s\n", __FUNCTION__, __LINE__, col->name);
+        }
+    }
+    index = col->index;
+    pthread_mutex_unlock(&attach_lock);
+    return index;
+}
+
+/*
+ * Records a crack at index at of the crack list. A crack that cannot be
+ * recorded for lack of memory is only a lost shortcut: the cracker column
+ * stays partitioned correctly and a later query cracks the piece again.
+ */
+static void add_crack(ColumnIndex *index, size_t at, Value value, int inclusive, size_t offset)
+{
+    if (index->num_cracks == index->cracks_capacity) {
+        size_t capacity = index->cracks_capacity > 0 ? index->cracks_capacity * 2 : 64;
+        Crack *grown = realloc(index->cracks, sizeof(Crack) * capacity);
+        if (grown == NULL) {
+            return;
+        }
+        index->cracks = grown;
+        index->cracks_capacity = capacity;
+    }
+    memmove(&index->cracks[at + 1], &index->cracks[at],
+            sizeof(Crack) * (index->num_cracks - at));
+    index->cracks[at].value = value;
+    index->cracks[at].inclusive = inclusive;
+    index->cracks[at].offset = offset;
+    index->num_cracks++;
+}
+
+/*
+ * crack_T: returns the offset in the cracker column before which all
+ * values are < bound (<= bound if inclusive). Unless a crack for the
+ * bound exists already, the piece holding the bound is partitioned
+ * around it, swapping values and positions from both ends inwards.
+ */
+#define BELOW(X, FIELD) (inclusive ? (X) <= bound.FIELD : (X) < bound.FIELD)
+
+#define DEFINE_CRACK(T, FIELD)                                                  \
+    static size_t crack_##T(ColumnIndex *index, Value bound, int inclusive)    \
+    {                                                                           \
+        T *values = index->values;                                              \
+        position_t *positions = index->positions;                               \
+        size_t lo = 0, hi = index->num_cracks;                                  \
+        size_t begin, end;                                                      \
+        while (lo < hi) {                                                       \
+            size_t mid = lo + (hi - lo) / 2;                                    \
+            const Crack *crack = &index->cracks[mid];                           \
+            if (crack->value.FIELD < bound.FIELD ||                             \
+                (crack->value.FIELD == bound.FIELD && crack->inclusive < inclusive)) { \
+                lo = mid + 1;                                                   \
+            } else {                                                            \
+                hi = mid;                                                       \
+            }                                                                   \
+        }                                                                       \
+        if (lo < index->num_cracks && index->cracks[lo].value.FIELD == bound.FIELD && \
+            index->cracks[lo].inclusive == inclusive) {                         \
+            return index->cracks[lo].offset;                                    \
+        }                                                                       \
+        begin = lo > 0 ? index->cracks[lo - 1].offset : 0;                      \
+        end = lo < index->num_cracks ? index->cracks[lo].offset : index->num_rows; \
+        while (begin < end) {                                                   \
+            T value;                                                            \
+            position_t pos;                                                     \
+            while (begin < end && BELOW(values[begin], FIELD)) {                \
+                begin++;                                                        \
+            }                                                                   \
+            while (begin < end && !BELOW(values[end - 1], FIELD)) {             \
+                end--;                                                          \
+            }                                                                   \
+            if (begin == end) {                                                 \
+                break;                                                          \
+            }                                                                   \
+            value = values[begin];                                              \
+            values[begin] = values[end - 1];                                    \
+            values[end - 1] = value;                                            \
+            pos = positions[begin];                                             \
+            positions[begin] = positions[end - 1];                              \
+            positions[end - 1] = pos;                                           \
+        }                                                                       \
+        add_crack(index, lo, bound, inclusive, begin);                          \
+        return begin;                                                           \
+    }
+
+DEFINE_CRACK(int, i)
+DEFINE_CRACK(long, l)
+DEFINE_CRACK(float, f)
+
+/*
+ * Sorts n positions below num_rows, using scratch (room for n positions)
+ * as the second buffer. Returns whichever of the two buffers ends up
+ * holding the sorted positions.
+ */
+static position_t *sort_positions(position_t *positions, size_t n, position_t *scratch,
+                                  size_t num_rows)
+{
+    size_t counts[RADIX_SIZE];
+
+    for (unsigned shift = 0; shift == 0 || (num_rows > 1 && (num_rows - 1) >> shift > 0);
+         shift += RADIX_BITS) {
+        size_t offset = 0;
+        position_t *swap;
+        memset(counts, 0, sizeof(counts));
+        for (size_t i = 0; i < n; i++) {
+            counts[(positions[i] >> shift) & (RADIX_SIZE - 1)]++;
+        }
+        for (size_t d = 0; d < RADIX_SIZE; d++) {
+            size_t count = counts[d];
+            counts[d] = offset;
+            offset += count;
+        }
+        for (size_t i = 0; i < n; i++) {
+            scratch[counts[(positions[i] >> shift) & (RADIX_SIZE - 1)]++] = positions[i];
+        }
+        swap = positions;
+        positions = scratch;
+        scratch = swap;
+    }
+    return positions;
+}
+
+
+/*
+ * Cracks a cracker column at both bounds of a range and copies out the
+ * positions between the two cracks that are not deleted, unsorted, into
+ * a new array. Returns NULL if out of memory.
+ */
+static position_t *crack_range(ColumnIndex *index, const Column *col, Value low, Value high,
+                               size_t *count)
+{
+    const Table *table = col->table;
+    size_t begin, end, n = 0;
+    position_t *positions;
+
+    pthread_mutex_lock(&index->lock);
+    switch (col->type) {
+    case LONG:
+        begin = crack_long(index, low, 0);
+        end = crack_long(index, high, 1);
+        break;
+    case FLOAT:
+        begin = crack_float(index, low, 0);
+        end = crack_float(index, high, 1);
+        break;
+    default:
+        begin = crack_int(index, low, 0);
+        end = crack_int(index, high, 1);
+        break;
+    }
+    // low > high
+    if (end < begin) {
+        end = begin;
+    }
+    positions = malloc(sizeof(position_t) * (end - begin + 1));
+    if (positions == NULL) {
+        pthread_mutex_unlock(&index->lock);
+        return NULL;
+    }
+    if (table->num_deleted == 0) {
+        n = end - begin;
+        memcpy(positions, index->positions + begin, sizeof(position_t) * n);
+    } else {
+        for (size_t i = begin; i < end; i++) {
+            position_t pos = index->positions[i];
+            positions[n] = pos;
+            n += !TestBit(table->deleted, pos);
+        }
+    }
+    pthread_mutex_unlock(&index->lock);
+    *count = n;
+    return positions;
+}
+
+
+/*
+ * Returns the first of rows [0, n) of a column, which are in order, whose
+ * raw key is >= key (> key if after).
+ */
+static size_t key_bound(const Column *col, size_t n, int64_t key, int after)
+{
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int64_t mid_key = raw_key(col, mid);
+        if (mid_key < key || (after && mid_key == key)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * Copies the live positions whose keys lie in [low, high] out of a sorted
+ * copy, in key order, into a new array. Returns NULL if out of memory.
+ */
+static position_t *sorted_range(const ColumnIndex *index, const Column *col, Value low,
+                                Value high, size_t *count)
+{
+    const Table *table = col->table;
+    int64_t low_key = index_key(col->type, low), high_key = index_key(col->type, high);
+    size_t lo = 0, hi = index->num_keys, begin, end, n = 0;
+    position_t *positions;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (index->keys[mid] < low_key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    begin = lo;
+    for (hi = index->num_keys; lo < hi;) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (index->keys[mid] <= high_key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    end = lo;
+    positions = malloc(sizeof(position_t) * (end - begin + 1));
+    if (positions == NULL) {
+        return NULL;
+    }
+    for (size_t i = begin; i < end; i++) {
+        position_t pos = index->positions[i];
+        positions[n] = pos;
+        n += table->num_deleted == 0 || !TestBit(table->deleted, pos);
+    }
+    *count = n;
+    return positions;
+}
+
+/*
+ * Answers a range select on a clustered column: two binary searches over
+ * its sorted prefix give the run of rows whose stored values qualify;
+ * updated rows of the prefix are taken from the delta instead, merged in
+ * row order, and the rows behind the prefix are scanned. The positions
+ * come out ascending, in a new array. Returns NULL if out of memory.
+ */
+static position_t *clustered_range(const ColumnIndex *index, const Column *col, Value low,
+                                   Value high, size_t *count)
+{
+    const Table *table = col->table;
+    const ColumnDelta *delta = col->delta;
+    int64_t low_key = index_key(col->type, low), high_key = index_key(col->type, high);
+    size_t sorted = index->sorted_rows;
+    size_t num_updated = column_delta_find(col, sorted);
+    size_t begin = key_bound(col, sorted, low_key, 0);
+    size_t end = key_bound(col, sorted, high_key, 1);
+    size_t n = 0;
+    position_t *positions;
+
+    // low > high
+    if (end < begin) {
+        end = begin;
+    }
+    positions = malloc(sizeof(position_t) *
+                       (end - begin + num_updated + index->num_rows - sorted + 1));
+    if (positions == NULL) {
+        return NULL;
+    }
+    for (size_t pos = begin, d = 0; pos < end || d < num_updated;) {
+        position_t next;
+        if (d < num_updated && (pos >= end || delta->positions[d] <= pos)) {
+            int64_t key = delta_key(col, d);
+            next = delta->positions[d++];
+            // the stored value is replaced
+            pos += next == pos;
+            if (key < low_key || key > high_key) {
+                continue;
+            }
+        } else {
+            next = pos++;
+        }
+        positions[n] = next;
+        n += table->num_deleted == 0 || !TestBit(table->deleted, next);
+    }
+    for (size_t pos = sorted; pos < index->num_rows; pos++) {
+        int64_t key = row_key(col, pos);
+        positions[n] = pos;
+        n += key >= low_key && key <= high_key &&
+             (table->num_deleted == 0 || !TestBit(table->deleted, pos));
+    }
+    *count = n;
+    return positions;
+}
+
+
+/******************************************************************************
+ * -- index_select --
+ *
+ * Answers a range select through the column's index, building it first if
+ * need be: the B+tree is walked from the low bound to the high one, the
+ * sorted copy binary searched for both bounds, the cracker column is
+ * cracked at both bounds and the live positions between the cracks copied
+ * out. Either way the positions come out in value order and are sorted
+ * back into row order. Clustered sorted columns produce row order
+ * directly.
+ *
+ * Params:
+ *    col [in/out]      The column
+ *    low [in]          Inclusive lower bound, in the column's type
+ *    high [in]         Inclusive upper bound, in the column's type
+ *    count [out]       The number of positions returned
+ *
+ * Returns the qualifying positions in ascending order, to be freed by the
+ * caller, or NULL if the column has no index (or out of memory), in
+ * which case the caller scans the column instead
+ *
+ ******************************************************************************
+ */
+
+position_t *index_select(Column *col,     // IN/OUT
+                         Value low,       // IN
+                         Value high,      // IN
+                         size_t *count)   // OUT
+{
+    ColumnIndex *index = column_index(col);
+    position_t *positions, *scratch, *sorted;
+    size_t n;
+
+    if (index == NULL) {
+        return NULL;
+    }
+    switch (index->kind) {
+    case INDEX_BTREE:
+        positions = btree_range(index->btree, index_key(col->type, low),
+                                index_key(col->type, high), &n);
+        break;
+    case INDEX_SORTED:
+        positions = sorted_range(index, col, low, high, &n);
+        break;
+    case INDEX_CLUSTERED:
+        return clustered_range(index, col, low, high, count);
+    default:
+        positions = crack_range(index, col, low, high, &n);
+        break;
+    }
+    scratch = malloc(sizeof(position_t) * (n + 1));
+    if (positions == NULL || scratch == NULL) {
+        free(positions);
+        free(scratch);
+        return NULL;
+    }
+    sorted = sort_positions(positions, n, scratch, index->num_rows);
+    free(sorted == positions ? scratch : positions);
+    *count = n;
+    return sorted;
+}
+
+
+/******************************************************************************
+ * -- column_create_index --
+ *
+ * Declares an index on a column and builds it from the column's rows. A
+ * clustered index can only be declared on an empty table, and only on one
+ * of its columns: loads order the rows they append by it (see
+ * table_cluster), which rows already checkpointed cannot be.
+ *
+ * Params:
+ *    col [in/out]      The column
+ *    type [in]         The kind of index
+ *    clustered [in]    Whether the table is to be ordered by the column
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ ******************************************************************************
+ */
+
+Status column_create_index(Column *col,         // IN/OUT
+                           IndexType type,      // IN
+                           bool clustered)      // IN
+{
+    Status ret_status;
+    const Table *table = col->table;
+
+    ret_status.code = ERROR;
+    ret_status.error_message = QUERY_INVALID_STR;
+
+    if (col->index_type != NO_INDEX) {
+        log_err("%s:%d: Column %s already has an index\n", __FUNCTION__, __LINE__, col->name);
+        return ret_status;
+    }
+    if (clustered && table->table_length > 0) {
+        log_err("%s:%d: Table %s is not empty, it cannot be clustered\n",
+                __FUNCTION__, __LINE__, table->name);
+        return ret_status;
+    }
+    for (size_t i = 0; clustered && i < table->col_count; i++) {
+        if (table->columns[i].clustered) {
+            log_err("%s:%d: Table %s is already clustered\n", __FUNCTION__, __LINE__,
+                    table->name);
+            return ret_status;
+        }
+    }
+    column_drop_index(col);
+    col->index_type = type;
+    col->clustered = clustered;
+    if (column_index(col) == NULL) {
+        col->index_type = NO_INDEX;
+        col->clustered = false;
+        ret_status.error_message = OUT_OF_MEMORY_STR;
+        return ret_status;
+    }
+
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+    return ret_status;
+}
+
+
+/*
+ * Moves the values of rows [begin, begin + n) of a column of type T into
+ * the order positions gives, using buffer (room for n values) as scratch.
+ */
+#define PERMUTE(T)                                                              \
+    do {                                                                        \
+        const T *values = (const T *) buffer;                                   \
+        column_copy(col, begin, n, buffer, 0);                                  \
+        for (size_t i = 0; i < n; i++) {                                        \
+            ((T *) permuted)[i] = values[positions[i] - begin];                 \
+        }                                                                       \
+        column_copy(col, begin, n, permuted, 1);                                \
+    } while (0)
+
+/******************************************************************************
+ * -- table_cluster --
+ *
+ * Orders rows [begin, end) of a table by its clustered column, if it has
+ * one: sorts their (key, position) entries, stably, and moves the values
+ * of every column by the resulting permutation. The rows must have just
+ * been written, with no tombstones, updates or index entries yet, and
+ * their zone maps and encodings are only computed afterwards.
+ *
+ * Params:
+ *    table [in/out]    The table
+ *    begin [in]        The first row to order
+ *    end [in]          The row after the last one
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ ******************************************************************************
+ */
+
+Status table_cluster(Table *table,     // IN/OUT
+                     size_t begin,     // IN
+                     size_t end)       // IN
+{
+    Status ret_status;
+    const Column *key_column = NULL;
+    size_t n = end - begin;
+    int64_t *keys;
+    position_t *positions;
+    unsigned char *buffer, *permuted;
+
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+
+    for (size_t i = 0; i < table->col_count; i++) {
+        if (table->columns[i].clustered) {
+            key_column = &table->columns[i];
+        }
+    }
+    if (key_column == NULL || n < 2) {
+        return ret_status;
+    }
+
+    buffer = malloc(sizeof(Value) * n);
+    permuted = malloc(sizeof(Value) * n);
+    if (range_entries(key_column, begin, n, &keys, &positions) == -1 ||
+        buffer == NULL || permuted == NULL) {
+        free(keys);
+        free(positions);
+        free(buffer);
+        free(permuted);
+        ret_status.code = ERROR;
+        ret_status.error_message = OUT_OF_MEMORY_STR;
+        return ret_status;
+    }
+
+    for (size_t i = 0; i < table->col_count; i++) {
+        Column *col = &table->columns[i];
+        switch (col->type) {
+        case LONG:
+            PERMUTE(long);
+            break;
+        case FLOAT:
+            PERMUTE(float);
+            break;
+        default:
+            PERMUTE(int);
+            break;
+        }
+    }
+    free(keys);
+    free(positions);
+    free(buffer);
+    free(permuted);
+    return ret_status;
+}
+
+
+/******************************************************************************
+ * -- column_index_append --
+ *
+ * Brings the index of a column up to date after rows [begin, end) were
+ * appended. A B+tree gets an entry per new row, or is bulk loaded again
+ * if the rows outnumber its entries; the sorted prefix of a clustered
+ * column grows over the new rows that continue it; sorted copies and
+ * cracker columns are dropped. Maintenance that runs out of memory drops
+ * the tree, which the next select builds again.
+ *
+ ******************************************************************************
+ */
+
+void column_index_append(Column *col,   // IN/OUT
+                         size_t begin,  // IN
+                         size_t end)    // IN
+{
+    ColumnIndex *index = col->index;
+
+    if (index == NULL) {
+        return;
+    }
+    index->saved = false;
+    if (index->kind == INDEX_CLUSTERED) {
+        if (index->sorted_rows == begin) {
+            index->sorted_rows = sorted_prefix(col, begin, end);
+        }
+        index->num_rows = end;
+        return;
+    }
+    if (index->kind != INDEX_BTREE) {
+        column_drop_index(col);
+        return;
+    }
+    if (end - begin > index->btree->num_entries) {
+        column_drop_index(col);
+        col->index = build_declared(col);
+        return;
+    }
+    for (size_t i = begin; i < end; i++) {
+        if (btree_insert(index->btree, row_key(col, i), i) == -1) {
+            column_drop_index(col);
+            return;
+        }
+    }
+    index->num_rows = end;
+}
+
+
+/*
+ * The entries a load builds the index of a column from: the keys and
+ * positions of the loaded rows, sorted chunk by chunk by the parse threads,
+ * and scratch arrays for merging the chunks.
+ */
+typedef struct LoadEntries {
+    Column *col;
+    int64_t *keys;
+    position_t *positions;
+    int64_t *key_scratch;
+    position_t *pos_scratch;
+} LoadEntries;
+
+struct IndexLoad {
+    size_t begin;
+    size_t n;
+    // run r, the entries of chunk r, is entries [bounds[r], bounds[r + 1])
+    size_t *bounds;
+    size_t num_runs;
+    LoadEntries *columns;
+    size_t num_columns;
+};
+
+/*
+ * Returns the entries a load collected for a column, NULL if it collected
+ * none.
+ */
+static LoadEntries *load_entries(const struct IndexLoad *load, const Column *col)
+{
+    for (size_t i = 0; load != NULL && i < load->num_columns; i++) {
+        if (load->columns[i].col == col) {
+            return &load->columns[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Merges the runs of entries a load sorted for a column and makes the
+ * column's index from them. Returns NULL if out of memory.
+ */
+static ColumnIndex *merged_index(const struct IndexLoad *load, LoadEntries *entries)
+{
+    size_t *bounds = malloc(sizeof(size_t) * (load->num_runs + 1));
+    ColumnIndex *index;
+
+    if (bounds == NULL) {
+        return NULL;
+    }
+    // other columns merge the same runs concurrently
+    memcpy(bounds, load->bounds, sizeof(size_t) * (load->num_runs + 1));
+    if (merge_runs(entries->keys, entries->positions, entries->key_scratch,
+                   entries->pos_scratch, bounds, load->num_runs)) {
+        int64_t *key_swap = entries->keys;
+        position_t *pos_swap = entries->positions;
+        entries->keys = entries->key_scratch;
+        entries->positions = entries->pos_scratch;
+        entries->key_scratch = key_swap;
+        entries->pos_scratch = pos_swap;
+    }
+    free(bounds);
+    free(entries->key_scratch);
+    free(entries->pos_scratch);
+    entries->key_scratch = NULL;
+    entries->pos_scratch = NULL;
+
+    index = entries_index(entries->col, entries->keys, entries->positions, load->n);
+    entries->keys = NULL;
+    entries->positions = NULL;
+    return index;
+}
+
+
+/******************************************************************************
+ * -- index_load_begin --
+ *
+ * Prepares the index builds of a load of rows [begin, end) into a table,
+ * which is parsed in num_runs chunks at once. A load into an empty table
+ * that is not clustered builds the declared indexes of its columns from
+ * the loaded rows alone, so the entries of every chunk can be sorted as
+ * soon as the chunk is parsed (index_load_run), on the thread that parsed
+ * it, while other chunks are still being parsed.
+ *
+ * Params:
+ *    table [in]        The table being loaded
+ *    begin [in]        The first loaded row
+ *    end [in]          The row after the last one
+ *    num_runs [in]     The number of chunks
+ *
+ * Returns the state of the builds, to be passed on to table_index_append,
+ * or NULL if no index is built this way (or out of memory), in which case
+ * table_index_append does all the work
+ *
+ ******************************************************************************
+ */
+
+struct IndexLoad *index_load_begin(Table *table,      // IN
+                                   size_t begin,      // IN
+                                   size_t end,        // IN
+                                   size_t num_runs)   // IN
+{
+    struct IndexLoad *load;
+    size_t n = end - begin;
+
+    if (begin > 0 || n == 0) {
+        return NULL;
+    }
+    for (size_t i = 0; i < table->col_count; i++) {
+        if (table->columns[i].clustered) {
+            return NULL;
+        }
+    }
+    load = calloc(1, sizeof(struct IndexLoad));
+    if (load == NULL) {
+        return NULL;
+    }
+    load->begin = begin;
+    load->n = n;
+    load->num_runs = num_runs;
+    load->bounds = calloc(num_runs + 1, sizeof(size_t));
+    load->columns = calloc(table->col_count, sizeof(LoadEntries));
+    if (load->bounds == NULL || load->columns == NULL) {
+        index_load_free(load);
+        return NULL;
+    }
+    load->bounds[num_runs] = n;
+    for (size_t i = 0; i < table->col_count; i++) {
+        LoadEntries *entries = &load->columns[load->num_columns];
+        if (table->columns[i].index_type == NO_INDEX) {
+            continue;
+        }
+        entries->col = &table->columns[i];
+        entries->keys = malloc(sizeof(int64_t) * (n + 1));
+        entries->positions = malloc(sizeof(position_t) * (n + 1));
+        entries->key_scratch = malloc(sizeof(int64_t) * (n + 1));
+        entries->pos_scratch = malloc(sizeof(position_t) * (n + 1));
+        load->num_columns++;
+        if (entries->keys == NULL || entries->positions == NULL ||
+            entries->key_scratch == NULL || entries->pos_scratch == NULL) {
+            index_load_free(load);
+            return NULL;
+        }
+    }
+    if (load->num_columns == 0) {
+        index_load_free(load);
+        return NULL;
+    }
+    return load;
+}
+
+
+/******************************************************************************
+ * -- index_load_run --
+ *
+ * Sorts the index entries of chunk run of a load, rows [begin, end), once
+ * the chunk is parsed. Chunks run concurrently, each on its own part of
+ * the entry arrays.
+ *
+ ******************************************************************************
+ */
+
+void index_load_run(struct IndexLoad *load, // IN/OUT
+                    size_t run,             // IN
+                    size_t begin,           // IN
+                    size_t end)             // IN
+{
+    size_t first = begin - load->begin;
+    size_t n = end - begin;
+
+    load->bounds[run] = first;
+    for (size_t c = 0; c < load->num_columns; c++) {
+        LoadEntries *entries = &load->columns[c];
+        range_keys(entries->col, begin, n, entries->keys + first);
+        for (size_t i = 0; i < n; i++) {
+            entries->positions[first + i] = begin + i;
+        }
+        sort_in_place(entries->keys + first, entries->positions + first,
+                      entries->key_scratch + first, entries->pos_scratch + first, n);
+    }
+}
+
+
+/*
+ * Brings the index of one column of a table up to date after a load, one
+ * morsel per column.
+ */
+typedef struct IndexAppend {
+    Table *table;
+    size_t begin;
+    size_t end;
+    const struct IndexLoad *load;
+} IndexAppend;
+
+static void append_column(void *arg, size_t i, size_t slot)
+{
+    const IndexAppend *task = arg;
+    Column *col = &task->table->columns[i];
+    LoadEntries *entries = load_entries(task->load, col);
+    (void) slot;
+
+    if (entries != NULL) {
+        column_drop_index(col);
+        col->index = merged_index(task->load, entries);
+    } else {
+        column_index_append(col, task->begin, task->end);
+        if (col->index == NULL && col->index_type != NO_INDEX) {
+            col->index = build_declared(col);
+        }
+    }
+    if (col->index == NULL && col->index_type != NO_INDEX) {
+        log_err("%s:%d: Unable to index column %s\n", __FUNCTION__, __LINE__, col->name);
+    }
+}
+
+/******************************************************************************
+ * -- table_index_append --
+ *
+ * Brings the indexes of a table up to date after a load appended rows
+ * [begin, end), so the table is fully indexed once the load returns. The
+ * columns are handled concurrently, one morsel each, and every sort and
+ * merge inside spreads over the thread pool again. Indexes the load
+ * collected entries for (see index_load_begin) merge them and are bulk
+ * loaded from the result; the others are maintained as after any append
+ * (see column_index_append), and declared indexes that were dropped or
+ * never built are built from the column right away rather than by the
+ * next select.
+ *
+ * Params:
+ *    table [in/out]    The table
+ *    begin [in]        The first loaded row
+ *    end [in]          The row after the last one
+ *    load [in/out]     What index_load_begin returned, freed here
+ *
+ ******************************************************************************
+ */
+
+void table_index_append(Table *table,               // IN/OUT
+                        size_t begin,               // IN
+                        size_t end,                 // IN
+                        struct IndexLoad *load)     // IN/OUT
+{
+    IndexAppend task = { table, begin, end, load };
+
+    parallel_for(table->col_count, append_column, &task);
+    index_load_free(load);
+}
+
+
+/******************************************************************************
+ * -- index_load_free --
+ *
+ * Releases the state of the index builds of a load, for loads that fail.
+ *
+ ******************************************************************************
+ */
+
+void index_load_free(struct IndexLoad *load) // IN/OUT
+{
+    if (load == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < load->num_columns; i++) {
+        free(load->columns[i].keys);
+        free(load->columns[i].positions);
+        free(load->columns[i].key_scratch);
+        free(load->columns[i].pos_scratch);
+    }
+    free(load->columns);
+    free(load->bounds);
+    free(load);
+}
+
+
+/******************************************************************************
+ * -- column_index_update --
+ *
+ * Brings the index of a column up to date before the rows at positions
+ * (ascending, duplicates allowed) are set to value: their B+tree entries
+ * move to the new key. Clustered columns read updated rows from the delta
+ * and keep their index; sorted copies and cracker columns are dropped.
+ *
+ ******************************************************************************
+ */
+
+void column_index_update(Column *col,                   // IN/OUT
+                         const position_t *positions,   // IN
+                         size_t n,                      // IN
+                         Value value)                   // IN
+{
+    ColumnIndex *index = col->index;
+    int64_t key = index_key(col->type, value);
+
+    if (index == NULL || index->kind == INDEX_CLUSTERED) {
+        return;
+    }
+    if (index->kind != INDEX_BTREE) {
+        column_drop_index(col);
+        return;
+    }
+    index->saved = false;
+    for (size_t i = 0; i < n; i++) {
+        int64_t old_key;
+        if (i > 0 && positions[i] == positions[i - 1]) {
+            continue;
+        }
+        old_key = row_key(col, positions[i]);
+        // deleted rows have no entry
+        if (old_key == key || btree_remove(index->btree, old_key, positions[i]) == -1) {
+            continue;
+        }
+        if (btree_insert(index->btree, key, positions[i]) == -1) {
+            column_drop_index(col);
+            return;
+        }
+    }
+}
+
+
+/******************************************************************************
+ * -- column_index_delete --
+ *
+ * Removes the entry of a row that is being deleted from the B+tree of its
+ * column. The other kinds of index leave deleted rows to the tombstones.
+ *
+ ******************************************************************************
+ */
+
+void column_index_delete(Column *col,       // IN/OUT
+                         position_t pos)    // IN
+{
+    ColumnIndex *index = col->index;
+
+    if (index != NULL && index->kind == INDEX_BTREE) {
+        btree_remove(index->btree, row_key(col, pos), pos);
+        index->saved = false;
+    }
+}
+
+
+/******************************************************************************
+ * -- column_index_fold --
+ *
+ * Brings the index of a column up to date after its delta was folded into
+ * its segments. Folded values may break the order of the sorted prefix of
+ * a clustered column, so its index is dropped and the next select
+ * measures the prefix again; the other kinds index the updated values
+ * already.
+ *
+ ******************************************************************************
+ */
+
+void column_index_fold(Column *col) // IN/OUT
+{
+    if (col->index != NULL && col->index->kind == INDEX_CLUSTERED) {
+        column_drop_index(col);
+    }
+}
+
+
+/******************************************************************************
+ * -- column_drop_index --
+ *
+ * Releases the index of a column. The caller must hold the database lock
+ * exclusively, so no select is using the index.
+ *
+ ******************************************************************************
+ */
+
+void column_drop_index(Column *col) // IN/OUT
+{
+    ColumnIndex *index = col->index;
+
+    if (index == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&index->lock);
+    free(index->values);
+    free(index->cracks);
+    btree_free(index->btree);
+    if (index->map != NULL) {
+        munmap(index->map, index->map_bytes);
+    } else {
+        free(index->keys);
+        free(index->positions);
+    }
+    free(index);
+    col->index = NULL;
+}
+
+
+/*
+ * Returns the kind of index declared on a column.
+ */
+static IndexKind declared_kind(const Column *col)
+{
+    if (col->index_type == BTREE_INDEX) {
+        return INDEX_BTREE;
+    }
+    return col->clustered ? INDEX_CLUSTERED : INDEX_SORTED;
+}
+
+/*
+ * Moves the header of an index file on to checkpoint lsn. Returns -1 on
+ * failure.
+ */
+static int relabel_index_file(const char *path, lsn_t lsn)
+{
+    uint64_t file_lsn = lsn;
+    int fd = open(path, O_WRONLY);
+    int failed;
+
+    if (fd < 0) {
+        return -1;
+    }
+    failed = pwrite(fd, &file_lsn, sizeof(file_lsn), offsetof(IndexFileHeader, lsn)) !=
+             sizeof(file_lsn) || fsync(fd) == -1;
+    close(fd);
+    return failed ? -1 : 0;
+}
+
+
+/******************************************************************************
+ * -- column_save_index --
+ *
+ * Writes the declared index of a column to DATA_DIR/<column>.idx, through
+ * a temporary file so a crash never leaves a torn file behind, or removes
+ * the file if the column has no such index. An index the file already
+ * holds only gets the checkpoint in its header updated. The caller must
+ * hold the database write lock.
+ *
+ * Format: an IndexFileHeader, padded to INDEX_HEADER_BYTES, then for a
+ * B+tree its image (see btree_save), for a sorted copy its num_keys keys
+ * followed by their positions.
+ *
+ * Params:
+ *    col [in/out]      The column
+ *    lsn [in]          The checkpoint being written
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ ******************************************************************************
+ */
+
+Status column_save_index(Column *col,   // IN/OUT
+                         lsn_t lsn)     // IN
+{
+    Status ret_status;
+    char path[sizeof(DATA_DIR) + MAX_SIZE_NAME + 8];
+    char tmp_path[sizeof(DATA_DIR) + MAX_SIZE_NAME + 12];
+    ColumnIndex *index = col->index;
+    IndexFileHeader header;
+    FILE *file;
+    int failed;
+
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+
+    sprintf(path, "%s/%s.idx", DATA_DIR, col->name);
+    if (index == NULL || index->kind == INDEX_CRACKER) {
+        unlink(path);
+        return ret_status;
+    }
+    if (index->saved && relabel_index_file(path, lsn) == 0) {
+        return ret_status;
+    }
+    sprintf(tmp_path, "%s.tmp", path);
+
+    file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        log_err("%s:%d: Unable to open %s\n", __FUNCTION__, __LINE__, tmp_path);
+        ret_status.code = ERROR;
+        ret_status.error_message = QUERY_INVALID_STR;
+        return ret_status;
+    }
+    memset(&header, 0, sizeof(header));
+    header.magic = INDEX_MAGIC;
+    header.kind = index->kind;
+    header.lsn = lsn;
+    header.num_rows = index->num_rows;
+    header.count = index->kind == INDEX_SORTED ? index->num_keys : index->sorted_rows;
+
+    // the header goes in last, btree_save fills in its image
+    failed = fseek(file, INDEX_HEADER_BYTES, SEEK_SET) != 0;
+    if (!failed && index->kind == INDEX_BTREE) {
+        failed = btree_save(index->btree, file, &header.btree) == -1;
+    } else if (!failed && index->kind == INDEX_SORTED) {
+        failed = fwrite(index->keys, sizeof(int64_t), index->num_keys, file) != index->num_keys ||
+                 fwrite(index->positions, sizeof(position_t), index->num_keys, file) !=
+                 index->num_keys;
+    }
+    failed = failed || fseek(file, 0, SEEK_SET) != 0 ||
+             fwrite(&header, sizeof(header), 1, file) != 1 ||
+             fflush(file) != 0 || fsync(fileno(file)) == -1;
+    fclose(file);
+
+    if (failed || rename(tmp_path, path) == -1) {
+        log_err("%s:%d: Unable to write %s\n", __FUNCTION__, __LINE__, path);
+        unlink(tmp_path);
+        ret_status.code = ERROR;
+        ret_status.error_message = QUERY_INVALID_STR;
+        return ret_status;
+    }
+    index->saved = true;
+    return ret_status;
+}
+
+
+/*
+ * Makes the index described by the header of an index file of bytes bytes,
+ * open as fd, mapping the file for a B+tree or a sorted copy. Returns
+ * NULL if the file does not hold what the header says, or out of memory.
+ */
+static ColumnIndex *map_index(const IndexFileHeader *header, int fd, size_t bytes)
+{
+    ColumnIndex *index = calloc(1, sizeof(ColumnIndex));
+    size_t payload_bytes = bytes > INDEX_HEADER_BYTES ? bytes - INDEX_HEADER_BYTES : 0;
+    char *payload;
+
+    if (index == NULL) {
+        return NULL;
+    }
+    index->kind = header->kind;
+    index->num_rows = header->num_rows;
+    if (header->kind == INDEX_CLUSTERED) {
+        index->sorted_rows = header->count;
+        if (index->sorted_rows > index->num_rows) {
+            free(index);
+            return NULL;
+        }
+        pthread_mutex_init(&index->lock, NULL);
+        return index;
+    }
+
+    index->map = payload_bytes > 0 ? mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)
+                                   : MAP_FAILED;
+    if (index->map == MAP_FAILED) {
+        free(index);
+        return NULL;
+    }
+    index->map_bytes = bytes;
+    payload = (char *) index->map + INDEX_HEADER_BYTES;
+    if (header->kind == INDEX_BTREE) {
+        index->btree = btree_map(&header->btree, payload, payload_bytes);
+    } else if (header->count <= payload_bytes / (sizeof(int64_t) + sizeof(position_t))) {
+        index->keys = (int64_t *) payload;
+        index->positions = (position_t *) (payload + sizeof(int64_t) * header->count);
+        index->num_keys = header->count;
+    }
+    if (index->btree == NULL && index->keys == NULL) {
+        munmap(index->map, bytes);
+        free(index);
+        return NULL;
+    }
+    pthread_mutex_init(&index->lock, NULL);
+    return index;
+}
+
+
+/******************************************************************************
+ * -- column_load_index --
+ *
+ * Maps the index saved by column_save_index back in, before the log is
+ * replayed. The column length must already be known. Nothing is read
+ * but the header: pages are faulted in as selects touch them. A missing
+ * file, or one saved by another checkpoint, leaves the index to the first
+ * select; so does a damaged one.
+ *
+ * Params:
+ *    col [in/out]      The column
+ *    lsn [in]          The checkpoint the catalog was written by
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ ******************************************************************************
+ */
+
+Status column_load_index(Column *col,   // IN/OUT
+                         lsn_t lsn)     // IN
+{
+    Status ret_status;
+    char path[sizeof(DATA_DIR) + MAX_SIZE_NAME + 8];
+    IndexFileHeader header;
+    struct stat st;
+    int fd;
+
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+
+    if (col->index_type == NO_INDEX) {
+        return ret_status;
+    }
+    sprintf(path, "%s/%s.idx", DATA_DIR, col->name);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return ret_status;
+    }
+    if (fstat(fd, &st) == -1 || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        header.magic != INDEX_MAGIC || header.kind != declared_kind(col) ||
+        header.num_rows != column_length(col)) {
+        log_err("%s:%d: Ignoring damaged %s\n", __FUNCTION__, __LINE__, path);
+    } else if (header.lsn != lsn) {
+        log_info("%s:%d: Ignoring %s, saved by another checkpoint\n", __FUNCTION__, __LINE__,
+                 path);
+    } else if ((col->index = map_index(&header, fd, st.st_size)) == NULL) {
+        log_err("%s:%d: Ignoring damaged %s\n", __FUNCTION__, __LINE__, path);
+    } else {
+        col->index->saved = true;
+    }
+    close(fd);
+    return ret_status;
+}
@@ -0,0 +1,884 @@
+/*
+ * -- kernels.c
+ *
+ *  type specialized inner loops of the query operators (see kernels.h)
+ *
+ *  The loops are written without data dependent branches where that is
+ *  cheap (select writes every candidate position and only advances the
+ *  output cursor for qualifying ones) so the compiler can vectorize them.
+ *
+ *  Select is vectorized by hand on x86: a block of values is compared
+ *  against both bounds at once, the comparison is turned into a bit mask
+ *  (movemask) and the mask indexes a table holding the lane numbers of its
+ *  set bits, so the qualifying positions of the block are written with a
+ *  single store and the cursor advances by the mask's popcount. Bitmap
+ *  output packs the masks into bitvector words instead. AVX2 and SSE4.2
+ *  versions exist; which one runs is decided once, at the first select or
+ *  fetch, from what the CPU supports. Fetch uses AVX2 gathers for blocks
+ *  of positions within one segment. Sum, min, max, add and sub have AVX2
+ *  versions working on 8 values at a time, and the key comparisons of
+ *  B+tree node searches (count_below) 4 or 2 at a time. Everything else
+ *  and the tail of every range runs the scalar loops.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include "bitvector.h"
+#include "column.h"
+#include "kernels.h"
+
+#if defined(__x86_64__)
+#define SIMD_KERNELS 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Kernels taking tombstones walk rows one bitvector word at a time: words
+ * without deletions are handled in bulk, fully deleted words are skipped
+ * and only the rest is looked at bit by bit.
+ */
+static inline size_t word_length(size_t n, size_t begin)
+{
+    return n - begin < BITVECTOR_WORD_BITS ? n - begin : BITVECTOR_WORD_BITS;
+}
+
+/*
+ * Fetch walks the positions in blocks of FETCH_BLOCK and looks at each
+ * block before gathering it: a run of consecutive rows is copied as is, a
+ * block within one segment is gathered with its indexes into the segment
+ * (one vector gather on x86 with AVX2), anything else one value at a time.
+ * The rows of the block FETCH_PREFETCH_DISTANCE positions ahead are
+ * prefetched, unless they lie close together, where the hardware
+ * prefetcher already follows the scan; so after a selective predicate the
+ * cache misses of several blocks overlap instead of stalling in turn.
+ */
+#define FETCH_BLOCK 8
+
+#ifndef FETCH_PREFETCH_DISTANCE
+#define FETCH_PREFETCH_DISTANCE 64
+#endif
+
+// blocks spanning fewer rows are left to the hardware prefetcher
+#define FETCH_DENSE_SPAN 256
+
+typedef enum FetchBlock {
+    FETCH_RUN,
+    FETCH_SEGMENT,
+    FETCH_SCATTERED,
+} FetchBlock;
+
+static inline FetchBlock fetch_block(const position_t *p)
+{
+    position_t run = 0;
+    position_t segment = 0;
+    for (position_t k = 0; k < FETCH_BLOCK; k++) {
+        run |= p[k] ^ (p[0] + k);
+        segment |= (p[k] ^ p[0]) >> SEGMENT_SHIFT;
+    }
+    if (segment != 0) {
+        return FETCH_SCATTERED;
+    }
+    return run == 0 ? FETCH_RUN : FETCH_SEGMENT;
+}
+
+static inline void prefetch_block(void *const *segments, const position_t *p, size_t width)
+{
+    if (p[FETCH_BLOCK - 1] - p[0] < FETCH_DENSE_SPAN) {
+        return;
+    }
+    for (size_t k = 0; k < FETCH_BLOCK; k++) {
+        __builtin_prefetch((const char *) segments[p[k] >> SEGMENT_SHIFT]
+                           + (p[k] & SEGMENT_MASK) * width);
+    }
+}
+
+/*
+ * Body of fetch_*_T: GATHER(values, p, out) gathers the FETCH_BLOCK values
+ * at positions p of the segment whose values start at values.
+ */
+#define FETCH_BLOCKS(T, GATHER)                                                 \
+    size_t i = 0;                                                               \
+    for (; i + FETCH_BLOCK <= n; i += FETCH_BLOCK) {                            \
+        const position_t *p = positions + i;                                    \
+        const T *values = segments[p[0] >> SEGMENT_SHIFT];                      \
+        if (i + FETCH_PREFETCH_DISTANCE + FETCH_BLOCK <= n) {                   \
+            prefetch_block(segments, p + FETCH_PREFETCH_DISTANCE, sizeof(T));   \
+        }                                                                       \
+        switch (fetch_block(p)) {                                               \
+        case FETCH_RUN:                                                         \
+            memcpy(out + i, values + (p[0] & SEGMENT_MASK), FETCH_BLOCK * sizeof(T)); \
+            break;                                                              \
+        case FETCH_SEGMENT:                                                     \
+            GATHER(values, p, out + i);                                         \
+            break;                                                              \
+        default:                                                                \
+            for (size_t k = 0; k < FETCH_BLOCK; k++) {                          \
+                out[i + k] = ((const T *) segments[p[k] >> SEGMENT_SHIFT])[p[k] & SEGMENT_MASK]; \
+            }                                                                   \
+            break;                                                              \
+        }                                                                       \
+    }                                                                           \
+    for (; i < n; i++) {                                                        \
+        position_t pos = positions[i];                                          \
+        out[i] = ((const T *) segments[pos >> SEGMENT_SHIFT])[pos & SEGMENT_MASK]; \
+    }
+
+#define DEFINE_KERNELS(T, NAME, SUM_T)                                          \
+                                                                                \
+static size_t select_scalar_##NAME(const T *values, size_t n, T low, T high,  \
+                                   position_t base, position_t *out)            \
+{                                                                               \
+    size_t count = 0;                                                           \
+    for (size_t i = 0; i < n; i++) {                                            \
+        out[count] = base + (position_t) i;                                     \
+        count += (values[i] >= low) & (values[i] <= high);                      \
+    }                                                                           \
+    return count;                                                               \
+}                                                                               \
+                                                                                \
+static size_t select_branch_scalar_##NAME(const T *values, size_t n, T low,    \
+                                          T high, position_t base,              \
+                                          position_t *out)                      \
+{                                                                               \
+    size_t count = 0;                                                           \
+    for (size_t i = 0; i < n; i++) {                                            \
+        if (values[i] >= low && values[i] <= high) {                            \
+            out[count++] = base + (position_t) i;                               \
+        }                                                                       \
+    }                                                                           \
+    return count;                                                               \
+}                                                                               \
+                                                                                \
+static void bitmap_scalar_##NAME(const T *values, size_t n, T low, T high,     \
+                                 uint64_t *bits)                                \
+{                                                                               \
+    for (size_t begin = 0; begin < n; begin += BITVECTOR_WORD_BITS) {           \
+        size_t length = word_length(n, begin);                                  \
+        uint64_t word = 0;                                                      \
+        for (size_t j = 0; j < length; j++) {                                   \
+            T v = values[begin + j];                                            \
+            word |= (uint64_t) ((v >= low) & (v <= high)) << j;                 \
+        }                                                                       \
+        bits[begin >> BITVECTOR_WORD_SHIFT] = word;                             \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+static inline void gather_scalar_##NAME(const T *values, const position_t *p,  \
+                                        T *out)                                 \
+{                                                                               \
+    for (size_t k = 0; k < FETCH_BLOCK; k++) {                                  \
+        out[k] = values[p[k] & SEGMENT_MASK];                                   \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+static void fetch_scalar_##NAME(void *const *segments,                         \
+                                const position_t *positions, size_t n, T *out)  \
+{                                                                               \
+    FETCH_BLOCKS(T, gather_scalar_##NAME);                                      \
+}                                                                               \
+                                                                                \
+static SUM_T sum_scalar_##NAME(const T *values, size_t n)                      \
+{                                                                               \
+    SUM_T sum = 0;                                                              \
+    for (size_t i = 0; i < n; i++) {                                            \
+        sum += values[i];                                                       \
+    }                                                                           \
+    return sum;                                                                 \
+}                                                                               \
+                                                                                \
+static T min_scalar_##NAME(const T *values, size_t n, T init)                   \
+{                                                                               \
+    T min = init;                                                               \
+    for (size_t i = 0; i < n; i++) {                                            \
+        min = values[i] < min ? values[i] : min;                                \
+    }                                                                           \
+    return min;                                                                 \
+}                                                                               \
+                                                                                \
+static T max_scalar_##NAME(const T *values, size_t n, T init)                   \
+{                                                                               \
+    T max = init;                                                               \
+    for (size_t i = 0; i < n; i++) {                                            \
+        max = values[i] > max ? values[i] : max;                                \
+    }                                                                           \
+    return max;                                                                 \
+}                                                                               \
+                                                                                \
+static void add_scalar_##NAME(const T *a, const T *b, size_t n, SUM_T *out)    \
+{                                                                               \
+    for (size_t i = 0; i < n; i++) {                                            \
+        out[i] = (SUM_T) a[i] + b[i];                                           \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+static void sub_scalar_##NAME(const T *a, const T *b, size_t n, SUM_T *out)    \
+{                                                                               \
+    for (size_t i = 0; i < n; i++) {                                            \
+        out[i] = (SUM_T) a[i] - b[i];                                           \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+size_t live_##NAME(const T *values, const uint64_t *deleted, size_t n, T *out)  \
+{                                                                               \
+    size_t count = 0;                                                           \
+    for (size_t begin = 0; begin < n; begin += BITVECTOR_WORD_BITS) {           \
+        size_t length = word_length(n, begin);                                  \
+        uint64_t word = deleted[begin >> BITVECTOR_WORD_SHIFT];                 \
+        if (word == 0) {                                                        \
+            memmove(out + count, values + begin, length * sizeof(T));           \
+            count += length;                                                    \
+        } else if (~word != 0) {                                                \
+            for (size_t j = 0; j < length; j++) {                               \
+                out[count] = values[begin + j];                                 \
+                count += !((word >> j) & 1);                                    \
+            }                                                                   \
+        }                                                                       \
+    }                                                                           \
+    return count;                                                               \
+}
+
+FOR_EACH_VALUE_TYPE(DEFINE_KERNELS)
+
+
+#ifdef SIMD_KERNELS
+
+typedef enum SimdLevel {
+    SIMD_NONE,
+    SIMD_SSE4,
+    SIMD_AVX2,
+} SimdLevel;
+
+static pthread_once_t simd_once = PTHREAD_ONCE_INIT;
+static SimdLevel simd_level;
+
+/*
+ * compact_lanes[mask] lists the lanes whose bit is set in mask, lowest
+ * first. Masks of 4 lane blocks use the first 4 entries.
+ */
+static uint32_t compact_lanes[256][8];
+
+static void simd_init(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        simd_level = SIMD_AVX2;
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        simd_level = SIMD_SSE4;
+    } else {
+        simd_level = SIMD_NONE;
+    }
+    for (unsigned mask = 0; mask < 256; mask++) {
+        unsigned k = 0;
+        for (unsigned lane = 0; lane < 8; lane++) {
+            if (mask & (1u << lane)) {
+                compact_lanes[mask][k++] = lane;
+            }
+        }
+    }
+}
+
+/*
+ * Writes first + lane for every lane set in a 4 lane mask to out, with one
+ * 4 position store, and returns how many were set.
+ */
+static inline size_t compact4(unsigned mask, position_t first, position_t *out)
+{
+    __m128i lanes = _mm_loadu_si128((const __m128i *) compact_lanes[mask]);
+    _mm_storeu_si128((__m128i *) out, _mm_add_epi32(_mm_set1_epi32(first), lanes));
+    return __builtin_popcount(mask);
+}
+
+__attribute__((target("avx2")))
+static inline size_t compact8(unsigned mask, position_t first, position_t *out)
+{
+    __m256i lanes = _mm256_loadu_si256((const __m256i *) compact_lanes[mask]);
+    _mm256_storeu_si256((__m256i *) out, _mm256_add_epi32(_mm256_set1_epi32(first), lanes));
+    return __builtin_popcount(mask);
+}
+
+/*
+ * match_<isa>_T returns the mask of the values of the block at p that lie
+ * in [lo, hi], bit k for p[k]. Blocks are 8 values wide for 32 bit types
+ * under AVX2, 4 values otherwise (two vectors for 64 bit types under
+ * SSE4.2). Integers are tested as "neither below lo nor above hi", floats
+ * with ordered compares so NaN never matches, like the scalar loops.
+ */
+
+__attribute__((target("avx2")))
+static inline unsigned match_avx2_int(const int *p, __m256i lo, __m256i hi)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i *) p);
+    __m256i outside = _mm256_or_si256(_mm256_cmpgt_epi32(lo, v), _mm256_cmpgt_epi32(v, hi));
+    return ~_mm256_movemask_ps(_mm256_castsi256_ps(outside)) & 0xff;
+}
+
+__attribute__((target("avx2")))
+static inline unsigned match_avx2_long(const long *p, __m256i lo, __m256i hi)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i *) p);
+    __m256i outside = _mm256_or_si256(_mm256_cmpgt_epi64(lo, v), _mm256_cmpgt_epi64(v, hi));
+    return ~_mm256_movemask_pd(_mm256_castsi256_pd(outside)) & 0xf;
+}
+
+__attribute__((target("avx2")))
+static inline unsigned match_avx2_float(const float *p, __m256 lo, __m256 hi)
+{
+    __m256 v = _mm256_loadu_ps(p);
+    return _mm256_movemask_ps(_mm256_and_ps(_mm256_cmp_ps(v, lo, _CMP_GE_OQ),
+                                            _mm256_cmp_ps(v, hi, _CMP_LE_OQ)));
+}
+
+__attribute__((target("avx2")))
+static inline unsigned match_avx2_double(const double *p, __m256d lo, __m256d hi)
+{
+    __m256d v = _mm256_loadu_pd(p);
+    return _mm256_movemask_pd(_mm256_and_pd(_mm256_cmp_pd(v, lo, _CMP_GE_OQ),
+                                            _mm256_cmp_pd(v, hi, _CMP_LE_OQ)));
+}
+
+__attribute__((target("sse4.2")))
+static inline unsigned match_sse4_int(const int *p, __m128i lo, __m128i hi)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    __m128i outside = _mm_or_si128(_mm_cmpgt_epi32(lo, v), _mm_cmpgt_epi32(v, hi));
+    return ~_mm_movemask_ps(_mm_castsi128_ps(outside)) & 0xf;
+}
+
+__attribute__((target("sse4.2")))
+static inline unsigned match_sse4_long(const long *p, __m128i lo, __m128i hi)
+{
+    __m128i v0 = _mm_loadu_si128((const __m128i *) p);
+    __m128i v1 = _mm_loadu_si128((const __m128i *) (p + 2));
+    __m128i out0 = _mm_or_si128(_mm_cmpgt_epi64(lo, v0), _mm_cmpgt_epi64(v0, hi));
+    __m128i out1 = _mm_or_si128(_mm_cmpgt_epi64(lo, v1), _mm_cmpgt_epi64(v1, hi));
+    return ~(_mm_movemask_pd(_mm_castsi128_pd(out0)) |
+             _mm_movemask_pd(_mm_castsi128_pd(out1)) << 2) & 0xf;
+}
+
+__attribute__((target("sse4.2")))
+static inline unsigned match_sse4_float(const float *p, __m128 lo, __m128 hi)
+{
+    __m128 v = _mm_loadu_ps(p);
+    return _mm_movemask_ps(_mm_and_ps(_mm_cmpge_ps(v, lo), _mm_cmple_ps(v, hi)));
+}
+
+__attribute__((target("sse4.2")))
+static inline unsigned match_sse4_double(const double *p, __m128d lo, __m128d hi)
+{
+    __m128d v0 = _mm_loadu_pd(p);
+    __m128d v1 = _mm_loadu_pd(p + 2);
+    return _mm_movemask_pd(_mm_and_pd(_mm_cmpge_pd(v0, lo), _mm_cmple_pd(v0, hi))) |
+           _mm_movemask_pd(_mm_and_pd(_mm_cmpge_pd(v1, lo), _mm_cmple_pd(v1, hi))) << 2;
+}
+
+/*
+ * Vector versions of the select and bitmap kernels for one ISA and type:
+ * VEC and SET1 broadcast the bounds, LANES is the block width of the
+ * match function and COMPACT the matching compact function. select walks
+ * the blocks (with sparse set it skips the store of blocks without a
+ * match, which pays off when matches are rare), bitmap packs 64 / LANES
+ * block masks into each bitvector word. The last values that do not fill
+ * a block, or a word, go through the scalar kernels. Select stores may
+ * write positions past the returned count but never past out + n.
+ */
+#define DEFINE_SIMD_KERNELS(ISA, TARGET, T, NAME, VEC, SET1, LANES, COMPACT)  \
+                                                                                \
+__attribute__((target(TARGET)))                                                 \
+static size_t select_##ISA##_##NAME(const T *values, size_t n, T low, T high,  \
+                                    position_t base, position_t *out, int sparse) \
+{                                                                               \
+    VEC lo = SET1(low);                                                         \
+    VEC hi = SET1(high);                                                        \
+    size_t count = 0, i = 0;                                                    \
+    for (; i + LANES <= n; i += LANES) {                                        \
+        unsigned mask = match_##ISA##_##NAME(values + i, lo, hi);               \
+        if (!sparse || mask != 0) {                                             \
+            count += COMPACT(mask, base + (position_t) i, out + count);         \
+        }                                                                       \
+    }                                                                           \
+    return count + select_scalar_##NAME(values + i, n - i, low, high,          \
+                                        base + (position_t) i, out + count);    \
+}                                                                               \
+                                                                                \
+__attribute__((target(TARGET)))                                                 \
+static void bitmap_##ISA##_##NAME(const T *values, size_t n, T low, T high,    \
+                                  uint64_t *bits)                               \
+{                                                                               \
+    VEC lo = SET1(low);                                                         \
+    VEC hi = SET1(high);                                                        \
+    size_t i = 0;                                                               \
+    for (; i + BITVECTOR_WORD_BITS <= n; i += BITVECTOR_WORD_BITS) {            \
+        uint64_t word = 0;                                                      \
+        for (size_t j = 0; j < BITVECTOR_WORD_BITS; j += LANES) {               \
+            word |= (uint64_t) match_##ISA##_##NAME(values + i + j, lo, hi) << j; \
+        }                                                                       \
+        bits[i >> BITVECTOR_WORD_SHIFT] = word;                                 \
+    }                                                                           \
+    bitmap_scalar_##NAME(values + i, n - i, low, high, bits + (i >> BITVECTOR_WORD_SHIFT)); \
+}
+
+DEFINE_SIMD_KERNELS(avx2, "avx2", int, int, __m256i, _mm256_set1_epi32, 8, compact8)
+DEFINE_SIMD_KERNELS(avx2, "avx2", long, long, __m256i, _mm256_set1_epi64x, 4, compact4)
+DEFINE_SIMD_KERNELS(avx2, "avx2", float, float, __m256, _mm256_set1_ps, 8, compact8)
+DEFINE_SIMD_KERNELS(avx2, "avx2", double, double, __m256d, _mm256_set1_pd, 4, compact4)
+DEFINE_SIMD_KERNELS(sse4, "sse4.2", int, int, __m128i, _mm_set1_epi32, 4, compact4)
+DEFINE_SIMD_KERNELS(sse4, "sse4.2", long, long, __m128i, _mm_set1_epi64x, 4, compact4)
+DEFINE_SIMD_KERNELS(sse4, "sse4.2", float, float, __m128, _mm_set1_ps, 4, compact4)
+DEFINE_SIMD_KERNELS(sse4, "sse4.2", double, double, __m128d, _mm_set1_pd, 4, compact4)
+
+/*
+ * gather_avx2_T gathers a fetch block within one segment: the positions,
+ * masked to indexes into the segment, go to one 8 lane gather for 32 bit
+ * types and two 4 lane gathers for 64 bit types.
+ */
+__attribute__((target("avx2")))
+static inline __m256i segment_indexes(const position_t *p)
+{
+    return _mm256_and_si256(_mm256_loadu_si256((const __m256i *) p),
+                            _mm256_set1_epi32(SEGMENT_MASK));
+}
+
+__attribute__((target("avx2")))
+static inline void gather_avx2_int(const int *values, const position_t *p, int *out)
+{
+    _mm256_storeu_si256((__m256i *) out, _mm256_i32gather_epi32(values, segment_indexes(p), 4));
+}
+
+__attribute__((target("avx2")))
+static inline void gather_avx2_float(const float *values, const position_t *p, float *out)
+{
+    _mm256_storeu_ps(out, _mm256_i32gather_ps(values, segment_indexes(p), 4));
+}
+
+__attribute__((target("avx2")))
+static inline void gather_avx2_long(const long *values, const position_t *p, long *out)
+{
+    __m256i idx = segment_indexes(p);
+    const long long *base = (const long long *) values;
+    _mm256_storeu_si256((__m256i *) out,
+                        _mm256_i32gather_epi64(base, _mm256_castsi256_si128(idx), 8));
+    _mm256_storeu_si256((__m256i *) (out + 4),
+                        _mm256_i32gather_epi64(base, _mm256_extracti128_si256(idx, 1), 8));
+}
+
+__attribute__((target("avx2")))
+static inline void gather_avx2_double(const double *values, const position_t *p, double *out)
+{
+    __m256i idx = segment_indexes(p);
+    _mm256_storeu_pd(out, _mm256_i32gather_pd(values, _mm256_castsi256_si128(idx), 8));
+    _mm256_storeu_pd(out + 4, _mm256_i32gather_pd(values, _mm256_extracti128_si256(idx, 1), 8));
+}
+
+#define DEFINE_SIMD_FETCH(T, NAME, SUM_T)                                       \
+__attribute__((target("avx2")))                                                 \
+static void fetch_avx2_##NAME(void *const *segments,                           \
+                              const position_t *positions, size_t n, T *out)    \
+{                                                                               \
+    FETCH_BLOCKS(T, gather_avx2_##NAME);                                        \
+}
+
+FOR_EACH_VALUE_TYPE(DEFINE_SIMD_FETCH)
+
+#define LOADU_SI256(p) _mm256_loadu_si256((const __m256i *) (p))
+#define STOREU_SI256(p, v) _mm256_storeu_si256((__m256i *) (p), v)
+
+/*
+ * widen_avx2_T loads 8 values and widens them to two vectors of 4 values
+ * of the sum type: ints to 64 bit integers, floats to doubles. Sums and
+ * differences are then computed on the wide vectors, so they cannot
+ * overflow where the scalar kernels do not.
+ */
+__attribute__((target("avx2")))
+static inline void widen_avx2_int(const int *p, __m256i *lo, __m256i *hi)
+{
+    __m256i v = LOADU_SI256(p);
+    *lo = _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v));
+    *hi = _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1));
+}
+
+__attribute__((target("avx2")))
+static inline void widen_avx2_long(const long *p, __m256i *lo, __m256i *hi)
+{
+    *lo = LOADU_SI256(p);
+    *hi = LOADU_SI256(p + 4);
+}
+
+__attribute__((target("avx2")))
+static inline void widen_avx2_float(const float *p, __m256d *lo, __m256d *hi)
+{
+    __m256 v = _mm256_loadu_ps(p);
+    *lo = _mm256_cvtps_pd(_mm256_castps256_ps128(v));
+    *hi = _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1));
+}
+
+__attribute__((target("avx2")))
+static inline void widen_avx2_double(const double *p, __m256d *lo, __m256d *hi)
+{
+    *lo = _mm256_loadu_pd(p);
+    *hi = _mm256_loadu_pd(p + 4);
+}
+
+/*
+ * Sum, add and sub over blocks of 8 values: WIDE is the vector of 4 sum
+ * type values and ZERO, ADD, SUB and STORE its operations. Sums keep two
+ * accumulators, one per half of a block, and add up their lanes at the
+ * end. The values that do not fill a block go through the scalar kernels.
+ */
+#define DEFINE_SIMD_ARITHMETIC(T, NAME, SUM_T, WIDE, ZERO, ADD, SUB, STORE)   \
+                                                                                \
+__attribute__((target("avx2")))                                                 \
+static SUM_T sum_avx2_##NAME(const T *values, size_t n)                        \
+{                                                                               \
+    WIDE acc0 = ZERO(), acc1 = ZERO();                                          \
+    SUM_T lanes[4];                                                             \
+    size_t i = 0;                                                               \
+    for (; i + 8 <= n; i += 8) {                                                \
+        WIDE lo, hi;                                                            \
+        widen_avx2_##NAME(values + i, &lo, &hi);                                \
+        acc0 = ADD(acc0, lo);                                                   \
+        acc1 = ADD(acc1, hi);                                                   \
+    }                                                                           \
+    STORE(lanes, ADD(acc0, acc1));                                              \
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] +                          \
+           sum_scalar_##NAME(values + i, n - i);                                \
+}                                                                               \
+                                                                                \
+__attribute__((target("avx2")))                                                 \
+static void add_avx2_##NAME(const T *a, const T *b, size_t n, SUM_T *out)      \
+{                                                                               \
+    size_t i = 0;                                                               \
+    for (; i + 8 <= n; i += 8) {                                                \
+        WIDE a0, a1, b0, b1;                                                    \
+        widen_avx2_##NAME(a + i, &a0, &a1);                                     \
+        widen_avx2_##NAME(b + i, &b0, &b1);                                     \
+        STORE(out + i, ADD(a0, b0));                                            \
+        STORE(out + i + 4, ADD(a1, b1));                                        \
+    }                                                                           \
+    add_scalar_##NAME(a + i, b + i, n - i, out + i);                            \
+}                                                                               \
+                                                                                \
+__attribute__((target("avx2")))                                                 \
+static void sub_avx2_##NAME(const T *a, const T *b, size_t n, SUM_T *out)      \
+{                                                                               \
+    size_t i = 0;                                                               \
+    for (; i + 8 <= n; i += 8) {                                                \
+        WIDE a0, a1, b0, b1;                                                    \
+        widen_avx2_##NAME(a + i, &a0, &a1);                                     \
+        widen_avx2_##NAME(b + i, &b0, &b1);                                     \
+        STORE(out + i, SUB(a0, b0));                                            \
+        STORE(out + i + 4, SUB(a1, b1));                                        \
+    }                                                                           \
+    sub_scalar_##NAME(a + i, b + i, n - i, out + i);                            \
+}
+
+DEFINE_SIMD_ARITHMETIC(int, int, long, __m256i, _mm256_setzero_si256,
+                       _mm256_add_epi64, _mm256_sub_epi64, STOREU_SI256)
+DEFINE_SIMD_ARITHMETIC(long, long, long, __m256i, _mm256_setzero_si256,
+                       _mm256_add_epi64, _mm256_sub_epi64, STOREU_SI256)
+DEFINE_SIMD_ARITHMETIC(float, float, double, __m256d, _mm256_setzero_pd,
+                       _mm256_add_pd, _mm256_sub_pd, _mm256_storeu_pd)
+DEFINE_SIMD_ARITHMETIC(double, double, double, __m256d, _mm256_setzero_pd,
+                       _mm256_add_pd, _mm256_sub_pd, _mm256_storeu_pd)
+
+// AVX2 has no 64 bit integer min and max, they are a compare and a blend
+__attribute__((target("avx2")))
+static inline __m256i min_epi64(__m256i a, __m256i b)
+{
+    return _mm256_blendv_epi8(a, b, _mm256_cmpgt_epi64(a, b));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i max_epi64(__m256i a, __m256i b)
+{
+    return _mm256_blendv_epi8(b, a, _mm256_cmpgt_epi64(a, b));
+}
+
+/*
+ * Min and max keep one vector of LANES running extremes, seeded with
+ * init, and reduce its lanes at the end. Values are the first operand of
+ * MIN and MAX, so a NaN value leaves the extreme as it was, like in the
+ * scalar loops.
+ */
+#define DEFINE_SIMD_EXTREMES(T, NAME, VEC, LANES, SET1, LOAD, STORE, MIN, MAX)  \
+                                                                                \
+__attribute__((target("avx2")))                                                 \
+static T min_avx2_##NAME(const T *values, size_t n, T init)                     \
+{                                                                               \
+    VEC acc = SET1(init);                                                       \
+    T lanes[LANES];                                                             \
+    size_t i = 0;                                                               \
+    for (; i + LANES <= n; i += LANES) {                                        \
+        acc = MIN(LOAD(values + i), acc);                                       \
+    }                                                                           \
+    STORE(lanes, acc);                                                          \
+    return min_scalar_##NAME(values + i, n - i, min_scalar_##NAME(lanes, LANES, init)); \
+}                                                                               \
+                                                                                \
+__attribute__((target("avx2")))                                                 \
+static T max_avx2_##NAME(const T *values, size_t n, T init)                     \
+{                                                                               \
+    VEC acc = SET1(init);                                                       \
+    T lanes[LANES];                                                             \
+    size_t i = 0;                                                               \
+    for (; i + LANES <= n; i += LANES) {                                        \
+        acc = MAX(LOAD(values + i), acc);                                       \
+    }                                                                           \
+    STORE(lanes, acc);                                                          \
+    return max_scalar_##NAME(values + i, n - i, max_scalar_##NAME(lanes, LANES, init)); \
+}
+
+DEFINE_SIMD_EXTREMES(int, int, __m256i, 8, _mm256_set1_epi32, LOADU_SI256,
+                     STOREU_SI256, _mm256_min_epi32, _mm256_max_epi32)
+DEFINE_SIMD_EXTREMES(long, long, __m256i, 4, _mm256_set1_epi64x, LOADU_SI256,
+                     STOREU_SI256, min_epi64, max_epi64)
+DEFINE_SIMD_EXTREMES(float, float, __m256, 8, _mm256_set1_ps, _mm256_loadu_ps,
+                     _mm256_storeu_ps, _mm256_min_ps, _mm256_max_ps)
+DEFINE_SIMD_EXTREMES(double, double, __m256d, 4, _mm256_set1_pd, _mm256_loadu_pd,
+                     _mm256_storeu_pd, _mm256_min_pd, _mm256_max_pd)
+
+#define DEFINE_DISPATCH(T, NAME, SUM_T)                                         \
+size_t select_##NAME(const T *values, size_t n, T low, T high,                 \
+                     position_t base, position_t *out)                          \
+{                                                                               \
+    pthread_once(&simd_once, simd_init);                                        \
+    switch (simd_level) {                                                       \
+    case SIMD_AVX2:                                                             \
+        return select_avx2_##NAME(values, n, low, high, base, out, 0);          \
+    case SIMD_SSE4:                                                             \
+        return select_sse4_##NAME(values, n, low, high, base, out, 0);          \
+    default:                                                                    \
+        return select_scalar_##NAME(values, n, low, high, base, out);           \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+size_t select_sparse_##NAME(const T *values, size_t n, T low, T high,          \
+                            position_t base, position_t *out)                   \
+{                                                                               \
+    pthread_once(&simd_once, simd_init);                                        \
+    switch (simd_level) {                                                       \
+    case SIMD_AVX2:                                                             \
+        return select_avx2_##NAME(values, n, low, high, base, out, 1);          \
+    case SIMD_SSE4:                                                             \
+        return select_sse4_##NAME(values, n, low, high, base, out, 1);          \
+    default:                                                                    \
+        return select_branch_scalar_##NAME(values, n, low, high, base, out);    \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+void bitmap_##NAME(const T *values, size_t n, T low, T high, uint64_t *bits)    \
+{                                                                               \
+    pthread_once(&simd_once, simd_init);                                        \
+    switch (simd_level) {                                                       \
+    case SIMD_AVX2:                                                             \
+        bitmap_avx2_##NAME(values, n, low, high, bits);                         \
+        break;                                                                  \
+    case SIMD_SSE4:                                                             \
+        bitmap_sse4_##NAME(values, n, low, high, bits);                         \
+        break;                                                                  \
+    default:                                                                    \
+        bitmap_scalar_##NAME(values, n, low, high, bits);                       \
+        break;                                                                  \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+void fetch_##NAME(void *const *segments, const position_t *positions,          \
+                  size_t n, T *out)                                             \
+{                                                                               \
+    pthread_once(&simd_once, simd_init);                                        \
+    if (simd_level == SIMD_AVX2) {                                              \
+        fetch_avx2_##NAME(segments, positions, n, out);                         \
+    } else {                                                                    \
+        fetch_scalar_##NAME(segments, positions, n, out);                       \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+SUM_T sum_##NAME(const T *values, size_t n)                                     \
+{                                                                               \
+    pthread_once(&simd_once, simd_init);                                        \
+    return simd_level == SIMD_AVX2 ? sum_avx2_##NAME(values, n)                 \
+                                   : sum_scalar_##NAME(values, n);              \
+}                                                                               \
+                                                                                \
+T min_##NAME(const T *values, size_t n, T init)                                 \
+{                                                                               \
+    pthread_once(&simd_once, simd_init);                                        \
+    return simd_level == SIMD_AVX2 ? min_avx2_##NAME(values, n, init)           \
+                                   : min_scalar_##NAME(values, n, init);        \
+}                                                                               \
+                                                                                \
+T max_##NAME(const T *values, size_t n, T init)                                 \
+{                                                                               \
+    pthread_once(&simd_once, simd_init);                                        \
+    return simd_level == SIMD_AVX2 ? max_avx2_##NAME(values, n, init)           \
+                                   : max_scalar_##NAME(values, n, init);        \
+}                                                                               \
+                                                                                \
+void add_##NAME(const T *a, const T *b, size_t n, SUM_T *out)                   \
+{                                                                               \
+    pthread_once(&simd_once, simd_init);                                        \
+    if (simd_level == SIMD_AVX2) {                                              \
+        add_avx2_##NAME(a, b, n, out);                                          \
+    } else {                                                                    \
+        add_scalar_##NAME(a, b, n, out);                                        \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+void sub_##NAME(const T *a, const T *b, size_t n, SUM_T *out)                   \
+{                                                                               \
+    pthread_once(&simd_once, simd_init);                                        \
+    if (simd_level == SIMD_AVX2) {                                              \
+        sub_avx2_##NAME(a, b, n, out);                                          \
+    } else {                                                                    \
+        sub_scalar_##NAME(a, b, n, out);                                        \
+    }                                                                           \
+}
+
+#else
+
+#define DEFINE_DISPATCH(T, NAME, SUM_T)                                         \
+size_t select_##NAME(const T *values, size_t n, T low, T high,                 \
+                     position_t base, position_t *out)                          \
+{                                                                               \
+    return select_scalar_##NAME(values, n, low, high, base, out);               \
+}                                                                               \
+                                                                                \
+size_t select_sparse_##NAME(const T *values, size_t n, T low, T high,          \
+                            position_t base, position_t *out)                   \
+{                                                                               \
+    return select_branch_scalar_##NAME(values, n, low, high, base, out);        \
+}                                                                               \
+                                                                                \
+void bitmap_##NAME(const T *values, size_t n, T low, T high, uint64_t *bits)    \
+{                                                                               \
+    bitmap_scalar_##NAME(values, n, low, high, bits);                           \
+}                                                                               \
+                                                                                \
+void fetch_##NAME(void *const *segments, const position_t *positions,          \
+                  size_t n, T *out)                                             \
+{                                                                               \
+    fetch_scalar_##NAME(segments, positions, n, out);                           \
+}                                                                               \
+                                                                                \
+SUM_T sum_##NAME(const T *values, size_t n)                                     \
+{                                                                               \
+    return sum_scalar_##NAME(values, n);                                        \
+}                                                                               \
+                                                                                \
+T min_##NAME(const T *values, size_t n, T init)                                 \
+{                                                                               \
+    return min_scalar_##NAME(values, n, init);                                  \
+}                                                                               \
+                                                                                \
+T max_##NAME(const T *values, size_t n, T init)                                 \
+{                                                                               \
+    return max_scalar_##NAME(values, n, init);                                  \
+}                                                                               \
+                                                                                \
+void add_##NAME(const T *a, const T *b, size_t n, SUM_T *out)                   \
+{                                                                               \
+    add_scalar_##NAME(a, b, n, out);                                            \
+}                                                                               \
+                                                                                \
+void sub_##NAME(const T *a, const T *b, size_t n, SUM_T *out)                   \
+{                                                                               \
+    sub_scalar_##NAME(a, b, n, out);                                            \
+}
+
+#endif
+
+FOR_EACH_VALUE_TYPE(DEFINE_DISPATCH)
+
+size_t select_all(size_t n, position_t base, position_t *out)
+{
+    for (size_t i = 0; i < n; i++) {
+        out[i] = base + (position_t) i;
+    }
+    return n;
+}
+
+size_t select_live(const uint64_t *deleted, size_t n, position_t base, position_t *out)
+{
+    size_t count = 0;
+    for (size_t begin = 0; begin < n; begin += BITVECTOR_WORD_BITS) {
+        size_t length = word_length(n, begin);
+        uint64_t word = deleted[begin >> BITVECTOR_WORD_SHIFT];
+        if (word == 0) {
+            count += select_all(length, base + (position_t) begin, out + count);
+        } else if (~word != 0) {
+            for (size_t j = 0; j < length; j++) {
+                out[count] = base + (position_t) (begin + j);
+                count += !((word >> j) & 1);
+            }
+        }
+    }
+    return count;
+}
+
+size_t drop_deleted(const uint64_t *deleted, position_t *positions, size_t n)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        position_t pos = positions[i];
+        positions[count] = pos;
+        count += !TestBit(deleted, pos);
+    }
+    return count;
+}
+
+/*
+ * count_below compares every key, without branches. On x86 the keys are
+ * compared 4 (AVX2) or 2 (SSE4.2) at a time and the comparison masks
+ * popcounted.
+ */
+static size_t count_below_scalar(const int64_t *keys, size_t n, int64_t key)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        count += keys[i] < key;
+    }
+    return count;
+}
+
+#ifdef SIMD_KERNELS
+
+__attribute__((target("avx2")))
+static size_t count_below_avx2(const int64_t *keys, size_t n, int64_t key)
+{
+    __m256i k = _mm256_set1_epi64x(key);
+    size_t count = 0;
+    for (size_t i = 0; i < n; i += 4) {
+        __m256i below = _mm256_cmpgt_epi64(k, _mm256_loadu_si256((const __m256i *) (keys + i)));
+        count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(below)));
+    }
+    return count;
+}
+
+__attribute__((target("sse4.2")))
+static size_t count_below_sse4(const int64_t *keys, size_t n, int64_t key)
+{
+    __m128i k = _mm_set1_epi64x(key);
+    size_t count = 0;
+    for (size_t i = 0; i < n; i += 2) {
+        __m128i below = _mm_cmpgt_epi64(k, _mm_loadu_si128((const __m128i *) (keys + i)));
+        count += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(below)));
+    }
+    return count;
+}
+
+#endif
+
+size_t count_below(const int64_t *keys, size_t n, int64_t key)
+{
+#ifdef SIMD_KERNELS
+    pthread_once(&simd_once, simd_init);
+    switch (simd_level) {
+    case SIMD_AVX2:
+        return count_below_avx2(keys, n, key);
+    case SIMD_SSE4:
+        return count_below_sse4(keys, n, key);
+    default:
+        break;
+    }
+#endif
+    return count_below_scalar(keys, n, key);
+}
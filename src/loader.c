@@ -0,0 +1,532 @@
+/*
+ * -- loader.c
+ *
+ *  implements the server side bulk loader behind load("file.csv")
+ *
+ *  The CSV is mapped read-only and cut into one chunk per worker thread,
+ *  always at newline boundaries. Loading is two parallel passes over the
+ *  mapping: the first counts the rows of every chunk, which gives each
+ *  chunk its first row position and the table a single capacity
+ *  reservation; the second parses the chunks and writes the values straight
+ *  into the mapped columns at those positions, in the type of each column.
+ *  A chunk that is parsed goes on to sort its index entries, if the load
+ *  builds indexes from the loaded rows alone (see index.h), and the
+ *  indexes of the table are finished before the load returns.
+ */
+
+#define _DEFAULT_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "client_context.h"
+#include "column.h"
+#include "compression.h"
+#include "cs165_api.h"
+#include "index.h"
+#include "utils.h"
+#include "zonemap.h"
+
+// never hand a worker less than this many bytes of the file
+#define LOAD_MIN_CHUNK_BYTES (1 << 20)
+#define LOAD_MAX_THREADS 32
+
+/*
+ * The part of the file a single worker is responsible for.
+ * - begin/end: the bytes of the chunk, end is one past a newline
+ *   (or the end of the file)
+ * - first_row: the table position the chunk's first row is written to
+ * - num_rows: the number of rows in the chunk (filled in by pass one)
+ * - failed: set by pass two if the chunk contains a malformed row or a
+ *   value that does not fit its column
+ * - index_load/run: where pass two sorts the chunk's index entries, the
+ *   chunk being run number run (index_load is NULL if it sorts none)
+ */
+typedef struct LoadChunk {
+    const char *begin;
+    const char *end;
+    Table *table;
+    Column **columns;
+    size_t first_row;
+    size_t num_rows;
+    int failed;
+    struct IndexLoad *index_load;
+    size_t run;
+} LoadChunk;
+
+
+/******************************************************************************
+ * -- parse_long --
+ *
+ * Parses a decimal integer starting at p, without the locale and error
+ * handling overhead of atoi/strtol. Also used for INT columns, which check
+ * the range of the value themselves.
+ *
+ * Params:
+ *    p [in]        first character of the number
+ *    end [in]      end of the buffer
+ *    value [out]   the parsed value
+ *
+ * Returns a pointer to the first character after the number, or p itself
+ * if there are no digits or the number does not fit in a long
+ *
+ ******************************************************************************
+ */
+
+static inline const char *parse_long(const char *p,     // IN
+                                     const char *end,   // IN
+                                     long *value)       // OUT
+{
+    const char *start = p;
+    unsigned long result = 0;
+    unsigned long limit = LONG_MAX;
+    int negative = 0;
+
+    if (p < end && *p == '-') {
+        negative = 1;
+        limit = (unsigned long) LONG_MAX + 1;
+        p++;
+    }
+    const char *digits = p;
+    while (p < end && (unsigned int) (*p - '0') < 10) {
+        unsigned int digit = *p - '0';
+        if (result > (limit - digit) / 10) {
+            return start;
+        }
+        result = result * 10 + digit;
+        p++;
+    }
+    if (p == digits) {
+        return start;
+    }
+    *value = negative ? -(long) (result - 1) - 1 : (long) result;
+    return p;
+}
+
+
+/******************************************************************************
+ * -- parse_float --
+ *
+ * Parses a decimal number with an optional fraction and exponent starting
+ * at p. Unlike strtof this never reads past end, which matters because the
+ * csv mapping is not NUL terminated.
+ *
+ * Params:
+ *    p [in]        first character of the number
+ *    end [in]      end of the buffer
+ *    value [out]   the parsed value
+ *
+ * Returns a pointer to the first character after the number
+ *
+ ******************************************************************************
+ */
+
+static inline const char *parse_float(const char *p,     // IN
+                                      const char *end,   // IN
+                                      float *value)      // OUT
+{
+    const char *start = p;
+    double result = 0;
+    double scale = 1;
+    int negative = 0;
+
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    while (p < end && (unsigned int) (*p - '0') < 10) {
+        result = result * 10 + (*p - '0');
+        p++;
+    }
+    if (p < end && *p == '.') {
+        p++;
+        while (p < end && (unsigned int) (*p - '0') < 10) {
+            result = result * 10 + (*p - '0');
+            scale *= 10;
+            p++;
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E') && p > start) {
+        long exponent;
+        const char *next = parse_long(p + 1 < end && p[1] == '+' ? p + 2 : p + 1, end, &exponent);
+        for (; exponent > 0; exponent--) {
+            result *= 10;
+        }
+        for (; exponent < 0; exponent++) {
+            scale *= 10;
+        }
+        p = next;
+    }
+    result /= scale;
+    *value = (float) (negative ? -result : result);
+    return p;
+}
+
+
+/******************************************************************************
+ * -- next_row --
+ *
+ * Finds the next row of a chunk at or after p. Rows are separated by '\n';
+ * trailing '\r' and ' ' characters are not part of a row and lines left
+ * empty hold no row. Both passes split lines here, so they always agree on
+ * the rows of a chunk.
+ *
+ * Params:
+ *    p [in]          where to start looking
+ *    end [in]        end of the chunk
+ *    row [out]       first character of the row
+ *    row_end [out]   one past the last character of the row
+ *
+ * Returns where to look for the row after this one, or NULL if there are
+ * no more rows before end
+ *
+ ******************************************************************************
+ */
+
+static inline const char *next_row(const char *p,          // IN
+                                   const char *end,        // IN
+                                   const char **row,       // OUT
+                                   const char **row_end)   // OUT
+{
+    while (p < end) {
+        const char *newline = memchr(p, '\n', end - p);
+        const char *line_end = newline == NULL ? end : newline;
+        const char *next = newline == NULL ? end : newline + 1;
+
+        while (line_end > p && (line_end[-1] == '\r' || line_end[-1] == ' ')) {
+            line_end--;
+        }
+        if (line_end > p) {
+            *row = p;
+            *row_end = line_end;
+            return next;
+        }
+        p = next;
+    }
+    return NULL;
+}
+
+
+/******************************************************************************
+ * -- count_rows --
+ *
+ * Pass one: counts the rows in a chunk.
+ *
+ ******************************************************************************
+ */
+
+static void *count_rows(void *arg)
+{
+    LoadChunk *chunk = arg;
+    const char *p = chunk->begin;
+    const char *row, *row_end;
+    size_t rows = 0;
+
+    while ((p = next_row(p, chunk->end, &row, &row_end)) != NULL) {
+        rows++;
+    }
+    chunk->num_rows = rows;
+    return NULL;
+}
+
+
+/******************************************************************************
+ * -- parse_rows --
+ *
+ * Pass two: parses every row in a chunk and stores the values directly in
+ * the columns, starting at chunk->first_row, then sorts the index entries
+ * of the chunk.
+ *
+ ******************************************************************************
+ */
+
+static void *parse_rows(void *arg)
+{
+    LoadChunk *chunk = arg;
+    const char *p = chunk->begin;
+    const char *row, *row_end;
+    size_t col_count = chunk->table->col_count;
+    size_t pos = chunk->first_row;
+    size_t last_row = chunk->first_row + chunk->num_rows;
+
+    while (pos < last_row && (p = next_row(p, chunk->end, &row, &row_end)) != NULL) {
+        for (size_t i = 0; i < col_count; i++) {
+            Column *col = chunk->columns[i];
+            const char *next;
+
+            if (col->type == FLOAT) {
+                float value;
+                next = parse_float(row, row_end, &value);
+                COLUMN_VALUE(col, float, pos) = value;
+            } else {
+                long value;
+                next = parse_long(row, row_end, &value);
+                if (col->type == LONG) {
+                    COLUMN_VALUE(col, long, pos) = value;
+                } else if (value < INT_MIN || value > INT_MAX) {
+                    chunk->failed = 1;
+                    return NULL;
+                } else {
+                    COLUMN_VALUE(col, int, pos) = (int) value;
+                }
+            }
+            if (next == row ||
+                (i + 1 < col_count && (next == row_end || *next != ',')) ||
+                (i + 1 == col_count && next != row_end)) {
+                chunk->failed = 1;
+                return NULL;
+            }
+            row = next + 1;
+        }
+        pos++;
+    }
+    if (chunk->index_load != NULL) {
+        index_load_run(chunk->index_load, chunk->run, chunk->first_row, last_row);
+    }
+    return NULL;
+}
+
+
+/******************************************************************************
+ * -- run_pass --
+ *
+ * Runs one pass over all chunks, the calling thread works on the first chunk.
+ *
+ ******************************************************************************
+ */
+
+static void run_pass(void *(*pass)(void *), LoadChunk *chunks, size_t num_chunks)
+{
+    pthread_t threads[LOAD_MAX_THREADS];
+
+    for (size_t i = 1; i < num_chunks; i++) {
+        if (pthread_create(&threads[i], NULL, pass, &chunks[i]) != 0) {
+            // fall back to doing the work ourselves
+            threads[i] = pthread_self();
+            pass(&chunks[i]);
+        }
+    }
+    pass(&chunks[0]);
+    for (size_t i = 1; i < num_chunks; i++) {
+        if (!pthread_equal(threads[i], pthread_self())) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+}
+
+
+/******************************************************************************
+ * -- resolve_header --
+ *
+ * Maps the header line of the csv (fully qualified column names) to the
+ * columns of the table being loaded.
+ *
+ * Params:
+ *    header [in]       the header line, NUL terminated
+ *    columns [out]     (*columns)[i] is the column of the i-th csv field,
+ *                      allocated here and owned by the caller
+ *
+ * Returns the table being loaded or NULL if the header is invalid
+ *
+ ******************************************************************************
+ */
+
+static Table *resolve_header(char *header,        // IN
+                             Column ***columns)   // OUT
+{
+    Table *table = NULL;
+    size_t fields = 0;
+    char *field;
+
+    *columns = NULL;
+
+    while ((field = strsep(&header, ",")) != NULL) {
+        field = trim_whitespace(field);
+        char *col_name = strrchr(field, '.');
+        if (col_name == NULL) {
+            return NULL;
+        }
+        *col_name++ = '\0';
+        if (table == NULL) {
+            table = lookup_table(field);
+            if (table == NULL) {
+                return NULL;
+            }
+            *columns = malloc(sizeof(Column *) * table->col_count);
+        }
+        if (fields == table->col_count ||
+            ((*columns)[fields] = lookup_column(field, col_name)) == NULL) {
+            return NULL;
+        }
+        fields++;
+    }
+    return table != NULL && fields == table->col_count ? table : NULL;
+}
+
+
+/*****************************************************************************
+ * -- load_file --
+ *
+ * Bulk loads a csv file into the table named by its header line. Full
+ * segments of the loaded columns are compressed once the data is in
+ * (see compression.c).
+ *
+ * params:
+ *    file_name [in]    path of the csv file, as seen by the server
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status load_file(const char *file_name)  // IN
+{
+    Status ret_status;
+    LoadChunk chunks[LOAD_MAX_THREADS];
+    Column **columns;
+    struct stat st;
+    const char *data, *body, *end;
+    char *header;
+    Table *table;
+    struct IndexLoad *index_load;
+    size_t num_chunks, total_rows;
+    long cpus;
+    int fd;
+
+    ret_status.code = ERROR;
+    ret_status.error_message = FILE_NOT_FOUND_STR;
+
+    fd = open(file_name, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) == -1 || st.st_size == 0) {
+        log_err("%s:%d: Unable to open %s\n", __FUNCTION__, __LINE__, file_name);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return ret_status;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        log_err("%s:%d: Unable to map %s\n", __FUNCTION__, __LINE__, file_name);
+        return ret_status;
+    }
+    madvise((void *) data, st.st_size, MADV_SEQUENTIAL);
+    end = data + st.st_size;
+
+    ret_status.error_message = INCORRECT_FILE_FORMAT_STR;
+
+    body = memchr(data, '\n', st.st_size);
+    body = body == NULL ? end : body + 1;
+    header = malloc(body - data + 1);
+    memcpy(header, data, body - data);
+    header[body - data] = '\0';
+    table = resolve_header(trim_newline(header), &columns);
+    free(header);
+    if (table == NULL) {
+        log_err("%s:%d: Bad csv header in %s\n", __FUNCTION__, __LINE__, file_name);
+        free(columns);
+        munmap((void *) data, st.st_size);
+        return ret_status;
+    }
+
+    /*
+     * Split the body into equally sized chunks, moving every boundary
+     * forward to just past the next newline.
+     */
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_chunks = (end - body) / LOAD_MIN_CHUNK_BYTES + 1;
+    if (cpus > 0 && num_chunks > (size_t) cpus) {
+        num_chunks = cpus;
+    }
+    if (num_chunks > LOAD_MAX_THREADS) {
+        num_chunks = LOAD_MAX_THREADS;
+    }
+    for (size_t i = 0; i < num_chunks; i++) {
+        const char *boundary = body + (end - body) * (i + 1) / num_chunks;
+        chunks[i].begin = i == 0 ? body : chunks[i - 1].end;
+        if (boundary < chunks[i].begin) {
+            boundary = chunks[i].begin;
+        }
+        if (boundary < end) {
+            const char *newline = memchr(boundary, '\n', end - boundary);
+            boundary = newline == NULL ? end : newline + 1;
+        }
+        chunks[i].end = i + 1 == num_chunks ? end : boundary;
+        chunks[i].table = table;
+        chunks[i].columns = columns;
+        chunks[i].failed = 0;
+        chunks[i].run = i;
+    }
+
+    run_pass(count_rows, chunks, num_chunks);
+
+    total_rows = 0;
+    for (size_t i = 0; i < num_chunks; i++) {
+        chunks[i].first_row = table->table_length + total_rows;
+        total_rows += chunks[i].num_rows;
+    }
+    if (total_rows > MAX_TABLE_ROWS - table->table_length) {
+        log_err("%s:%d: %s has more rows than fit in %s\n",
+                __FUNCTION__, __LINE__, file_name, table->name);
+        free(columns);
+        munmap((void *) data, st.st_size);
+        return ret_status;
+    }
+
+    ret_status = table_reserve(table, table->table_length + total_rows);
+    if (ret_status.code != OK) {
+        free(columns);
+        munmap((void *) data, st.st_size);
+        return ret_status;
+    }
+
+    index_load = index_load_begin(table, table->table_length, table->table_length + total_rows,
+                                  num_chunks);
+    for (size_t i = 0; i < num_chunks; i++) {
+        chunks[i].index_load = index_load;
+    }
+
+    run_pass(parse_rows, chunks, num_chunks);
+    free(columns);
+    munmap((void *) data, st.st_size);
+
+    for (size_t i = 0; i < num_chunks; i++) {
+        if (chunks[i].failed) {
+            log_err("%s:%d: Malformed row or value out of range in %s\n", __FUNCTION__, __LINE__, file_name);
+            index_load_free(index_load);
+            ret_status.code = ERROR;
+            ret_status.error_message = INCORRECT_FILE_FORMAT_STR;
+            return ret_status;
+        }
+    }
+
+    ret_status = table_cluster(table, table->table_length, table->table_length + total_rows);
+    if (ret_status.code != OK) {
+        index_load_free(index_load);
+        return ret_status;
+    }
+    for (size_t j = 0; j < table->col_count; j++) {
+        ret_status = column_zones_extend(&table->columns[j], table->table_length,
+                                         table->table_length + total_rows);
+        if (ret_status.code != OK) {
+            index_load_free(index_load);
+            return ret_status;
+        }
+    }
+    table->table_length += total_rows;
+    for (size_t j = 0; j < table->col_count; j++) {
+        column_encode(&table->columns[j]);
+    }
+    table_index_append(table, table->table_length - total_rows, table->table_length, index_load);
+    log_info("%s:%d: Loaded %zu rows into %s using %zu threads\n",
+             __FUNCTION__, __LINE__, total_rows, table->name, num_chunks);
+
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+    return ret_status;
+}
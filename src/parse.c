@@ -12,10 +12,14 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <limits.h>
+#include <math.h>
+#include "column.h"
 #include "cs165_api.h"
 #include "parse.h"
 #include "utils.h"
 #include "client_context.h"
+#include "query.h"
 
 /**
  * Takes a pointer to a string.
@@ -32,10 +36,189 @@ char* next_token(char** tokenizer, message_status* status) {
     return token;
 }
 
-DbOperator* parse_select(char *select_arguments) {
+/**
+ * lookup_column_name resolves a fully qualified db.tbl.col name.
+ * Returns NULL if the name is malformed or the column does not exist.
+ **/
+
+Column* lookup_column_name(char* name) {
+    char* col_part = strrchr(name, '.');
+    if (col_part == NULL) {
+        return NULL;
+    }
+    *col_part = '\0';
+    Column* col = lookup_column(name, col_part + 1);
+    *col_part = '.';
+    return col;
+}
+
+/**
+ * parse_range turns the DSL's half open [lower, upper) range, where either
+ * bound may be null, into the inclusive bounds of a SelectOperator in the
+ * given type. Bounds outside the type's domain are clamped; a range that
+ * selects nothing comes back with low > high.
+ * Returns false if a bound is not a number.
+ **/
+
+bool parse_range(char* lower, char* upper, DataType type, Value* low, Value* high) {
+    bool lower_null = strcmp(lower, "null") == 0;
+    bool upper_null = strcmp(upper, "null") == 0;
+    bool empty = false;
+    char* end;
+
+    if (type == FLOAT) {
+        float lo = -INFINITY, hi = INFINITY;
+        if (!lower_null && (lo = strtof(lower, &end), end == lower || *end != '\0')) {
+            return false;
+        }
+        if (!upper_null) {
+            hi = strtof(upper, &end);
+            if (end == upper || *end != '\0') {
+                return false;
+            }
+            hi = nextafterf(hi, -INFINITY);
+        }
+        empty = lo > hi;
+        low->f = lo;
+        high->f = hi;
+    } else {
+        long lo = LONG_MIN, hi = LONG_MAX;
+        if (!lower_null && (lo = strtol(lower, &end, 10), end == lower || *end != '\0')) {
+            return false;
+        }
+        if (!upper_null) {
+            hi = strtol(upper, &end, 10);
+            if (end == upper || *end != '\0') {
+                return false;
+            }
+            empty = hi == LONG_MIN;
+            hi--;
+        }
+        if (type == INT) {
+            empty = empty || lo > INT_MAX || hi < INT_MIN;
+            low->i = lo < INT_MIN ? INT_MIN : (int) lo;
+            high->i = hi > INT_MAX ? INT_MAX : (int) hi;
+        } else {
+            low->l = lo;
+            high->l = hi;
+        }
+        empty = empty || lo > hi;
+    }
+
+    if (empty) {
+        // any bounds with low > high select nothing
+        if (type == FLOAT) {
+            low->f = 1;
+            high->f = 0;
+        } else if (type == INT) {
+            low->i = 1;
+            high->i = 0;
+        } else {
+            low->l = 1;
+            high->l = 0;
+        }
+    }
+    return true;
+}
+
+/**
+ * Returns whether two values of a column of the given type are equal.
+ **/
+
+static bool value_equal(DataType type, Value a, Value b) {
+    switch (type) {
+    case LONG:
+        return a.l == b.l;
+    case FLOAT:
+        return a.f == b.f;
+    default:
+        return a.i == b.i;
+    }
+}
+
+/**
+ * Returns whether two pipelines select the same rows, whatever they fetch.
+ **/
+
+static bool same_rows(const Pipeline* a, const Pipeline* b) {
+    if (a->col != b->col || a->num_filters != b->num_filters ||
+        !value_equal(a->col->type, a->low, b->low) ||
+        !value_equal(a->col->type, a->high, b->high)) {
+        return false;
+    }
+    for (size_t f = 0; f < a->num_filters; f++) {
+        const PipelineFilter* fa = &a->filters[f];
+        const PipelineFilter* fb = &b->filters[f];
+        if (fa->col != fb->col || !value_equal(fa->col->type, fa->low, fb->low) ||
+            !value_equal(fa->col->type, fa->high, fb->high)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Returns whether a select on the values of the deferred fetch values, at
+ * the rows of the deferred select rows, can be added to their pipeline.
+ **/
+
+static bool can_refine(const Pipeline* rows, const Pipeline* values) {
+    return rows != NULL && values != NULL && rows->fetch == NULL && values->fetch != NULL &&
+           rows->num_filters < PIPELINE_MAX_FILTERS && same_rows(rows, values);
+}
+
+/**
+ * Turns a parsed select into a DEFER operator when it can extend the
+ * client's deferred statements: a select on a column starts a pipeline
+ * (unless it is part of a batch), a select on the values a deferred fetch
+ * gathered at the rows of a deferred select adds a filter to its
+ * pipeline. pos_name and vals_name are the handles of the latter, NULL
+ * for a select on a column.
+ **/
+
+static void defer_select(DbOperator* dbo, const char* pos_name, const char* vals_name,
+                         ClientContext* context) {
+    SelectOperator select = dbo->operator_fields.select_operator;
+    Pipeline* pipeline = &dbo->operator_fields.defer_operator.pipeline;
+    if (select.col != NULL) {
+        if (context->batching) {
+            return;
+        }
+        dbo->type = DEFER;
+        pipeline->col = select.col;
+        pipeline->low = select.lower;
+        pipeline->high = select.upper;
+        pipeline->num_filters = 0;
+        pipeline->fetch = NULL;
+        return;
+    }
+    const Pipeline* rows = lookup_pipeline(context, pos_name);
+    const Pipeline* values = lookup_pipeline(context, vals_name);
+    if (!can_refine(rows, values)) {
+        return;
+    }
+    Column* filtered = values->fetch;
+    *pipeline = *rows;
+    pipeline->filters[pipeline->num_filters].col = filtered;
+    pipeline->filters[pipeline->num_filters].low = select.lower;
+    pipeline->filters[pipeline->num_filters].high = select.upper;
+    pipeline->num_filters++;
+    dbo->type = DEFER;
+}
+
+/**
+ * parse_select reads select(db.tbl.col,low,high), or select(pos,vals,low,high)
+ * where pos and vals are the handles of a select and of a fetch at its
+ * positions. The positions of the qualifying values are stored under the
+ * statement's handle. Where it can, the select is deferred (see
+ * defer_select) rather than run.
+ **/
+
+DbOperator* parse_select(char* select_arguments, message* send_message, ClientContext* context) {
     message_status status = OK_DONE;
     char **select_arguments_index = &select_arguments;
     char *col_name;
+    char *values_name = NULL;
     char *lower;
     char *upper;
     if (strncmp(select_arguments, "(", 1) == 0) {
@@ -45,30 +228,252 @@ DbOperator* parse_select(char *select_arguments) {
     col_name = next_token(select_arguments_index, &status);
     lower = next_token(select_arguments_index, &status);
     upper = next_token(select_arguments_index, &status);
+    if (status != INCORRECT_FORMAT && *select_arguments_index != NULL) {
+        values_name = lower;
+        lower = upper;
+        upper = next_token(select_arguments_index, &status);
+    }
 
     log_info("%s:%d: params passed in %s, %s, %s\n", __FUNCTION__,
              __LINE__, col_name, lower, upper);
 
-    if (status == INCORRECT_FORMAT) {
+    if (status == INCORRECT_FORMAT || *select_arguments_index != NULL) {
+        send_message->status = INCORRECT_FORMAT;
         return NULL;
     }
+    upper = trim_parenthesis(upper);
 
-    col_name = trim_quotes(col_name);
-
-    char *saveptr = col_name;
-    char *col_part = strrchr(col_name, '.');
-    col_part[0] = '\0';
-    col_part++;
+    Column *col = NULL;
+    Result *positions = NULL;
+    Result *values = NULL;
+    DataType type;
+    if (values_name == NULL) {
+        col = lookup_column_name(trim_quotes(col_name));
+        if (col == NULL) {
+            send_message->status = OBJECT_NOT_FOUND;
+            return NULL;
+        }
+        type = col->type;
+    } else {
+        const Pipeline *rows = lookup_pipeline(context, col_name);
+        const Pipeline *fetched = lookup_pipeline(context, values_name);
+        if (can_refine(rows, fetched)) {
+            // both stay deferred, defer_select extends their pipeline
+            type = fetched->fetch->type;
+        } else {
+            GeneralizedColumn *pos_handle = lookup_handle(context, col_name);
+            GeneralizedColumn *vals_handle = lookup_handle(context, values_name);
+            if (pos_handle == NULL || vals_handle == NULL) {
+                send_message->status = OBJECT_NOT_FOUND;
+                return NULL;
+            }
+            positions = pos_handle->column_pointer.result;
+            values = vals_handle->column_pointer.result;
+            type = values->data_type;
+            if (!is_position_result(positions)
+                || (type != INT && type != LONG && type != FLOAT)) {
+                send_message->status = INCORRECT_FORMAT;
+                return NULL;
+            }
+        }
+    }
 
     DbOperator *dbo = malloc(sizeof(DbOperator));
     dbo->type = SELECT;
-    Column *col = malloc(sizeof(Column));
-    col = lookup_column(saveptr, col_part);
-
     dbo->operator_fields.select_operator.col = col;
-    dbo->operator_fields.select_operator.lower = atoi(lower);
-    dbo->operator_fields.select_operator.upper = atoi(upper);
+    dbo->operator_fields.select_operator.positions = positions;
+    dbo->operator_fields.select_operator.values = values;
+    if (!parse_range(lower, upper, type,
+                     &dbo->operator_fields.select_operator.lower,
+                     &dbo->operator_fields.select_operator.upper)) {
+        send_message->status = INCORRECT_FORMAT;
+        free(dbo);
+        return NULL;
+    }
+    defer_select(dbo, col_name, values_name, context);
+    return dbo;
+}
+
+/**
+ * parse_fetch reads fetch(db.tbl.col,positions) where positions is the
+ * handle of an earlier select. A fetch at the rows of a deferred select
+ * of the same table is deferred too, as the end of its pipeline.
+ **/
+
+DbOperator* parse_fetch(char* fetch_arguments, message* send_message, ClientContext* context) {
+    message_status status = OK_DONE;
+    char *col_name, *positions;
+
+    fetch_arguments = trim_parenthesis(fetch_arguments);
+    col_name = next_token(&fetch_arguments, &status);
+    positions = next_token(&fetch_arguments, &status);
+    if (status == INCORRECT_FORMAT || fetch_arguments != NULL) {
+        send_message->status = INCORRECT_FORMAT;
+        return NULL;
+    }
+
+    Column *col = lookup_column_name(col_name);
+    const Pipeline *rows = lookup_pipeline(context, positions);
+    if (col != NULL && rows != NULL && rows->fetch == NULL && rows->col->table == col->table) {
+        DbOperator *dbo = malloc(sizeof(DbOperator));
+        dbo->type = DEFER;
+        dbo->operator_fields.defer_operator.pipeline = *rows;
+        dbo->operator_fields.defer_operator.pipeline.fetch = col;
+        return dbo;
+    }
+    GeneralizedColumn *input = lookup_handle(context, positions);
+    if (col == NULL || input == NULL) {
+        send_message->status = OBJECT_NOT_FOUND;
+        return NULL;
+    }
+
+    DbOperator *dbo = malloc(sizeof(DbOperator));
+    dbo->type = FETCH;
+    dbo->operator_fields.fetch_operator.col = col;
+    dbo->operator_fields.fetch_operator.positions = input->column_pointer.result;
+    return dbo;
+}
+
+/**
+ * parse_aggregate reads sum/avg/min/max(x) where x is either a handle or
+ * a db.tbl.col name, or sum/avg/min/max(db.tbl.col,db.tbl.pred,low,high),
+ * which aggregates the rows of col whose pred lies in the range, like a
+ * select on pred followed by a fetch of col would. Aggregates of a
+ * deferred fetch, and the second form, run as a pipeline.
+ **/
+
+DbOperator* parse_aggregate(char* aggregate_arguments, AggregateType type,
+                            message* send_message, ClientContext* context) {
+    message_status status = OK_DONE;
+    char *arguments = trim_parenthesis(aggregate_arguments);
+    char *name = next_token(&arguments, &status);
+    GeneralizedColumn input;
+    Column *predicate = NULL;
+    const Pipeline *deferred = NULL;
+    char *lower = NULL;
+    char *upper = NULL;
+
+    if (arguments != NULL) {
+        char *predicate_name = next_token(&arguments, &status);
+        lower = next_token(&arguments, &status);
+        upper = next_token(&arguments, &status);
+        if (status == INCORRECT_FORMAT || arguments != NULL) {
+            send_message->status = INCORRECT_FORMAT;
+            return NULL;
+        }
+        predicate = lookup_column_name(predicate_name);
+        if (predicate == NULL) {
+            send_message->status = OBJECT_NOT_FOUND;
+            return NULL;
+        }
+    }
 
+    if (predicate == NULL) {
+        deferred = lookup_pipeline(context, name);
+        if (deferred != NULL && deferred->fetch != NULL) {
+            DbOperator *dbo = malloc(sizeof(DbOperator));
+            dbo->type = AGGREGATE;
+            dbo->operator_fields.aggregate_operator.type = type;
+            dbo->operator_fields.aggregate_operator.pipeline = *deferred;
+            return dbo;
+        }
+    }
+
+    GeneralizedColumn *handle = predicate == NULL ? lookup_handle(context, name) : NULL;
+    if (handle != NULL) {
+        input = *handle;
+    } else {
+        input.column_type = COLUMN;
+        input.column_pointer.column = lookup_column_name(name);
+        if (input.column_pointer.column == NULL) {
+            send_message->status = OBJECT_NOT_FOUND;
+            return NULL;
+        }
+        if (predicate != NULL && predicate->table != input.column_pointer.column->table) {
+            send_message->status = INCORRECT_FORMAT;
+            return NULL;
+        }
+    }
+
+    DbOperator *dbo = malloc(sizeof(DbOperator));
+    dbo->type = AGGREGATE;
+    dbo->operator_fields.aggregate_operator.type = type;
+    dbo->operator_fields.aggregate_operator.input = input;
+    dbo->operator_fields.aggregate_operator.pipeline.col = NULL;
+    if (predicate != NULL) {
+        Pipeline *pipeline = &dbo->operator_fields.aggregate_operator.pipeline;
+        pipeline->col = predicate;
+        pipeline->num_filters = 0;
+        pipeline->fetch = input.column_pointer.column;
+        if (!parse_range(lower, upper, predicate->type, &pipeline->low, &pipeline->high)) {
+            send_message->status = INCORRECT_FORMAT;
+            free(dbo);
+            return NULL;
+        }
+    }
+    return dbo;
+}
+
+/**
+ * parse_arithmetic reads add/sub(a,b) where a and b are the handles of
+ * two results of the same length.
+ **/
+
+DbOperator* parse_arithmetic(char* arithmetic_arguments, ArithmeticType type,
+                             message* send_message, ClientContext* context) {
+    message_status status = OK_DONE;
+    char *arguments = trim_parenthesis(arithmetic_arguments);
+    char *left_name = next_token(&arguments, &status);
+    char *right_name = next_token(&arguments, &status);
+    if (status == INCORRECT_FORMAT || arguments != NULL) {
+        send_message->status = INCORRECT_FORMAT;
+        return NULL;
+    }
+
+    GeneralizedColumn *left = lookup_handle(context, left_name);
+    GeneralizedColumn *right = lookup_handle(context, right_name);
+    if (left == NULL || right == NULL) {
+        send_message->status = OBJECT_NOT_FOUND;
+        return NULL;
+    }
+
+    DbOperator *dbo = malloc(sizeof(DbOperator));
+    dbo->type = ARITHMETIC;
+    dbo->operator_fields.arithmetic_operator.type = type;
+    dbo->operator_fields.arithmetic_operator.left = left->column_pointer.result;
+    dbo->operator_fields.arithmetic_operator.right = right->column_pointer.result;
+    return dbo;
+}
+
+/**
+ * parse_print reads print(h1,...,hn) and collects the results bound to
+ * the handles.
+ **/
+
+DbOperator* parse_print(char* print_arguments, message* send_message, ClientContext* context) {
+    char *list = trim_parenthesis(print_arguments);
+    size_t capacity = 1;
+    size_t count = 0;
+    char *name;
+
+    for (char *c = list; *c != '\0'; c++) {
+        capacity += (*c == ',');
+    }
+    Result **results = malloc(sizeof(Result*) * capacity);
+    while ((name = strsep(&list, ",")) != NULL) {
+        GeneralizedColumn *handle = lookup_handle(context, name);
+        if (handle == NULL) {
+            send_message->status = OBJECT_NOT_FOUND;
+            free(results);
+            return NULL;
+        }
+        results[count++] = handle->column_pointer.result;
+    }
+
+    DbOperator *dbo = malloc(sizeof(DbOperator));
+    dbo->type = PRINT;
+    dbo->operator_fields.print_operator.results = results;
+    dbo->operator_fields.print_operator.num_results = count;
     return dbo;
 }
 
@@ -77,6 +482,9 @@ DbOperator* parse_create_col(char* create_arguments) {
     char** create_arguments_index = &create_arguments;
     char* col_name = next_token(create_arguments_index, &status);
     char* table_name = next_token(create_arguments_index, &status);
+    // the value type is optional and defaults to int
+    char* type_name = *create_arguments_index == NULL ? NULL : next_token(create_arguments_index, &status);
+    DataType type = INT;
 
     // not enough arguments
     if (status == INCORRECT_FORMAT) {
@@ -85,21 +493,65 @@ DbOperator* parse_create_col(char* create_arguments) {
     // Get the col name free of quotation marks
     table_name = trim_quotes(table_name);
     col_name = trim_quotes(col_name);
-    // read and chop off last char, which should be a ')'
-    int last_char = strlen(table_name) - 1;
-    if (table_name[last_char] != ')') {
+    // read and chop off last char of the last argument, which should be a ')'
+    char* last_argument = type_name == NULL ? table_name : type_name;
+    int last_char = strlen(last_argument) - 1;
+    if (last_char < 0 || last_argument[last_char] != ')') {
         return NULL;
     }
     // replace the ')' with a null terminating character. 
-    table_name[last_char] = '\0';
+    last_argument[last_char] = '\0';
+    if (type_name != NULL && data_type_from_name(type_name, &type) != 0) {
+        return NULL;
+    }
 
     // make create dbo for table
     DbOperator* dbo = malloc(sizeof(DbOperator));
     dbo->type = CREATE;
     dbo->operator_fields.create_operator.create_type = _COLUMN;
     strcpy(dbo->operator_fields.create_operator.name, col_name);
-    dbo->operator_fields.create_operator.table = malloc(sizeof(Table));
     dbo->operator_fields.create_operator.table = lookup_table(table_name); 
+    dbo->operator_fields.create_operator.data_type = type;
+    return dbo;
+}
+
+/**
+ * parse_create_idx parses create(idx,<db.tbl.col>,<sorted|btree>,<clustered|unclustered>).
+ **/
+
+DbOperator* parse_create_idx(char* create_arguments) {
+    message_status status = OK_DONE;
+    char** create_arguments_index = &create_arguments;
+    char* col_name = next_token(create_arguments_index, &status);
+    char* index_type = next_token(create_arguments_index, &status);
+    char* organization = next_token(create_arguments_index, &status);
+
+    // not enough arguments
+    if (status == INCORRECT_FORMAT) {
+        return NULL;
+    }
+    // read and chop off last char, which should be a ')'
+    int last_char = strlen(organization) - 1;
+    if (last_char < 0 || organization[last_char] != ')') {
+        return NULL;
+    }
+    organization[last_char] = '\0';
+    if ((strcmp(index_type, "btree") != 0 && strcmp(index_type, "sorted") != 0) ||
+        (strcmp(organization, "clustered") != 0 && strcmp(organization, "unclustered") != 0)) {
+        return NULL;
+    }
+    Column* col = lookup_column_name(trim_quotes(col_name));
+    if (col == NULL) {
+        return NULL;
+    }
+
+    DbOperator* dbo = malloc(sizeof(DbOperator));
+    dbo->type = CREATE;
+    dbo->operator_fields.create_operator.create_type = _INDEX;
+    dbo->operator_fields.create_operator.column = col;
+    dbo->operator_fields.create_operator.index_type =
+        strcmp(index_type, "btree") == 0 ? BTREE_INDEX : SORTED_INDEX;
+    dbo->operator_fields.create_operator.clustered = strcmp(organization, "clustered") == 0;
     return dbo;
 }
 
@@ -190,7 +642,7 @@ DbOperator* parse_create_db(char* create_arguments) {
  * parse_create parses a create statement and then passes the necessary arguments off to the next function
  **/
 DbOperator* parse_create(char* create_arguments) {
-    message_status mes_status;
+    message_status mes_status = OK_DONE;
     DbOperator* dbo = NULL;
     char *tokenizer_copy, *to_free;
     // Since strsep destroys input, we create a copy of our input. 
@@ -212,6 +664,8 @@ DbOperator* parse_create(char* create_arguments) {
                 dbo = parse_create_tbl(tokenizer_copy);
             } else if (strcmp(token, "col") == 0) {
                 dbo = parse_create_col(tokenizer_copy);
+            } else if (strcmp(token, "idx") == 0) {
+                dbo = parse_create_idx(tokenizer_copy);
             } else {
                 mes_status = UNKNOWN_COMMAND;
             }
@@ -224,13 +678,65 @@ DbOperator* parse_create(char* create_arguments) {
 }
 
 /**
- * parse_insert reads in the arguments for a create statement and 
- * then passes these arguments to a database function to insert a row.
+ * parse_value reads a single value of the given type from the start of
+ * text and points *end just past it (at text if there is no number).
+ **/
+
+static void parse_value(char* text, DataType type, Value* value, char** end) {
+    if (type == FLOAT) {
+        value->f = strtof(text, end);
+    } else if (type == LONG) {
+        value->l = strtol(text, end, 10);
+    } else {
+        value->i = (int) strtol(text, end, 10);
+    }
+}
+
+/**
+ * parse_values turns a comma separated list of values, optionally closed
+ * by a ')', into a freshly allocated array. Values are rows of table,
+ * back to back, so the k-th value is parsed in the type of column
+ * k % col_count. The array is sized once by counting commas, so long
+ * lists cost a single allocation.
+ * Returns NULL if the list is malformed.
  **/
 
-DbOperator* parse_insert(char* query_command, message* send_message) {
-    unsigned int columns_inserted = 0;
-    char* token = NULL;
+Value* parse_values(char* list, const Table* table, size_t* num_values) {
+    size_t capacity = 1;
+    size_t count = 0;
+    char* p = list;
+    for (char* c = list; *c != '\0'; c++) {
+        capacity += (*c == ',');
+    }
+    Value* values = malloc(sizeof(Value) * capacity);
+    while (*p != '\0' && *p != ')') {
+        char* end;
+        DataType type = table->columns[count % table->col_count].type;
+        if (count == capacity) {
+            free(values);
+            return NULL;
+        }
+        parse_value(p, type, &values[count], &end);
+        if (end == p || (*end != ',' && *end != ')' && *end != '\0')) {
+            free(values);
+            return NULL;
+        }
+        count++;
+        p = (*end == ',') ? end + 1 : end;
+    }
+    *num_values = count;
+    return values;
+}
+
+/**
+ * parse_insert reads in the arguments for an insert statement and 
+ * then passes these arguments to a database function to insert rows.
+ * relational_insert(tbl,v1,...,vn) carries exactly one row,
+ * relational_insert_batch(tbl,v1,...,vk*n) carries k rows back to back.
+ **/
+
+DbOperator* parse_insert(char* query_command, message* send_message, bool batch) {
+    size_t num_values = 0;
     // check for leading '('
     if (strncmp(query_command, "(", 1) == 0) {
         query_command++;
@@ -242,27 +748,25 @@ DbOperator* parse_insert(char* query_command, message* send_message) {
         }
         // lookup the table and make sure it exists. 
         Table* insert_table = lookup_table(table_name);
-        if (insert_table == NULL) {
+        if (insert_table == NULL || insert_table->col_count == 0) {
             send_message->status = OBJECT_NOT_FOUND;
             return NULL;
         }
+        Value* values = query_command == NULL ? NULL : parse_values(query_command, insert_table, &num_values);
+        // check that we received whole rows of input values
+        if (values == NULL || num_values == 0 ||
+            num_values % insert_table->col_count != 0 ||
+            (!batch && num_values != insert_table->col_count)) {
+            send_message->status = INCORRECT_FORMAT;
+            free(values);
+            return NULL;
+        }
         // make insert operator. 
         DbOperator* dbo = malloc(sizeof(DbOperator));
         dbo->type = INSERT;
         dbo->operator_fields.insert_operator.table = insert_table;
-        dbo->operator_fields.insert_operator.values = malloc(sizeof(int) * insert_table->col_count);
-        // parse inputs until we reach the end. Turn each given string into an integer. 
-        while ((token = strsep(command_index, ",")) != NULL) {
-            int insert_val = atoi(token);
-            dbo->operator_fields.insert_operator.values[columns_inserted] = insert_val;
-            columns_inserted++;
-        }
-        // check that we received the correct number of input values
-        if (columns_inserted != insert_table->col_count) {
-            send_message->status = INCORRECT_FORMAT;
-            free (dbo);
-            return NULL;
-        } 
+        dbo->operator_fields.insert_operator.values = values;
+        dbo->operator_fields.insert_operator.num_rows = num_values / insert_table->col_count;
         return dbo;
     } else {
         send_message->status = UNKNOWN_COMMAND;
@@ -270,6 +774,144 @@ DbOperator* parse_insert(char* query_command, message* send_message) {
     }
 }
 
+/**
+ * parse_delete reads relational_delete(db.tbl,positions) where positions
+ * is the handle of an earlier select on the table.
+ **/
+
+DbOperator* parse_delete(char* delete_arguments, message* send_message, ClientContext* context) {
+    message_status status = OK_DONE;
+    char *table_name, *positions;
+
+    delete_arguments = trim_parenthesis(delete_arguments);
+    table_name = next_token(&delete_arguments, &status);
+    positions = next_token(&delete_arguments, &status);
+    if (status == INCORRECT_FORMAT || delete_arguments != NULL) {
+        send_message->status = INCORRECT_FORMAT;
+        return NULL;
+    }
+
+    Table *table = lookup_table(table_name);
+    GeneralizedColumn *input = lookup_handle(context, positions);
+    if (table == NULL || input == NULL) {
+        send_message->status = OBJECT_NOT_FOUND;
+        return NULL;
+    }
+    if (input->column_type != RESULT || !is_position_result(input->column_pointer.result)) {
+        send_message->status = INCORRECT_FORMAT;
+        return NULL;
+    }
+
+    DbOperator *dbo = malloc(sizeof(DbOperator));
+    dbo->type = DELETE;
+    dbo->operator_fields.delete_operator.table = table;
+    dbo->operator_fields.delete_operator.positions = input->column_pointer.result;
+    return dbo;
+}
+
+/**
+ * parse_update reads relational_update(db.tbl.col,positions,value) where
+ * positions is the handle of an earlier select on the column's table and
+ * value is in the column's type.
+ **/
+
+DbOperator* parse_update(char* update_arguments, message* send_message, ClientContext* context) {
+    message_status status = OK_DONE;
+    char *column_name, *positions, *value_text, *end;
+    Value value;
+
+    update_arguments = trim_parenthesis(update_arguments);
+    column_name = next_token(&update_arguments, &status);
+    positions = next_token(&update_arguments, &status);
+    value_text = next_token(&update_arguments, &status);
+    if (status == INCORRECT_FORMAT || update_arguments != NULL) {
+        send_message->status = INCORRECT_FORMAT;
+        return NULL;
+    }
+
+    Column *col = lookup_column_name(column_name);
+    GeneralizedColumn *input = lookup_handle(context, positions);
+    if (col == NULL || input == NULL) {
+        send_message->status = OBJECT_NOT_FOUND;
+        return NULL;
+    }
+    parse_value(value_text, col->type, &value, &end);
+    if (input->column_type != RESULT || !is_position_result(input->column_pointer.result) ||
+        end == value_text || *end != '\0') {
+        send_message->status = INCORRECT_FORMAT;
+        return NULL;
+    }
+
+    DbOperator *dbo = malloc(sizeof(DbOperator));
+    dbo->type = UPDATE;
+    dbo->operator_fields.update_operator.col = col;
+    dbo->operator_fields.update_operator.positions = input->column_pointer.result;
+    dbo->operator_fields.update_operator.value = value;
+    return dbo;
+}
+
+/**
+ * parse_load reads the file name out of a load("path") statement.
+ * The file itself is read by the server (see loader.c).
+ **/
+
+DbOperator* parse_load(char* query_command, message* send_message) {
+    char* file_name = trim_quotes(trim_parenthesis(query_command));
+    if (strlen(file_name) == 0) {
+        send_message->status = INCORRECT_FORMAT;
+        return NULL;
+    }
+    DbOperator* dbo = malloc(sizeof(DbOperator));
+    dbo->type = LOAD;
+    dbo->operator_fields.load_operator.file_name = malloc(strlen(file_name) + 1);
+    strcpy(dbo->operator_fields.load_operator.file_name, file_name);
+    return dbo;
+}
+
+/**
+ * parse_batch_execute reads batch_execute(), which runs the selects
+ * collected since batch_queries(). The operator takes the queued selects
+ * over from the client context.
+ **/
+
+DbOperator* parse_batch_execute(char* batch_arguments, message* send_message, ClientContext* context) {
+    if (strcmp(batch_arguments, "()") != 0 || !context->batching) {
+        send_message->status = INCORRECT_FORMAT;
+        return NULL;
+    }
+
+    DbOperator *dbo = malloc(sizeof(DbOperator));
+    dbo->type = BATCH;
+    dbo->operator_fields.batch_operator.selects = context->batch;
+    dbo->operator_fields.batch_operator.num_selects = context->batch_count;
+    context->batching = false;
+    context->batch = NULL;
+    context->batch_count = 0;
+    context->batch_slots = 0;
+    return dbo;
+}
+
+/**
+ * db_operator_free releases a DbOperator together with the buffers the
+ * parse functions allocated for it.
+ **/
+
+void db_operator_free(DbOperator* query) {
+    if (query == NULL) {
+        return;
+    }
+    if (query->type == INSERT) {
+        free(query->operator_fields.insert_operator.values);
+    } else if (query->type == LOAD) {
+        free(query->operator_fields.load_operator.file_name);
+    } else if (query->type == PRINT) {
+        free(query->operator_fields.print_operator.results);
+    } else if (query->type == BATCH) {
+        free(query->operator_fields.batch_operator.selects);
+    }
+    free(query);
+}
+
 /**
  * parse_command takes as input the send_message from the client and then
  * parses it into the appropriate query. Stores into send_message the
@@ -320,18 +962,85 @@ DbOperator* parse_command(char* query_command, message* send_message, int client
         else{
             send_message->status = OK_DONE;
         }
+    } else if (strncmp(query_command, "relational_insert_batch", 23) == 0) {
+        query_command += 23;
+        dbo = parse_insert(query_command, send_message, true);
     } else if (strncmp(query_command, "relational_insert", 17) == 0) {
         query_command += 17;
-        dbo = parse_insert(query_command, send_message);
+        dbo = parse_insert(query_command, send_message, false);
+    } else if (strncmp(query_command, "relational_delete", 17) == 0) {
+        query_command += 17;
+        dbo = parse_delete(query_command, send_message, context);
+    } else if (strncmp(query_command, "relational_update", 17) == 0) {
+        query_command += 17;
+        dbo = parse_update(query_command, send_message, context);
+    } else if (strncmp(query_command, "batch_queries", 13) == 0) {
+        // the selects that follow are queued until batch_execute()
+        if (strcmp(query_command + 13, "()") != 0 || context->batching) {
+            send_message->status = INCORRECT_FORMAT;
+        } else {
+            context->batching = true;
+            send_message->status = OK_DONE;
+        }
+    } else if (strncmp(query_command, "batch_execute", 13) == 0) {
+        query_command += 13;
+        dbo = parse_batch_execute(query_command, send_message, context);
     } else if (strncmp(query_command, "select", 6) == 0) {
-        printf("select!!\n");
         query_command += 6;
-        dbo = parse_select(query_command);
-    } 
+        dbo = parse_select(query_command, send_message, context);
+    } else if (strncmp(query_command, "fetch", 5) == 0) {
+        query_command += 5;
+        dbo = parse_fetch(query_command, send_message, context);
+    } else if (strncmp(query_command, "sum", 3) == 0) {
+        dbo = parse_aggregate(query_command + 3, SUM, send_message, context);
+    } else if (strncmp(query_command, "avg", 3) == 0) {
+        dbo = parse_aggregate(query_command + 3, AVG, send_message, context);
+    } else if (strncmp(query_command, "min", 3) == 0) {
+        dbo = parse_aggregate(query_command + 3, MIN, send_message, context);
+    } else if (strncmp(query_command, "max", 3) == 0) {
+        dbo = parse_aggregate(query_command + 3, MAX, send_message, context);
+    } else if (strncmp(query_command, "add", 3) == 0) {
+        dbo = parse_arithmetic(query_command + 3, ADD, send_message, context);
+    } else if (strncmp(query_command, "sub", 3) == 0) {
+        dbo = parse_arithmetic(query_command + 3, SUB, send_message, context);
+    } else if (strncmp(query_command, "print", 5) == 0) {
+        query_command += 5;
+        dbo = parse_print(query_command, send_message, context);
+    } else if (strncmp(query_command, "load", 4) == 0) {
+        query_command += 4;
+        dbo = parse_load(query_command, send_message);
+    } else if (strncmp(query_command, "shutdown", 8) == 0) {
+        dbo = malloc(sizeof(DbOperator));
+        dbo->type = SHUTDOWN;
+    } else {
+        send_message->status = UNKNOWN_COMMAND;
+    }
     if (dbo == NULL) {
         return dbo;
     }
+
+    // operators producing a result need a handle to store it under
+    if (dbo->type == SELECT || dbo->type == FETCH || dbo->type == AGGREGATE ||
+        dbo->type == ARITHMETIC || dbo->type == DEFER) {
+        if (handle == NULL || strlen(handle) >= HANDLE_MAX_SIZE) {
+            send_message->status = INCORRECT_FORMAT;
+            db_operator_free(dbo);
+            return NULL;
+        }
+        strcpy(dbo->handle, handle);
+    } else {
+        dbo->handle[0] = '\0';
+    }
     
+    // selects over earlier results run right away, their inputs exist already
+    if (dbo->type == SELECT && dbo->operator_fields.select_operator.col != NULL
+        && context->batching) {
+        Status queued = batch_select(context, dbo->handle, &dbo->operator_fields.select_operator);
+        send_message->status = queued.code == OK ? OK_DONE : EXECUTION_ERROR;
+        db_operator_free(dbo);
+        return NULL;
+    }
+
     dbo->client_fd = client_socket;
     dbo->context = context;
     return dbo;
@@ -0,0 +1,1166 @@
+/*
+ * -- persistence.c
+ *
+ *  Keeps the database on disk between server runs.
+ *
+ *  Every column is backed by its own file under DATA_DIR. Segment i of the
+ *  column (see column.h) is the file region starting at i * segment bytes,
+ *  mapped into memory with MAP_SHARED, so the segments are the file
+ *  contents and no (de)serialization ever happens. The catalog is a small
+ *  text file listing the Db, Table and Column metadata needed to map the
+ *  columns back in at startup.
+ *
+ *  Tables with deleted rows also have a tombstone file,
+ *  DATA_DIR/<table>.del, holding their Table.deleted bitvector.
+ */
+
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "bitvector.h"
+#include "client_context.h"
+#include "column.h"
+#include "compression.h"
+#include "cs165_api.h"
+#include "delta.h"
+#include "index.h"
+#include "kernels.h"
+#include "persistence.h"
+#include "utils.h"
+#include "wal.h"
+#include "zonemap.h"
+
+// identifies tombstone files ("DEL1")
+#define TOMBSTONE_MAGIC 0x314c4544u
+
+typedef struct TombstoneFileHeader {
+    uint32_t magic;
+    uint32_t reserved;
+    // rows covered by the bitvector in the file
+    uint64_t num_rows;
+} TombstoneFileHeader;
+
+/*
+ * A consistent image of the database taken by checkpoint_capture: the
+ * catalog metadata with a copy of every table's tombstones, and per column
+ * a private copy of its segment directory, zone maps and delta. Appends
+ * never touch the captured rows and a delta fold syncs the rows it
+ * rewrites itself, so the image can be written out while queries go on.
+ */
+struct Checkpoint {
+    lsn_t lsn;
+    char db_name[MAX_SIZE_NAME];
+    Table *tables;
+    size_t num_tables;
+};
+
+// held from checkpoint_capture until checkpoint_write finished
+static pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+// log position and per table row counts the last checkpoint made durable
+static lsn_t checkpoint_lsn = 0;
+static size_t *durable_lengths = NULL;
+static size_t num_durable_lengths = 0;
+
+
+/******************************************************************************
+ * -- ensure_data_dir --
+ *
+ * Creates DATA_DIR if it does not exist yet.
+ *
+ * Returns -1 on failure
+ *          0 on success
+ *
+ ******************************************************************************
+ */
+
+int ensure_data_dir()
+{
+    if (mkdir(DATA_DIR, 0755) == -1 && errno != EEXIST) {
+        log_err("%s:%d: Unable to create %s\n", __FUNCTION__, __LINE__, DATA_DIR);
+        return -1;
+    }
+    return 0;
+}
+
+
+/******************************************************************************
+ * -- column_reserve --
+ *
+ * Makes sure the segments of a column can hold at least capacity values.
+ * The column file is opened on first use; its existing contents are kept,
+ * which is how db_startup maps persisted columns back in.
+ *
+ * All missing segments are mapped with a single mmap of the file region
+ * they cover, so a column needs O(log n) mappings rather than one per
+ * segment. Segments that already exist are never touched.
+ *
+ * Params:
+ *    col [in/out]      The column to grow
+ *    capacity [in]     The number of values the column must be able to hold
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ ******************************************************************************
+ */
+
+Status column_reserve(Column *col,       // IN/OUT
+                      size_t capacity)   // IN
+{
+    Status ret_status;
+    char path[sizeof(DATA_DIR) + MAX_SIZE_NAME + 1];
+    struct stat st;
+    size_t num_segments = column_segment_count(capacity);
+    size_t segment_bytes = column_segment_bytes(col);
+    size_t new_segments;
+    off_t offset, bytes;
+    char *data;
+
+    ret_status.code = ERROR;
+    ret_status.error_message = OUT_OF_MEMORY_STR;
+
+    if (num_segments <= col->num_segments) {
+        ret_status.code = OK;
+        ret_status.error_message = SUCCESS_STR;
+        return ret_status;
+    }
+
+    if (col->fd < 0) {
+        if (ensure_data_dir() == -1) {
+            return ret_status;
+        }
+        sprintf(path, "%s/%s", DATA_DIR, col->name);
+        col->fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (col->fd < 0) {
+            log_err("%s:%d: Unable to open column file %s\n",
+                    __FUNCTION__, __LINE__, path);
+            return ret_status;
+        }
+    }
+
+    if (fstat(col->fd, &st) == -1) {
+        log_err("%s:%d: Unable to stat column %s\n", __FUNCTION__, __LINE__, col->name);
+        return ret_status;
+    }
+
+    if ((off_t) (num_segments * segment_bytes) > st.st_size &&
+        ftruncate(col->fd, num_segments * segment_bytes) == -1) {
+        log_err("%s:%d: Unable to grow column %s\n", __FUNCTION__, __LINE__, col->name);
+        return ret_status;
+    }
+
+    if (num_segments > col->segments_capacity) {
+        size_t slots = col->segments_capacity == 0 ? 1 : col->segments_capacity;
+        while (slots < num_segments) {
+            slots *= 2;
+        }
+        void **segments = realloc(col->segments, sizeof(void *) * slots);
+        if (segments == NULL) {
+            return ret_status;
+        }
+        col->segments = segments;
+        col->segments_capacity = slots;
+    }
+
+    new_segments = num_segments - col->num_segments;
+    offset = col->num_segments * segment_bytes;
+    bytes = new_segments * segment_bytes;
+    data = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, col->fd, offset);
+    if (data == MAP_FAILED) {
+        log_err("%s:%d: Unable to map column %s\n", __FUNCTION__, __LINE__, col->name);
+        return ret_status;
+    }
+    for (size_t i = 0; i < new_segments; i++) {
+        col->segments[col->num_segments++] = data + i * segment_bytes;
+    }
+    col->capacity = col->num_segments * SEGMENT_SIZE;
+
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+    return ret_status;
+}
+
+
+/******************************************************************************
+ * -- column_sync --
+ *
+ * Flushes the dirty pages of the segments of a column holding rows from
+ * first_row on to its file.
+ *
+ * Params:
+ *    col [in]        The column to flush
+ *    first_row [in]  First row that may have changed since the last flush
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ ******************************************************************************
+ */
+
+Status column_sync(Column *col,         // IN
+                   size_t first_row)    // IN
+{
+    Status ret_status;
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+
+    for (size_t i = first_row >> SEGMENT_SHIFT; i < col->num_segments; i++) {
+        if (msync(col->segments[i], column_segment_bytes(col), MS_SYNC) == -1) {
+            log_err("%s:%d: Unable to flush column %s\n", __FUNCTION__, __LINE__, col->name);
+            ret_status.code = ERROR;
+            ret_status.error_message = QUERY_INVALID_STR;
+            break;
+        }
+    }
+    return ret_status;
+}
+
+
+/******************************************************************************
+ * -- column_close --
+ *
+ * Unmaps the segments of a column and closes its file.
+ *
+ * Params:
+ *    col [in/out]  The column to close
+ *
+ ******************************************************************************
+ */
+
+void column_close(Column *col) // IN/OUT
+{
+    column_drop_encodings(col);
+    column_drop_zones(col);
+    column_drop_delta(col);
+    column_drop_index(col);
+    for (size_t i = 0; i < col->num_segments; i++) {
+        munmap(col->segments[i], column_segment_bytes(col));
+    }
+    free(col->segments);
+    col->segments = NULL;
+    col->num_segments = 0;
+    col->segments_capacity = 0;
+    if (col->fd >= 0) {
+        close(col->fd);
+        col->fd = -1;
+    }
+    col->capacity = 0;
+}
+
+
+/******************************************************************************
+ * -- column_remove_files --
+ *
+ * Deletes whatever files an earlier column of the same name left behind,
+ * so a newly created column starts out empty. Must be called before the
+ * column is first mapped.
+ *
+ ******************************************************************************
+ */
+
+void column_remove_files(const Column *col) // IN
+{
+    static const char *suffixes[] = { "", ".enc", ".zone", ".dlt", ".idx", ".new" };
+    char path[sizeof(DATA_DIR) + MAX_SIZE_NAME + 8];
+
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        sprintf(path, "%s/%s%s", DATA_DIR, col->name, suffixes[i]);
+        unlink(path);
+    }
+}
+
+
+/******************************************************************************
+ * -- table_save_tombstones --
+ *
+ * Writes the tombstones of a table to DATA_DIR/<table>.del through a
+ * temporary file, or removes the file if no row of the table is deleted.
+ *
+ * Format: a TombstoneFileHeader, then the bitvector words covering
+ * num_rows rows.
+ *
+ * Returns -1 on failure
+ *          0 on success
+ *
+ ******************************************************************************
+ */
+
+static int table_save_tombstones(const Table *tbl)
+{
+    char path[sizeof(DATA_DIR) + MAX_SIZE_NAME + 8];
+    char tmp_path[sizeof(DATA_DIR) + MAX_SIZE_NAME + 12];
+    TombstoneFileHeader header = { TOMBSTONE_MAGIC, 0, tbl->table_length };
+    size_t words = bitvector_words(tbl->table_length);
+    FILE *file;
+    int failed;
+
+    sprintf(path, "%s/%s.del", DATA_DIR, tbl->name);
+    if (tbl->num_deleted == 0) {
+        return unlink(path) == -1 && errno != ENOENT ? -1 : 0;
+    }
+    sprintf(tmp_path, "%s.tmp", path);
+
+    file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        log_err("%s:%d: Unable to open %s\n", __FUNCTION__, __LINE__, tmp_path);
+        return -1;
+    }
+    failed = fwrite(&header, sizeof(header), 1, file) != 1 ||
+             fwrite(tbl->deleted, sizeof(uint64_t), words, file) != words ||
+             fflush(file) != 0 || fsync(fileno(file)) == -1;
+    fclose(file);
+
+    if (failed || rename(tmp_path, path) == -1) {
+        log_err("%s:%d: Unable to write %s\n", __FUNCTION__, __LINE__, path);
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+
+/******************************************************************************
+ * -- table_load_tombstones --
+ *
+ * Reads the tombstones written by table_save_tombstones back in. The table
+ * length and capacity must already be known.
+ *
+ * Returns -1 if the file is damaged
+ *          0 on success (also when there is no file)
+ *
+ ******************************************************************************
+ */
+
+static int table_load_tombstones(Table *tbl)
+{
+    char path[sizeof(DATA_DIR) + MAX_SIZE_NAME + 8];
+    TombstoneFileHeader header;
+    size_t words;
+    FILE *file;
+
+    sprintf(path, "%s/%s.del", DATA_DIR, tbl->name);
+    file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        header.magic != TOMBSTONE_MAGIC || header.num_rows > tbl->table_length) {
+        log_err("%s:%d: Damaged %s\n", __FUNCTION__, __LINE__, path);
+        fclose(file);
+        return -1;
+    }
+    words = bitvector_words(header.num_rows);
+    tbl->deleted = calloc(bitvector_words(tbl->row_capacity) + 1, sizeof(uint64_t));
+    if (tbl->deleted == NULL || fread(tbl->deleted, sizeof(uint64_t), words, file) != words) {
+        log_err("%s:%d: Damaged %s\n", __FUNCTION__, __LINE__, path);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    tbl->num_deleted = 0;
+    for (size_t w = 0; w < words; w++) {
+        tbl->num_deleted += __builtin_popcountll(tbl->deleted[w]);
+    }
+    return 0;
+}
+
+
+/******************************************************************************
+ * -- write_catalog --
+ *
+ * Writes the metadata of a database to CATALOG_PATH. The catalog
+ * is written to a temporary file first and renamed into place so a crash
+ * never leaves a half written catalog behind.
+ *
+ * Format (one record per line):
+ *    db <name> <tables_size> <lsn of the last log record the catalog covers>
+ *    table <name> <col_count> <table_length> <row_capacity>
+ *    column <name> <type> [<btree|sorted> [clustered], its declared index]
+ *
+ * Returns -1 on failure
+ *          0 on success
+ *
+ ******************************************************************************
+ */
+
+static int write_catalog(const char *db_name, const Table *tables, size_t num_tables,
+                         lsn_t lsn)
+{
+    FILE *catalog;
+
+    if (ensure_data_dir() == -1) {
+        return -1;
+    }
+    catalog = fopen(CATALOG_TMP_PATH, "w");
+    if (catalog == NULL) {
+        log_err("%s:%d: Unable to open catalog\n", __FUNCTION__, __LINE__);
+        return -1;
+    }
+
+    fprintf(catalog, "db %s %zu %lu\n", db_name, num_tables, (unsigned long) lsn);
+    for (size_t i = 0; i < num_tables; i++) {
+        const Table *tbl = &tables[i];
+        fprintf(catalog, "table %s %zu %zu %zu\n", tbl->name, tbl->col_count,
+                tbl->table_length, tbl->row_capacity);
+        for (size_t j = 0; j < tbl->col_count; j++) {
+            const Column *col = &tbl->columns[j];
+            fprintf(catalog, "column %s %s%s%s\n", col->name, data_type_name(col->type),
+                    col->index_type == BTREE_INDEX ? " btree" :
+                    col->index_type == SORTED_INDEX ? " sorted" : "",
+                    col->clustered ? " clustered" : "");
+        }
+    }
+
+    if (fflush(catalog) != 0 || fsync(fileno(catalog)) == -1) {
+        log_err("%s:%d: Unable to write catalog\n", __FUNCTION__, __LINE__);
+        fclose(catalog);
+        return -1;
+    }
+    fclose(catalog);
+
+    if (rename(CATALOG_TMP_PATH, CATALOG_PATH) == -1) {
+        log_err("%s:%d: Unable to install catalog\n", __FUNCTION__, __LINE__);
+        return -1;
+    }
+    return 0;
+}
+
+
+/******************************************************************************
+ * -- read_catalog --
+ *
+ * Recreates the database described by the catalog and maps every column
+ * file, and the index files saved with the catalog, back into memory.
+ *
+ * Returns -1 if the catalog is corrupt
+ *          0 on success
+ *
+ ******************************************************************************
+ */
+
+static int read_catalog(FILE *catalog, lsn_t *lsn)
+{
+    char name[MAX_SIZE_NAME];
+    char type_name[MAX_SIZE_NAME];
+    char index_name[MAX_SIZE_NAME];
+    char organization[MAX_SIZE_NAME];
+    char line[4 * MAX_SIZE_NAME];
+    DataType type;
+    size_t num_tables;
+    unsigned long checkpoint_lsn;
+
+    if (fscanf(catalog, "db %63s %zu %lu\n", name, &num_tables, &checkpoint_lsn) != 3 ||
+        create_db(name).code != OK) {
+        log_err("%s:%d: Corrupt catalog header\n", __FUNCTION__, __LINE__);
+        return -1;
+    }
+    *lsn = checkpoint_lsn;
+
+    for (size_t i = 0; i < num_tables; i++) {
+        size_t col_count, table_length, row_capacity;
+        Table *tbl;
+
+        if (fscanf(catalog, "table %63s %zu %zu %zu\n", name, &col_count,
+                   &table_length, &row_capacity) != 4 ||
+            create_table(current_db, strchr(name, '.') + 1, col_count).code != OK) {
+            log_err("%s:%d: Corrupt table entry\n", __FUNCTION__, __LINE__);
+            return -1;
+        }
+        tbl = &current_db->tables[current_db->tables_size - 1];
+
+        for (size_t j = 0; j < col_count; j++) {
+            int fields;
+            if (fgets(line, sizeof(line), catalog) == NULL ||
+                (fields = sscanf(line, "column %63s %63s %63s %63s", name, type_name,
+                                 index_name, organization)) < 2 ||
+                (fields >= 3 && strcmp(index_name, "btree") != 0 &&
+                 strcmp(index_name, "sorted") != 0) ||
+                (fields == 4 && strcmp(organization, "clustered") != 0) ||
+                data_type_from_name(type_name, &type) == -1 ||
+                create_column(tbl, strrchr(name, '.') + 1, type).code != OK) {
+                log_err("%s:%d: Corrupt column entry\n", __FUNCTION__, __LINE__);
+                return -1;
+            }
+            if (fields >= 3) {
+                tbl->columns[j].index_type =
+                    strcmp(index_name, "btree") == 0 ? BTREE_INDEX : SORTED_INDEX;
+                tbl->columns[j].clustered = fields == 4;
+            }
+            if (row_capacity > 0 &&
+                column_reserve(&tbl->columns[j], row_capacity).code != OK) {
+                return -1;
+            }
+        }
+        tbl->table_length = table_length;
+        tbl->row_capacity = row_capacity;
+        if (table_load_tombstones(tbl) == -1) {
+            return -1;
+        }
+        for (size_t j = 0; j < col_count; j++) {
+            if (column_load_delta(&tbl->columns[j]).code != OK ||
+                column_load_index(&tbl->columns[j], checkpoint_lsn).code != OK) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+/*****************************************************************************
+ * -- db_startup --
+ *
+ * Recovers the database: the catalog restores the state of the last
+ * checkpoint, replaying the write-ahead log redoes the changes made after
+ * it, and then the derived per column files (encodings, zone maps) are
+ * read back. Column values and indexes are not read eagerly, pages are
+ * faulted in as queries touch them. No catalog and no log simply means a fresh server.
+ * Finally the log is opened for new records, and if anything was
+ * replayed a checkpoint makes it durable so it is not replayed again.
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status db_startup()
+{
+    Status ret_status;
+    FILE *catalog;
+
+    ret_status.code = ERROR;
+    ret_status.error_message = QUERY_INVALID_STR;
+
+    catalog = fopen(CATALOG_PATH, "r");
+    if (catalog != NULL) {
+        int corrupt = read_catalog(catalog, &checkpoint_lsn) == -1;
+        fclose(catalog);
+        if (corrupt) {
+            return ret_status;
+        }
+    } else {
+        log_info("%s:%d: No catalog found, starting from the log alone\n",
+                 __FUNCTION__, __LINE__);
+    }
+
+    ret_status = wal_replay(checkpoint_lsn);
+    if (ret_status.code != OK) {
+        return ret_status;
+    }
+
+    for (size_t i = 0; current_db != NULL && i < current_db->tables_size; i++) {
+        Table *tbl = &current_db->tables[i];
+        for (size_t j = 0; j < tbl->col_count; j++) {
+            char path[sizeof(DATA_DIR) + MAX_SIZE_NAME + 8];
+            // left behind by a compaction that never committed
+            sprintf(path, "%s/%s.new", DATA_DIR, tbl->columns[j].name);
+            unlink(path);
+            column_load_encodings(&tbl->columns[j]);
+            ret_status = column_load_zones(&tbl->columns[j]);
+            if (ret_status.code != OK) {
+                return ret_status;
+            }
+        }
+    }
+    if (current_db != NULL) {
+        log_info("%s:%d: Recovered database %s with %zu tables\n",
+                 __FUNCTION__, __LINE__, current_db->name, current_db->tables_size);
+    }
+
+    ret_status = wal_open();
+    if (ret_status.code != OK) {
+        return ret_status;
+    }
+    if (wal_last_lsn() > checkpoint_lsn) {
+        return db_checkpoint();
+    }
+    wal_discard_rotated();
+    return ret_status;
+}
+
+
+/******************************************************************************
+ * -- snapshot_column --
+ *
+ * Fills snap with a copy of the column that stays valid while the column
+ * keeps growing: it has its own segment directory, zone arrays and delta
+ * and belongs to the table copy table.
+ *
+ * Returns -1 on failure
+ *          0 on success
+ *
+ ******************************************************************************
+ */
+
+static int snapshot_column(Column *snap, const Column *col, Table *table)
+{
+    size_t zone_bytes = col->num_zones * data_type_size(col->type);
+
+    *snap = *col;
+    snap->table = table;
+    snap->encodings = NULL;
+    snap->num_encodings = 0;
+    snap->index = NULL;
+    snap->delta = column_copy_delta(col);
+    if (col->delta != NULL && col->delta->count > 0 && snap->delta == NULL) {
+        snap->segments = snap->zone_min = snap->zone_max = NULL;
+        return -1;
+    }
+    snap->segments_capacity = col->num_segments;
+    snap->zones_capacity = col->num_zones;
+    snap->segments = malloc(sizeof(void *) * (col->num_segments + 1));
+    snap->zone_min = malloc(zone_bytes + 1);
+    snap->zone_max = malloc(zone_bytes + 1);
+    if (snap->segments == NULL || snap->zone_min == NULL || snap->zone_max == NULL) {
+        return -1;
+    }
+    // a column without rows has no arrays to copy
+    if (col->num_segments > 0) {
+        memcpy(snap->segments, col->segments, sizeof(void *) * col->num_segments);
+    }
+    if (zone_bytes > 0) {
+        memcpy(snap->zone_min, col->zone_min, zone_bytes);
+        memcpy(snap->zone_max, col->zone_max, zone_bytes);
+    }
+    return 0;
+}
+
+static void checkpoint_free(Checkpoint *checkpoint)
+{
+    for (size_t i = 0; i < checkpoint->num_tables; i++) {
+        Table *tbl = &checkpoint->tables[i];
+        for (size_t j = 0; j < tbl->col_count; j++) {
+            free(tbl->columns[j].segments);
+            free(tbl->columns[j].zone_min);
+            free(tbl->columns[j].zone_max);
+            column_drop_delta(&tbl->columns[j]);
+        }
+        free(tbl->columns);
+        free(tbl->deleted);
+    }
+    free(checkpoint->tables);
+    free(checkpoint);
+}
+
+
+/*****************************************************************************
+ * -- checkpoint_capture --
+ *
+ * First half of a checkpoint: takes a snapshot of the database and rotates
+ * the log so that the snapshot covers exactly the closed log files. Only
+ * metadata is copied, so this is quick. The caller must hold the database
+ * lock, shared is enough since nothing is modified, and must pass the
+ * snapshot to checkpoint_write (which may run without any lock). Only one
+ * checkpoint is in progress at a time; a second capture waits until the
+ * first one was written.
+ *
+ * Params:
+ *    force [in]        Capture even if nothing was logged since the last
+ *                      checkpoint (used after unlogged bulk loads)
+ *    checkpoint [out]  The snapshot, NULL if there is nothing to do
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status checkpoint_capture(int force,                // IN
+                          Checkpoint **checkpoint)  // OUT
+{
+    Status ret_status;
+    Checkpoint *snap;
+
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+    *checkpoint = NULL;
+
+    pthread_mutex_lock(&checkpoint_lock);
+    if (current_db == NULL || (!force && wal_last_lsn() == checkpoint_lsn)) {
+        pthread_mutex_unlock(&checkpoint_lock);
+        return ret_status;
+    }
+
+    ret_status.code = ERROR;
+    ret_status.error_message = OUT_OF_MEMORY_STR;
+    snap = calloc(1, sizeof(Checkpoint));
+    if (snap == NULL) {
+        pthread_mutex_unlock(&checkpoint_lock);
+        return ret_status;
+    }
+    snap->lsn = wal_last_lsn();
+    strcpy(snap->db_name, current_db->name);
+    snap->tables = calloc(current_db->tables_size + 1, sizeof(Table));
+    if (snap->tables == NULL) {
+        checkpoint_free(snap);
+        pthread_mutex_unlock(&checkpoint_lock);
+        return ret_status;
+    }
+    for (size_t i = 0; i < current_db->tables_size; i++) {
+        const Table *tbl = &current_db->tables[i];
+        Table *copy = &snap->tables[snap->num_tables++];
+        size_t words = bitvector_words(tbl->table_length);
+        *copy = *tbl;
+        copy->col_count = 0;
+        copy->deleted = NULL;
+        copy->columns = calloc(tbl->col_count + 1, sizeof(Column));
+        if (tbl->num_deleted > 0) {
+            copy->deleted = malloc(sizeof(uint64_t) * (words + 1));
+            if (copy->deleted != NULL) {
+                memcpy(copy->deleted, tbl->deleted, sizeof(uint64_t) * words);
+            }
+        }
+        if (copy->columns == NULL || (tbl->num_deleted > 0 && copy->deleted == NULL)) {
+            checkpoint_free(snap);
+            pthread_mutex_unlock(&checkpoint_lock);
+            return ret_status;
+        }
+        for (size_t j = 0; j < tbl->col_count; j++) {
+            if (snapshot_column(&copy->columns[copy->col_count++], &tbl->columns[j], copy) == -1) {
+                checkpoint_free(snap);
+                pthread_mutex_unlock(&checkpoint_lock);
+                return ret_status;
+            }
+        }
+    }
+
+    ret_status = wal_rotate();
+    if (ret_status.code != OK) {
+        checkpoint_free(snap);
+        pthread_mutex_unlock(&checkpoint_lock);
+        return ret_status;
+    }
+    *checkpoint = snap;
+    return ret_status;
+}
+
+
+/*****************************************************************************
+ * -- checkpoint_write --
+ *
+ * Second half of a checkpoint: flushes the column pages appended since the
+ * last checkpoint, saves the zone maps, deltas and tombstones and installs the
+ * catalog of the snapshot. Only then are the log files it covers deleted; if anything
+ * fails they are kept and the next checkpoint retries. Frees the snapshot.
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status checkpoint_write(Checkpoint *checkpoint) // IN
+{
+    Status ret_status;
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+
+    for (size_t i = 0; i < checkpoint->num_tables && ret_status.code == OK; i++) {
+        Table *tbl = &checkpoint->tables[i];
+        size_t durable = i < num_durable_lengths ? durable_lengths[i] : 0;
+        for (size_t j = 0; j < tbl->col_count && ret_status.code == OK; j++) {
+            ret_status = column_sync(&tbl->columns[j], durable);
+            if (ret_status.code == OK) {
+                ret_status = column_save_zones(&tbl->columns[j]);
+            }
+            if (ret_status.code == OK) {
+                ret_status = column_save_delta(&tbl->columns[j]);
+            }
+        }
+        if (ret_status.code == OK && table_save_tombstones(tbl) == -1) {
+            ret_status.code = ERROR;
+            ret_status.error_message = QUERY_INVALID_STR;
+        }
+    }
+
+    // the log stays authoritative unless everything above made it to disk
+    if (ret_status.code == OK &&
+        write_catalog(checkpoint->db_name, checkpoint->tables, checkpoint->num_tables,
+                      checkpoint->lsn) == -1) {
+        ret_status.code = ERROR;
+        ret_status.error_message = QUERY_INVALID_STR;
+    }
+    if (ret_status.code == OK) {
+        size_t *lengths = realloc(durable_lengths, sizeof(size_t) * (checkpoint->num_tables + 1));
+        if (lengths != NULL) {
+            durable_lengths = lengths;
+            num_durable_lengths = checkpoint->num_tables;
+            for (size_t i = 0; i < checkpoint->num_tables; i++) {
+                durable_lengths[i] = checkpoint->tables[i].table_length;
+            }
+        }
+        checkpoint_lsn = checkpoint->lsn;
+        wal_discard_rotated();
+    }
+
+    checkpoint_free(checkpoint);
+    pthread_mutex_unlock(&checkpoint_lock);
+    return ret_status;
+}
+
+
+/*****************************************************************************
+ * -- db_checkpoint --
+ *
+ * Makes the current state of the database durable right away: folds the
+ * deltas of updated columns, encodes full segments filled since the last
+ * load or checkpoint, saves the encodings and the indexes and then
+ * captures and writes a checkpoint. Used for bulk loads,
+ * which are not logged, and at shutdown. The caller must hold the database
+ * write lock.
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status db_checkpoint()
+{
+    Status ret_status;
+    Checkpoint *checkpoint;
+    // what checkpoint_capture takes, nothing is logged while the lock is held
+    lsn_t lsn = wal_last_lsn();
+
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+
+    if (current_db == NULL) {
+        return ret_status;
+    }
+
+    for (size_t i = 0; i < current_db->tables_size; i++) {
+        Table *tbl = &current_db->tables[i];
+        for (size_t j = 0; j < tbl->col_count; j++) {
+            if (column_delta_fold(&tbl->columns[j]).code != OK) {
+                ret_status.code = ERROR;
+                ret_status.error_message = QUERY_INVALID_STR;
+                continue;
+            }
+            column_encode(&tbl->columns[j]);
+            if (column_save_encodings(&tbl->columns[j]).code != OK ||
+                column_save_index(&tbl->columns[j], lsn).code != OK) {
+                ret_status.code = ERROR;
+                ret_status.error_message = QUERY_INVALID_STR;
+            }
+        }
+    }
+    if (ret_status.code != OK) {
+        return ret_status;
+    }
+
+    ret_status = checkpoint_capture(1, &checkpoint);
+    if (ret_status.code != OK) {
+        return ret_status;
+    }
+    return checkpoint_write(checkpoint);
+}
+
+
+/******************************************************************************
+ * -- write_live_values --
+ *
+ * Appends the values of the live rows of a column to file. Encoded
+ * segments are decoded first. scratch must hold a segment of the widest
+ * type.
+ *
+ * Returns -1 on failure
+ *          0 on success
+ *
+ ******************************************************************************
+ */
+
+static int write_live_values(const Column *col, FILE *file, void *scratch)
+{
+    size_t n = column_length(col);
+
+    for (size_t s = 0; s < column_segment_count(n); s++) {
+        size_t length = column_segment_length(s, n);
+        const uint64_t *mask = col->table->deleted + ((s << SEGMENT_SHIFT) >> BITVECTOR_WORD_SHIFT);
+        const SegmentEncoding *enc = column_encoding(col, s);
+        const void *values = col->segments[s];
+        size_t live;
+
+        if (enc != NULL) {
+            int *decoded = scratch;
+            for (size_t i = 0; i < length; i++) {
+                decoded[i] = encoded_value(enc, i);
+            }
+            values = scratch;
+        }
+        switch (col->type) {
+        case LONG:
+            live = live_long(values, mask, length, scratch);
+            break;
+        case FLOAT:
+            live = live_float(values, mask, length, scratch);
+            break;
+        default:
+            live = live_int(values, mask, length, scratch);
+            break;
+        }
+        if (live > 0 && fwrite(scratch, data_type_size(col->type), live, file) != live) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/*****************************************************************************
+ * -- table_compact --
+ *
+ * Drops the deleted rows of a table for good. The live rows of every
+ * column are written to a new file, DATA_DIR/<column>.new, next to the
+ * current one, which stays untouched. Once all of them are on disk a
+ * WAL_COMPACT record commits the compaction and table_compaction_finish
+ * swaps the files in. A crash before the record leaves the table as it
+ * was, one after it is finished by replaying the record.
+ *
+ * Positions change, so position lists computed before are meaningless
+ * afterwards. The caller must hold the database write lock and make sure
+ * no client holds on to such lists.
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status table_compact(Table *table) // IN/OUT
+{
+    Status ret_status;
+    char path[sizeof(DATA_DIR) + MAX_SIZE_NAME + 8];
+    size_t num_rows = table->table_length - table->num_deleted;
+    void *scratch;
+    lsn_t lsn;
+
+    // nothing logged before the compaction may be replayed after it, and
+    // the checkpoint folds the deltas, so the segments hold current values
+    ret_status = db_checkpoint();
+    if (ret_status.code != OK) {
+        return ret_status;
+    }
+
+    ret_status.code = ERROR;
+    ret_status.error_message = OUT_OF_MEMORY_STR;
+    scratch = malloc(SEGMENT_SIZE * sizeof(long));
+    if (scratch == NULL) {
+        return ret_status;
+    }
+    ret_status.error_message = QUERY_INVALID_STR;
+
+    for (size_t i = 0; i < table->col_count; i++) {
+        FILE *file;
+        int failed;
+
+        sprintf(path, "%s/%s.new", DATA_DIR, table->columns[i].name);
+        file = fopen(path, "w");
+        if (file == NULL) {
+            log_err("%s:%d: Unable to open %s\n", __FUNCTION__, __LINE__, path);
+            failed = 1;
+        } else {
+            failed = write_live_values(&table->columns[i], file, scratch) == -1 ||
+                     fflush(file) != 0 || fsync(fileno(file)) == -1;
+            fclose(file);
+        }
+        if (failed) {
+            log_err("%s:%d: Unable to compact %s\n", __FUNCTION__, __LINE__,
+                    table->columns[i].name);
+            for (size_t j = 0; j <= i; j++) {
+                sprintf(path, "%s/%s.new", DATA_DIR, table->columns[j].name);
+                unlink(path);
+            }
+            free(scratch);
+            return ret_status;
+        }
+    }
+    free(scratch);
+
+    lsn = wal_log_compact(table, num_rows);
+    if (lsn == 0 || wal_commit(lsn).code != OK) {
+        return ret_status;
+    }
+    ret_status = table_compaction_finish(table, num_rows);
+    if (ret_status.code != OK) {
+        return ret_status;
+    }
+    log_info("%s:%d: Compacted %s to %zu rows\n", __FUNCTION__, __LINE__, table->name, num_rows);
+    return db_checkpoint();
+}
+
+
+/*****************************************************************************
+ * -- table_compaction_finish --
+ *
+ * Second half of table_compact, also run when a WAL_COMPACT record is
+ * replayed: installs the <column>.new files that are still around, maps
+ * the columns afresh and forgets the tombstones. Encodings and zone maps
+ * described the old layout; the zones are rebuilt here, segments are
+ * encoded again by the next checkpoint.
+ *
+ * Params:
+ *    table [in/out]    The table being compacted
+ *    num_rows [in]     The number of rows left
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status table_compaction_finish(Table *table,      // IN/OUT
+                               size_t num_rows)   // IN
+{
+    Status ret_status;
+    char path[sizeof(DATA_DIR) + MAX_SIZE_NAME + 8];
+    char new_path[sizeof(DATA_DIR) + MAX_SIZE_NAME + 12];
+
+    ret_status.code = ERROR;
+    ret_status.error_message = QUERY_INVALID_STR;
+
+    for (size_t i = 0; i < table->col_count; i++) {
+        Column *col = &table->columns[i];
+        sprintf(path, "%s/%s", DATA_DIR, col->name);
+        snprintf(new_path, sizeof(new_path), "%s.new", path);
+        if (access(new_path, F_OK) == 0 && rename(new_path, path) == -1) {
+            log_err("%s:%d: Unable to install %s\n", __FUNCTION__, __LINE__, new_path);
+            return ret_status;
+        }
+        column_close(col);
+        sprintf(path, "%s/%s.enc", DATA_DIR, col->name);
+        unlink(path);
+        sprintf(path, "%s/%s.zone", DATA_DIR, col->name);
+        unlink(path);
+        sprintf(path, "%s/%s.dlt", DATA_DIR, col->name);
+        unlink(path);
+        sprintf(path, "%s/%s.idx", DATA_DIR, col->name);
+        unlink(path);
+    }
+
+    free(table->deleted);
+    table->deleted = NULL;
+    table->num_deleted = 0;
+    table->table_length = 0;
+    table->row_capacity = 0;
+    ret_status = table_reserve(table, num_rows);
+    if (ret_status.code != OK) {
+        return ret_status;
+    }
+    for (size_t i = 0; i < table->col_count; i++) {
+        ret_status = column_zones_extend(&table->columns[i], 0, num_rows);
+        if (ret_status.code != OK) {
+            return ret_status;
+        }
+    }
+    table->table_length = num_rows;
+
+    // the new files were synced as a whole
+    pthread_mutex_lock(&checkpoint_lock);
+    size_t index = table - current_db->tables;
+    if (index < num_durable_lengths) {
+        durable_lengths[index] = num_rows;
+    }
+    pthread_mutex_unlock(&checkpoint_lock);
+    return ret_status;
+}
+
+
+/*****************************************************************************
+ * -- db_compaction_due --
+ *
+ * Returns whether some table has more than COMPACT_DELETED_PERCENT percent
+ * of its rows deleted. The caller must hold the database lock.
+ *
+ *****************************************************************************
+ */
+
+bool db_compaction_due()
+{
+    for (size_t i = 0; current_db != NULL && i < current_db->tables_size; i++) {
+        const Table *tbl = &current_db->tables[i];
+        if (tbl->num_deleted > 0 &&
+            tbl->num_deleted * 100 >= tbl->table_length * COMPACT_DELETED_PERCENT) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/*****************************************************************************
+ * -- db_compact --
+ *
+ * Compacts every table db_compaction_due would report, see table_compact.
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status db_compact()
+{
+    Status ret_status;
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+
+    for (size_t i = 0; current_db != NULL && i < current_db->tables_size; i++) {
+        Table *tbl = &current_db->tables[i];
+        if (tbl->num_deleted > 0 &&
+            tbl->num_deleted * 100 >= tbl->table_length * COMPACT_DELETED_PERCENT) {
+            ret_status = table_compact(tbl);
+            if (ret_status.code != OK) {
+                return ret_status;
+            }
+        }
+    }
+    return ret_status;
+}
+
+
+/*****************************************************************************
+ * -- shutdown_server --
+ *
+ * Persists the database before the server exits: compacts the tables
+ * with many deleted rows, then checkpoints (see db_checkpoint).
+ * Compaction renumbers rows, so the caller only asks for it while no
+ * other client can hold positions.
+ *
+ * Params:
+ *    compact [in]   whether to compact tables first
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status shutdown_server(bool compact)  // IN
+{
+    if (compact) {
+        Status ret_status = db_compact();
+        if (ret_status.code != OK) {
+            return ret_status;
+        }
+    }
+    return db_checkpoint();
+}
@@ -0,0 +1,2041 @@
+/*
+ * -- query.c
+ *
+ *  implements the query operators (select, fetch, aggregates, print)
+ *
+ *  Operators walk columns segment by segment and hand every segment to the
+ *  kernel instantiated for the column's type (see kernels.h). The type
+ *  dispatch happens once per segment, never per value. Compressed segments
+ *  of int columns are handed to the scans in compression.c instead, which
+ *  work on the encoded data directly.
+ *
+ *  Deleted rows stay in the columns until compaction; operators reading a
+ *  column mask them out with the table's tombstones, a word (64 rows) at
+ *  a time, and skip the mask entirely for zones and segments without
+ *  deletions. Updated values likewise sit in the column's delta until it
+ *  is folded (see delta.h); operators merge it in for the zones and
+ *  segments it has entries in and read everything else untouched.
+ *
+ *  Select, fetch and aggregate statements of a client that depend on each
+ *  other are not run one by one but compiled into a pipeline (see
+ *  Pipeline and parse.c), which pushes a zone of rows at a time through
+ *  all of them. Their intermediates are only built in full when a client
+ *  uses a handle some other way (see pipeline_result).
+ */
+
+#include <limits.h>
+#include <string.h>
+#include "bitvector.h"
+#include "column.h"
+#include "compression.h"
+#include "delta.h"
+#include "index.h"
+#include "kernels.h"
+#include "query.h"
+#include "threadpool.h"
+#include "utils.h"
+#include "zonemap.h"
+
+
+/******************************************************************************
+ * -- create_result --
+ *
+ * Allocates a result with room for num_tuples values of data_type (bits
+ * for a BITMAP).
+ *
+ * Returns NULL on failure
+ *
+ ******************************************************************************
+ */
+
+Result *create_result(DataType data_type,   // IN
+                      size_t num_tuples)    // IN
+{
+    Result *result = malloc(sizeof(Result));
+    size_t bytes;
+    if (result == NULL) {
+        return NULL;
+    }
+    result->data_type = data_type;
+    result->num_tuples = num_tuples;
+    bytes = data_type == BITMAP ? sizeof(uint64_t) * bitvector_words(num_tuples)
+                                : data_type_size(data_type) * num_tuples;
+    // never ask for 0 bytes so a NULL payload always means out of memory
+    result->payload = malloc(bytes > 0 ? bytes : 1);
+    if (result->payload == NULL) {
+        free(result);
+        return NULL;
+    }
+    return result;
+}
+
+
+/******************************************************************************
+ * -- free_result --
+ *
+ * Releases a result and its payload.
+ *
+ ******************************************************************************
+ */
+
+void free_result(Result *result) // IN
+{
+    if (result == NULL) {
+        return;
+    }
+    free(result->payload);
+    free(result);
+}
+
+
+/*
+ * Select picks one of three ways to produce its output per query, from the
+ * share of a sample of SELECT_SAMPLE_SIZE values that matches:
+ *    below SELECT_SPARSE_PERMILLE   positions, written by the branching
+ *                                   kernels (most blocks have no match)
+ *    from SELECT_BITMAP_PERMILLE    a BITMAP result, 1 bit per row instead
+ *                                   of 32 per match
+ *    otherwise                      positions, written branch free
+ * Columns shorter than SELECT_SAMPLE_MIN_ROWS are not sampled.
+ */
+#define SELECT_SAMPLE_SIZE 1024
+#define SELECT_SAMPLE_MIN_ROWS (16 * SELECT_SAMPLE_SIZE)
+#define SELECT_SPARSE_PERMILLE 10
+#define SELECT_BITMAP_PERMILLE 200
+
+typedef enum SelectStrategy {
+    SELECT_BRANCHING,
+    SELECT_PREDICATED,
+    SELECT_BITMAP,
+} SelectStrategy;
+
+/*
+ * Counts the values in [low, high] among SELECT_SAMPLE_SIZE evenly spaced
+ * rows of a column of type T. Encoded segments are sampled on their codes
+ * so their raw pages stay cold.
+ */
+#define SAMPLE_MATCHES(T, FIELD)                                                \
+    for (size_t k = 0; k < SELECT_SAMPLE_SIZE; k++) {                           \
+        size_t pos = k * (n / SELECT_SAMPLE_SIZE);                              \
+        const SegmentEncoding *enc = column_encoding(col, pos >> SEGMENT_SHIFT); \
+        T value = enc != NULL ? (T) encoded_value(enc, pos & SEGMENT_MASK)      \
+                              : COLUMN_VALUE(col, T, pos);                      \
+        matches += value >= low.FIELD && value <= high.FIELD;                   \
+    }
+
+static SelectStrategy choose_strategy(const Column *col, size_t n, Value low, Value high)
+{
+    size_t matches = 0;
+
+    if (n < SELECT_SAMPLE_MIN_ROWS) {
+        return SELECT_PREDICATED;
+    }
+    switch (col->type) {
+    case LONG:
+        SAMPLE_MATCHES(long, l);
+        break;
+    case FLOAT:
+        SAMPLE_MATCHES(float, f);
+        break;
+    default:
+        SAMPLE_MATCHES(int, i);
+        break;
+    }
+    if (matches * 1000 < SELECT_SPARSE_PERMILLE * SELECT_SAMPLE_SIZE) {
+        return SELECT_BRANCHING;
+    }
+    if (matches * 1000 >= SELECT_BITMAP_PERMILLE * SELECT_SAMPLE_SIZE) {
+        return SELECT_BITMAP;
+    }
+    return SELECT_PREDICATED;
+}
+
+/*
+ * Declares, for zone z of a column of type T, its bounds, its rows
+ * [begin, begin + length) with their raw values and their encoding (int
+ * columns only, for other types column_encoding is always NULL), and the
+ * delta entries [first, last) falling in them.
+ */
+#define ZONE_BOUNDS(T)                                                          \
+    T zone_min = ((const T *) col->zone_min)[z];                                \
+    T zone_max = ((const T *) col->zone_max)[z];                                \
+    size_t begin = z << ZONE_SHIFT;                                             \
+    size_t length = column_zone_length(z, n);                                   \
+    size_t seg = begin >> SEGMENT_SHIFT;                                        \
+    const SegmentEncoding *enc = column_encoding(col, seg);                     \
+    const T *values = (const T *) col->segments[seg] + (begin & SEGMENT_MASK);  \
+    size_t first = 0, last = 0;                                                 \
+    if (has_delta) {                                                            \
+        first = column_delta_find(col, begin);                                  \
+        last = column_delta_find(col, begin + length);                          \
+    }
+
+/*
+ * Appends the live positions of the current zone (see ZONE_BOUNDS) whose
+ * value lies in [LOW, HIGH] to OUT + COUNT and advances COUNT. Zones
+ * whose [min, max] misses the range are skipped, zones entirely inside it
+ * qualify as a whole, only the rest is scanned: encoded zones on their
+ * codes, raw ones with KERNEL. Positions of deleted rows are then
+ * dropped. The min/max of zones with delta entries only describe the base
+ * values, so these zones are always scanned and the delta merged in.
+ */
+#define SELECT_ZONE(T, FIELD, LOW, HIGH, KERNEL, OUT, COUNT)                    \
+    do {                                                                        \
+        size_t found;                                                           \
+        if (first == last && (zone_max < (LOW).FIELD || zone_min > (HIGH).FIELD)) { \
+            break;                                                              \
+        }                                                                       \
+        if (first == last && zone_min >= (LOW).FIELD && zone_max <= (HIGH).FIELD) { \
+            COUNT += deleted != NULL                                            \
+                ? select_live(deleted + (begin >> BITVECTOR_WORD_SHIFT), length, \
+                              begin, (OUT) + COUNT)                             \
+                : select_all(length, begin, (OUT) + COUNT);                     \
+            break;                                                              \
+        }                                                                       \
+        found = enc != NULL                                                     \
+            ? encoded_select(enc, begin & SEGMENT_MASK, length, (LOW).i, (HIGH).i, \
+                             begin, (OUT) + COUNT)                              \
+            : (KERNEL)(values, length, (LOW).FIELD, (HIGH).FIELD, begin,         \
+                       (OUT) + COUNT);                                          \
+        if (deleted != NULL && bitvector_any(deleted, begin, length)) {         \
+            found = drop_deleted(deleted, (OUT) + COUNT, found);                \
+        }                                                                       \
+        if (first < last) {                                                     \
+            memcpy(scratch, (OUT) + COUNT, found * sizeof(position_t));         \
+            found = column_delta_select(col, first, last, LOW, HIGH, deleted,   \
+                                        scratch, found, (OUT) + COUNT);         \
+        }                                                                       \
+        COUNT += found;                                                         \
+    } while (0)
+
+/*
+ * Same as SELECT_ZONE, writing the bits of the current zone into the
+ * bitmap BITS (zones start at multiples of the bitvector word size).
+ * Tombstones are applied a word at a time.
+ */
+#define SELECT_ZONE_BITS(T, NAME, FIELD, LOW, HIGH, BITS)                       \
+    do {                                                                        \
+        size_t num_words = bitvector_words(length);                             \
+        uint64_t *words = (BITS) + (begin >> BITVECTOR_WORD_SHIFT);             \
+        if (first == last && (zone_max < (LOW).FIELD || zone_min > (HIGH).FIELD)) { \
+            memset(words, 0, num_words * sizeof(uint64_t));                     \
+            break;                                                              \
+        }                                                                       \
+        if (first == last && zone_min >= (LOW).FIELD && zone_max <= (HIGH).FIELD) { \
+            memset(words, 0xff, num_words * sizeof(uint64_t));                  \
+            if (length & (BITVECTOR_WORD_BITS - 1)) {                           \
+                words[num_words - 1] = ((uint64_t) 1 << (length & 63)) - 1;     \
+            }                                                                   \
+        } else if (enc != NULL) {                                               \
+            size_t found = encoded_select(enc, begin & SEGMENT_MASK, length,    \
+                                          (LOW).i, (HIGH).i, begin, scratch);   \
+            memset(words, 0, num_words * sizeof(uint64_t));                     \
+            for (size_t i = 0; i < found; i++) {                                \
+                SetBit((BITS), scratch[i]);                                     \
+            }                                                                   \
+        } else {                                                                \
+            bitmap_##NAME(values, length, (LOW).FIELD, (HIGH).FIELD, words);   \
+        }                                                                       \
+        if (deleted != NULL) {                                                  \
+            const uint64_t *dead = deleted + (begin >> BITVECTOR_WORD_SHIFT);   \
+            for (size_t w = 0; w < num_words; w++) {                            \
+                words[w] &= ~dead[w];                                           \
+            }                                                                   \
+        }                                                                       \
+        if (first < last) {                                                     \
+            column_delta_select_bits(col, first, last, LOW, HIGH, deleted, BITS); \
+        }                                                                       \
+    } while (0)
+
+/*
+ * Scans zones [zone_begin, zone_end) of a column of type T into positions,
+ * with the select kernel of the strategy.
+ */
+#define SELECT_ZONES(T, NAME, FIELD)                                            \
+    size_t (*select_kernel)(const T *, size_t, T, T, position_t, position_t *) = \
+        strategy == SELECT_BRANCHING ? select_sparse_##NAME : select_##NAME;   \
+    for (size_t z = zone_begin; z < zone_end; z++) {                            \
+        ZONE_BOUNDS(T)                                                          \
+        SELECT_ZONE(T, FIELD, low, high, select_kernel, positions, count);      \
+    }
+
+/*
+ * Scans zones [zone_begin, zone_end) of a column of type T into the bitmap
+ * bits.
+ */
+#define SELECT_ZONES_BITMAP(T, NAME, FIELD)                                     \
+    for (size_t z = zone_begin; z < zone_end; z++) {                            \
+        ZONE_BOUNDS(T)                                                          \
+        SELECT_ZONE_BITS(T, NAME, FIELD, low, high, bits);                      \
+    }
+
+/*
+ * A select split into morsels of one segment each. A morsel writes its
+ * positions starting at its first row, where no other morsel writes, and
+ * leaves their number in counts; select_column then moves the lists
+ * together in row order. Bitmap morsels write their own words.
+ */
+typedef struct SelectTask {
+    const Column *col;
+    size_t n;
+    Value low;
+    Value high;
+    SelectStrategy strategy;
+    const uint64_t *deleted;
+    int has_delta;
+    position_t *positions;
+    size_t *counts;
+    uint64_t *bits;
+} SelectTask;
+
+static void select_morsel(void *arg, size_t morsel, size_t slot)
+{
+    SelectTask *task = arg;
+    // the names the zone macros expect
+    const Column *col = task->col;
+    size_t n = task->n;
+    Value low = task->low, high = task->high;
+    SelectStrategy strategy = task->strategy;
+    const uint64_t *deleted = task->deleted;
+    int has_delta = task->has_delta;
+    size_t zone_begin = morsel << (SEGMENT_SHIFT - ZONE_SHIFT);
+    size_t zone_end = column_zone_count(column_segment_length(morsel, n)) + zone_begin;
+    position_t scratch[ZONE_SIZE];
+    (void) slot;
+
+    if (strategy == SELECT_BITMAP) {
+        uint64_t *bits = task->bits;
+        switch (col->type) {
+        case LONG:
+            SELECT_ZONES_BITMAP(long, long, l);
+            break;
+        case FLOAT:
+            SELECT_ZONES_BITMAP(float, float, f);
+            break;
+        default:
+            SELECT_ZONES_BITMAP(int, int, i);
+            break;
+        }
+    } else {
+        position_t *positions = task->positions + (morsel << SEGMENT_SHIFT);
+        size_t count = 0;
+        switch (col->type) {
+        case LONG: {
+            SELECT_ZONES(long, long, l);
+            break;
+        }
+        case FLOAT: {
+            SELECT_ZONES(float, float, f);
+            break;
+        }
+        default: {
+            SELECT_ZONES(int, int, i);
+            break;
+        }
+        }
+        task->counts[morsel] = count;
+    }
+}
+
+/*****************************************************************************
+ * -- select_column --
+ *
+ * Computes the live rows of a column whose value lies within [low, high],
+ * skipping the blocks the column's zone maps rule out. Depending on how
+ * many rows a sample suggests will match, the rows come back as positions
+ * or as a bitmap. Segments are scanned in parallel on the thread pool.
+ * Selects expected to return positions go through the column's index
+ * instead, if it has one or is large enough to get a cracker column, and
+ * so do all selects on the clustered column of a table (see index.h).
+ *
+ * params:
+ *    col [in]          The column to scan
+ *    low [in]          Inclusive lower bound, in the column's type
+ *    high [in]         Inclusive upper bound, in the column's type
+ *    result [out]      A POSITION result holding the qualifying positions,
+ *                      or a BITMAP result over the column's rows
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status select_column(Column *col,       // IN
+                     Value low,         // IN
+                     Value high,        // IN
+                     Result **result)   // OUT
+{
+    Status ret_status;
+    size_t n = column_length(col);
+    size_t num_morsels = column_segment_count(n);
+    SelectTask task;
+
+    ret_status.code = ERROR;
+    ret_status.error_message = OUT_OF_MEMORY_STR;
+
+    task.col = col;
+    task.n = n;
+    task.low = low;
+    task.high = high;
+    task.strategy = choose_strategy(col, n, low, high);
+    task.deleted = col->table->num_deleted > 0 ? col->table->deleted : NULL;
+    task.has_delta = col->delta != NULL && col->delta->count > 0;
+    task.positions = NULL;
+    task.counts = NULL;
+    task.bits = NULL;
+
+    if (task.strategy != SELECT_BITMAP || col->clustered) {
+        size_t count;
+        position_t *indexed = index_select(col, low, high, &count);
+        if (indexed != NULL) {
+            *result = malloc(sizeof(Result));
+            if (*result == NULL) {
+                free(indexed);
+                return ret_status;
+            }
+            (*result)->data_type = POSITION;
+            (*result)->num_tuples = count;
+            (*result)->payload = indexed;
+            ret_status.code = OK;
+            ret_status.error_message = SUCCESS_STR;
+            return ret_status;
+        }
+    }
+
+    if (task.strategy == SELECT_BITMAP) {
+        *result = create_result(BITMAP, n);
+        if (*result == NULL) {
+            return ret_status;
+        }
+        task.bits = (*result)->payload;
+        parallel_for(num_morsels, select_morsel, &task);
+    } else {
+        size_t count = 0;
+        /*
+         * The kernels write a candidate position for every value they look
+         * at, so size the output for the worst case and shrink it
+         * afterwards.
+         */
+        *result = create_result(POSITION, n);
+        task.counts = malloc(sizeof(size_t) * (num_morsels > 0 ? num_morsels : 1));
+        if (*result == NULL || task.counts == NULL) {
+            free_result(*result);
+            free(task.counts);
+            return ret_status;
+        }
+        task.positions = (*result)->payload;
+        parallel_for(num_morsels, select_morsel, &task);
+
+        for (size_t m = 0; m < num_morsels; m++) {
+            memmove(task.positions + count, task.positions + (m << SEGMENT_SHIFT),
+                    task.counts[m] * sizeof(position_t));
+            count += task.counts[m];
+        }
+        free(task.counts);
+        (*result)->num_tuples = count;
+        if (count < n) {
+            void *shrunk = realloc(task.positions, sizeof(position_t) * (count > 0 ? count : 1));
+            (*result)->payload = shrunk != NULL ? shrunk : task.positions;
+        }
+    }
+
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+    return ret_status;
+}
+
+
+/*
+ * A query of select_column_batch: its range, the strategy its sample
+ * picked and the result it is building, a bitmap for SELECT_BITMAP and a
+ * growing position list otherwise.
+ */
+typedef struct BatchQuery {
+    Value low;
+    Value high;
+    size_t index;
+    SelectStrategy strategy;
+    Result *result;
+    size_t count;
+    size_t capacity;
+} BatchQuery;
+
+#define DEFINE_COMPARE_LOW(T, FIELD)                                            \
+    static int compare_low_##T(const void *a, const void *b)                    \
+    {                                                                           \
+        T x = ((const BatchQuery *) a)->low.FIELD;                              \
+        T y = ((const BatchQuery *) b)->low.FIELD;                              \
+        return (x > y) - (x < y);                                               \
+    }
+
+DEFINE_COMPARE_LOW(int, i)
+DEFINE_COMPARE_LOW(long, l)
+DEFINE_COMPARE_LOW(float, f)
+
+/*
+ * Makes room for extra more positions in the list of a batched query.
+ * Returns 0 if out of memory.
+ */
+static int reserve_positions(BatchQuery *query, size_t extra)
+{
+    size_t capacity = query->capacity * 2;
+    position_t *grown;
+
+    if (query->count + extra <= query->capacity) {
+        return 1;
+    }
+    if (capacity < query->count + extra) {
+        capacity = query->count + extra;
+    }
+    grown = realloc(query->result->payload, sizeof(position_t) * capacity);
+    if (grown == NULL) {
+        return 0;
+    }
+    query->result->payload = grown;
+    query->capacity = capacity;
+    return 1;
+}
+
+/*
+ * Runs every batched query against a zone while it is in cache, then
+ * moves on to the next zone. The queries are sorted by lower bound, so
+ * the ones starting above the zone's max are a suffix found by binary
+ * search and never looked at; zones with delta entries see all queries.
+ * An encoded zone several queries look at is decoded once into decoded
+ * and scanned raw, rather than unpacked again by every query.
+ */
+#define SELECT_ZONES_BATCH(T, NAME, FIELD)                                      \
+    for (size_t z = 0; ok && z < column_zone_count(n); z++) {                   \
+        ZONE_BOUNDS(T)                                                          \
+        size_t reach = num_queries;                                             \
+        if (first == last) {                                                    \
+            size_t lo = 0;                                                      \
+            while (lo < reach) {                                                \
+                size_t mid = lo + (reach - lo) / 2;                             \
+                if (queries[mid].low.FIELD <= zone_max) {                       \
+                    lo = mid + 1;                                               \
+                } else {                                                        \
+                    reach = mid;                                                \
+                }                                                               \
+            }                                                                   \
+        }                                                                       \
+        if (enc != NULL && reach > 1) {                                         \
+            encoded_decode(enc, begin & SEGMENT_MASK, length, decoded);         \
+            enc = NULL;                                                         \
+            values = (const T *) decoded;                                       \
+        }                                                                       \
+        for (size_t k = 0; k < reach; k++) {                                    \
+            BatchQuery *query = &queries[k];                                    \
+            if (query->strategy == SELECT_BITMAP) {                             \
+                SELECT_ZONE_BITS(T, NAME, FIELD, query->low, query->high,       \
+                                 (uint64_t *) query->result->payload);          \
+            } else if (!reserve_positions(query, length)) {                     \
+                ok = 0;                                                         \
+                break;                                                          \
+            } else {                                                            \
+                SELECT_ZONE(T, FIELD, query->low, query->high,                  \
+                            query->strategy == SELECT_BRANCHING                 \
+                                ? select_sparse_##NAME : select_##NAME,         \
+                            (position_t *) query->result->payload, query->count); \
+            }                                                                   \
+        }                                                                       \
+    }
+
+/*****************************************************************************
+ * -- select_column_batch --
+ *
+ * Computes several selects over the same column in a single pass: each
+ * zone is read from memory once and every query is evaluated on it while
+ * it is cache resident, instead of one scan of the column per query. Each
+ * query picks its output strategy as select_column would.
+ *
+ * params:
+ *    col [in]          The column to scan
+ *    lows [in]         Inclusive lower bound of each query
+ *    highs [in]        Inclusive upper bound of each query
+ *    num_queries [in]  The number of queries
+ *    results [out]     The result of each query, in the order of lows
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure, no result is returned then
+ *
+ *****************************************************************************
+ */
+
+Status select_column_batch(Column *col,         // IN
+                           const Value *lows,   // IN
+                           const Value *highs,  // IN
+                           size_t num_queries,  // IN
+                           Result **results)    // OUT
+{
+    Status ret_status;
+    size_t n = column_length(col);
+    const uint64_t *deleted = col->table->num_deleted > 0 ? col->table->deleted : NULL;
+    int has_delta = col->delta != NULL && col->delta->count > 0;
+    BatchQuery *queries = calloc(num_queries, sizeof(BatchQuery));
+    position_t *scratch = NULL;
+    int *decoded = NULL;
+    int ok = queries != NULL;
+
+    ret_status.code = ERROR;
+    ret_status.error_message = OUT_OF_MEMORY_STR;
+
+    if (ok && (has_delta || col->num_encodings > 0)) {
+        scratch = malloc(sizeof(position_t) * ZONE_SIZE);
+        ok = scratch != NULL;
+    }
+    if (ok && col->num_encodings > 0) {
+        decoded = malloc(sizeof(int) * ZONE_SIZE);
+        ok = decoded != NULL;
+    }
+    for (size_t q = 0; ok && q < num_queries; q++) {
+        BatchQuery *query = &queries[q];
+        query->low = lows[q];
+        query->high = highs[q];
+        query->index = q;
+        query->strategy = choose_strategy(col, n, lows[q], highs[q]);
+        if (query->strategy == SELECT_BITMAP) {
+            // zones past a query's reach are never written
+            query->result = create_result(BITMAP, n);
+            if (query->result != NULL) {
+                memset(query->result->payload, 0, sizeof(uint64_t) * bitvector_words(n));
+            }
+        } else {
+            query->capacity = n < ZONE_SIZE ? n : ZONE_SIZE;
+            query->result = create_result(POSITION, query->capacity);
+        }
+        ok = query->result != NULL;
+    }
+
+    if (ok) {
+        switch (col->type) {
+        case LONG:
+            qsort(queries, num_queries, sizeof(BatchQuery), compare_low_long);
+            SELECT_ZONES_BATCH(long, long, l);
+            break;
+        case FLOAT:
+            qsort(queries, num_queries, sizeof(BatchQuery), compare_low_float);
+            SELECT_ZONES_BATCH(float, float, f);
+            break;
+        default:
+            qsort(queries, num_queries, sizeof(BatchQuery), compare_low_int);
+            SELECT_ZONES_BATCH(int, int, i);
+            break;
+        }
+    }
+
+    for (size_t q = 0; queries != NULL && q < num_queries; q++) {
+        BatchQuery *query = &queries[q];
+        if (!ok) {
+            free_result(query->result);
+            continue;
+        }
+        if (query->strategy != SELECT_BITMAP) {
+            query->result->num_tuples = query->count;
+            if (query->count < query->capacity) {
+                void *shrunk = realloc(query->result->payload,
+                                       sizeof(position_t) * (query->count > 0 ? query->count : 1));
+                query->result->payload = shrunk != NULL ? shrunk : query->result->payload;
+            }
+        }
+        results[query->index] = query->result;
+    }
+    free(queries);
+    free(scratch);
+    free(decoded);
+
+    if (ok) {
+        ret_status.code = OK;
+        ret_status.error_message = SUCCESS_STR;
+    }
+    return ret_status;
+}
+
+
+/******************************************************************************
+ * -- result_positions --
+ *
+ * Returns the rows a POSITION or BITMAP result lists as positions: the
+ * payload itself for POSITION results, a new array (to be freed by the
+ * caller) for bitmaps.
+ *
+ * Returns NULL if out of memory
+ *
+ ******************************************************************************
+ */
+
+position_t *result_positions(const Result *result,  // IN
+                             size_t *num_positions) // OUT
+{
+    const uint64_t *bits = result->payload;
+    size_t num_words = bitvector_words(result->num_tuples);
+    size_t count = 0;
+    position_t *positions;
+
+    if (result->data_type == POSITION) {
+        *num_positions = result->num_tuples;
+        return result->payload;
+    }
+    for (size_t w = 0; w < num_words; w++) {
+        count += __builtin_popcountll(bits[w]);
+    }
+    positions = malloc(sizeof(position_t) * (count > 0 ? count : 1));
+    if (positions == NULL) {
+        return NULL;
+    }
+    count = 0;
+    for (size_t w = 0; w < num_words; w++) {
+        for (uint64_t word = bits[w]; word != 0; word &= word - 1) {
+            positions[count++] = (w << BITVECTOR_WORD_SHIFT) + __builtin_ctzll(word);
+        }
+    }
+    *num_positions = count;
+    return positions;
+}
+
+
+/*
+ * A select over earlier results split into morsels of SEGMENT_SIZE values.
+ * Like select morsels, a morsel writes its positions starting at the index
+ * of its first value and leaves their number in counts.
+ */
+typedef struct RefineTask {
+    const position_t *positions;
+    const Result *values;
+    Value low;
+    Value high;
+    position_t *out;
+    size_t *counts;
+} RefineTask;
+
+static void refine_morsel(void *arg, size_t morsel, size_t slot)
+{
+    RefineTask *task = arg;
+    size_t begin = morsel << SEGMENT_SHIFT;
+    size_t n = column_segment_length(morsel, task->values->num_tuples);
+    position_t *out = task->out + begin;
+    size_t count;
+    (void) slot;
+
+    // the kernels yield indexes into values, which map to their positions
+    switch (task->values->data_type) {
+    case LONG:
+        count = select_long((const long *) task->values->payload + begin, n,
+                            task->low.l, task->high.l, begin, out);
+        break;
+    case FLOAT:
+        count = select_float((const float *) task->values->payload + begin, n,
+                             task->low.f, task->high.f, begin, out);
+        break;
+    default:
+        count = select_int((const int *) task->values->payload + begin, n,
+                           task->low.i, task->high.i, begin, out);
+        break;
+    }
+    for (size_t k = 0; k < count; k++) {
+        out[k] = task->positions[out[k]];
+    }
+    task->counts[morsel] = count;
+}
+
+/*
+ * Runs a select over earlier results once its positions are listed.
+ * Returns 0 if out of memory.
+ */
+static int refine(RefineTask *task, Result **result)
+{
+    size_t n = task->values->num_tuples;
+    size_t num_morsels = column_segment_count(n);
+    size_t count = 0;
+
+    // the kernels write a candidate for every value they look at
+    *result = create_result(POSITION, n);
+    task->counts = malloc(sizeof(size_t) * (num_morsels > 0 ? num_morsels : 1));
+    if (*result == NULL || task->counts == NULL) {
+        free_result(*result);
+        free(task->counts);
+        return 0;
+    }
+    task->out = (*result)->payload;
+    parallel_for(num_morsels, refine_morsel, task);
+
+    for (size_t m = 0; m < num_morsels; m++) {
+        memmove(task->out + count, task->out + (m << SEGMENT_SHIFT),
+                task->counts[m] * sizeof(position_t));
+        count += task->counts[m];
+    }
+    free(task->counts);
+    (*result)->num_tuples = count;
+    if (count < n) {
+        void *shrunk = realloc(task->out, sizeof(position_t) * (count > 0 ? count : 1));
+        (*result)->payload = shrunk != NULL ? shrunk : task->out;
+    }
+    return 1;
+}
+
+
+/*****************************************************************************
+ * -- select_result --
+ *
+ * Narrows down an earlier select: keeps the positions whose fetched value
+ * lies within [low, high]. Only the values are read, not the column they
+ * came from, so a further predicate costs in proportion to the rows that
+ * passed the ones before it.
+ *
+ * params:
+ *    positions [in]    A POSITION or BITMAP result
+ *    values [in]       An INT, LONG or FLOAT result holding the values
+ *                      fetched at positions, in the same order
+ *    low [in]          Inclusive lower bound, in the type of values
+ *    high [in]         Inclusive upper bound, in the type of values
+ *    result [out]      A POSITION result holding the qualifying positions
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status select_result(const Result *positions,   // IN
+                     const Result *values,      // IN
+                     Value low,                 // IN
+                     Value high,                // IN
+                     Result **result)           // OUT
+{
+    Status ret_status = { ERROR, OUT_OF_MEMORY_STR };
+    size_t num_positions = 0;
+    RefineTask task;
+
+    task.positions = result_positions(positions, &num_positions);
+    if (task.positions == NULL) {
+        return ret_status;
+    }
+    task.values = values;
+    task.low = low;
+    task.high = high;
+    if (num_positions != values->num_tuples) {
+        log_err("%s:%d: %zu positions for %zu values\n", __FUNCTION__, __LINE__,
+                num_positions, values->num_tuples);
+        ret_status.error_message = QUERY_INVALID_STR;
+    } else if (refine(&task, result)) {
+        ret_status.code = OK;
+        ret_status.error_message = SUCCESS_STR;
+    }
+    if (task.positions != positions->payload) {
+        free((position_t *) task.positions);
+    }
+    return ret_status;
+}
+
+
+/*
+ * Gathers from an int column with compressed segments, decoding values of
+ * encoded segments and reading the others raw.
+ */
+static void fetch_encoded(const Column *col, const position_t *positions, size_t n, int *out)
+{
+    for (size_t i = 0; i < n; i++) {
+        position_t pos = positions[i];
+        const SegmentEncoding *enc = column_encoding(col, pos >> SEGMENT_SHIFT);
+        out[i] = enc != NULL ? encoded_value(enc, pos & SEGMENT_MASK) : COLUMN_VALUE(col, int, pos);
+    }
+}
+
+
+/*
+ * Gathers the values of a column of type T at the rows set in words
+ * [first_word, first_word + num_words) of a bitmap, in row order. Full
+ * words are read as a run of rows, without looking for their bits.
+ */
+#define FETCH_BITS(T, VALUE)                                                    \
+    for (size_t w = first_word, k = 0; w < first_word + num_words; w++) {      \
+        if (~bits[w] == 0) {                                                    \
+            position_t first = w << BITVECTOR_WORD_SHIFT;                       \
+            for (position_t pos = first; pos < first + BITVECTOR_WORD_BITS; pos++) { \
+                ((T *) out)[k++] = VALUE;                                       \
+            }                                                                   \
+            continue;                                                           \
+        }                                                                       \
+        for (uint64_t word = bits[w]; word != 0; word &= word - 1) {            \
+            position_t pos = (w << BITVECTOR_WORD_SHIFT) + __builtin_ctzll(word); \
+            ((T *) out)[k++] = VALUE;                                           \
+        }                                                                       \
+    }
+
+static void fetch_bits(const Column *col, const uint64_t *bits, size_t first_word,
+                       size_t num_words, void *out)
+{
+    switch (col->type) {
+    case LONG:
+        FETCH_BITS(long, COLUMN_VALUE(col, long, pos));
+        break;
+    case FLOAT:
+        FETCH_BITS(float, COLUMN_VALUE(col, float, pos));
+        break;
+    default:
+        if (col->num_encodings > 0) {
+            FETCH_BITS(int, column_encoding(col, pos >> SEGMENT_SHIFT) != NULL
+                            ? encoded_value(column_encoding(col, pos >> SEGMENT_SHIFT),
+                                            pos & SEGMENT_MASK)
+                            : COLUMN_VALUE(col, int, pos));
+        } else {
+            FETCH_BITS(int, COLUMN_VALUE(col, int, pos));
+        }
+        break;
+    }
+}
+
+
+/*
+ * Gathers the values of a column at n positions into out, with the
+ * column's updates applied.
+ */
+static void fetch_values(const Column *col, const position_t *positions, size_t n, void *out)
+{
+    switch (col->type) {
+    case LONG:
+        fetch_long(col->segments, positions, n, out);
+        break;
+    case FLOAT:
+        fetch_float(col->segments, positions, n, out);
+        break;
+    default:
+        if (col->num_encodings > 0) {
+            fetch_encoded(col, positions, n, out);
+        } else {
+            fetch_int(col->segments, positions, n, out);
+        }
+        break;
+    }
+    if (col->delta != NULL && col->delta->count > 0) {
+        column_delta_fetch(col, positions, n, out);
+    }
+}
+
+
+/*
+ * A fetch split into morsels: SEGMENT_SIZE positions of a list, or one
+ * segment of rows of a bitmap. List morsels put their values at the index
+ * of their first position, bitmap morsels after the values of the rows set
+ * before them (offsets).
+ */
+typedef struct FetchTask {
+    const Column *col;
+    const Result *positions;
+    const size_t *offsets;
+    void *out;
+} FetchTask;
+
+static void fetch_morsel(void *arg, size_t morsel, size_t slot)
+{
+    const FetchTask *task = arg;
+    const Column *col = task->col;
+    size_t width = data_type_size(col->type);
+    size_t begin = morsel << SEGMENT_SHIFT;
+    size_t n = column_segment_length(morsel, task->positions->num_tuples);
+    const position_t *positions = (const position_t *) task->positions->payload + begin;
+    void *out = (char *) task->out + begin * width;
+    (void) slot;
+
+    if (task->positions->data_type == BITMAP) {
+        fetch_bits(col, task->positions->payload, begin >> BITVECTOR_WORD_SHIFT,
+                   bitvector_words(n), (char *) task->out + task->offsets[morsel] * width);
+        return;
+    }
+    fetch_values(col, positions, n, out);
+}
+
+
+/*****************************************************************************
+ * -- fetch_column --
+ *
+ * Gathers the values of a column at a list of positions, in parallel
+ * chunks of SEGMENT_SIZE positions (segments of rows for bitmaps).
+ *
+ * params:
+ *    col [in]          The column to read
+ *    positions [in]    A POSITION or BITMAP result, e.g. the output of
+ *                      select_column
+ *    result [out]      The values, in the column's type
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status fetch_column(Column *col,                // IN
+                    const Result *positions,    // IN
+                    Result **result)            // OUT
+{
+    Status ret_status;
+    FetchTask task;
+    size_t num_morsels;
+    ret_status.code = ERROR;
+    ret_status.error_message = QUERY_INVALID_STR;
+
+    if (!is_position_result(positions)) {
+        log_err("%s:%d: fetch needs a list of positions\n", __FUNCTION__, __LINE__);
+        return ret_status;
+    }
+
+    task.col = col;
+    task.positions = positions;
+    task.offsets = NULL;
+    num_morsels = column_segment_count(positions->num_tuples);
+
+    if (positions->data_type == BITMAP) {
+        const uint64_t *bits = positions->payload;
+        size_t *offsets = malloc(sizeof(size_t) * (num_morsels > 0 ? num_morsels : 1));
+        size_t count = 0;
+        if (offsets == NULL) {
+            ret_status.error_message = OUT_OF_MEMORY_STR;
+            return ret_status;
+        }
+        for (size_t m = 0; m < num_morsels; m++) {
+            size_t first_word = (m << SEGMENT_SHIFT) >> BITVECTOR_WORD_SHIFT;
+            size_t num_words = bitvector_words(column_segment_length(m, positions->num_tuples));
+            offsets[m] = count;
+            for (size_t w = first_word; w < first_word + num_words; w++) {
+                count += __builtin_popcountll(bits[w]);
+            }
+        }
+        *result = create_result(col->type, count);
+        if (*result == NULL) {
+            free(offsets);
+            ret_status.error_message = OUT_OF_MEMORY_STR;
+            return ret_status;
+        }
+        task.offsets = offsets;
+        task.out = (*result)->payload;
+        parallel_for(num_morsels, fetch_morsel, &task);
+        free(offsets);
+        column_delta_fetch_bits(col, bits, positions->num_tuples, (*result)->payload);
+        ret_status.code = OK;
+        ret_status.error_message = SUCCESS_STR;
+        return ret_status;
+    }
+
+    *result = create_result(col->type, positions->num_tuples);
+    if (*result == NULL) {
+        ret_status.error_message = OUT_OF_MEMORY_STR;
+        return ret_status;
+    }
+    task.out = (*result)->payload;
+    parallel_for(num_morsels, fetch_morsel, &task);
+
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+    return ret_status;
+}
+
+
+/*
+ * Pipelines run morsels of one segment of their select column each, and
+ * within a morsel one zone at a time: the zone is selected, its positions
+ * pass the filters and the survivors go to a sink, which appends them (or
+ * the values fetched at them) to the output or aggregates them. The
+ * positions and values of a zone stay in the thread's cache from the
+ * select to the sink, and no intermediate ever spans more than a zone.
+ */
+typedef void (*pipeline_sink)(void *arg, size_t morsel, const position_t *positions,
+                              size_t count, void *values);
+
+/*
+ * Runs the filters of a pipeline over the count positions of a zone that
+ * passed its select: the values of each filter's column are gathered at
+ * the positions left and the positions whose value misses the range are
+ * dropped. index and values are scratch for ZONE_SIZE entries. Returns
+ * how many positions are left.
+ */
+static size_t pipeline_filter(const Pipeline *pipeline, position_t *positions, size_t count,
+                              position_t *index, void *values)
+{
+    for (size_t f = 0; f < pipeline->num_filters && count > 0; f++) {
+        const PipelineFilter *filter = &pipeline->filters[f];
+        size_t kept;
+        fetch_values(filter->col, positions, count, values);
+        // like select_result, the kernels yield indexes into values
+        switch (filter->col->type) {
+        case LONG:
+            kept = select_long(values, count, filter->low.l, filter->high.l, 0, index);
+            break;
+        case FLOAT:
+            kept = select_float(values, count, filter->low.f, filter->high.f, 0, index);
+            break;
+        default:
+            kept = select_int(values, count, filter->low.i, filter->high.i, 0, index);
+            break;
+        }
+        for (size_t k = 0; k < kept; k++) {
+            positions[k] = positions[index[k]];
+        }
+        count = kept;
+    }
+    return count;
+}
+
+/*
+ * Selects zones [zone_begin, zone_end) of a select column of type T and
+ * hands each zone's positions that pass the filters to the sink.
+ */
+#define PIPELINE_ZONES(T, NAME, FIELD)                                          \
+    for (size_t z = zone_begin; z < zone_end; z++) {                            \
+        size_t count = 0;                                                       \
+        ZONE_BOUNDS(T)                                                          \
+        SELECT_ZONE(T, FIELD, pipeline->low, pipeline->high, select_##NAME,    \
+                    positions, count);                                          \
+        count = pipeline_filter(pipeline, positions, count, scratch, gathered); \
+        sink(arg, morsel, positions, count, gathered);                          \
+    }
+
+/*
+ * Returns the index of the first of n ascending positions at or after pos.
+ */
+static size_t first_position(const position_t *positions, size_t n, size_t pos)
+{
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (positions[mid] < pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * Runs a pipeline over segment morsel of its select column. If the select
+ * was answered by the column's cracker column, selected holds its
+ * num_selected positions, and the segment's share of them goes through
+ * the filters and to the sink ZONE_SIZE positions at a time instead.
+ */
+static void pipeline_segment(const Pipeline *pipeline, const position_t *selected,
+                             size_t num_selected, size_t morsel, pipeline_sink sink, void *arg)
+{
+    // the names the zone macros expect
+    const Column *col = pipeline->col;
+    size_t n = column_length(col);
+    const uint64_t *deleted = col->table->num_deleted > 0 ? col->table->deleted : NULL;
+    int has_delta = col->delta != NULL && col->delta->count > 0;
+    size_t zone_begin = morsel << (SEGMENT_SHIFT - ZONE_SHIFT);
+    size_t zone_end = column_zone_count(column_segment_length(morsel, n)) + zone_begin;
+    position_t positions[ZONE_SIZE];
+    position_t scratch[ZONE_SIZE];
+    // values of the widest type
+    long gathered[ZONE_SIZE];
+
+    if (selected != NULL) {
+        size_t first = first_position(selected, num_selected, morsel << SEGMENT_SHIFT);
+        size_t last = first_position(selected, num_selected, (morsel + 1) << SEGMENT_SHIFT);
+        for (; first < last; first += ZONE_SIZE) {
+            size_t count = last - first < ZONE_SIZE ? last - first : ZONE_SIZE;
+            memcpy(positions, selected + first, sizeof(position_t) * count);
+            count = pipeline_filter(pipeline, positions, count, scratch, gathered);
+            sink(arg, morsel, positions, count, gathered);
+        }
+        return;
+    }
+
+    switch (col->type) {
+    case LONG:
+        PIPELINE_ZONES(long, long, l);
+        break;
+    case FLOAT:
+        PIPELINE_ZONES(float, float, f);
+        break;
+    default:
+        PIPELINE_ZONES(int, int, i);
+        break;
+    }
+}
+
+/*
+ * A pipeline materializing its output: positions, or the fetched values.
+ * Like select morsels, a morsel writes its output starting at the index
+ * of its first row and leaves its length in counts.
+ */
+typedef struct PipelineTask {
+    const Pipeline *pipeline;
+    // positions of the select if it went through a cracker column
+    position_t *selected;
+    size_t num_selected;
+    char *out;
+    size_t width;
+    size_t *counts;
+} PipelineTask;
+
+static void pipeline_emit(void *arg, size_t morsel, const position_t *positions, size_t count,
+                          void *values)
+{
+    PipelineTask *task = arg;
+    size_t at = (morsel << SEGMENT_SHIFT) + task->counts[morsel];
+    (void) values;
+
+    if (task->pipeline->fetch != NULL) {
+        fetch_values(task->pipeline->fetch, positions, count, task->out + at * task->width);
+    } else {
+        memcpy(task->out + at * task->width, positions, count * sizeof(position_t));
+    }
+    task->counts[morsel] += count;
+}
+
+static void pipeline_morsel(void *arg, size_t morsel, size_t slot)
+{
+    PipelineTask *task = arg;
+    (void) slot;
+    pipeline_segment(task->pipeline, task->selected, task->num_selected, morsel,
+                     pipeline_emit, task);
+}
+
+/*
+ * Runs the select of a pipeline through the index of its select column,
+ * unless select_column would answer it with a bitmap. Returns the
+ * positions, NULL if the pipeline has to scan.
+ */
+static position_t *pipeline_index(const Pipeline *pipeline, size_t *count)
+{
+    Column *col = pipeline->col;
+
+    *count = 0;
+    if (!col->clustered &&
+        choose_strategy(col, column_length(col), pipeline->low, pipeline->high) == SELECT_BITMAP) {
+        return NULL;
+    }
+    return index_select(col, pipeline->low, pipeline->high, count);
+}
+
+
+/*****************************************************************************
+ * -- pipeline_result --
+ *
+ * Materializes the output of a pipeline: the positions it selects, or the
+ * values it fetches at them, in row order. A bare select is left to
+ * select_column, which may answer with a bitmap.
+ *
+ * params:
+ *    pipeline [in]     The pipeline to run
+ *    result [out]      A POSITION result, or the values in the type of
+ *                      the fetched column
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status pipeline_result(const Pipeline *pipeline,    // IN
+                       Result **result)             // OUT
+{
+    Status ret_status = { ERROR, OUT_OF_MEMORY_STR };
+    size_t n = column_length(pipeline->col);
+    size_t num_morsels = column_segment_count(n);
+    DataType type = pipeline->fetch != NULL ? pipeline->fetch->type : POSITION;
+    PipelineTask task;
+    size_t count = 0;
+
+    if (pipeline->num_filters == 0 && pipeline->fetch == NULL) {
+        return select_column(pipeline->col, pipeline->low, pipeline->high, result);
+    }
+
+    // sized for the worst case and shrunk afterwards, like select_column
+    *result = create_result(type, n);
+    task.counts = calloc(num_morsels > 0 ? num_morsels : 1, sizeof(size_t));
+    if (*result == NULL || task.counts == NULL) {
+        free_result(*result);
+        free(task.counts);
+        return ret_status;
+    }
+    task.pipeline = pipeline;
+    task.selected = pipeline_index(pipeline, &task.num_selected);
+    task.out = (*result)->payload;
+    task.width = data_type_size(type);
+    parallel_for(num_morsels, pipeline_morsel, &task);
+    free(task.selected);
+
+    for (size_t m = 0; m < num_morsels; m++) {
+        memmove(task.out + count * task.width, task.out + (m << SEGMENT_SHIFT) * task.width,
+                task.counts[m] * task.width);
+        count += task.counts[m];
+    }
+    free(task.counts);
+    (*result)->num_tuples = count;
+    if (count < n) {
+        void *shrunk = realloc(task.out, task.width * (count > 0 ? count : 1));
+        (*result)->payload = shrunk != NULL ? shrunk : task.out;
+    }
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+    return ret_status;
+}
+
+
+/*
+ * Returns the tombstone words of segment s if any of its first length rows
+ * is deleted, NULL otherwise.
+ */
+static const uint64_t *segment_mask(const Table *table, size_t s, size_t length)
+{
+    size_t begin = s << SEGMENT_SHIFT;
+    if (table->num_deleted == 0 || !bitvector_any(table->deleted, begin, length)) {
+        return NULL;
+    }
+    return table->deleted + (begin >> BITVECTOR_WORD_SHIFT);
+}
+
+/*
+ * An aggregate split into chunks of SEGMENT_SIZE values: the segments of a
+ * column, or slices of a result. Every chunk leaves a partial aggregate
+ * (sum in the sum type, extreme in the input type, and whether it had any
+ * value) that run_aggregate merges once all chunks are done. Chunks
+ * needing a copy of their values (patched by a delta or masked by
+ * tombstones) use the scratch buffer of the thread running them.
+ *
+ * With a pipeline, chunks are the segments of its select column and only
+ * the values the pipeline fetches count; chunks also leave how many those
+ * were.
+ */
+typedef struct AggregateTask {
+    AggregateType type;
+    DataType data_type;
+    // the column aggregated, NULL for a result
+    const Column *col;
+    const void *values;
+    size_t num_values;
+    int encoded;
+    const Pipeline *pipeline;
+    position_t *selected;
+    size_t num_selected;
+    void **scratch;
+    int failed;
+    void *sums;
+    void *extremes;
+    unsigned char *found;
+    size_t *counts;
+} AggregateTask;
+
+/*
+ * Returns the scratch buffer of a thread, allocated on first use, NULL if
+ * out of memory.
+ */
+static void *slot_scratch(AggregateTask *task, size_t slot)
+{
+    if (task->scratch[slot] == NULL) {
+        task->scratch[slot] = malloc(SEGMENT_SIZE * sizeof(long));
+        if (task->scratch[slot] == NULL) {
+            task->failed = 1;
+        }
+    }
+    return task->scratch[slot];
+}
+
+/*
+ * Computes the partial aggregate of chunk c of values of type T. Chunks
+ * the column's delta has entries for are first copied to scratch and
+ * patched, chunks with a tombstone mask reduced to their live values.
+ */
+#define AGGREGATE_CHUNK(T, NAME, SUM_T)                                         \
+    do {                                                                        \
+        const T *values;                                                        \
+        size_t length;                                                          \
+        const uint64_t *mask = NULL;                                            \
+        int patch = 0;                                                          \
+        SUM_T sum = 0;                                                          \
+        T extreme = 0;                                                          \
+        if (col != NULL) {                                                      \
+            values = col->segments[c];                                          \
+            length = column_segment_length(c, task->num_values);                \
+            mask = segment_mask(col->table, c, length);                         \
+            patch = column_delta_any(col, c << SEGMENT_SHIFT, length);          \
+        } else {                                                                \
+            values = (const T *) task->values + (c << SEGMENT_SHIFT);           \
+            length = column_segment_length(c, task->num_values);                \
+        }                                                                       \
+        if (patch || mask != NULL) {                                            \
+            T *scratch = slot_scratch(task, slot);                              \
+            if (scratch == NULL) {                                              \
+                return;                                                         \
+            }                                                                   \
+            if (patch) {                                                        \
+                memcpy(scratch, values, length * sizeof(T));                    \
+                column_delta_patch(col, c << SEGMENT_SHIFT, length, scratch);   \
+                values = scratch;                                               \
+            }                                                                   \
+            if (mask != NULL) {                                                 \
+                length = live_##NAME(values, mask, length, scratch);            \
+                values = scratch;                                               \
+            }                                                                   \
+        }                                                                       \
+        if (task->type == SUM || task->type == AVG) {                           \
+            sum = sum_##NAME(values, length);                                   \
+        } else if (length > 0) {                                                \
+            extreme = task->type == MIN ? min_##NAME(values, length, values[0]) \
+                                        : max_##NAME(values, length, values[0]); \
+        }                                                                       \
+        ((SUM_T *) task->sums)[c] = sum;                                        \
+        ((T *) task->extremes)[c] = extreme;                                    \
+        task->found[c] = length > 0;                                            \
+    } while (0)
+
+/*
+ * Partial aggregate of segment s of an int column with compressed
+ * segments. Encoded segments are summed on their codes and answer min and
+ * max from their headers, unless rows of them were deleted or updated;
+ * those are decoded, patched and masked first.
+ */
+static void aggregate_encoded(AggregateTask *task, size_t s, size_t slot)
+{
+    const Column *col = task->col;
+    const SegmentEncoding *enc = column_encoding(col, s);
+    const int *values = col->segments[s];
+    size_t length = column_segment_length(s, task->num_values);
+    const uint64_t *mask = segment_mask(col->table, s, length);
+    int patch = column_delta_any(col, s << SEGMENT_SHIFT, length);
+    long sum = 0;
+    int extreme = 0;
+
+    if (patch || mask != NULL) {
+        int *scratch = slot_scratch(task, slot);
+        if (scratch == NULL) {
+            return;
+        }
+        if (enc != NULL) {
+            encoded_decode(enc, 0, length, scratch);
+        } else {
+            memcpy(scratch, values, length * sizeof(int));
+        }
+        values = scratch;
+        enc = NULL;
+        if (patch) {
+            column_delta_patch(col, s << SEGMENT_SHIFT, length, scratch);
+        }
+        if (mask != NULL) {
+            length = live_int(values, mask, length, scratch);
+        }
+    }
+    if (task->type == SUM || task->type == AVG) {
+        sum = enc != NULL ? encoded_sum(enc, length) : sum_int(values, length);
+    } else if (enc != NULL) {
+        extreme = task->type == MIN ? enc->header.min : enc->header.max;
+    } else if (length > 0) {
+        extreme = task->type == MIN ? min_int(values, length, values[0])
+                                    : max_int(values, length, values[0]);
+    }
+    ((long *) task->sums)[s] = sum;
+    ((int *) task->extremes)[s] = extreme;
+    task->found[s] = length > 0;
+}
+
+/*
+ * Pipeline sink of aggregates: adds the values of the aggregated column
+ * of type T at the count positions of a zone to the partial aggregate of
+ * chunk c, gathering them into the zone's scratch buffer first.
+ */
+#define AGGREGATE_POSITIONS(T, NAME, SUM_T)                                     \
+    do {                                                                        \
+        T *vals = gathered;                                                     \
+        T *extreme = (T *) task->extremes + c;                                  \
+        fetch_values(task->col, positions, count, vals);                        \
+        if (task->type == SUM || task->type == AVG) {                           \
+            ((SUM_T *) task->sums)[c] += sum_##NAME(vals, count);               \
+            break;                                                              \
+        }                                                                       \
+        if (!task->found[c]) {                                                  \
+            *extreme = vals[0];                                                 \
+        }                                                                       \
+        *extreme = task->type == MIN ? min_##NAME(vals, count, *extreme)        \
+                                     : max_##NAME(vals, count, *extreme);       \
+    } while (0)
+
+static void aggregate_sink(void *arg, size_t c, const position_t *positions, size_t count,
+                           void *gathered)
+{
+    AggregateTask *task = arg;
+
+    if (count == 0) {
+        return;
+    }
+    switch (task->data_type) {
+    case LONG:
+        AGGREGATE_POSITIONS(long, long, long);
+        break;
+    case FLOAT:
+        AGGREGATE_POSITIONS(float, float, double);
+        break;
+    default:
+        AGGREGATE_POSITIONS(int, int, long);
+        break;
+    }
+    task->found[c] = 1;
+    task->counts[c] += count;
+}
+
+static void aggregate_morsel(void *arg, size_t c, size_t slot)
+{
+    AggregateTask *task = arg;
+    const Column *col = task->col;
+
+    if (task->pipeline != NULL) {
+        pipeline_segment(task->pipeline, task->selected, task->num_selected, c,
+                         aggregate_sink, task);
+        return;
+    }
+    if (task->encoded) {
+        aggregate_encoded(task, c, slot);
+        return;
+    }
+    switch (task->data_type) {
+    case LONG:
+        AGGREGATE_CHUNK(long, long, long);
+        break;
+    case FLOAT:
+        AGGREGATE_CHUNK(float, float, double);
+        break;
+    case DOUBLE:
+        AGGREGATE_CHUNK(double, double, double);
+        break;
+    default:
+        AGGREGATE_CHUNK(int, int, long);
+        break;
+    }
+}
+
+/*
+ * Merges the partial aggregates of num_chunks chunks of values of type T
+ * into *result. Sums are accumulated in SUM_T and reported as SUM_TYPE;
+ * averages are always DOUBLE over total values; min and max keep the
+ * input type. Aggregates other than SUM over no values produce an empty
+ * result.
+ */
+#define MERGE_CHUNKS(T, SUM_T, SUM_TYPE)                                        \
+    do {                                                                        \
+        SUM_T sum = 0;                                                          \
+        T extreme = 0;                                                          \
+        int found = 0;                                                          \
+        for (size_t c = 0; c < num_chunks; c++) {                               \
+            T value = ((const T *) task->extremes)[c];                          \
+            sum += ((const SUM_T *) task->sums)[c];                             \
+            if (task->found[c] && (!found || (type == MIN ? value < extreme     \
+                                                          : value > extreme))) { \
+                extreme = value;                                                \
+                found = 1;                                                      \
+            }                                                                   \
+        }                                                                       \
+        if (type == SUM) {                                                      \
+            *result = create_result(SUM_TYPE, 1);                               \
+            if (*result != NULL) {                                              \
+                *(SUM_T *) (*result)->payload = sum;                            \
+            }                                                                   \
+        } else if (type == AVG) {                                               \
+            *result = create_result(DOUBLE, total > 0);                         \
+            if (*result != NULL) {                                              \
+                *(double *) (*result)->payload = (double) sum / total;          \
+            }                                                                   \
+        } else {                                                                \
+            *result = create_result(task->data_type, found);                    \
+            if (*result != NULL && found) {                                     \
+                *(T *) (*result)->payload = extreme;                            \
+            }                                                                   \
+        }                                                                       \
+    } while (0)
+
+/*
+ * Runs an aggregate task over all its chunks on the thread pool and
+ * merges their partial aggregates into *result. total is the number of
+ * values averages divide by; with a pipeline it is counted instead.
+ * Leaves *result NULL if out of memory.
+ */
+static void run_aggregate(AggregateTask *task, size_t total, Result **result)
+{
+    AggregateType type = task->type;
+    size_t num_chunks = column_segment_count(task->num_values);
+    size_t slots = thread_pool_slots();
+
+    *result = NULL;
+    task->failed = 0;
+    task->scratch = calloc(slots, sizeof(void *));
+    // fused chunks add to their partials, so these start out zero
+    task->sums = calloc(num_chunks > 0 ? num_chunks : 1, sizeof(double));
+    task->extremes = malloc(sizeof(double) * (num_chunks > 0 ? num_chunks : 1));
+    task->found = calloc(num_chunks > 0 ? num_chunks : 1, 1);
+    task->counts = calloc(num_chunks > 0 ? num_chunks : 1, sizeof(size_t));
+    if (task->scratch != NULL && task->sums != NULL && task->extremes != NULL &&
+        task->found != NULL && task->counts != NULL) {
+        parallel_for(num_chunks, aggregate_morsel, task);
+        if (task->pipeline != NULL) {
+            total = 0;
+            for (size_t c = 0; c < num_chunks; c++) {
+                total += task->counts[c];
+            }
+        }
+        if (!task->failed) {
+            switch (task->data_type) {
+            case LONG:
+                MERGE_CHUNKS(long, long, LONG);
+                break;
+            case FLOAT:
+                MERGE_CHUNKS(float, double, DOUBLE);
+                break;
+            case DOUBLE:
+                MERGE_CHUNKS(double, double, DOUBLE);
+                break;
+            default:
+                MERGE_CHUNKS(int, long, LONG);
+                break;
+            }
+        }
+    }
+    for (size_t s = 0; task->scratch != NULL && s < slots; s++) {
+        free(task->scratch[s]);
+    }
+    free(task->scratch);
+    free(task->sums);
+    free(task->extremes);
+    free(task->found);
+    free(task->counts);
+}
+
+/*****************************************************************************
+ * -- aggregate --
+ *
+ * Computes sum, avg, min or max over a column or a result, in parallel
+ * chunks of SEGMENT_SIZE values.
+ *
+ * params:
+ *    type [in]         The aggregate to compute
+ *    input [in]        The column or result to aggregate
+ *    result [out]      A result holding a single value
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status aggregate(AggregateType type,                // IN
+                 const GeneralizedColumn *input,    // IN
+                 Result **result)                   // OUT
+{
+    Status ret_status;
+    AggregateTask task;
+    size_t total;
+
+    ret_status.code = ERROR;
+    ret_status.error_message = OUT_OF_MEMORY_STR;
+    *result = NULL;
+
+    task.type = type;
+    task.pipeline = NULL;
+    task.selected = NULL;
+    task.num_selected = 0;
+    if (input->column_type == COLUMN) {
+        Column *col = input->column_pointer.column;
+        task.col = col;
+        task.values = NULL;
+        task.num_values = column_length(col);
+        task.data_type = col->type;
+        task.encoded = col->num_encodings > 0;
+        // averages are over the rows still live
+        total = task.num_values - col->table->num_deleted;
+    } else {
+        Result *res = input->column_pointer.result;
+        task.col = NULL;
+        task.values = res->payload;
+        task.num_values = res->num_tuples;
+        task.data_type = res->data_type;
+        task.encoded = 0;
+        total = res->num_tuples;
+    }
+    if (task.data_type == POSITION || task.data_type == BITMAP) {
+        log_err("%s:%d: Cannot aggregate positions\n", __FUNCTION__, __LINE__);
+        ret_status.error_message = QUERY_INVALID_STR;
+        return ret_status;
+    }
+
+    run_aggregate(&task, total, result);
+    if (*result == NULL) {
+        return ret_status;
+    }
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+    return ret_status;
+}
+
+
+/*****************************************************************************
+ * -- aggregate_pipeline --
+ *
+ * Computes sum, avg, min or max over the values a pipeline fetches,
+ * without materializing them or the positions they are fetched at: each
+ * thread runs the pipeline one zone of rows at a time and aggregates the
+ * zone's values while they are in its cache.
+ *
+ * params:
+ *    type [in]         The aggregate to compute
+ *    pipeline [in]     A pipeline with a fetch column
+ *    result [out]      A result holding a single value
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status aggregate_pipeline(AggregateType type,           // IN
+                          const Pipeline *pipeline,     // IN
+                          Result **result)              // OUT
+{
+    Status ret_status;
+    AggregateTask task;
+
+    ret_status.code = ERROR;
+    ret_status.error_message = OUT_OF_MEMORY_STR;
+    *result = NULL;
+
+    if (pipeline->fetch == NULL) {
+        log_err("%s:%d: Cannot aggregate positions\n", __FUNCTION__, __LINE__);
+        ret_status.error_message = QUERY_INVALID_STR;
+        return ret_status;
+    }
+    task.type = type;
+    task.data_type = pipeline->fetch->type;
+    task.col = pipeline->fetch;
+    task.values = NULL;
+    task.num_values = column_length(pipeline->col);
+    task.encoded = 0;
+    task.pipeline = pipeline;
+    task.selected = pipeline_index(pipeline, &task.num_selected);
+
+    run_aggregate(&task, 0, result);
+    free(task.selected);
+    if (*result == NULL) {
+        return ret_status;
+    }
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+    return ret_status;
+}
+
+
+/*
+ * Arithmetic over two results, in morsels of SEGMENT_SIZE values. Inputs
+ * of the same type go straight to the add/sub kernels of their type;
+ * mixed inputs are first converted to the type of the output, in blocks
+ * of ARITHMETIC_BLOCK values.
+ */
+#define ARITHMETIC_BLOCK 1024
+
+typedef struct ArithmeticTask {
+    ArithmeticType type;
+    const Result *left;
+    const Result *right;
+    Result *out;
+} ArithmeticTask;
+
+/*
+ * Returns the type add and sub produce from inputs of types a and b:
+ * DOUBLE if either is a decimal, LONG otherwise.
+ */
+static DataType arithmetic_type(DataType a, DataType b)
+{
+    if (a == FLOAT || a == DOUBLE || b == FLOAT || b == DOUBLE) {
+        return DOUBLE;
+    }
+    return LONG;
+}
+
+/*
+ * Copies n values of a result, from index begin on, to out converted to
+ * WIDE_T.
+ */
+#define CONVERT_VALUES(WIDE_T)                                                  \
+    do {                                                                        \
+        WIDE_T *wide = out;                                                     \
+        for (size_t k = 0; k < n; k++) {                                        \
+            switch (input->data_type) {                                         \
+            case LONG:                                                          \
+                wide[k] = (WIDE_T) ((const long *) input->payload)[begin + k];  \
+                break;                                                          \
+            case FLOAT:                                                         \
+                wide[k] = (WIDE_T) ((const float *) input->payload)[begin + k]; \
+                break;                                                          \
+            case DOUBLE:                                                        \
+                wide[k] = (WIDE_T) ((const double *) input->payload)[begin + k]; \
+                break;                                                          \
+            default:                                                            \
+                wide[k] = (WIDE_T) ((const int *) input->payload)[begin + k];   \
+                break;                                                          \
+            }                                                                   \
+        }                                                                       \
+    } while (0)
+
+static void convert_values(const Result *input, size_t begin, size_t n, DataType to, void *out)
+{
+    if (to == DOUBLE) {
+        CONVERT_VALUES(double);
+    } else {
+        CONVERT_VALUES(long);
+    }
+}
+
+/*
+ * Applies the add or sub kernel of type T to the n values at left and
+ * right, writing the output from index begin on.
+ */
+#define ARITHMETIC_KERNEL(T, NAME, SUM_T)                                       \
+    do {                                                                        \
+        const T *a = left;                                                      \
+        const T *b = right;                                                     \
+        SUM_T *out = (SUM_T *) task->out->payload + begin;                      \
+        if (task->type == ADD) {                                                \
+            add_##NAME(a, b, n, out);                                           \
+        } else {                                                                \
+            sub_##NAME(a, b, n, out);                                           \
+        }                                                                       \
+    } while (0)
+
+static void arithmetic_span(const ArithmeticTask *task, DataType type, const void *left,
+                            const void *right, size_t begin, size_t n)
+{
+    switch (type) {
+    case LONG:
+        ARITHMETIC_KERNEL(long, long, long);
+        break;
+    case FLOAT:
+        ARITHMETIC_KERNEL(float, float, double);
+        break;
+    case DOUBLE:
+        ARITHMETIC_KERNEL(double, double, double);
+        break;
+    default:
+        ARITHMETIC_KERNEL(int, int, long);
+        break;
+    }
+}
+
+static void arithmetic_morsel(void *arg, size_t morsel, size_t slot)
+{
+    const ArithmeticTask *task = arg;
+    size_t begin = morsel << SEGMENT_SHIFT;
+    size_t n = column_segment_length(morsel, task->out->num_tuples);
+    DataType to = task->out->data_type;
+    (void) slot;
+
+    if (task->left->data_type == task->right->data_type) {
+        size_t width = data_type_size(task->left->data_type);
+        arithmetic_span(task, task->left->data_type,
+                        (const char *) task->left->payload + begin * width,
+                        (const char *) task->right->payload + begin * width, begin, n);
+        return;
+    }
+    for (size_t i = begin; i < begin + n; i += ARITHMETIC_BLOCK) {
+        size_t length = begin + n - i < ARITHMETIC_BLOCK ? begin + n - i : ARITHMETIC_BLOCK;
+        union {
+            long l[ARITHMETIC_BLOCK];
+            double d[ARITHMETIC_BLOCK];
+        } a, b;
+        convert_values(task->left, i, length, to, &a);
+        convert_values(task->right, i, length, to, &b);
+        arithmetic_span(task, to, &a, &b, i, length);
+    }
+}
+
+
+/*****************************************************************************
+ * -- arithmetic --
+ *
+ * Adds or subtracts two results value by value, in parallel chunks of
+ * SEGMENT_SIZE values. Integers are added as 64 bit integers and decimals
+ * as doubles, so the sum of two int or long results is a LONG result and
+ * any sum involving a decimal a DOUBLE one.
+ *
+ * params:
+ *    type [in]         ADD or SUB
+ *    left [in]         The values to add to, or subtract from
+ *    right [in]        The values to add, or subtract, as many as left
+ *    result [out]      left + right, or left - right
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status arithmetic(ArithmeticType type,  // IN
+                  const Result *left,   // IN
+                  const Result *right,  // IN
+                  Result **result)      // OUT
+{
+    Status ret_status;
+    ArithmeticTask task;
+
+    ret_status.code = ERROR;
+    ret_status.error_message = QUERY_INVALID_STR;
+    *result = NULL;
+
+    if (is_position_result(left) || is_position_result(right)) {
+        log_err("%s:%d: Cannot add positions\n", __FUNCTION__, __LINE__);
+        return ret_status;
+    }
+    if (left->num_tuples != right->num_tuples) {
+        log_err("%s:%d: %zu values and %zu values\n", __FUNCTION__, __LINE__,
+                left->num_tuples, right->num_tuples);
+        return ret_status;
+    }
+
+    *result = create_result(arithmetic_type(left->data_type, right->data_type),
+                            left->num_tuples);
+    if (*result == NULL) {
+        ret_status.error_message = OUT_OF_MEMORY_STR;
+        return ret_status;
+    }
+    task.type = type;
+    task.left = left;
+    task.right = right;
+    task.out = *result;
+    parallel_for(column_segment_count(left->num_tuples), arithmetic_morsel, &task);
+
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+    return ret_status;
+}
+
+
+/******************************************************************************
+ * -- format_value --
+ *
+ * Writes the i-th value of a result to buf. Decimals are printed with two
+ * places, which is what the test harness compares against.
+ *
+ * Returns the number of characters written
+ *
+ ******************************************************************************
+ */
+
+static int format_value(char *buf, size_t size, const Result *result, size_t i)
+{
+    switch (result->data_type) {
+    case LONG:
+        return snprintf(buf, size, "%ld", ((long *) result->payload)[i]);
+    case FLOAT:
+        return snprintf(buf, size, "%.2f", ((float *) result->payload)[i]);
+    case DOUBLE:
+        return snprintf(buf, size, "%.2f", ((double *) result->payload)[i]);
+    case POSITION:
+        return snprintf(buf, size, "%u", ((position_t *) result->payload)[i]);
+    case INT:
+    default:
+        return snprintf(buf, size, "%d", ((int *) result->payload)[i]);
+    }
+}
+
+
+/*
+ * Releases the position lists print_results made for the first num_results
+ * results, and the array holding them.
+ */
+static void free_shown(Result *shown, Result **results, size_t num_results)
+{
+    for (size_t r = 0; r < num_results; r++) {
+        if (results[r]->data_type == BITMAP) {
+            free(shown[r].payload);
+        }
+    }
+    free(shown);
+}
+
+
+/*****************************************************************************
+ * -- print_results --
+ *
+ * Renders results side by side, one row per line and values separated by
+ * commas. Shorter results leave their cells empty. Bitmaps are printed as
+ * the positions they hold.
+ *
+ * params:
+ *    results [in]      The results to print
+ *    num_results [in]  The number of results
+ *    output [out]      The rendered text, allocated here
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+// longest rendering of a single value, plus its separator
+#define MAX_VALUE_CHARS 48
+
+Status print_results(Result **results,      // IN
+                     size_t num_results,    // IN
+                     char **output)         // OUT
+{
+    Status ret_status;
+    size_t rows = 0;
+    size_t length = 0;
+    size_t capacity;
+    char *text;
+    // the results as printed, bitmaps turned into positions
+    Result *shown;
+
+    ret_status.code = ERROR;
+    ret_status.error_message = OUT_OF_MEMORY_STR;
+
+    shown = malloc(sizeof(Result) * (num_results > 0 ? num_results : 1));
+    if (shown == NULL) {
+        return ret_status;
+    }
+    for (size_t r = 0; r < num_results; r++) {
+        shown[r] = *results[r];
+        if (results[r]->data_type == BITMAP) {
+            shown[r].data_type = POSITION;
+            shown[r].payload = result_positions(results[r], &shown[r].num_tuples);
+            if (shown[r].payload == NULL) {
+                free_shown(shown, results, r);
+                return ret_status;
+            }
+        }
+        if (shown[r].num_tuples > rows) {
+            rows = shown[r].num_tuples;
+        }
+    }
+
+    capacity = rows * num_results * MAX_VALUE_CHARS + 1;
+    text = malloc(capacity);
+    if (text == NULL) {
+        free_shown(shown, results, num_results);
+        return ret_status;
+    }
+
+    for (size_t i = 0; i < rows; i++) {
+        for (size_t r = 0; r < num_results; r++) {
+            if (i < shown[r].num_tuples) {
+                length += format_value(text + length, capacity - length, &shown[r], i);
+            }
+            text[length++] = r + 1 < num_results ? ',' : '\n';
+        }
+    }
+    // the client adds the final newline
+    if (length > 0) {
+        length--;
+    }
+    text[length] = '\0';
+    free_shown(shown, results, num_results);
+
+    *output = text;
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+    return ret_status;
+}
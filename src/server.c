@@ -12,8 +12,11 @@
  * For more information on unix sockets, refer to:
  * http://beej.us/guide/bgipc/output/html/multipage/unixsock.html
  **/
+#define _DEFAULT_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/un.h>
@@ -27,16 +30,226 @@
 #include "message.h"
 #include "utils.h"
 #include "client_context.h"
+#include "column.h"
+#include "index.h"
+#include "persistence.h"
+#include "query.h"
+#include "threadpool.h"
+#include "wal.h"
 
 #define DEFAULT_QUERY_BUFFER_SIZE 1024
 
+// longest statement a client may send; batched inserts stay far below
+#define MAX_STATEMENT_LENGTH (1 << 26)
+
+// set once a client asked the server to persist its data and exit
+static volatile int shutdown_requested = 0;
+static int server_socket = -1;
+
+/*
+ * Every client is served by its own thread. Statements that only read
+ * (queries on handles and print) share db_lock, everything that changes
+ * the catalog or the data holds it exclusively. The lock is held from
+ * parsing on, since parsing resolves table and column pointers.
+ */
+static pthread_rwlock_t db_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ * Sockets of the connected clients. Compaction moves rows, so it only runs
+ * in the background while no client holds position lists from before. On
+ * shutdown main stops reading from every client and waits on clients_done
+ * until the last one sent its reply and left.
+ */
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t clients_done = PTHREAD_COND_INITIALIZER;
+static int* client_sockets = NULL;
+static int clients_capacity = 0;
+static int active_clients = 0;
+
+/*
+ * Registers a connected client. Returns false if there is no memory to
+ * track it.
+ */
+static bool client_join(int client_socket) {
+    bool joined = true;
+    pthread_mutex_lock(&clients_lock);
+    if (active_clients == clients_capacity) {
+        int capacity = clients_capacity > 0 ? 2 * clients_capacity : 16;
+        int* sockets = realloc(client_sockets, capacity * sizeof(int));
+        if (sockets == NULL) {
+            joined = false;
+        } else {
+            client_sockets = sockets;
+            clients_capacity = capacity;
+        }
+    }
+    if (joined) {
+        client_sockets[active_clients++] = client_socket;
+    }
+    pthread_mutex_unlock(&clients_lock);
+    return joined;
+}
+
+static void client_leave(int client_socket) {
+    pthread_mutex_lock(&clients_lock);
+    for (int i = 0; i < active_clients; i++) {
+        if (client_sockets[i] == client_socket) {
+            client_sockets[i] = client_sockets[--active_clients];
+            break;
+        }
+    }
+    if (active_clients == 0) {
+        pthread_cond_broadcast(&clients_done);
+    }
+    pthread_mutex_unlock(&clients_lock);
+}
+
+/*
+ * Statements binding a handle (h=select(...), h=fetch(...), ...), print
+ * and batches of selects only read the database; anything else is treated
+ * as a change.
+ */
+static bool statement_reads_only(const char* statement) {
+    while (*statement == ' ' || *statement == '\t') {
+        statement++;
+    }
+    const char* paren = strchr(statement, '(');
+    const char* equals = strchr(statement, '=');
+    return (equals != NULL && (paren == NULL || equals < paren)) ||
+           strncmp(statement, "print", 5) == 0 ||
+           strncmp(statement, "batch_", 6) == 0 ||
+           strncmp(statement, "--", 2) == 0;
+}
+
+/*****************************************************************************
+ * -- store_query_result --
+ *
+ * Binds the result of an operator to the handle the client named it by.
+ * The result is released if it could not be stored.
+ *
+ *****************************************************************************
+ */
+
+static Status store_query_result(DbOperator* query, Status status, Result* result) {
+    if (status.code != OK) {
+        return status;
+    }
+    status = store_result(query->context, query->handle, result);
+    if (status.code != OK) {
+        free_result(result);
+    }
+    return status;
+}
+
+/*****************************************************************************
+ * -- execute_batch --
+ *
+ * Runs the selects of a batch with one shared scan per column, then binds
+ * the results to their handles in the order the selects were issued.
+ *
+ *****************************************************************************
+ */
+
+static Status execute_batch(DbOperator* query) {
+    BatchOperator* batch = &query->operator_fields.batch_operator;
+    size_t n = batch->num_selects;
+    Status stat = { OK, SUCCESS_STR };
+    bool* scanned = calloc(n + 1, sizeof(bool));
+    size_t* members = malloc(sizeof(size_t) * (n + 1));
+    Value* lows = malloc(sizeof(Value) * (n + 1));
+    Value* highs = malloc(sizeof(Value) * (n + 1));
+    Result** group = malloc(sizeof(Result*) * (n + 1));
+    Result** results = calloc(n + 1, sizeof(Result*));
+
+    if (scanned == NULL || members == NULL || lows == NULL || highs == NULL ||
+        group == NULL || results == NULL) {
+        stat.code = ERROR;
+        stat.error_message = OUT_OF_MEMORY_STR;
+    }
+    for (size_t i = 0; stat.code == OK && i < n; i++) {
+        Column* col = batch->selects[i].col;
+        size_t num_members = 0;
+        if (scanned[i]) {
+            continue;
+        }
+        for (size_t j = i; j < n; j++) {
+            if (!scanned[j] && batch->selects[j].col == col) {
+                scanned[j] = true;
+                members[num_members] = j;
+                lows[num_members] = batch->selects[j].lower;
+                highs[num_members] = batch->selects[j].upper;
+                num_members++;
+            }
+        }
+        stat = select_column_batch(col, lows, highs, num_members, group);
+        for (size_t k = 0; stat.code == OK && k < num_members; k++) {
+            results[members[k]] = group[k];
+        }
+    }
+    for (size_t i = 0; results != NULL && i < n; i++) {
+        if (stat.code == OK) {
+            stat = store_result(query->context, batch->selects[i].handle, results[i]);
+            if (stat.code == OK) {
+                continue;
+            }
+        }
+        free_result(results[i]);
+    }
+
+    free(scanned);
+    free(members);
+    free(lows);
+    free(highs);
+    free(group);
+    free(results);
+    return stat;
+}
+
+/*
+ * Creates a database, table, column or index and logs it; the caller
+ * reserved room for the record.
+ */
+static Status execute_create(CreateOperator* create, lsn_t* lsn) {
+    Status stat = { ERROR, QUERY_INVALID_STR };
+    if (create->create_type == _DB) {
+        stat = create_db(create->name);
+        if (stat.code == OK) {
+            *lsn = wal_log_create_db(create->name);
+        }
+    } else if (create->create_type == _TABLE) {
+        stat = create_table(create->db, create->name, create->col_count);
+        if (stat.code == OK) {
+            *lsn = wal_log_create_table(create->name, create->col_count);
+        }
+    } else if (create->create_type == _COLUMN) {
+        stat = create_column(create->table, create->name, create->data_type);
+        if (stat.code == OK) {
+            column_remove_files(&create->table->columns[create->table->col_count - 1]);
+            *lsn = wal_log_create_column(create->table, create->name, create->data_type);
+        }
+    } else if (create->create_type == _INDEX) {
+        stat = column_create_index(create->column, create->index_type, create->clustered);
+        if (stat.code == OK) {
+            *lsn = wal_log_create_index(create->column, create->index_type,
+                                        create->clustered);
+        }
+    }
+    return stat;
+}
+
 /*****************************************************************************
  * -- execute_DbOperator --
  * 
  * This function is responsible for running queries
  *
  * Params:
- *    query [in]  pointer to DbOperator which contains query
+ *    query [in]   pointer to DbOperator which contains query
+ *    output [out] text to send back to the client, NULL if there is none
+ *    lsn [out]    log record the change must be committed with, 0 if none
+ *
+ * Room for the record of a change is reserved before the change is
+ * applied (see wal_reserve), so a change is either made and logged or
+ * fails without being made.
  *
  * Returns:
  *    Status OK on success
@@ -44,12 +257,14 @@
  *****************************************************************************
  */
 
-Status* execute_DbOperator(DbOperator* query) {
-    // there is a small memory leak here (when combined with other parts of your database.)
-    // as practice with something like valgrind and to develop intuition on memory leaks, find and fix the memory leak. 
-    Status *stat = malloc(sizeof(Status));
-    stat->code = ERROR;
-    stat->error_message = "Query Invalid";
+Status execute_DbOperator(DbOperator* query, char** output, lsn_t* lsn) {
+    Status stat;
+    Result* result = NULL;
+    bool reserved = false;
+    stat.code = ERROR;
+    stat.error_message = QUERY_INVALID_STR;
+    *output = NULL;
+    *lsn = 0;
 
     if (query == NULL) {
         log_err("%s:%d: Query not valid\n", __FUNCTION__, __LINE__);
@@ -57,29 +272,125 @@ Status* execute_DbOperator(DbOperator* query) {
     }
 
     if (query->type == CREATE) {
-        if (query->operator_fields.create_operator.create_type == _DB) {
-            *stat = create_db(query->operator_fields.create_operator.name);
-        } else if (query->operator_fields.create_operator.create_type == _TABLE) {
-            *stat = create_table(query->operator_fields.create_operator.db, 
-                                query->operator_fields.create_operator.name, 
-                                query->operator_fields.create_operator.col_count);
-                                
-        } else if (query->operator_fields.create_operator.create_type == _COLUMN) {
-            *stat = create_column(query->operator_fields.create_operator.table,
-                                  query->operator_fields.create_operator.name);
-                
-        } 
+        stat = wal_reserve(0);
+        reserved = stat.code == OK;
+        if (reserved) {
+            stat = execute_create(&query->operator_fields.create_operator, lsn);
+        }
     } else if (query->type == INSERT) {
-        *stat = relational_insert(query->operator_fields.insert_operator.table,
-                                  query->operator_fields.insert_operator.values);
-        Table *tbl = query->operator_fields.insert_operator.table;
-
-        for (size_t i = 0; i < tbl->table_length; i++) {
-            printf("tbl item %zu: %i\n", i, tbl->columns[0].data[i]);
+        Table* table = query->operator_fields.insert_operator.table;
+        size_t num_rows = query->operator_fields.insert_operator.num_rows;
+        size_t first_row = table->table_length;
+        stat = wal_reserve(num_rows * table_row_width(table));
+        reserved = stat.code == OK;
+        if (reserved) {
+            stat = relational_insert_values(table,
+                                            query->operator_fields.insert_operator.values,
+                                            num_rows);
+        }
+        if (stat.code == OK) {
+            *lsn = wal_log_insert(table, first_row, num_rows);
+        }
+    } else if (query->type == DELETE) {
+        Table* table = query->operator_fields.delete_operator.table;
+        Result* positions = query->operator_fields.delete_operator.positions;
+        size_t num_positions;
+        position_t* list = result_positions(positions, &num_positions);
+        if (list == NULL) {
+            stat.code = ERROR;
+            stat.error_message = OUT_OF_MEMORY_STR;
+            return stat;
+        }
+        stat = wal_reserve(num_positions * sizeof(position_t));
+        reserved = stat.code == OK;
+        if (reserved) {
+            stat = relational_delete(table, list, num_positions);
+        }
+        if (stat.code == OK) {
+            *lsn = wal_log_delete(table, list, num_positions);
+        }
+        if (list != positions->payload) {
+            free(list);
+        }
+    } else if (query->type == UPDATE) {
+        UpdateOperator* update = &query->operator_fields.update_operator;
+        Result* positions = update->positions;
+        size_t num_positions;
+        position_t* list = result_positions(positions, &num_positions);
+        if (list == NULL) {
+            stat.code = ERROR;
+            stat.error_message = OUT_OF_MEMORY_STR;
+            return stat;
+        }
+        stat = wal_reserve(num_positions * sizeof(position_t));
+        reserved = stat.code == OK;
+        if (reserved) {
+            stat = relational_update(update->col, list, num_positions, update->value);
+        }
+        if (stat.code == OK) {
+            *lsn = wal_log_update(update->col, list, num_positions, update->value);
+        }
+        if (list != positions->payload) {
+            free(list);
+        }
+    } else if (query->type == LOAD) {
+        // bulk loads are made durable by a checkpoint rather than logged
+        stat = load_file(query->operator_fields.load_operator.file_name);
+        if (stat.code == OK) {
+            stat = db_checkpoint();
         }
     } else if (query->type == SELECT) {
+        SelectOperator* select = &query->operator_fields.select_operator;
+        if (select->col != NULL) {
+            stat = select_column(select->col, select->lower, select->upper, &result);
+        } else {
+            stat = select_result(select->positions, select->values,
+                                 select->lower, select->upper, &result);
+        }
+        stat = store_query_result(query, stat, result);
+    } else if (query->type == FETCH) {
+        stat = fetch_column(query->operator_fields.fetch_operator.col,
+                            query->operator_fields.fetch_operator.positions,
+                            &result);
+        stat = store_query_result(query, stat, result);
+    } else if (query->type == AGGREGATE) {
+        AggregateOperator* agg = &query->operator_fields.aggregate_operator;
+        if (agg->pipeline.col != NULL) {
+            stat = aggregate_pipeline(agg->type, &agg->pipeline, &result);
+        } else {
+            stat = aggregate(agg->type, &agg->input, &result);
+        }
+        stat = store_query_result(query, stat, result);
+    } else if (query->type == ARITHMETIC) {
+        stat = arithmetic(query->operator_fields.arithmetic_operator.type,
+                          query->operator_fields.arithmetic_operator.left,
+                          query->operator_fields.arithmetic_operator.right,
+                          &result);
+        stat = store_query_result(query, stat, result);
+    } else if (query->type == DEFER) {
+        stat = store_pipeline(query->context, query->handle,
+                              &query->operator_fields.defer_operator.pipeline);
+    } else if (query->type == BATCH) {
+        stat = execute_batch(query);
+    } else if (query->type == PRINT) {
+        stat = print_results(query->operator_fields.print_operator.results,
+                             query->operator_fields.print_operator.num_results,
+                             output);
+    } else if (query->type == SHUTDOWN) {
+        // like the background thread, leave rows where they are while
+        // another client may still use positions of them
+        pthread_mutex_lock(&clients_lock);
+        bool alone = active_clients <= 1;
+        pthread_mutex_unlock(&clients_lock);
+        stat = shutdown_server(alone);
+        shutdown_requested = 1;
+        // wake up the accept loop in main
+        shutdown(server_socket, SHUT_RDWR);
     }
-    free(query);
+    if (reserved && stat.code != OK) {
+        wal_cancel();
+    }
+    db_operator_free(query);
     return stat;
 }
 
@@ -87,6 +398,9 @@ Status* execute_DbOperator(DbOperator* query) {
  * handle_client(client_socket)
  * This is the execution routine after a client has connected.
  * It will continually listen for messages from the client and execute queries.
+ * Every reply carries a status: OK_DONE with no payload for statements
+ * without output, OK_WAIT_FOR_RESPONSE with the printed text for print,
+ * and an error status with the error message otherwise.
  **/
 void handle_client(int client_socket) {
     int done = 0;
@@ -98,8 +412,14 @@ void handle_client(int client_socket) {
     message send_message;
     message recv_message;
 
-    // create the client context here
-    ClientContext* client_context = NULL;
+    if (!client_join(client_socket)) {
+        log_err("L%d: Failed to register the client.\n", __LINE__);
+        close(client_socket);
+        return;
+    }
+
+    // the handles of this client's intermediate results
+    ClientContext* client_context = create_client_context();
 
     // Continually receive messages from client and execute queries.
     // 1. Parse the command
@@ -107,51 +427,103 @@ void handle_client(int client_socket) {
     // 3. Send status of the received message (OK, UNKNOWN_QUERY, etc)
     // 4. Send response to the request.
     do {
-        length = recv(client_socket, &recv_message, sizeof(message), 0);
-        if (length < 0) {
-            log_err("Client connection closed!\n");
-            exit(1);
-        } else if (length == 0) {
+        length = recv(client_socket, &recv_message, sizeof(message), MSG_WAITALL);
+        if (length == 0) {
             done = 1;
+        } else if (length != (int) sizeof(message) || recv_message.length < 0 ||
+                   recv_message.length > MAX_STATEMENT_LENGTH) {
+            // the client is gone or does not speak the protocol
+            log_err("L%d: Dropping client at socket %d.\n", __LINE__, client_socket);
+            break;
         }
 
         if (!done) {
-            char recv_buffer[recv_message.length + 1];
-            length = recv(client_socket, recv_buffer, recv_message.length,0);
+            // batched statements can be large, keep them off the stack and
+            // wait until the whole payload arrived
+            char* recv_buffer = malloc(recv_message.length + 1);
+            if (recv_buffer == NULL ||
+                recv(client_socket, recv_buffer, recv_message.length, MSG_WAITALL) !=
+                    (ssize_t) recv_message.length) {
+                log_err("L%d: Dropping client at socket %d.\n", __LINE__, client_socket);
+                free(recv_buffer);
+                break;
+            }
             recv_message.payload = recv_buffer;
             recv_message.payload[recv_message.length] = '\0';
 
+            Status status = { OK, SUCCESS_STR };
+            if (statement_reads_only(recv_message.payload)) {
+                pthread_rwlock_rdlock(&db_lock);
+            } else {
+                pthread_rwlock_wrlock(&db_lock);
+                // deferred statements must not see this change, so it is
+                // not made if one of them cannot run now
+                status = materialize_deferred_handles();
+            }
+
             // 1. Parse command
             //    Query string is converted into a request for an database operator
-            DbOperator* query = parse_command(recv_message.payload, &send_message, client_socket, client_context);
+            DbOperator* query = NULL;
+            if (status.code == OK) {
+                query = parse_command(recv_message.payload, &send_message, client_socket, client_context);
+            }
 
             // 2. Handle request
             //    Corresponding database operator is executed over the query
-            Status *status = execute_DbOperator(query); 
-            char* result = status->error_message;
-            free(status);
+            char* output = NULL;
+            const char* result = "";
+            lsn_t lsn = 0;
+            if (query != NULL) {
+                status = execute_DbOperator(query, &output, &lsn);
+            }
+            pthread_rwlock_unlock(&db_lock);
+
+            if (query != NULL || status.code != OK) {
+                // wait for durability outside the lock so commits of
+                // several clients share one log flush
+                if (status.code == OK && lsn != 0) {
+                    status = wal_commit(lsn);
+                }
+                if (status.code != OK) {
+                    send_message.status = EXECUTION_ERROR;
+                    result = status.error_message;
+                } else if (output != NULL) {
+                    send_message.status = OK_WAIT_FOR_RESPONSE;
+                    result = output;
+                } else {
+                    send_message.status = OK_DONE;
+                }
+            } else if (send_message.status != OK_DONE) {
+                // the statement did not parse
+                if (send_message.status == OK_WAIT_FOR_RESPONSE) {
+                    send_message.status = INCORRECT_FORMAT;
+                }
+                result = QUERY_INVALID_STR;
+            }
+            free(recv_buffer);
 
             send_message.length = strlen(result);
-            char send_buffer[send_message.length + 1];
-            strcpy(send_buffer, result);
-            send_message.payload = send_buffer;
-            send_message.status = OK_WAIT_FOR_RESPONSE;
             
             // 3. Send status of the received message (OK, UNKNOWN_QUERY, etc)
-            if (send(client_socket, &(send_message), sizeof(message), 0) == -1) {
-                log_err("Failed to send message.");
-                exit(1);
+            // 4. Send response to the request
+            // a client that went away only ends its own connection
+            if (send(client_socket, &(send_message), sizeof(message), MSG_NOSIGNAL) == -1 ||
+                (send_message.length > 0 &&
+                 send(client_socket, result, send_message.length, MSG_NOSIGNAL) == -1)) {
+                log_err("L%d: Failed to send message.\n", __LINE__);
+                done = 1;
             }
+            free(output);
 
-            // 4. Send response to the request
-            if (send(client_socket, result, send_message.length, 0) == -1) {
-                log_err("Failed to send message.");
-                exit(1);
+            if (shutdown_requested) {
+                done = 1;
             }
         }
     } while (!done);
 
+    free_client_context(client_context);
     log_info("Connection closed at socket %d!\n", client_socket);
+    client_leave(client_socket);
     close(client_socket);
 }
 
@@ -200,10 +572,60 @@ int setup_server() {
     return server_socket;
 }
 
-// Currently this main will setup the socket and accept a single client.
-// After handling the client, it will exit.
-// You WILL need to extend this to handle MULTIPLE concurrent clients
-// and remain running until it receives a shut-down command.
+/*
+ * Thread routine checkpointing the database every CHECKPOINT_INTERVAL_S
+ * seconds. The snapshot is taken under the shared lock, so queries keep
+ * running throughout and writers only wait for the metadata copy; the
+ * column pages are flushed with no lock held. Tables with many deleted
+ * rows are compacted when no client is connected.
+ */
+static void* checkpoint_thread(void* arg) {
+    (void) arg;
+    while (!shutdown_requested) {
+        sleep(CHECKPOINT_INTERVAL_S);
+
+        Checkpoint* checkpoint;
+        pthread_rwlock_rdlock(&db_lock);
+        Status status = checkpoint_capture(0, &checkpoint);
+        pthread_rwlock_unlock(&db_lock);
+        if (status.code == OK && checkpoint != NULL) {
+            status = checkpoint_write(checkpoint);
+        }
+        if (status.code != OK) {
+            log_err("L%d: Background checkpoint failed.\n", __LINE__);
+        }
+
+        pthread_rwlock_rdlock(&db_lock);
+        bool compact = db_compaction_due();
+        pthread_rwlock_unlock(&db_lock);
+        if (compact) {
+            pthread_rwlock_wrlock(&db_lock);
+            // clients connecting now cannot have positions from before
+            pthread_mutex_lock(&clients_lock);
+            bool idle = active_clients == 0;
+            pthread_mutex_unlock(&clients_lock);
+            if (idle && !shutdown_requested && db_compact().code != OK) {
+                log_err("L%d: Background compaction failed.\n", __LINE__);
+            }
+            pthread_rwlock_unlock(&db_lock);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Thread routine serving one client; arg is a malloc'd socket descriptor.
+ */
+static void* client_thread(void* arg) {
+    int client_socket = *(int*) arg;
+    free(arg);
+    handle_client(client_socket);
+    return NULL;
+}
+
+
+// main recovers the persisted database, sets up the socket and then serves
+// every client on its own thread until one of them sends a shutdown command.
 // 
 // Getting Started Hints:
 //      How will you extend main to handle multiple concurrent clients? 
@@ -211,23 +633,70 @@ int setup_server() {
 //      What aspects of siloes or isolation are maintained in your design? (Think `what` is shared between `whom`?)
 int main(void)
 {
-    int server_socket = setup_server();
+    if (db_startup().code != OK) {
+        log_err("L%d: Failed to recover the database.\n", __LINE__);
+        exit(1);
+    }
+
+    server_socket = setup_server();
     if (server_socket < 0) {
         exit(1);
     }
 
-    log_info("Waiting for a connection %d ...\n", server_socket);
+    // the thread running a query works on its morsels too
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (thread_pool_start(cpus > 1 ? (size_t) cpus - 1 : 0).code != OK) {
+        log_err("L%d: Running with fewer worker threads.\n", __LINE__);
+    }
+
+    pthread_t checkpointer;
+    if (pthread_create(&checkpointer, NULL, checkpoint_thread, NULL) != 0) {
+        log_err("L%d: Failed to start the checkpoint thread.\n", __LINE__);
+        exit(1);
+    }
+    pthread_detach(checkpointer);
 
     struct sockaddr_un remote;
     socklen_t t = sizeof(remote);
     int client_socket = 0;
 
-    if ((client_socket = accept(server_socket, (struct sockaddr *)&remote, &t)) == -1) {
-        log_err("L%d: Failed to accept a new connection.\n", __LINE__);
-        exit(1);
+    while (!shutdown_requested) {
+        log_info("Waiting for a connection %d ...\n", server_socket);
+
+        if ((client_socket = accept(server_socket, (struct sockaddr *)&remote, &t)) == -1) {
+            if (shutdown_requested || errno == EINTR) {
+                continue;
+            }
+            log_err("L%d: Failed to accept a new connection.\n", __LINE__);
+            exit(1);
+        }
+
+        pthread_t thread;
+        int* arg = malloc(sizeof(int));
+        *arg = client_socket;
+        if (pthread_create(&thread, NULL, client_thread, arg) != 0) {
+            log_err("L%d: Failed to start a client thread.\n", __LINE__);
+            free(arg);
+            close(client_socket);
+            continue;
+        }
+        pthread_detach(thread);
     }
 
-    handle_client(client_socket);
+    // clients waiting for their next statement leave, the others after
+    // the reply to the current one
+    pthread_mutex_lock(&clients_lock);
+    for (int i = 0; i < active_clients; i++) {
+        shutdown(client_sockets[i], SHUT_RD);
+    }
+    while (active_clients > 0) {
+        pthread_cond_wait(&clients_done, &clients_lock);
+    }
+    pthread_mutex_unlock(&clients_lock);
+    free(client_sockets);
 
+    thread_pool_stop();
+    close(server_socket);
+    unlink(SOCK_PATH);
     return 0;
 }
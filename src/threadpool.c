@@ -0,0 +1,219 @@
+/*
+ * -- threadpool.c
+ *
+ *  implements the worker pool behind parallel_for (see threadpool.h)
+ *
+ *  Every running parallel_for is a job in a list shared by the workers.
+ *  Morsels are claimed with an atomic increment of the job's next morsel,
+ *  so claiming never takes the pool lock; the lock only guards the list
+ *  and the count of workers inside each job. The caller leaves once it
+ *  has unlinked its job (no worker can join after that) and the workers
+ *  that had joined are out again, by then every claimed morsel is done.
+ */
+
+#include <pthread.h>
+#include "threadpool.h"
+#include "utils.h"
+
+typedef struct Job {
+    morsel_fn work;
+    void *arg;
+    size_t num_morsels;
+    // next unclaimed morsel, only changed atomically
+    size_t next;
+    // workers running morsels of the job, under the pool lock
+    size_t helpers;
+    struct Job *next_job;
+} Job;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+// a job was added or the pool is stopping
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+// a worker left a job
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+static Job *jobs = NULL;
+static pthread_t workers[THREAD_POOL_MAX_WORKERS];
+static size_t num_workers = 0;
+static int stopping = 0;
+
+/*
+ * Runs morsels of a job until none is left to claim.
+ */
+static void run_morsels(Job *job, size_t slot)
+{
+    for (;;) {
+        size_t morsel = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (morsel >= job->num_morsels) {
+            return;
+        }
+        job->work(job->arg, morsel, slot);
+    }
+}
+
+/*
+ * Returns the first job with morsels left to claim, NULL if there is none.
+ * The caller must hold the pool lock.
+ */
+static Job *pending_job(void)
+{
+    for (Job *job = jobs; job != NULL; job = job->next_job) {
+        if (__atomic_load_n(&job->next, __ATOMIC_RELAXED) < job->num_morsels) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+static void *worker_thread(void *arg)
+{
+    size_t slot = (size_t) arg;
+
+    pthread_mutex_lock(&pool_lock);
+    while (!stopping) {
+        Job *job = pending_job();
+        if (job == NULL) {
+            pthread_cond_wait(&work_ready, &pool_lock);
+            continue;
+        }
+        job->helpers++;
+        pthread_mutex_unlock(&pool_lock);
+
+        run_morsels(job, slot);
+
+        pthread_mutex_lock(&pool_lock);
+        if (--job->helpers == 0) {
+            pthread_cond_broadcast(&job_done);
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return NULL;
+}
+
+
+/******************************************************************************
+ * -- thread_pool_start --
+ *
+ * Starts the worker threads, at most THREAD_POOL_MAX_WORKERS, once when
+ * the server starts. Without workers parallel_for runs every morsel on the
+ * calling thread.
+ *
+ * Params:
+ *    wanted [in]       The number of workers wanted
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR if not all workers could be started, the pool then runs
+ *                 with the ones that were
+ *
+ ******************************************************************************
+ */
+
+Status thread_pool_start(size_t wanted)   // IN
+{
+    Status ret_status = { OK, SUCCESS_STR };
+
+    if (wanted > THREAD_POOL_MAX_WORKERS) {
+        wanted = THREAD_POOL_MAX_WORKERS;
+    }
+    while (num_workers < wanted) {
+        if (pthread_create(&workers[num_workers], NULL, worker_thread,
+                           (void *) num_workers) != 0) {
+            log_err("%s:%d: Cannot start worker %zu\n", __FUNCTION__, __LINE__, num_workers);
+            ret_status.code = ERROR;
+            ret_status.error_message = "Cannot start worker threads";
+            break;
+        }
+        num_workers++;
+    }
+    log_info("%s:%d: %zu worker threads\n", __FUNCTION__, __LINE__, num_workers);
+    return ret_status;
+}
+
+
+/******************************************************************************
+ * -- thread_pool_stop --
+ *
+ * Stops and joins the worker threads. Calls to parallel_for still running
+ * or made later are completed by their calling threads alone.
+ *
+ ******************************************************************************
+ */
+
+void thread_pool_stop(void)
+{
+    pthread_mutex_lock(&pool_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&work_ready);
+    pthread_mutex_unlock(&pool_lock);
+
+    for (size_t i = 0; i < num_workers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+}
+
+
+/******************************************************************************
+ * -- thread_pool_slots --
+ *
+ * Returns the number of distinct thread indexes morsel functions can see:
+ * one per worker and one for the caller of parallel_for.
+ *
+ ******************************************************************************
+ */
+
+size_t thread_pool_slots(void)
+{
+    return num_workers + 1;
+}
+
+
+/******************************************************************************
+ * -- parallel_for --
+ *
+ * Calls work(arg, morsel, slot) for every morsel in [0, num_morsels), on
+ * the pool's workers and the calling thread, and returns once all calls
+ * returned. Morsels run in no particular order.
+ *
+ * Params:
+ *    num_morsels [in]  The number of morsels
+ *    work [in]         The function processing a morsel
+ *    arg [in]          Passed to work
+ *
+ ******************************************************************************
+ */
+
+void parallel_for(size_t num_morsels,  // IN
+                  morsel_fn work,      // IN
+                  void *arg)           // IN
+{
+    Job job = { work, arg, num_morsels, 0, 0, NULL };
+    // the workers have the slots below
+    size_t slot = num_workers;
+    Job **link;
+
+    if (slot == 0 || num_morsels <= 1) {
+        for (size_t morsel = 0; morsel < num_morsels; morsel++) {
+            work(arg, morsel, slot);
+        }
+        return;
+    }
+
+    // oldest jobs first, so queries finish in the order they came
+    pthread_mutex_lock(&pool_lock);
+    for (link = &jobs; *link != NULL; link = &(*link)->next_job) {
+    }
+    *link = &job;
+    pthread_cond_broadcast(&work_ready);
+    pthread_mutex_unlock(&pool_lock);
+
+    run_morsels(&job, slot);
+
+    pthread_mutex_lock(&pool_lock);
+    for (link = &jobs; *link != &job; link = &(*link)->next_job) {
+    }
+    *link = job.next_job;
+    while (job.helpers > 0) {
+        pthread_cond_wait(&job_done, &pool_lock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
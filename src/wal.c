@@ -0,0 +1,945 @@
+/*
+ * -- wal.c
+ *
+ *  write-ahead log with group commit (see wal.h)
+ *
+ *  Record layout: a WalRecordHeader followed by length bytes of payload.
+ *  The checksum covers header and payload, so a record torn by a crash is
+ *  recognized and replay stops in front of it. Records are packed, so
+ *  headers are copied in and out of the log rather than used in place.
+ *
+ *  Payloads (integers in host byte order, names NUL terminated):
+ *    WAL_CREATE_DB      name
+ *    WAL_CREATE_TABLE   uint32 num_columns, short name
+ *    WAL_CREATE_COLUMN  uint32 table index, uint32 DataType, short name
+ *    WAL_INSERT         uint32 table index, uint32 num_rows,
+ *                       uint64 first_row, then per column num_rows values
+ *                       in the column's type
+ *    WAL_DELETE         uint32 table index, uint32 num_positions, then the
+ *                       positions
+ *    WAL_COMPACT        uint32 table index, uint32 unused, uint64 number of
+ *                       rows left (see table_compact)
+ *    WAL_UPDATE         uint32 table index, uint32 column index, uint32
+ *                       num_positions, the new value as a Value, then the
+ *                       positions
+ *    WAL_CREATE_INDEX   uint32 table index, uint32 column index, uint32
+ *                       IndexType, uint32 clustered
+ */
+
+#define _DEFAULT_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "column.h"
+#include "delta.h"
+#include "index.h"
+#include "persistence.h"
+#include "utils.h"
+#include "wal.h"
+
+typedef struct WalRecordHeader {
+    uint64_t lsn;
+    uint32_t type;
+    uint32_t length;
+    uint32_t checksum;
+    uint32_t reserved;
+} WalRecordHeader;
+
+/*
+ * Upper bound for the fixed fields and the name of a record, see
+ * wal_reserve.
+ */
+#define RECORD_FIXED_BYTES (32 + MAX_SIZE_NAME)
+
+typedef struct WalBuffer {
+    unsigned char *data;
+    size_t length;
+    size_t capacity;
+} WalBuffer;
+
+// guards everything below
+static pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+// signalled when records were added to wal_pending
+static pthread_cond_t wal_work = PTHREAD_COND_INITIALIZER;
+// signalled when wal_durable_lsn advanced or a flush failed
+static pthread_cond_t wal_flushed = PTHREAD_COND_INITIALIZER;
+
+static int wal_fd = -1;
+// sequence number of the log file wal_fd appends to
+static uint64_t wal_seq = 0;
+// files before this one are covered by the checkpoint being written
+static uint64_t wal_rotated_seq = 0;
+// records not handed to the flusher yet, and the ones it is writing
+static WalBuffer wal_pending;
+static WalBuffer wal_writing;
+static lsn_t wal_next_lsn = 1;
+// every record up to this one is on disk or covered by a checkpoint
+static lsn_t wal_durable_lsn = 0;
+static int wal_flushing = 0;
+static int wal_failed = 0;
+// room kept in wal_pending for the record of a change being applied; the
+// flusher leaves wal_pending alone meanwhile (see wal_reserve)
+static size_t wal_reserved = 0;
+
+
+/*
+ * FNV-1a, continuing from hash.
+ */
+static uint32_t checksum(uint32_t hash, const void *data, size_t length)
+{
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t record_checksum(const WalRecordHeader *header, const void *payload)
+{
+    WalRecordHeader copy = *header;
+    copy.checksum = 0;
+    return checksum(checksum(2166136261u, &copy, sizeof(copy)), payload, header->length);
+}
+
+static void log_path(char *path, uint64_t seq)
+{
+    sprintf(path, "%s/%s%lu", DATA_DIR, WAL_PREFIX, (unsigned long) seq);
+}
+
+static int compare_seqs(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Collects the sequence numbers of the log files in DATA_DIR, in order.
+ * Returns the number of files, or -1 on failure.
+ */
+static long list_logs(uint64_t **seqs)
+{
+    DIR *dir = opendir(DATA_DIR);
+    struct dirent *entry;
+    size_t count = 0, capacity = 0;
+
+    *seqs = NULL;
+    if (dir == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        char *end;
+        unsigned long seq;
+        if (strncmp(entry->d_name, WAL_PREFIX, strlen(WAL_PREFIX)) != 0) {
+            continue;
+        }
+        seq = strtoul(entry->d_name + strlen(WAL_PREFIX), &end, 10);
+        if (*end != '\0' || end == entry->d_name + strlen(WAL_PREFIX)) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity == 0 ? 8 : capacity * 2;
+            uint64_t *grown = realloc(*seqs, capacity * sizeof(uint64_t));
+            if (grown == NULL) {
+                free(*seqs);
+                closedir(dir);
+                return -1;
+            }
+            *seqs = grown;
+        }
+        (*seqs)[count++] = seq;
+    }
+    closedir(dir);
+    qsort(*seqs, count, sizeof(uint64_t), compare_seqs);
+    return count;
+}
+
+static int write_all(int fd, const unsigned char *data, size_t length)
+{
+    for (size_t written = 0; written < length;) {
+        ssize_t n = write(fd, data + written, length - written);
+        if (n < 0 && errno != EINTR) {
+            return -1;
+        } else if (n > 0) {
+            written += n;
+        }
+    }
+    return 0;
+}
+
+
+/******************************************************************************
+ * -- begin_record --
+ *
+ * Appends a record header to the pending buffer and returns where its
+ * payload goes; *record is set to the offset of the header, to be passed
+ * to end_record. wal_lock is held on return; end_record releases it.
+ *
+ * Returns NULL (with wal_lock released) if the payload does not fit the
+ *         header's length field or the buffer cannot grow
+ *
+ ******************************************************************************
+ */
+
+static unsigned char *begin_record(WalRecordType type, size_t length, size_t *record)
+{
+    WalRecordHeader header;
+    size_t needed;
+
+    if (length > UINT32_MAX) {
+        log_err("%s:%d: Log record of %zu bytes is too large\n", __FUNCTION__, __LINE__, length);
+        wal_cancel();
+        return NULL;
+    }
+    pthread_mutex_lock(&wal_lock);
+    needed = wal_pending.length + sizeof(WalRecordHeader) + length;
+    if (needed > wal_pending.capacity) {
+        size_t capacity = wal_pending.capacity == 0 ? 4096 : wal_pending.capacity;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        unsigned char *data = realloc(wal_pending.data, capacity);
+        if (data == NULL) {
+            log_err("%s:%d: Unable to grow the log buffer\n", __FUNCTION__, __LINE__);
+            wal_reserved = 0;
+            pthread_cond_signal(&wal_work);
+            pthread_mutex_unlock(&wal_lock);
+            return NULL;
+        }
+        wal_pending.data = data;
+        wal_pending.capacity = capacity;
+    }
+    header.lsn = wal_next_lsn++;
+    header.type = type;
+    header.length = length;
+    header.checksum = 0;
+    header.reserved = 0;
+    *record = wal_pending.length;
+    memcpy(wal_pending.data + *record, &header, sizeof(header));
+    wal_pending.length = needed;
+    return wal_pending.data + *record + sizeof(header);
+}
+
+static lsn_t end_record(size_t record)
+{
+    WalRecordHeader header;
+    memcpy(&header, wal_pending.data + record, sizeof(header));
+    header.checksum = record_checksum(&header, wal_pending.data + record + sizeof(header));
+    memcpy(wal_pending.data + record, &header, sizeof(header));
+    wal_reserved = 0;
+    pthread_cond_signal(&wal_work);
+    pthread_mutex_unlock(&wal_lock);
+    return header.lsn;
+}
+
+
+/*****************************************************************************
+ * -- wal_reserve --
+ *
+ * Changes are logged after they were applied, when logging must no longer
+ * fail. Before applying a change, the caller reserves room for its record
+ * in the pending buffer; the flusher does not swap the buffer until the
+ * record is logged (wal_log_*) or the reservation is given up because the
+ * change failed (wal_cancel). The caller holds the database write lock
+ * throughout, so no other record can take the room.
+ *
+ * Params:
+ *    bytes [in]   size of the record's values or positions, on top of its
+ *                 fixed fields and name
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR if the record would be too large or there is no memory
+ *
+ *****************************************************************************
+ */
+
+Status wal_reserve(size_t bytes) // IN
+{
+    Status ret_status = { ERROR, OUT_OF_MEMORY_STR };
+    size_t length = RECORD_FIXED_BYTES + bytes;
+    size_t needed;
+
+    if (bytes > UINT32_MAX - RECORD_FIXED_BYTES) {
+        log_err("%s:%d: Log record of %zu bytes is too large\n", __FUNCTION__, __LINE__, length);
+        ret_status.error_message = QUERY_INVALID_STR;
+        return ret_status;
+    }
+    pthread_mutex_lock(&wal_lock);
+    needed = wal_pending.length + sizeof(WalRecordHeader) + length;
+    if (needed > wal_pending.capacity) {
+        size_t capacity = wal_pending.capacity == 0 ? 4096 : wal_pending.capacity;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        unsigned char *data = realloc(wal_pending.data, capacity);
+        if (data == NULL) {
+            log_err("%s:%d: Unable to grow the log buffer\n", __FUNCTION__, __LINE__);
+            pthread_mutex_unlock(&wal_lock);
+            return ret_status;
+        }
+        wal_pending.data = data;
+        wal_pending.capacity = capacity;
+    }
+    wal_reserved = sizeof(WalRecordHeader) + length;
+    pthread_mutex_unlock(&wal_lock);
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+    return ret_status;
+}
+
+/*
+ * Gives up the room wal_reserve kept for a change that failed.
+ */
+void wal_cancel(void)
+{
+    pthread_mutex_lock(&wal_lock);
+    wal_reserved = 0;
+    pthread_cond_signal(&wal_work);
+    pthread_mutex_unlock(&wal_lock);
+}
+
+
+/*****************************************************************************
+ * -- wal_log_* --
+ *
+ * Log a change that was just applied. The caller must hold the database
+ * write lock, which keeps records in the order changes were made, and
+ * pass the returned LSN to wal_commit once it released that lock. After
+ * wal_reserve, logging the change cannot fail.
+ *
+ * Returns the LSN of the record, 0 if it could not be logged
+ *
+ *****************************************************************************
+ */
+
+lsn_t wal_log_create_db(const char *name)
+{
+    size_t record;
+    size_t length = strlen(name) + 1;
+    unsigned char *payload = begin_record(WAL_CREATE_DB, length, &record);
+    if (payload == NULL) {
+        return 0;
+    }
+    memcpy(payload, name, length);
+    return end_record(record);
+}
+
+lsn_t wal_log_create_table(const char *name, size_t num_columns)
+{
+    size_t record;
+    uint32_t count = num_columns;
+    size_t length = strlen(name) + 1;
+    unsigned char *payload = begin_record(WAL_CREATE_TABLE, sizeof(count) + length, &record);
+    if (payload == NULL) {
+        return 0;
+    }
+    memcpy(payload, &count, sizeof(count));
+    memcpy(payload + sizeof(count), name, length);
+    return end_record(record);
+}
+
+lsn_t wal_log_create_column(const Table *table, const char *name, DataType type)
+{
+    size_t record;
+    uint32_t fields[2] = { table - current_db->tables, type };
+    size_t length = strlen(name) + 1;
+    unsigned char *payload = begin_record(WAL_CREATE_COLUMN, sizeof(fields) + length, &record);
+    if (payload == NULL) {
+        return 0;
+    }
+    memcpy(payload, fields, sizeof(fields));
+    memcpy(payload + sizeof(fields), name, length);
+    return end_record(record);
+}
+
+lsn_t wal_log_insert(const Table *table, size_t first_row, size_t num_rows)
+{
+    size_t record;
+    uint32_t fields[2] = { table - current_db->tables, num_rows };
+    uint64_t first = first_row;
+    size_t prefix = sizeof(fields) + sizeof(first);
+    unsigned char *payload = begin_record(WAL_INSERT, prefix + num_rows * table_row_width(table), &record);
+    if (payload == NULL) {
+        return 0;
+    }
+    memcpy(payload, fields, sizeof(fields));
+    memcpy(payload + sizeof(fields), &first, sizeof(first));
+    payload += prefix;
+    for (size_t i = 0; i < table->col_count; i++) {
+        Column *col = &table->columns[i];
+        column_copy(col, first_row, num_rows, payload, 0);
+        payload += num_rows * data_type_size(col->type);
+    }
+    return end_record(record);
+}
+
+lsn_t wal_log_delete(const Table *table, const position_t *positions, size_t num_positions)
+{
+    size_t record;
+    uint32_t fields[2] = { table - current_db->tables, num_positions };
+    size_t bytes = num_positions * sizeof(position_t);
+    unsigned char *payload = begin_record(WAL_DELETE, sizeof(fields) + bytes, &record);
+    if (payload == NULL) {
+        return 0;
+    }
+    memcpy(payload, fields, sizeof(fields));
+    memcpy(payload + sizeof(fields), positions, bytes);
+    return end_record(record);
+}
+
+lsn_t wal_log_compact(const Table *table, size_t num_rows)
+{
+    size_t record;
+    uint32_t fields[2] = { table - current_db->tables, 0 };
+    uint64_t rows = num_rows;
+    unsigned char *payload = begin_record(WAL_COMPACT, sizeof(fields) + sizeof(rows), &record);
+    if (payload == NULL) {
+        return 0;
+    }
+    memcpy(payload, fields, sizeof(fields));
+    memcpy(payload + sizeof(fields), &rows, sizeof(rows));
+    return end_record(record);
+}
+
+lsn_t wal_log_update(const Column *col, const position_t *positions, size_t num_positions,
+                     Value value)
+{
+    size_t record;
+    const Table *table = col->table;
+    uint32_t fields[3] = { table - current_db->tables, col - table->columns, num_positions };
+    size_t prefix = sizeof(fields) + sizeof(value);
+    size_t bytes = num_positions * sizeof(position_t);
+    unsigned char *payload = begin_record(WAL_UPDATE, prefix + bytes, &record);
+    if (payload == NULL) {
+        return 0;
+    }
+    memcpy(payload, fields, sizeof(fields));
+    memcpy(payload + sizeof(fields), &value, sizeof(value));
+    memcpy(payload + prefix, positions, bytes);
+    return end_record(record);
+}
+
+lsn_t wal_log_create_index(const Column *col, IndexType type, bool clustered)
+{
+    size_t record;
+    const Table *table = col->table;
+    uint32_t fields[4] = { table - current_db->tables, col - table->columns, type, clustered };
+    unsigned char *payload = begin_record(WAL_CREATE_INDEX, sizeof(fields), &record);
+    if (payload == NULL) {
+        return 0;
+    }
+    memcpy(payload, fields, sizeof(fields));
+    return end_record(record);
+}
+
+
+/******************************************************************************
+ * -- wal_flusher --
+ *
+ * Body of the flusher thread. Waits for records, gives concurrent commits
+ * WAL_COMMIT_WINDOW_US to join, then writes everything pending with one
+ * write and one fdatasync.
+ *
+ ******************************************************************************
+ */
+
+static void *wal_flusher(void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&wal_lock);
+    for (;;) {
+        WalBuffer swap;
+        lsn_t target;
+        int failed = 0;
+
+        while (wal_pending.length == 0 || wal_reserved > 0) {
+            pthread_cond_wait(&wal_work, &wal_lock);
+        }
+        if (WAL_COMMIT_WINDOW_US > 0) {
+            pthread_mutex_unlock(&wal_lock);
+            usleep(WAL_COMMIT_WINDOW_US);
+            pthread_mutex_lock(&wal_lock);
+            if (wal_pending.length == 0 || wal_reserved > 0) {
+                // a checkpoint made the records durable meanwhile, or a
+                // change is about to be logged
+                continue;
+            }
+        }
+
+        swap = wal_writing;
+        wal_writing = wal_pending;
+        wal_pending = swap;
+        wal_pending.length = 0;
+        target = wal_next_lsn - 1;
+        wal_flushing = 1;
+        pthread_mutex_unlock(&wal_lock);
+
+        failed = write_all(wal_fd, wal_writing.data, wal_writing.length) == -1 ||
+                 fdatasync(wal_fd) == -1;
+
+        pthread_mutex_lock(&wal_lock);
+        wal_writing.length = 0;
+        wal_flushing = 0;
+        if (failed) {
+            log_err("%s:%d: Unable to write the log\n", __FUNCTION__, __LINE__);
+            wal_failed = 1;
+        } else if (target > wal_durable_lsn) {
+            wal_durable_lsn = target;
+        }
+        pthread_cond_broadcast(&wal_flushed);
+    }
+    return NULL;
+}
+
+
+/*****************************************************************************
+ * -- wal_commit --
+ *
+ * Waits until the record with the given LSN (and every record before it)
+ * is durable.
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status wal_commit(lsn_t lsn) // IN
+{
+    Status ret_status;
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+
+    pthread_mutex_lock(&wal_lock);
+    while (wal_durable_lsn < lsn && !wal_failed) {
+        pthread_cond_wait(&wal_flushed, &wal_lock);
+    }
+    if (wal_durable_lsn < lsn) {
+        ret_status.code = ERROR;
+        ret_status.error_message = QUERY_INVALID_STR;
+    }
+    pthread_mutex_unlock(&wal_lock);
+    return ret_status;
+}
+
+/*
+ * Returns the LSN of the last record logged.
+ */
+lsn_t wal_last_lsn(void)
+{
+    lsn_t lsn;
+    pthread_mutex_lock(&wal_lock);
+    lsn = wal_next_lsn - 1;
+    pthread_mutex_unlock(&wal_lock);
+    return lsn;
+}
+
+
+/*****************************************************************************
+ * -- wal_rotate --
+ *
+ * Makes every record logged so far durable and switches the log to a new
+ * file. A checkpoint calls this while it snapshots the database, holding
+ * the database lock so no change slips in between; the snapshot then
+ * covers exactly the files before the new one, and wal_discard_rotated
+ * removes them once the snapshot is on disk.
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status wal_rotate(void)
+{
+    Status ret_status;
+    char path[sizeof(DATA_DIR) + sizeof(WAL_PREFIX) + 24];
+    int fd;
+
+    ret_status.code = ERROR;
+    ret_status.error_message = QUERY_INVALID_STR;
+
+    pthread_mutex_lock(&wal_lock);
+    while (wal_flushing) {
+        pthread_cond_wait(&wal_flushed, &wal_lock);
+    }
+    if (write_all(wal_fd, wal_pending.data, wal_pending.length) == -1 ||
+        fdatasync(wal_fd) == -1) {
+        log_err("%s:%d: Unable to write the log\n", __FUNCTION__, __LINE__);
+        wal_failed = 1;
+        pthread_cond_broadcast(&wal_flushed);
+        pthread_mutex_unlock(&wal_lock);
+        return ret_status;
+    }
+    wal_pending.length = 0;
+    wal_durable_lsn = wal_next_lsn - 1;
+    pthread_cond_broadcast(&wal_flushed);
+
+    log_path(path, wal_seq + 1);
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        // keep appending to the current file, the checkpoint fails
+        log_err("%s:%d: Unable to open %s\n", __FUNCTION__, __LINE__, path);
+        pthread_mutex_unlock(&wal_lock);
+        return ret_status;
+    }
+    close(wal_fd);
+    wal_fd = fd;
+    wal_seq++;
+    wal_rotated_seq = wal_seq;
+    pthread_mutex_unlock(&wal_lock);
+
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+    return ret_status;
+}
+
+
+/******************************************************************************
+ * -- wal_discard_rotated --
+ *
+ * Deletes the log files the last wal_rotate closed, and any older ones.
+ * Only called once the checkpoint covering them is durable.
+ *
+ ******************************************************************************
+ */
+
+void wal_discard_rotated(void)
+{
+    char path[sizeof(DATA_DIR) + sizeof(WAL_PREFIX) + 24];
+    uint64_t *seqs;
+    long count = list_logs(&seqs);
+
+    for (long i = 0; i < count && seqs[i] < wal_rotated_seq; i++) {
+        log_path(path, seqs[i]);
+        unlink(path);
+    }
+    free(seqs);
+}
+
+
+/******************************************************************************
+ * -- apply_record --
+ *
+ * Redoes the change a record describes.
+ *
+ * Returns -1 if the record does not fit the database it is applied to
+ *          0 on success
+ *
+ ******************************************************************************
+ */
+
+static int apply_record(const WalRecordHeader *header, const unsigned char *payload)
+{
+    uint32_t fields[2];
+
+    switch (header->type) {
+    case WAL_CREATE_DB:
+        return create_db((const char *) payload).code == OK ? 0 : -1;
+    case WAL_CREATE_TABLE:
+        memcpy(fields, payload, sizeof(uint32_t));
+        if (current_db == NULL) {
+            return -1;
+        }
+        return create_table(current_db, (const char *) payload + sizeof(uint32_t),
+                            fields[0]).code == OK ? 0 : -1;
+    case WAL_CREATE_COLUMN: {
+        Table *table;
+        memcpy(fields, payload, sizeof(fields));
+        if (current_db == NULL || fields[0] >= current_db->tables_size) {
+            return -1;
+        }
+        table = &current_db->tables[fields[0]];
+        if (create_column(table, (char *) payload + sizeof(fields), fields[1]).code != OK) {
+            return -1;
+        }
+        column_remove_files(&table->columns[table->col_count - 1]);
+        return 0;
+    }
+    case WAL_INSERT: {
+        Table *table;
+        uint64_t first_row;
+        memcpy(fields, payload, sizeof(fields));
+        memcpy(&first_row, payload + sizeof(fields), sizeof(first_row));
+        payload += sizeof(fields) + sizeof(first_row);
+        if (current_db == NULL || fields[0] >= current_db->tables_size) {
+            return -1;
+        }
+        table = &current_db->tables[fields[0]];
+        if (header->length != sizeof(fields) + sizeof(first_row) + fields[1] * table_row_width(table) ||
+            table_reserve(table, first_row + fields[1]).code != OK) {
+            return -1;
+        }
+        for (size_t i = 0; i < table->col_count; i++) {
+            Column *col = &table->columns[i];
+            column_copy(col, first_row, fields[1], (unsigned char *) payload, 1);
+            payload += fields[1] * data_type_size(col->type);
+        }
+        if (first_row + fields[1] > table->table_length) {
+            size_t begin = table->table_length > first_row ? table->table_length : first_row;
+            table->table_length = first_row + fields[1];
+            // indexes mapped from the checkpoint follow the log like live ones
+            for (size_t i = 0; i < table->col_count; i++) {
+                column_index_append(&table->columns[i], begin, table->table_length);
+            }
+        }
+        return 0;
+    }
+    case WAL_DELETE: {
+        position_t *positions;
+        int failed;
+        memcpy(fields, payload, sizeof(fields));
+        if (current_db == NULL || fields[0] >= current_db->tables_size ||
+            header->length != sizeof(fields) + fields[1] * sizeof(position_t)) {
+            return -1;
+        }
+        // the payload is not aligned for position_t
+        positions = malloc(sizeof(position_t) * (fields[1] + 1));
+        if (positions == NULL) {
+            return -1;
+        }
+        memcpy(positions, payload + sizeof(fields), fields[1] * sizeof(position_t));
+        failed = relational_delete(&current_db->tables[fields[0]], positions,
+                                   fields[1]).code != OK;
+        free(positions);
+        return failed ? -1 : 0;
+    }
+    case WAL_COMPACT: {
+        uint64_t num_rows;
+        memcpy(fields, payload, sizeof(fields));
+        memcpy(&num_rows, payload + sizeof(fields), sizeof(num_rows));
+        if (current_db == NULL || fields[0] >= current_db->tables_size) {
+            return -1;
+        }
+        return table_compaction_finish(&current_db->tables[fields[0]],
+                                       num_rows).code == OK ? 0 : -1;
+    }
+    case WAL_UPDATE: {
+        uint32_t update_fields[3];
+        size_t prefix = sizeof(update_fields) + sizeof(Value);
+        position_t *positions;
+        Table *table;
+        Value value;
+        int failed = 0;
+        memcpy(update_fields, payload, sizeof(update_fields));
+        memcpy(&value, payload + sizeof(update_fields), sizeof(value));
+        if (current_db == NULL || update_fields[0] >= current_db->tables_size ||
+            update_fields[1] >= current_db->tables[update_fields[0]].col_count ||
+            header->length != prefix + update_fields[2] * sizeof(position_t)) {
+            return -1;
+        }
+        table = &current_db->tables[update_fields[0]];
+        positions = malloc(sizeof(position_t) * (update_fields[2] + 1));
+        if (positions == NULL) {
+            return -1;
+        }
+        memcpy(positions, payload + prefix, update_fields[2] * sizeof(position_t));
+        for (size_t i = 0; i < update_fields[2]; i++) {
+            failed |= positions[i] >= table->table_length;
+        }
+        // folding waits for the checkpoint that ends recovery, when the
+        // encodings and zone maps it has to maintain are loaded
+        failed = failed || column_update(&table->columns[update_fields[1]], positions,
+                                         update_fields[2], value).code != OK;
+        free(positions);
+        return failed ? -1 : 0;
+    }
+    case WAL_CREATE_INDEX: {
+        uint32_t index_fields[4];
+        Column *col;
+        memcpy(index_fields, payload, sizeof(index_fields));
+        if (current_db == NULL || index_fields[0] >= current_db->tables_size ||
+            index_fields[1] >= current_db->tables[index_fields[0]].col_count) {
+            return -1;
+        }
+        // only the declaration: the first select builds the index
+        col = &current_db->tables[index_fields[0]].columns[index_fields[1]];
+        column_drop_index(col);
+        col->index_type = index_fields[2];
+        col->clustered = index_fields[3];
+        return 0;
+    }
+    default:
+        return -1;
+    }
+}
+
+
+/******************************************************************************
+ * -- replay_file --
+ *
+ * Redoes the records of one log file that come after the checkpoint.
+ * Reading stops at the first torn or corrupt record; *valid_end is set to
+ * the offset just past the last good one.
+ *
+ * Returns -1 if a record does not apply
+ *          0 otherwise
+ *
+ ******************************************************************************
+ */
+
+static int replay_file(FILE *log, lsn_t checkpoint_lsn, lsn_t *last_lsn,
+                       size_t *replayed, long *valid_end)
+{
+    WalRecordHeader header;
+
+    *valid_end = 0;
+    while (fread(&header, sizeof(header), 1, log) == 1) {
+        unsigned char *payload = malloc(header.length > 0 ? header.length : 1);
+        if (payload == NULL ||
+            (header.length > 0 && fread(payload, header.length, 1, log) != 1) ||
+            record_checksum(&header, payload) != header.checksum) {
+            free(payload);
+            break;
+        }
+        if (header.lsn > checkpoint_lsn) {
+            if (apply_record(&header, payload) == -1) {
+                log_err("%s:%d: Log record %lu does not apply\n",
+                        __FUNCTION__, __LINE__, (unsigned long) header.lsn);
+                free(payload);
+                return -1;
+            }
+            (*replayed)++;
+        }
+        if (header.lsn > *last_lsn) {
+            *last_lsn = header.lsn;
+        }
+        *valid_end = ftell(log);
+        free(payload);
+    }
+    return 0;
+}
+
+
+/*****************************************************************************
+ * -- wal_replay --
+ *
+ * Redoes the logged changes made after the checkpoint the database was
+ * just recovered from, file by file. Only the newest file can end in a
+ * record torn by a crash; that tail is cut off so it is never mistaken
+ * for a gap once later files exist.
+ *
+ * Params:
+ *    checkpoint_lsn [in]   LSN of the last record the checkpoint covers
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status wal_replay(lsn_t checkpoint_lsn) // IN
+{
+    Status ret_status;
+    char path[sizeof(DATA_DIR) + sizeof(WAL_PREFIX) + 24];
+    uint64_t *seqs;
+    long count = list_logs(&seqs);
+    size_t replayed = 0;
+    lsn_t last_lsn = checkpoint_lsn;
+
+    ret_status.code = ERROR;
+    ret_status.error_message = QUERY_INVALID_STR;
+
+    if (count < 0) {
+        log_err("%s:%d: Unable to list the log files\n", __FUNCTION__, __LINE__);
+        return ret_status;
+    }
+    for (long i = 0; i < count; i++) {
+        struct stat st;
+        long valid_end;
+        FILE *log;
+        int failed;
+
+        log_path(path, seqs[i]);
+        log = fopen(path, "r");
+        if (log == NULL || fstat(fileno(log), &st) == -1) {
+            log_err("%s:%d: Unable to read %s\n", __FUNCTION__, __LINE__, path);
+            if (log != NULL) {
+                fclose(log);
+            }
+            free(seqs);
+            return ret_status;
+        }
+        failed = replay_file(log, checkpoint_lsn, &last_lsn, &replayed, &valid_end) == -1;
+        fclose(log);
+        if (failed) {
+            free(seqs);
+            return ret_status;
+        }
+        if (valid_end < st.st_size) {
+            if (i + 1 < count) {
+                log_err("%s:%d: %s is damaged\n", __FUNCTION__, __LINE__, path);
+                free(seqs);
+                return ret_status;
+            }
+            if (truncate(path, valid_end) == -1) {
+                log_err("%s:%d: Unable to cut off the log tail\n", __FUNCTION__, __LINE__);
+            }
+        }
+        wal_seq = seqs[i];
+    }
+    free(seqs);
+    log_info("%s:%d: Replayed %zu log records\n", __FUNCTION__, __LINE__, replayed);
+
+    wal_next_lsn = last_lsn + 1;
+    wal_durable_lsn = last_lsn;
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+    return ret_status;
+}
+
+
+/*****************************************************************************
+ * -- wal_open --
+ *
+ * Starts a new log file after the ones just replayed and the flusher
+ * thread. Called once, after recovery. The replayed files stay until the
+ * next checkpoint covers them.
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status wal_open(void)
+{
+    Status ret_status;
+    char path[sizeof(DATA_DIR) + sizeof(WAL_PREFIX) + 24];
+    pthread_t flusher;
+
+    ret_status.code = ERROR;
+    ret_status.error_message = QUERY_INVALID_STR;
+
+    if (ensure_data_dir() == -1) {
+        return ret_status;
+    }
+    // every file replayed is older than the new one
+    wal_seq++;
+    wal_rotated_seq = wal_seq;
+    log_path(path, wal_seq);
+    wal_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (wal_fd < 0) {
+        log_err("%s:%d: Unable to open the log\n", __FUNCTION__, __LINE__);
+        return ret_status;
+    }
+    if (pthread_create(&flusher, NULL, wal_flusher, NULL) != 0) {
+        log_err("%s:%d: Unable to start the log flusher\n", __FUNCTION__, __LINE__);
+        return ret_status;
+    }
+    pthread_detach(flusher);
+
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+    return ret_status;
+}
@@ -0,0 +1,257 @@
+/*
+ * -- zonemap.c
+ *
+ *  per block min/max metadata of columns (see zonemap.h)
+ */
+
+#define _DEFAULT_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "column.h"
+#include "kernels.h"
+#include "persistence.h"
+#include "utils.h"
+#include "zonemap.h"
+
+// identifies zone map files ("ZON1")
+#define ZONE_MAGIC 0x314e4f5au
+
+typedef struct ZoneFileHeader {
+    uint32_t magic;
+    uint32_t type;
+    // rows covered by the zones in the file
+    uint64_t num_rows;
+} ZoneFileHeader;
+
+/*
+ * Folds values [begin, end) of a column of type T into its zones. A zone
+ * that starts at begin is reset, a partially covered one is widened.
+ */
+#define EXTEND_ZONES(T, NAME)                                                   \
+    for (size_t row = begin; row < end;) {                                      \
+        size_t z = row >> ZONE_SHIFT;                                           \
+        size_t zone_end = (z + 1) << ZONE_SHIFT;                                \
+        const T *values = &COLUMN_VALUE(col, T, row);                           \
+        T *mins = col->zone_min;                                                \
+        T *maxs = col->zone_max;                                                \
+        if (zone_end > end) {                                                   \
+            zone_end = end;                                                     \
+        }                                                                       \
+        if ((row & (ZONE_SIZE - 1)) == 0) {                                     \
+            mins[z] = maxs[z] = values[0];                                      \
+        }                                                                       \
+        mins[z] = min_##NAME(values, zone_end - row, mins[z]);                  \
+        maxs[z] = max_##NAME(values, zone_end - row, maxs[z]);                  \
+        row = zone_end;                                                         \
+    }
+
+
+/******************************************************************************
+ * -- reserve_zones --
+ *
+ * Makes sure the zone arrays of a column can hold num_zones zones.
+ *
+ * Returns -1 on failure
+ *          0 on success
+ *
+ ******************************************************************************
+ */
+
+static int reserve_zones(Column *col, size_t num_zones)
+{
+    if (num_zones <= col->zones_capacity) {
+        return 0;
+    }
+    size_t slots = col->zones_capacity == 0 ? 16 : col->zones_capacity;
+    while (slots < num_zones) {
+        slots *= 2;
+    }
+    void *mins = realloc(col->zone_min, slots * data_type_size(col->type));
+    if (mins == NULL) {
+        return -1;
+    }
+    col->zone_min = mins;
+    void *maxs = realloc(col->zone_max, slots * data_type_size(col->type));
+    if (maxs == NULL) {
+        return -1;
+    }
+    col->zone_max = maxs;
+    col->zones_capacity = slots;
+    return 0;
+}
+
+
+/*****************************************************************************
+ * -- column_zones_extend --
+ *
+ * Brings the zones of a column up to date after values [begin, end) were
+ * written. The zones must already cover all rows before begin.
+ *
+ * Params:
+ *    col [in/out]  The column
+ *    begin [in]    First new row
+ *    end [in]      One past the last new row
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status column_zones_extend(Column *col,     // IN/OUT
+                           size_t begin,    // IN
+                           size_t end)      // IN
+{
+    Status ret_status;
+    size_t num_zones = column_zone_count(end);
+
+    ret_status.code = ERROR;
+    ret_status.error_message = OUT_OF_MEMORY_STR;
+
+    if (reserve_zones(col, num_zones) == -1) {
+        return ret_status;
+    }
+
+    switch (col->type) {
+    case LONG:
+        EXTEND_ZONES(long, long);
+        break;
+    case FLOAT:
+        EXTEND_ZONES(float, float);
+        break;
+    default:
+        EXTEND_ZONES(int, int);
+        break;
+    }
+    if (num_zones > col->num_zones) {
+        col->num_zones = num_zones;
+    }
+
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+    return ret_status;
+}
+
+
+/******************************************************************************
+ * -- column_drop_zones --
+ *
+ * Releases the zones of a column.
+ *
+ ******************************************************************************
+ */
+
+void column_drop_zones(Column *col) // IN/OUT
+{
+    free(col->zone_min);
+    free(col->zone_max);
+    col->zone_min = NULL;
+    col->zone_max = NULL;
+    col->num_zones = 0;
+    col->zones_capacity = 0;
+}
+
+
+/*****************************************************************************
+ * -- column_save_zones --
+ *
+ * Writes the zones of a column to DATA_DIR/<column>.zone, through a
+ * temporary file so a crash never leaves a torn file behind.
+ *
+ * Format: a ZoneFileHeader, then the zone minimums, then the maximums.
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status column_save_zones(Column *col) // IN
+{
+    Status ret_status;
+    char path[sizeof(DATA_DIR) + MAX_SIZE_NAME + 8];
+    char tmp_path[sizeof(DATA_DIR) + MAX_SIZE_NAME + 12];
+    ZoneFileHeader header = { ZONE_MAGIC, col->type, column_length(col) };
+    size_t bytes = col->num_zones * data_type_size(col->type);
+    FILE *file;
+    int failed;
+
+    ret_status.code = OK;
+    ret_status.error_message = SUCCESS_STR;
+
+    sprintf(path, "%s/%s.zone", DATA_DIR, col->name);
+    sprintf(tmp_path, "%s.tmp", path);
+
+    file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        log_err("%s:%d: Unable to open %s\n", __FUNCTION__, __LINE__, tmp_path);
+        ret_status.code = ERROR;
+        ret_status.error_message = QUERY_INVALID_STR;
+        return ret_status;
+    }
+    failed = fwrite(&header, sizeof(header), 1, file) != 1 ||
+             (bytes > 0 && (fwrite(col->zone_min, bytes, 1, file) != 1 ||
+                            fwrite(col->zone_max, bytes, 1, file) != 1)) ||
+             fflush(file) != 0 || fsync(fileno(file)) == -1;
+    fclose(file);
+
+    if (failed || rename(tmp_path, path) == -1) {
+        log_err("%s:%d: Unable to write %s\n", __FUNCTION__, __LINE__, path);
+        unlink(tmp_path);
+        ret_status.code = ERROR;
+        ret_status.error_message = QUERY_INVALID_STR;
+    }
+    return ret_status;
+}
+
+
+/*****************************************************************************
+ * -- column_load_zones --
+ *
+ * Reads the zones written by column_save_zones back in and recomputes the
+ * zones of rows the file does not cover. The column length must already
+ * be known. Without a usable file the zones are computed from the data.
+ *
+ * Returns:
+ *    Status OK on success
+ *           ERROR on failure
+ *
+ *****************************************************************************
+ */
+
+Status column_load_zones(Column *col) // IN/OUT
+{
+    char path[sizeof(DATA_DIR) + MAX_SIZE_NAME + 8];
+    ZoneFileHeader header;
+    size_t num_rows = column_length(col);
+    size_t covered = 0;
+    FILE *file;
+
+    sprintf(path, "%s/%s.zone", DATA_DIR, col->name);
+    file = fopen(path, "r");
+    if (file != NULL) {
+        int loaded = 0;
+        if (fread(&header, sizeof(header), 1, file) == 1 &&
+            header.magic == ZONE_MAGIC && header.type == (uint32_t) col->type &&
+            header.num_rows <= num_rows) {
+            size_t num_zones = column_zone_count(header.num_rows);
+            size_t bytes = num_zones * data_type_size(col->type);
+            loaded = reserve_zones(col, num_zones) == 0 &&
+                     (bytes == 0 || (fread(col->zone_min, bytes, 1, file) == 1 &&
+                                     fread(col->zone_max, bytes, 1, file) == 1));
+            if (loaded) {
+                col->num_zones = num_zones;
+                // the last saved zone may have grown after it was saved
+                covered = (header.num_rows >> ZONE_SHIFT) << ZONE_SHIFT;
+            }
+        }
+        if (!loaded) {
+            log_err("%s:%d: Ignoring damaged %s\n", __FUNCTION__, __LINE__, path);
+        }
+        fclose(file);
+    }
+    return column_zones_extend(col, covered, num_rows);
+}